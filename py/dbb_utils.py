@@ -17,6 +17,7 @@ import struct
 applen = 225280 # flash size minus bootloader length
 chunksize = 8*512
 usb_report_size = 64 # firmware > v2.0
+hww_report_size = usb_report_size # IN report size for HWW replies; see hid_report_size()
 report_buf_size = 4096 # firmware v2.0.0
 boot_buf_size_send = 4098
 boot_buf_size_reply = 256
@@ -94,8 +95,10 @@ def openHid():
 
 HWW_CID = 0xFF000000
 HWW_CMD = 0x80 + 0x40 + 0x01
+HWW_REPORT_CMD = 0x80 + 0x40 + 0x02
+KEEPALIVE_CMD = 0x80 + 0x3b
 
-def hid_send_frame(data):
+def hid_send_frame(data, cmd=HWW_CMD):
     data = bytearray(data)
     data_len = len(data)
     seq = 0;
@@ -105,7 +108,7 @@ def hid_send_frame(data):
         if idx == 0:
             # INIT frame
             write = data[idx : idx + min(data_len, usb_report_size - 7)]
-            dbb_hid.write(b'\0' + struct.pack(">IBH",HWW_CID, HWW_CMD, data_len & 0xFFFF) + write + b'\xEE' * (usb_report_size - 7 - len(write)))
+            dbb_hid.write(b'\0' + struct.pack(">IBH",HWW_CID, cmd, data_len & 0xFFFF) + write + b'\xEE' * (usb_report_size - 7 - len(write)))
         else:
             # CONT frame
             write = data[idx : idx + min(data_len, usb_report_size - 5)]
@@ -114,22 +117,41 @@ def hid_send_frame(data):
         idx += len(write)
 
 
-def hid_read_frame():
-    # INIT response
-    read = dbb_hid.read(usb_report_size)
-    cid = ((read[0] * 256 + read[1]) * 256 + read[2]) * 256 + read[3]
-    cmd = read[4]
+def hid_read_frame(expected_cmd=HWW_CMD):
+    # Only HWW replies use the negotiated report size. Reports can arrive shorter
+    # than that size, so the payload length comes from the frame header.
+    report_size = hww_report_size if expected_cmd == HWW_CMD else usb_report_size
+    # INIT response; skip the keepalives sent while a command waits for a touch
+    cmd = KEEPALIVE_CMD
+    while cmd == KEEPALIVE_CMD:
+        read = dbb_hid.read(report_size)
+        cid = ((read[0] * 256 + read[1]) * 256 + read[2]) * 256 + read[3]
+        cmd = read[4]
     data_len = read[5] * 256 + read[6]
-    data = read[7:]
-    idx = len(read) - 7;
+    data = read[7:report_size]
+    idx = len(data)
     while idx < data_len:
         # CONT response
-        read = dbb_hid.read(usb_report_size)
-        data += read[5:]
-        idx += len(read) - 5
+        read = dbb_hid.read(report_size)
+        data += read[5:report_size]
+        idx += len(read[5:report_size])
     assert cid == HWW_CID, '- USB command ID mismatch'
-    assert cmd == HWW_CMD, '- USB command frame mismatch'
-    return data
+    assert cmd == expected_cmd, '- USB command frame mismatch'
+    return data[:data_len]
+
+
+def hid_report_size(size=0xFFFF):
+    # Ask for HWW IN reports of up to `size` bytes. Firmware built without large
+    # reports answers with 64, older firmware with an error; both keep 64-byte reports.
+    global hww_report_size
+    hww_report_size = usb_report_size
+    hid_send_frame(struct.pack(">H", size), HWW_REPORT_CMD)
+    try:
+        r = hid_read_frame(HWW_REPORT_CMD)
+        hww_report_size = max(usb_report_size, r[2] * 256 + r[3])
+    except AssertionError:
+        pass
+    return hww_report_size
 
 
 def hid_send_plain(msg):
@@ -162,8 +184,12 @@ def hid_send_encrypt(msg, password):
         reply = hid_send_plain(msg)
         if 'ciphertext' in reply:
             reply = DecodeAES(secret, ''.join(reply["ciphertext"]))
+            # With "echo_format":"2" the raw TFA echo follows the JSON after a null byte
+            reply, _, echo = reply.partition(b'\0')
             print("Reply:   {}\n".format(reply))
             reply = json.loads(reply)
+            if echo:
+                reply['echo'] = base64.b64encode(echo).decode('ascii')
         if 'error' in reply:
             password = None
             print("\n\nReply:   {}\n\n".format(reply))
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+#
+# Generates the precomputed generator tables used by uECC: the fixed-base comb
+# for k * G and the odd multiples of G for the wNAF verification.
+#
+#   python3 py/gen_curve_tables.py comb > src/asm/curve-comb.inc
+#   python3 py/gen_curve_tables.py wnaf > src/asm/curve-wnaf.inc
+
+import sys
+
+TEETH = 6
+SPACING = (256 + TEETH - 1) // TEETH
+WNAF_WINDOW = 6
+
+CURVES = [
+    ('secp256r1', 2**256 - 2**224 + 2**192 + 2**96 - 1, -3,
+     (0x6B17D1F2E12C4247F8BCE6E563A440F277037D812DEB33A0F4A13945D898C296,
+      0x4FE342E2FE1A7F9B8EE7EB4A7C0F9E162BCE33576B315ECECBB6406837BF51F5)),
+    ('secp256k1', 2**256 - 2**32 - 977, 0,
+     (0x79BE667EF9DCBBAC55A06295CE870B07029BFCDB2DCE28D959F2815B16F81798,
+      0x483ADA7726A3C4655DA4FBFC0E1108A8FD17B448A68554199C47D08FFB10D4B8)),
+]
+
+
+def point_add(P, Q, p, a):
+    if P is None:
+        return Q
+    if Q is None:
+        return P
+    if P[0] == Q[0]:
+        if (P[1] + Q[1]) % p == 0:
+            return None
+        l = (3 * P[0] * P[0] + a) * pow(2 * P[1], -1, p) % p
+    else:
+        l = (Q[1] - P[1]) * pow(Q[0] - P[0], -1, p) % p
+    x = (l * l - P[0] - Q[0]) % p
+    return (x, (l * (P[0] - x) - P[1]) % p)
+
+
+def point_mult(k, P, p, a):
+    R = None
+    while k:
+        if k & 1:
+            R = point_add(R, P, p, a)
+        P = point_add(P, P, p, a)
+        k >>= 1
+    return R
+
+
+def words(v):
+    b = v.to_bytes(32, 'little')
+    return ['BYTES_TO_WORDS_8(%s)' % ', '.join('%02X' % x for x in b[i:i + 8])
+            for i in range(0, 32, 8)]
+
+
+def print_points(name, suffix, count, points):
+    print('static const uECC_word_t curve_%s_G_%s[%s * num_words_%s * 2] = {'
+          % (name, suffix, count, name))
+    for i in range(len(points)):
+        w = words(points[i][0]) + words(points[i][1])
+        print('    ' + ',\n    '.join(w[:4]) + ',')
+        print('    ' + ',\n    '.join(w[4:]) + (',' if i + 1 < len(points) else ''))
+        if i + 1 < len(points):
+            print('')
+    print('};')
+
+
+def comb():
+    print('''/* Fixed-base comb tables for uECC, generated by py/gen_curve_tables.py.
+
+   Entry i holds the affine point (1 + sum of 2^((j + 1) * uECC_COMB_SPACING) for
+   every bit j set in i) * G, i.e. the comb column value 2 * i + 1 with one point
+   per tooth. */
+
+#ifndef _UECC_CURVE_COMB_H_
+#define _UECC_CURVE_COMB_H_
+
+#define uECC_COMB_TEETH %d
+#define uECC_COMB_SPACING %d /* ceil(256 / uECC_COMB_TEETH) */
+#define uECC_COMB_POINTS (1 << (uECC_COMB_TEETH - 1))
+''' % (TEETH, SPACING))
+
+    for name, p, a, G in CURVES:
+        print('#if uECC_SUPPORTS_%s' % name)
+        points = []
+        for i in range(1 << (TEETH - 1)):
+            k = 1 + sum(1 << ((j + 1) * SPACING) for j in range(TEETH - 1) if i >> j & 1)
+            points.append(point_mult(k, G, p, a))
+        print_points(name, 'comb', 'uECC_COMB_POINTS', points)
+        print('#endif /* uECC_SUPPORTS_%s */' % name)
+        print('')
+
+    print('#endif /* _UECC_CURVE_COMB_H_ */')
+
+
+def wnaf():
+    print('''/* Odd multiples of G for uECC_verify(), generated by py/gen_curve_tables.py.
+
+   Entry i holds the affine point (2 * i + 1) * G, i.e. every nonzero digit of a
+   width-uECC_WNAF_G_WINDOW NAF. */
+
+#ifndef _UECC_CURVE_WNAF_H_
+#define _UECC_CURVE_WNAF_H_
+
+#define uECC_WNAF_G_WINDOW %d
+#define uECC_WNAF_G_POINTS (1 << (uECC_WNAF_G_WINDOW - 2))
+''' % WNAF_WINDOW)
+
+    for name, p, a, G in CURVES:
+        print('#if uECC_SUPPORTS_%s' % name)
+        print_points(name, 'wnaf', 'uECC_WNAF_G_POINTS',
+                     [point_mult(2 * i + 1, G, p, a) for i in range(1 << (WNAF_WINDOW - 2))])
+        print('#endif /* uECC_SUPPORTS_%s */' % name)
+        print('')
+
+    print('#endif /* _UECC_CURVE_WNAF_H_ */')
+
+
+if len(sys.argv) != 2 or sys.argv[1] not in ('comb', 'wnaf'):
+    sys.exit('usage: %s comb|wnaf' % sys.argv[0])
+comb() if sys.argv[1] == 'comb' else wnaf()
@@ -9,6 +9,7 @@ try:
     password = '0000'
 
     openHid()
+    hid_report_size()
 
 
     # Start up options - factory reset; initial password setting
@@ -0,0 +1,678 @@
+/*
+ * Copyright (c) 2016 Thomas Pornin <pornin@bolet.org>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * Constant-time AES on 32-bit words, adapted from BearSSL's aes_ct.
+ *
+ * The state of two blocks is held bitsliced in eight 32-bit words, so the
+ * S-box is a fixed boolean circuit and there are no secret-dependent table
+ * lookups or branches. Single blocks (CBC encryption) leave the second slot
+ * empty; CBC decryption fills both slots and processes two blocks per pass.
+ *
+ * The compressed key schedule (60 words) is stored little-endian in the
+ * aes_context key bytes and expanded on the stack for each call.
+ */
+
+
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "aes.h"
+#include "aes_ct.h"
+#include "utils.h"
+
+
+#define AES_CT_SKEY_LEN     ((N_MAX_ROUNDS + 1) * N_COL)
+
+
+static uint32_t dec32le(const uint8_t *src)
+{
+    return (uint32_t)src[0]
+           | ((uint32_t)src[1] << 8)
+           | ((uint32_t)src[2] << 16)
+           | ((uint32_t)src[3] << 24);
+}
+
+
+static void enc32le(uint8_t *dst, uint32_t x)
+{
+    dst[0] = (uint8_t)x;
+    dst[1] = (uint8_t)(x >> 8);
+    dst[2] = (uint8_t)(x >> 16);
+    dst[3] = (uint8_t)(x >> 24);
+}
+
+
+// Boyar-Peralta circuit for the AES S-box, applied to 32 bytes in parallel
+static void aes_ct_sbox(uint32_t *q)
+{
+    uint32_t x0, x1, x2, x3, x4, x5, x6, x7;
+    uint32_t y1, y2, y3, y4, y5, y6, y7, y8, y9;
+    uint32_t y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+    uint32_t y20, y21;
+    uint32_t z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+    uint32_t z10, z11, z12, z13, z14, z15, z16, z17;
+    uint32_t t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+    uint32_t t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+    uint32_t t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+    uint32_t t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+    uint32_t t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+    uint32_t t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+    uint32_t t60, t61, t62, t63, t64, t65, t66, t67;
+    uint32_t s0, s1, s2, s3, s4, s5, s6, s7;
+
+    x0 = q[7];
+    x1 = q[6];
+    x2 = q[5];
+    x3 = q[4];
+    x4 = q[3];
+    x5 = q[2];
+    x6 = q[1];
+    x7 = q[0];
+
+    // Top linear transformation
+    y14 = x3 ^ x5;
+    y13 = x0 ^ x6;
+    y9 = x0 ^ x3;
+    y8 = x0 ^ x5;
+    t0 = x1 ^ x2;
+    y1 = t0 ^ x7;
+    y4 = y1 ^ x3;
+    y12 = y13 ^ y14;
+    y2 = y1 ^ x0;
+    y5 = y1 ^ x6;
+    y3 = y5 ^ y8;
+    t1 = x4 ^ y12;
+    y15 = t1 ^ x5;
+    y20 = t1 ^ x1;
+    y6 = y15 ^ x7;
+    y10 = y15 ^ t0;
+    y11 = y20 ^ y9;
+    y7 = x7 ^ y11;
+    y17 = y10 ^ y11;
+    y19 = y10 ^ y8;
+    y16 = t0 ^ y11;
+    y21 = y13 ^ y16;
+    y18 = x0 ^ y16;
+
+    // Non-linear section
+    t2 = y12 & y15;
+    t3 = y3 & y6;
+    t4 = t3 ^ t2;
+    t5 = y4 & x7;
+    t6 = t5 ^ t2;
+    t7 = y13 & y16;
+    t8 = y5 & y1;
+    t9 = t8 ^ t7;
+    t10 = y2 & y7;
+    t11 = t10 ^ t7;
+    t12 = y9 & y11;
+    t13 = y14 & y17;
+    t14 = t13 ^ t12;
+    t15 = y8 & y10;
+    t16 = t15 ^ t12;
+    t17 = t4 ^ t14;
+    t18 = t6 ^ t16;
+    t19 = t9 ^ t14;
+    t20 = t11 ^ t16;
+    t21 = t17 ^ y20;
+    t22 = t18 ^ y19;
+    t23 = t19 ^ y21;
+    t24 = t20 ^ y18;
+
+    t25 = t21 ^ t22;
+    t26 = t21 & t23;
+    t27 = t24 ^ t26;
+    t28 = t25 & t27;
+    t29 = t28 ^ t22;
+    t30 = t23 ^ t24;
+    t31 = t22 ^ t26;
+    t32 = t31 & t30;
+    t33 = t32 ^ t24;
+    t34 = t23 ^ t33;
+    t35 = t27 ^ t33;
+    t36 = t24 & t35;
+    t37 = t36 ^ t34;
+    t38 = t27 ^ t36;
+    t39 = t29 & t38;
+    t40 = t25 ^ t39;
+
+    t41 = t40 ^ t37;
+    t42 = t29 ^ t33;
+    t43 = t29 ^ t40;
+    t44 = t33 ^ t37;
+    t45 = t42 ^ t41;
+    z0 = t44 & y15;
+    z1 = t37 & y6;
+    z2 = t33 & x7;
+    z3 = t43 & y16;
+    z4 = t40 & y1;
+    z5 = t29 & y7;
+    z6 = t42 & y11;
+    z7 = t45 & y17;
+    z8 = t41 & y10;
+    z9 = t44 & y12;
+    z10 = t37 & y3;
+    z11 = t33 & y4;
+    z12 = t43 & y13;
+    z13 = t40 & y5;
+    z14 = t29 & y2;
+    z15 = t42 & y9;
+    z16 = t45 & y14;
+    z17 = t41 & y8;
+
+    // Bottom linear transformation
+    t46 = z15 ^ z16;
+    t47 = z10 ^ z11;
+    t48 = z5 ^ z13;
+    t49 = z9 ^ z10;
+    t50 = z2 ^ z12;
+    t51 = z2 ^ z5;
+    t52 = z7 ^ z8;
+    t53 = z0 ^ z3;
+    t54 = z6 ^ z7;
+    t55 = z16 ^ z17;
+    t56 = z12 ^ t48;
+    t57 = t50 ^ t53;
+    t58 = z4 ^ t46;
+    t59 = z3 ^ t54;
+    t60 = t46 ^ t57;
+    t61 = z14 ^ t57;
+    t62 = t52 ^ t58;
+    t63 = t49 ^ t58;
+    t64 = z4 ^ t59;
+    t65 = t61 ^ t62;
+    t66 = z1 ^ t63;
+    s0 = t59 ^ t63;
+    s6 = t56 ^ ~t62;
+    s7 = t48 ^ ~t60;
+    t67 = t64 ^ t65;
+    s3 = t53 ^ t66;
+    s4 = t51 ^ t66;
+    s5 = t47 ^ t65;
+    s1 = t64 ^ ~s3;
+    s2 = t55 ^ ~t67;
+
+    q[7] = s0;
+    q[6] = s1;
+    q[5] = s2;
+    q[4] = s3;
+    q[3] = s4;
+    q[2] = s5;
+    q[1] = s6;
+    q[0] = s7;
+}
+
+
+// The inverse S-box reuses the forward circuit: iS(x) = B(S(B(x ^ 0x63)) ^ 0x63),
+// where B is the inverse of the S-box affine transformation.
+static void aes_ct_inv_affine(uint32_t *q)
+{
+    uint32_t q0, q1, q2, q3, q4, q5, q6, q7;
+
+    q0 = ~q[0];
+    q1 = ~q[1];
+    q2 = q[2];
+    q3 = q[3];
+    q4 = q[4];
+    q5 = ~q[5];
+    q6 = ~q[6];
+    q7 = q[7];
+    q[7] = q1 ^ q4 ^ q6;
+    q[6] = q0 ^ q3 ^ q5;
+    q[5] = q7 ^ q2 ^ q4;
+    q[4] = q6 ^ q1 ^ q3;
+    q[3] = q5 ^ q0 ^ q2;
+    q[2] = q4 ^ q7 ^ q1;
+    q[1] = q3 ^ q6 ^ q0;
+    q[0] = q2 ^ q5 ^ q7;
+}
+
+
+static void aes_ct_inv_sbox(uint32_t *q)
+{
+    aes_ct_inv_affine(q);
+    aes_ct_sbox(q);
+    aes_ct_inv_affine(q);
+}
+
+
+#define AES_CT_SWAPN(cl, ch, s, x, y) do { \
+        uint32_t a, b; \
+        a = (x); \
+        b = (y); \
+        (x) = (a & (uint32_t)(cl)) | ((b & (uint32_t)(cl)) << (s)); \
+        (y) = ((a & (uint32_t)(ch)) >> (s)) | (b & (uint32_t)(ch)); \
+    } while (0)
+
+#define AES_CT_SWAP2(x, y) AES_CT_SWAPN(0x55555555, 0xAAAAAAAA, 1, x, y)
+#define AES_CT_SWAP4(x, y) AES_CT_SWAPN(0x33333333, 0xCCCCCCCC, 2, x, y)
+#define AES_CT_SWAP8(x, y) AES_CT_SWAPN(0x0F0F0F0F, 0xF0F0F0F0, 4, x, y)
+
+
+// Converts between the byte-wise and the bitsliced representation (an involution)
+static void aes_ct_ortho(uint32_t *q)
+{
+    AES_CT_SWAP2(q[0], q[1]);
+    AES_CT_SWAP2(q[2], q[3]);
+    AES_CT_SWAP2(q[4], q[5]);
+    AES_CT_SWAP2(q[6], q[7]);
+
+    AES_CT_SWAP4(q[0], q[2]);
+    AES_CT_SWAP4(q[1], q[3]);
+    AES_CT_SWAP4(q[4], q[6]);
+    AES_CT_SWAP4(q[5], q[7]);
+
+    AES_CT_SWAP8(q[0], q[4]);
+    AES_CT_SWAP8(q[1], q[5]);
+    AES_CT_SWAP8(q[2], q[6]);
+    AES_CT_SWAP8(q[3], q[7]);
+}
+
+
+static uint32_t aes_ct_sub_word(uint32_t x)
+{
+    uint32_t q[8];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        q[i] = x;
+    }
+    aes_ct_ortho(q);
+    aes_ct_sbox(q);
+    aes_ct_ortho(q);
+    x = q[0];
+    utils_zero(q, sizeof(q));
+    return x;
+}
+
+
+static void aes_ct_skey_expand(uint32_t *skey, unsigned num_rounds, const uint8_t *ksch)
+{
+    unsigned u, v, n;
+
+    n = (num_rounds + 1) << 2;
+    for (u = 0, v = 0; u < n; u++, v += 2) {
+        uint32_t x, y;
+
+        x = y = dec32le(ksch + (u << 2));
+        x &= 0x55555555;
+        skey[v + 0] = x | (x << 1);
+        y &= 0xAAAAAAAA;
+        skey[v + 1] = y | (y >> 1);
+    }
+}
+
+
+static void aes_ct_add_round_key(uint32_t *q, const uint32_t *sk)
+{
+    int i;
+    for (i = 0; i < 8; i++) {
+        q[i] ^= sk[i];
+    }
+}
+
+
+static void aes_ct_shift_rows(uint32_t *q)
+{
+    int i;
+    for (i = 0; i < 8; i++) {
+        uint32_t x = q[i];
+        q[i] = (x & 0x000000FF)
+               | ((x & 0x0000FC00) >> 2) | ((x & 0x00000300) << 6)
+               | ((x & 0x00F00000) >> 4) | ((x & 0x000F0000) << 4)
+               | ((x & 0xC0000000) >> 6) | ((x & 0x3F000000) << 2);
+    }
+}
+
+
+static void aes_ct_inv_shift_rows(uint32_t *q)
+{
+    int i;
+    for (i = 0; i < 8; i++) {
+        uint32_t x = q[i];
+        q[i] = (x & 0x000000FF)
+               | ((x & 0x00003F00) << 2) | ((x & 0x0000C000) >> 6)
+               | ((x & 0x000F0000) << 4) | ((x & 0x00F00000) >> 4)
+               | ((x & 0x03000000) << 6) | ((x & 0xFC000000) >> 2);
+    }
+}
+
+
+static uint32_t rotr16(uint32_t x)
+{
+    return (x << 16) | (x >> 16);
+}
+
+
+static void aes_ct_mix_columns(uint32_t *q)
+{
+    uint32_t q0, q1, q2, q3, q4, q5, q6, q7;
+    uint32_t r0, r1, r2, r3, r4, r5, r6, r7;
+
+    q0 = q[0];
+    q1 = q[1];
+    q2 = q[2];
+    q3 = q[3];
+    q4 = q[4];
+    q5 = q[5];
+    q6 = q[6];
+    q7 = q[7];
+    r0 = (q0 >> 8) | (q0 << 24);
+    r1 = (q1 >> 8) | (q1 << 24);
+    r2 = (q2 >> 8) | (q2 << 24);
+    r3 = (q3 >> 8) | (q3 << 24);
+    r4 = (q4 >> 8) | (q4 << 24);
+    r5 = (q5 >> 8) | (q5 << 24);
+    r6 = (q6 >> 8) | (q6 << 24);
+    r7 = (q7 >> 8) | (q7 << 24);
+
+    q[0] = q7 ^ r7 ^ r0 ^ rotr16(q0 ^ r0);
+    q[1] = q0 ^ r0 ^ q7 ^ r7 ^ r1 ^ rotr16(q1 ^ r1);
+    q[2] = q1 ^ r1 ^ r2 ^ rotr16(q2 ^ r2);
+    q[3] = q2 ^ r2 ^ q7 ^ r7 ^ r3 ^ rotr16(q3 ^ r3);
+    q[4] = q3 ^ r3 ^ q7 ^ r7 ^ r4 ^ rotr16(q4 ^ r4);
+    q[5] = q4 ^ r4 ^ r5 ^ rotr16(q5 ^ r5);
+    q[6] = q5 ^ r5 ^ r6 ^ rotr16(q6 ^ r6);
+    q[7] = q6 ^ r6 ^ r7 ^ rotr16(q7 ^ r7);
+}
+
+
+static void aes_ct_inv_mix_columns(uint32_t *q)
+{
+    uint32_t q0, q1, q2, q3, q4, q5, q6, q7;
+    uint32_t r0, r1, r2, r3, r4, r5, r6, r7;
+
+    q0 = q[0];
+    q1 = q[1];
+    q2 = q[2];
+    q3 = q[3];
+    q4 = q[4];
+    q5 = q[5];
+    q6 = q[6];
+    q7 = q[7];
+    r0 = (q0 >> 8) | (q0 << 24);
+    r1 = (q1 >> 8) | (q1 << 24);
+    r2 = (q2 >> 8) | (q2 << 24);
+    r3 = (q3 >> 8) | (q3 << 24);
+    r4 = (q4 >> 8) | (q4 << 24);
+    r5 = (q5 >> 8) | (q5 << 24);
+    r6 = (q6 >> 8) | (q6 << 24);
+    r7 = (q7 >> 8) | (q7 << 24);
+
+    q[0] = q5 ^ q6 ^ q7 ^ r0 ^ r5 ^ r7 ^ rotr16(q0 ^ q5 ^ q6 ^ r0 ^ r5);
+    q[1] = q0 ^ q5 ^ r0 ^ r1 ^ r5 ^ r6 ^ r7 ^ rotr16(q1 ^ q5 ^ q7 ^ r1 ^ r5 ^ r6);
+    q[2] = q0 ^ q1 ^ q6 ^ r1 ^ r2 ^ r6 ^ r7 ^ rotr16(q0 ^ q2 ^ q6 ^ r2 ^ r6 ^ r7);
+    q[3] = q0 ^ q1 ^ q2 ^ q5 ^ q6 ^ r0 ^ r2 ^ r3 ^ r5
+           ^ rotr16(q0 ^ q1 ^ q3 ^ q5 ^ q6 ^ q7 ^ r0 ^ r3 ^ r5 ^ r7);
+    q[4] = q1 ^ q2 ^ q3 ^ q5 ^ r1 ^ r3 ^ r4 ^ r5 ^ r6 ^ r7
+           ^ rotr16(q1 ^ q2 ^ q4 ^ q5 ^ q7 ^ r1 ^ r4 ^ r5 ^ r6);
+    q[5] = q2 ^ q3 ^ q4 ^ q6 ^ r2 ^ r4 ^ r5 ^ r6 ^ r7
+           ^ rotr16(q2 ^ q3 ^ q5 ^ q6 ^ r2 ^ r5 ^ r6 ^ r7);
+    q[6] = q3 ^ q4 ^ q5 ^ q7 ^ r3 ^ r5 ^ r6 ^ r7
+           ^ rotr16(q3 ^ q4 ^ q6 ^ q7 ^ r3 ^ r6 ^ r7);
+    q[7] = q4 ^ q5 ^ q6 ^ r4 ^ r6 ^ r7 ^ rotr16(q4 ^ q5 ^ q7 ^ r4 ^ r7);
+}
+
+
+static void aes_ct_bitslice_encrypt(unsigned num_rounds, const uint32_t *skey,
+                                    uint32_t *q)
+{
+    unsigned u;
+
+    aes_ct_add_round_key(q, skey);
+    for (u = 1; u < num_rounds; u++) {
+        aes_ct_sbox(q);
+        aes_ct_shift_rows(q);
+        aes_ct_mix_columns(q);
+        aes_ct_add_round_key(q, skey + (u << 3));
+    }
+    aes_ct_sbox(q);
+    aes_ct_shift_rows(q);
+    aes_ct_add_round_key(q, skey + (num_rounds << 3));
+}
+
+
+static void aes_ct_bitslice_decrypt(unsigned num_rounds, const uint32_t *skey,
+                                    uint32_t *q)
+{
+    unsigned u;
+
+    aes_ct_add_round_key(q, skey + (num_rounds << 3));
+    for (u = num_rounds - 1; u > 0; u--) {
+        aes_ct_inv_shift_rows(q);
+        aes_ct_inv_sbox(q);
+        aes_ct_add_round_key(q, skey + (u << 3));
+        aes_ct_inv_mix_columns(q);
+    }
+    aes_ct_inv_shift_rows(q);
+    aes_ct_inv_sbox(q);
+    aes_ct_add_round_key(q, skey);
+}
+
+
+// Loads up to two blocks into the bitsliced state; a NULL second block is left empty
+static void aes_ct_load(uint32_t *q, const uint8_t *a, const uint8_t *b)
+{
+    int i;
+    for (i = 0; i < 4; i++) {
+        q[i << 1] = dec32le(a + (i << 2));
+        q[(i << 1) + 1] = b ? dec32le(b + (i << 2)) : 0;
+    }
+    aes_ct_ortho(q);
+}
+
+
+static void aes_ct_store(uint32_t *q, uint8_t *a, uint8_t *b)
+{
+    int i;
+    aes_ct_ortho(q);
+    for (i = 0; i < 4; i++) {
+        enc32le(a + (i << 2), q[i << 1]);
+        if (b) {
+            enc32le(b + (i << 2), q[(i << 1) + 1]);
+        }
+    }
+}
+
+
+return_type aes_ct_set_key(const unsigned char key[], length_type keylen,
+                           aes_context ctx[1])
+{
+    unsigned num_rounds;
+    int i, j, k, nk, nkf;
+    uint32_t tmp;
+    uint32_t skey[AES_CT_SKEY_LEN * 2];
+    static const uint8_t rcon[] = {
+        0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36
+    };
+
+    switch (keylen) {
+        case 16:
+        case 128:
+            keylen = 16;
+            num_rounds = 10;
+            break;
+        case 24:
+        case 192:
+            keylen = 24;
+            num_rounds = 12;
+            break;
+        case 32:
+            num_rounds = 14;
+            break;
+        default:
+            ctx->rnd = 0;
+            return -1;
+    }
+
+    nk = keylen >> 2;
+    nkf = (num_rounds + 1) << 2;
+    tmp = 0;
+    for (i = 0; i < nk; i++) {
+        tmp = dec32le(key + (i << 2));
+        skey[(i << 1) + 0] = tmp;
+        skey[(i << 1) + 1] = tmp;
+    }
+    for (i = nk, j = 0, k = 0; i < nkf; i++) {
+        if (j == 0) {
+            tmp = (tmp << 24) | (tmp >> 8);
+            tmp = aes_ct_sub_word(tmp) ^ rcon[k];
+        } else if (nk > 6 && j == 4) {
+            tmp = aes_ct_sub_word(tmp);
+        }
+        tmp ^= skey[(i - nk) << 1];
+        skey[(i << 1) + 0] = tmp;
+        skey[(i << 1) + 1] = tmp;
+        if (++j == nk) {
+            j = 0;
+            k++;
+        }
+    }
+    for (i = 0; i < nkf; i += 4) {
+        aes_ct_ortho(skey + (i << 1));
+    }
+    for (i = 0, j = 0; i < nkf; i++, j += 2) {
+        enc32le(ctx->ksch + (i << 2), (skey[j + 0] & 0x55555555) | (skey[j + 1] & 0xAAAAAAAA));
+    }
+    ctx->rnd = num_rounds;
+
+    tmp = 0;
+    utils_zero(skey, sizeof(skey));
+    return 0;
+}
+
+
+return_type aes_ct_encrypt(const unsigned char in[N_BLOCK], unsigned char out[N_BLOCK],
+                           const aes_context ctx[1])
+{
+    uint32_t skey[AES_CT_SKEY_LEN * 2];
+    uint32_t q[8];
+
+    if (!ctx->rnd) {
+        return EXIT_FAILURE;
+    }
+    aes_ct_skey_expand(skey, ctx->rnd, ctx->ksch);
+    aes_ct_load(q, in, NULL);
+    aes_ct_bitslice_encrypt(ctx->rnd, skey, q);
+    aes_ct_store(q, out, NULL);
+
+    utils_zero(skey, sizeof(skey));
+    utils_zero(q, sizeof(q));
+    return EXIT_SUCCESS;
+}
+
+
+return_type aes_ct_decrypt(const unsigned char in[N_BLOCK], unsigned char out[N_BLOCK],
+                           const aes_context ctx[1])
+{
+    uint32_t skey[AES_CT_SKEY_LEN * 2];
+    uint32_t q[8];
+
+    if (!ctx->rnd) {
+        return EXIT_FAILURE;
+    }
+    aes_ct_skey_expand(skey, ctx->rnd, ctx->ksch);
+    aes_ct_load(q, in, NULL);
+    aes_ct_bitslice_decrypt(ctx->rnd, skey, q);
+    aes_ct_store(q, out, NULL);
+
+    utils_zero(skey, sizeof(skey));
+    utils_zero(q, sizeof(q));
+    return EXIT_SUCCESS;
+}
+
+
+return_type aes_ct_cbc_encrypt(const unsigned char *in, unsigned char *out, int n_block,
+                               unsigned char iv[N_BLOCK], const aes_context ctx[1])
+{
+    int i;
+    uint32_t skey[AES_CT_SKEY_LEN * 2];
+    uint32_t q[8];
+
+    if (!ctx->rnd) {
+        return EXIT_FAILURE;
+    }
+    aes_ct_skey_expand(skey, ctx->rnd, ctx->ksch);
+    while (n_block--) {
+        for (i = 0; i < N_BLOCK; i++) {
+            iv[i] ^= in[i];
+        }
+        aes_ct_load(q, iv, NULL);
+        aes_ct_bitslice_encrypt(ctx->rnd, skey, q);
+        aes_ct_store(q, iv, NULL);
+        memcpy(out, iv, N_BLOCK);
+        in += N_BLOCK;
+        out += N_BLOCK;
+    }
+
+    utils_zero(skey, sizeof(skey));
+    utils_zero(q, sizeof(q));
+    return EXIT_SUCCESS;
+}
+
+
+// Decrypts two blocks per pass through the cipher. Supports in == out.
+return_type aes_ct_cbc_decrypt(const unsigned char *in, unsigned char *out, int n_block,
+                               unsigned char iv[N_BLOCK], const aes_context ctx[1])
+{
+    int i;
+    uint32_t skey[AES_CT_SKEY_LEN * 2];
+    uint32_t q[8];
+    uint8_t c[2 * N_BLOCK];
+
+    if (!ctx->rnd) {
+        return EXIT_FAILURE;
+    }
+    aes_ct_skey_expand(skey, ctx->rnd, ctx->ksch);
+    while (n_block > 0) {
+        int pair = n_block > 1;
+
+        memcpy(c, in, pair ? 2 * N_BLOCK : N_BLOCK);
+        aes_ct_load(q, c, pair ? c + N_BLOCK : NULL);
+        aes_ct_bitslice_decrypt(ctx->rnd, skey, q);
+        aes_ct_store(q, out, pair ? out + N_BLOCK : NULL);
+        for (i = 0; i < N_BLOCK; i++) {
+            out[i] ^= iv[i];
+        }
+        if (pair) {
+            for (i = 0; i < N_BLOCK; i++) {
+                out[N_BLOCK + i] ^= c[i];
+            }
+            memcpy(iv, c + N_BLOCK, N_BLOCK);
+        } else {
+            memcpy(iv, c, N_BLOCK);
+        }
+        in += pair ? 2 * N_BLOCK : N_BLOCK;
+        out += pair ? 2 * N_BLOCK : N_BLOCK;
+        n_block -= pair ? 2 : 1;
+    }
+
+    utils_zero(skey, sizeof(skey));
+    utils_zero(q, sizeof(q));
+    utils_zero(c, sizeof(c));
+    return EXIT_SUCCESS;
+}
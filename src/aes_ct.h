@@ -0,0 +1,50 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2015-2018 Douglas J. Bakkum
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+#ifndef _AES_CT_H_
+#define _AES_CT_H_
+
+
+#include "aes.h"
+
+
+// Constant-time (bitsliced) AES using the same aes_context and calling
+// conventions as the byte-oriented aes_set_key()/aes_cbc_*() in aes.c.
+// A context must be keyed by the engine that uses it.
+return_type aes_ct_set_key(const unsigned char key[], length_type keylen,
+                           aes_context ctx[1]);
+return_type aes_ct_encrypt(const unsigned char in[N_BLOCK], unsigned char out[N_BLOCK],
+                           const aes_context ctx[1]);
+return_type aes_ct_decrypt(const unsigned char in[N_BLOCK], unsigned char out[N_BLOCK],
+                           const aes_context ctx[1]);
+return_type aes_ct_cbc_encrypt(const unsigned char *in, unsigned char *out, int n_block,
+                               unsigned char iv[N_BLOCK], const aes_context ctx[1]);
+return_type aes_ct_cbc_decrypt(const unsigned char *in, unsigned char *out, int n_block,
+                               unsigned char iv[N_BLOCK], const aes_context ctx[1]);
+
+
+#endif
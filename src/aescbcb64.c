@@ -34,159 +34,648 @@
 #include "sharedsecret.h"
 #include "memory.h"
 #include "base64.h"
-#include "aes.h"
+#include "aes_ct.h"
 #include "sha2.h"
 #include "random.h"
 #include "flags.h"
 #include "utils.h"
 
-// Must free() returned value
-static uint8_t *aescbcb64_init_and_encrypt(const unsigned char *in, int inlen,
-        int *out_len,
-        const uint8_t *key)
-{
-    int  pads;
-    int  inpadlen = inlen + N_BLOCK - inlen % N_BLOCK;
-    unsigned char inpad[inpadlen];
-    unsigned char enc[inpadlen];
-    unsigned char iv[N_BLOCK];
-    uint8_t *enc_cat = malloc(sizeof(uint8_t) * (inpadlen +
-                              N_BLOCK)); // concatenating [ iv0  |  enc ]
-    *out_len = inpadlen + N_BLOCK;
-
+typedef struct {
     aes_context ctx[1];
+    uint8_t key[32];
+    uint8_t valid;
+} aescbcb64_key_schedule;
+
+static aescbcb64_key_schedule aes_key_cache[AES_KEY_NONE];
+
+
+void aescbcb64_key_cache_invalidate(AES_KEY_SLOT slot)
+{
+    if (slot < AES_KEY_NONE) {
+        utils_zero(&aes_key_cache[slot], sizeof(aes_key_cache[slot]));
+    }
+}
+
+
+void aescbcb64_key_cache_clear(void)
+{
+    utils_zero(aes_key_cache, sizeof(aes_key_cache));
+}
+
+
+// Keys derived from the TFA shared secret. Kept across commands like the secret
+// itself and only replaced by aescbcb64_tfa_keys_set().
+static struct {
+    uint8_t encryption_key[SHA256_DIGEST_LENGTH];
+    HMAC_SHA256_CTX authentication;
+    uint8_t valid;
+} tfa_keys;
+
+
+void aescbcb64_tfa_keys_set(const uint8_t *shared_secret)
+{
+    uint8_t authentication_key[SHA256_DIGEST_LENGTH];
+    sharedsecret_derive_keys(shared_secret, tfa_keys.encryption_key, authentication_key);
+    hmac_sha256_Init(&tfa_keys.authentication, authentication_key, SHA256_DIGEST_LENGTH);
+    tfa_keys.valid = 1;
+    aescbcb64_key_cache_invalidate(AES_KEY_TFA);
+    utils_zero(authentication_key, sizeof(authentication_key));
+}
+
+
+// Returns the expanded schedule for `key`, either from the slot's cache entry or
+// expanded into `scratch` when the slot is AES_KEY_NONE.
+static const aes_context *aescbcb64_key_schedule_get(const uint8_t *key,
+        AES_KEY_SLOT slot,
+        aes_context *scratch)
+{
+    aescbcb64_key_schedule *entry;
+
+    if (slot >= AES_KEY_NONE) {
+        memset(scratch, 0, sizeof(aes_context));
+        aes_ct_set_key(key, 32, scratch);
+        return scratch;
+    }
 
-    // Set cipher key
-    memset(ctx, 0, sizeof(ctx));
-    aes_set_key(key, 32, ctx);
+    entry = &aes_key_cache[slot];
+    if (!entry->valid || !MEMEQ(entry->key, key, sizeof(entry->key))) {
+        memset(entry->ctx, 0, sizeof(entry->ctx));
+        aes_ct_set_key(key, 32, entry->ctx);
+        memcpy(entry->key, key, sizeof(entry->key));
+        entry->valid = 1;
+    }
+    return entry->ctx;
+}
 
-    // PKCS7 padding
-    memcpy(inpad, in, inlen);
-    for (pads = 0; pads < N_BLOCK - inlen % N_BLOCK; pads++ ) {
-        inpad[inlen + pads] = (N_BLOCK - inlen % N_BLOCK);
+
+// Base64 encodes [ iv | ciphertext | hmac ] into the output span in chunks of three
+// AES blocks (64 base64 characters), so no intermediate ciphertext buffer is needed.
+typedef struct {
+    uint8_t chunk[3 * N_BLOCK];
+    int chunk_len;
+    char *out;
+    int out_size;
+    int out_len;
+} aescbcb64_b64_stream;
+
+
+static void aescbcb64_stream_flush(aescbcb64_b64_stream *s)
+{
+    // Output size is checked up front, so this cannot fail.
+    s->out_len += base64_to(s->chunk, s->chunk_len, s->out + s->out_len,
+                            s->out_size - s->out_len);
+    s->chunk_len = 0;
+}
+
+
+static void aescbcb64_stream_put(aescbcb64_b64_stream *s, const uint8_t *data, int len)
+{
+    while (len > 0) {
+        int n = MIN(len, (int)sizeof(s->chunk) - s->chunk_len);
+        memcpy(s->chunk + s->chunk_len, data, n);
+        s->chunk_len += n;
+        data += n;
+        len -= n;
+        if (s->chunk_len == (int)sizeof(s->chunk)) {
+            aescbcb64_stream_flush(s);
+        }
     }
+}
+
+
+// PKCS7 pads and CBC encrypts `in` under a random IV, streaming the result. The
+// plaintext is padded and encrypted in place inside the stream chunk. If `hctx` is
+// given, it is updated with the IV and ciphertext.
+static int aescbcb64_stream_encrypt(aescbcb64_b64_stream *s, const unsigned char *in,
+                                    int inlen, const aes_context *ctx, HMAC_SHA256_CTX *hctx)
+{
+    uint8_t iv[N_BLOCK];
+    int n_block = inlen / N_BLOCK + 1;
+    uint8_t pad = N_BLOCK - inlen % N_BLOCK;
 
     // Make a random initialization vector
-    if (random_bytes((uint8_t *)iv, N_BLOCK, 0) == DBB_ERROR) {
+    if (random_bytes(iv, N_BLOCK, 0) == DBB_ERROR) {
         commander_fill_report(cmd_str(CMD_random), NULL, DBB_ERR_MEM_ATAES);
-        utils_zero(inpad, inpadlen);
-        utils_zero(ctx, sizeof(ctx));
-        return NULL;
+        return DBB_ERROR;
+    }
+    aescbcb64_stream_put(s, iv, N_BLOCK);
+    if (hctx) {
+        hmac_sha256_Update(hctx, iv, N_BLOCK);
     }
-    memcpy(enc_cat, iv, N_BLOCK);
 
-    // CBC encrypt multiple blocks
-    aes_cbc_encrypt(inpad, enc, inpadlen / N_BLOCK, iv, ctx);
-    memcpy(enc_cat + N_BLOCK, enc, inpadlen);
+    while (n_block) {
+        uint8_t *blocks = s->chunk + s->chunk_len;
+        int n = MIN(n_block, ((int)sizeof(s->chunk) - s->chunk_len) / N_BLOCK);
+        int copy = MIN(inlen, n * N_BLOCK);
+
+        memcpy(blocks, in, copy);
+        memset(blocks + copy, pad, n * N_BLOCK - copy);
+        in += copy;
+        inlen -= copy;
+
+        aes_ct_cbc_encrypt(blocks, blocks, n, iv, ctx);
+        if (hctx) {
+            hmac_sha256_Update(hctx, blocks, n * N_BLOCK);
+        }
+        s->chunk_len += n * N_BLOCK;
+        n_block -= n;
+        if (s->chunk_len == (int)sizeof(s->chunk)) {
+            aescbcb64_stream_flush(s);
+        }
+    }
 
-    utils_zero(inpad, inpadlen);
-    utils_zero(ctx, sizeof(ctx));
-    return enc_cat;
+    utils_zero(iv, sizeof(iv));
+    return DBB_OK;
 }
 
 
-// Must free() returned value (allocated inside base64() function)
+static void aescbcb64_stream_finish(aescbcb64_b64_stream *s, int *out_b64len)
+{
+    aescbcb64_stream_flush(s);
+    s->out[s->out_len] = '\0';
+    *out_b64len = s->out_len;
+    utils_zero(s->chunk, sizeof(s->chunk));
+}
+
+
+// Encrypts `in` with AES-CBC and PKCS7 padding and base64 encodes [ iv | enc ] into
+// `out`, which must hold AESCBCB64_ENCRYPT_SIZE(inlen) bytes.
+int aescbcb64_encrypt_to(const unsigned char *in, int inlen, char *out, int out_size,
+                         int *out_b64len, const uint8_t *key, AES_KEY_SLOT slot)
+{
+    int ret;
+    aes_context scratch[1];
+    aescbcb64_b64_stream s;
+
+    *out_b64len = 0;
+    if (inlen < 0 || out_size < AESCBCB64_ENCRYPT_SIZE(inlen)) {
+        return DBB_ERROR;
+    }
+
+    memset(&s, 0, sizeof(s));
+    s.out = out;
+    s.out_size = out_size;
+
+    ret = aescbcb64_stream_encrypt(&s, in, inlen,
+                                   aescbcb64_key_schedule_get(key, slot, scratch), NULL);
+    if (ret == DBB_OK) {
+        aescbcb64_stream_finish(&s, out_b64len);
+    }
+    utils_zero(&s, sizeof(s));
+    utils_zero(scratch, sizeof(scratch));
+    return ret;
+}
+
+
+// Must free() returned value
 char *aescbcb64_encrypt(const unsigned char *in, int inlen, int *out_b64len,
-                        const uint8_t *key)
+                        const uint8_t *key, AES_KEY_SLOT slot)
 {
-    int out_len;
-    uint8_t *enc_cat = aescbcb64_init_and_encrypt(in, inlen, &out_len, key);
-    // base64 encoding
-    char *b64;
-    b64 = base64(enc_cat, out_len, out_b64len);
-    free(enc_cat);
+    int size = AESCBCB64_ENCRYPT_SIZE(inlen);
+    char *b64 = malloc(size);
+    if (!b64) {
+        return NULL;
+    }
+    if (aescbcb64_encrypt_to(in, inlen, b64, size, out_b64len, key, slot) != DBB_OK) {
+        free(b64);
+        return NULL;
+    }
     return b64;
 }
 
+
 // Encrypts a given constant char array of length inlen using the AES algorithm with CBC mode,
-// appends its SHA256 HMAC and base64 encodes the result.
-//
-// Must free() returned value
-char *aescbcb64_hmac_encrypt(const unsigned char *in, int inlen, int *out_b64len,
-                             const uint8_t *shared_secret)
+// appends its SHA256 HMAC and base64 encodes the result into `out`, which must hold
+// AESCBCB64_HMAC_ENCRYPT_SIZE(inlen) bytes. Uses the keys derived from the TFA shared
+// secret by aescbcb64_tfa_keys_set().
+int aescbcb64_hmac_encrypt_to(const unsigned char *in, int inlen, char *out, int out_size,
+                              int *out_b64len)
 {
-    uint8_t encryption_key[SHA256_DIGEST_LENGTH];
-    uint8_t authentication_key[SHA256_DIGEST_LENGTH];
+    int ret;
+    uint8_t hmac[SHA256_DIGEST_LENGTH];
+    aes_context scratch[1];
+    HMAC_SHA256_CTX hctx;
+    aescbcb64_b64_stream s;
 
-    sharedsecret_derive_keys(shared_secret, encryption_key, authentication_key);
+    *out_b64len = 0;
+    if (!tfa_keys.valid || inlen < 0 || out_size < AESCBCB64_HMAC_ENCRYPT_SIZE(inlen)) {
+        return DBB_ERROR;
+    }
 
-    int encrypt_len;
-    uint8_t *encrypted = aescbcb64_init_and_encrypt(in,
-                         inlen,
-                         &encrypt_len,
-                         encryption_key);
-    uint8_t hmac[SHA256_DIGEST_LENGTH];
-    hmac_sha256(authentication_key, SHA256_DIGEST_LENGTH, encrypted, encrypt_len, hmac);
+    memset(&s, 0, sizeof(s));
+    s.out = out;
+    s.out_size = out_size;
 
-    uint8_t authenticated_encrypted_msg[encrypt_len + SHA256_DIGEST_LENGTH];
-    memcpy(authenticated_encrypted_msg, encrypted, encrypt_len);
-    memcpy(authenticated_encrypted_msg + encrypt_len, hmac, SHA256_DIGEST_LENGTH);
+    hmac_sha256_Copy(&hctx, &tfa_keys.authentication);
+    ret = aescbcb64_stream_encrypt(&s, in, inlen,
+                                   aescbcb64_key_schedule_get(tfa_keys.encryption_key,
+                                           AES_KEY_TFA, scratch), &hctx);
+    hmac_sha256_Final(&hctx, hmac);
+    if (ret == DBB_OK) {
+        aescbcb64_stream_put(&s, hmac, sizeof(hmac));
+        aescbcb64_stream_finish(&s, out_b64len);
+    }
+    utils_zero(&s, sizeof(s));
+    utils_zero(scratch, sizeof(scratch));
+    return ret;
+}
 
-    free(encrypted);
-    utils_zero(encryption_key, sizeof(encryption_key));
-    utils_zero(authentication_key, sizeof(authentication_key));
-    char *b64 = base64(authenticated_encrypted_msg, encrypt_len + SHA256_DIGEST_LENGTH,
-                       out_b64len);
+
+// Encrypts and authenticates the `len` bytes at the start of `buf` like
+// aescbcb64_hmac_encrypt_to(), but leaves the raw [ iv | ciphertext | hmac ] in `buf`
+// instead of base64 encoding it. `buf` must hold AESCBCB64_HMAC_CIPHER_LEN(len) bytes.
+int aescbcb64_hmac_encrypt_in_place(uint8_t *buf, int len, int buf_size, int *out_len)
+{
+    int padded = AESCBCB64_CIPHER_LEN(len) - N_BLOCK;
+    uint8_t iv[N_BLOCK];
+    aes_context scratch[1];
+    HMAC_SHA256_CTX hctx;
+
+    *out_len = 0;
+    if (!tfa_keys.valid || len < 0 || buf_size < AESCBCB64_HMAC_CIPHER_LEN(len)) {
+        return DBB_ERROR;
+    }
+    if (random_bytes(iv, N_BLOCK, 0) == DBB_ERROR) {
+        return DBB_ERROR;
+    }
+
+    // PKCS7 pad behind the IV, then CBC encrypt in place
+    memmove(buf + N_BLOCK, buf, len);
+    memset(buf + N_BLOCK + len, padded - len, padded - len);
+    memcpy(buf, iv, N_BLOCK);
+    aes_ct_cbc_encrypt(buf + N_BLOCK, buf + N_BLOCK, padded / N_BLOCK, iv,
+                       aescbcb64_key_schedule_get(tfa_keys.encryption_key, AES_KEY_TFA,
+                               scratch));
+
+    hmac_sha256_Copy(&hctx, &tfa_keys.authentication);
+    hmac_sha256_Update(&hctx, buf, N_BLOCK + padded);
+    hmac_sha256_Final(&hctx, buf + N_BLOCK + padded);
+    *out_len = AESCBCB64_HMAC_CIPHER_LEN(len);
+
+    utils_zero(iv, sizeof(iv));
+    utils_zero(scratch, sizeof(scratch));
+    return DBB_OK;
+}
+
+
+// Must free() returned value
+char *aescbcb64_hmac_encrypt(const unsigned char *in, int inlen, int *out_b64len)
+{
+    int size = AESCBCB64_HMAC_ENCRYPT_SIZE(inlen);
+    char *b64;
+
+    if (!tfa_keys.valid) {
+        return NULL;
+    }
+    b64 = malloc(size);
+    if (!b64) {
+        return NULL;
+    }
+    if (aescbcb64_hmac_encrypt_to(in, inlen, b64, size, out_b64len) != DBB_OK) {
+        free(b64);
+        return NULL;
+    }
     return b64;
 }
 
-char *aescbcb64_init_and_decrypt(uint8_t *ub64, int ub64len, int *decrypt_len,
-                                 const uint8_t *key)
+
+// Decrypts [ iv | ciphertext ] of length `len` in place, moves the unpadded plaintext
+// to the start of `buf` and null terminates it. The rest of `buf` is zeroed.
+// `decrypt_len` includes the null terminator.
+static int aescbcb64_cbc_decrypt(uint8_t *buf, int len, int *decrypt_len,
+                                 const uint8_t *key, AES_KEY_SLOT slot)
 {
-    *decrypt_len = 0;
+    int padlen, plainlen;
+    uint8_t iv[N_BLOCK];
+    aes_context scratch[1];
+    const aes_context *ctx;
 
-    // Set cipher key
-    aes_context ctx[1];
-    memset(ctx, 0, sizeof(ctx));
-    aes_set_key(key, 32, ctx);
+    *decrypt_len = 0;
+    if ((len % N_BLOCK) || len < 2 * N_BLOCK) {
+        utils_zero(buf, len);
+        return DBB_ERROR;
+    }
 
-    unsigned char dec_pad[ub64len - N_BLOCK];
-    aes_cbc_decrypt(ub64 + N_BLOCK, dec_pad, ub64len / N_BLOCK - 1, ub64, ctx);
+    ctx = aescbcb64_key_schedule_get(key, slot, scratch);
+    memcpy(iv, buf, N_BLOCK);
+    aes_ct_cbc_decrypt(buf + N_BLOCK, buf + N_BLOCK, len / N_BLOCK - 1, iv, ctx);
+    utils_zero(scratch, sizeof(scratch));
+    utils_zero(iv, sizeof(iv));
 
     // Strip PKCS7 padding
-    int padlen = dec_pad[ub64len - N_BLOCK - 1];
-    if (ub64len - N_BLOCK - padlen <= 0) {
-        utils_zero(dec_pad, sizeof(dec_pad));
-        utils_zero(ctx, sizeof(ctx));
-        return NULL;
+    padlen = buf[len - 1];
+    plainlen = len - N_BLOCK - padlen;
+    if (plainlen <= 0) {
+        utils_zero(buf, len);
+        return DBB_ERROR;
+    }
+    memmove(buf, buf + N_BLOCK, plainlen);
+    utils_zero(buf + plainlen, len - plainlen);
+    *decrypt_len = plainlen + 1;
+    return DBB_OK;
+}
+
+
+// Decodes the base64 `in` into `out` and decrypts it there. `out` must hold
+// AESCBCB64_DECRYPT_SIZE(inlen) bytes and may be `in` itself to decrypt in place.
+// On success `out` holds the null terminated plaintext and `decrypt_len` includes
+// the null terminator.
+int aescbcb64_decrypt_to(const char *in, int inlen, char *out, int out_size,
+                         int *decrypt_len, const uint8_t *key, AES_KEY_SLOT slot)
+{
+    int ub64len;
+
+    *decrypt_len = 0;
+    if (!in || inlen <= 0) {
+        return DBB_ERROR;
+    }
+
+    ub64len = unbase64_to(in, inlen, (unsigned char *)out, out_size);
+    if (ub64len < 0) {
+        return DBB_ERROR;
     }
-    char *dec = malloc(ub64len - N_BLOCK - padlen + 1); // +1 for null termination
+    return aescbcb64_cbc_decrypt((uint8_t *)out, ub64len, decrypt_len, key, slot);
+}
+
+
+// Must free() returned value
+char *aescbcb64_init_and_decrypt(const uint8_t *ub64, int ub64len, int *decrypt_len,
+                                 const uint8_t *key)
+{
+    char *dec = malloc(ub64len > 0 ? ub64len : 1);
     if (!dec) {
-        utils_zero(dec_pad, sizeof(dec_pad));
-        utils_zero(ctx, sizeof(ctx));
+        *decrypt_len = 0;
+        return NULL;
+    }
+    memcpy(dec, ub64, ub64len > 0 ? ub64len : 0);
+    if (aescbcb64_cbc_decrypt((uint8_t *)dec, ub64len, decrypt_len, key,
+                              AES_KEY_NONE) != DBB_OK) {
+        free(dec);
         return NULL;
     }
-    memcpy(dec, dec_pad, ub64len - N_BLOCK - padlen);
-    dec[ub64len - N_BLOCK - padlen] = '\0';
-    *decrypt_len = ub64len - N_BLOCK - padlen + 1;
-    utils_zero(dec_pad, sizeof(dec_pad));
-    utils_zero(ctx, sizeof(ctx));
     return dec;
 }
 
+
 // Must free() returned value
 char *aescbcb64_decrypt(const unsigned char *in, int inlen, int *decrypt_len,
-                        const uint8_t *key)
+                        const uint8_t *key, AES_KEY_SLOT slot)
 {
-    if (!in || inlen == 0) {
+    int size = AESCBCB64_DECRYPT_SIZE(inlen);
+    char *dec;
+
+    *decrypt_len = 0;
+    if (!in || size <= 0) {
+        return NULL;
+    }
+    dec = malloc(size);
+    if (!dec) {
+        return NULL;
+    }
+    if (aescbcb64_decrypt_to((const char *)in, inlen, dec, size, decrypt_len, key,
+                             slot) != DBB_OK) {
+        free(dec);
+        return NULL;
+    }
+    return dec;
+}
+
+
+enum {
+    AESCBCB64_STREAM_RUNNING = 1,
+    AESCBCB64_STREAM_DONE,
+    AESCBCB64_STREAM_FAILED
+};
+
+
+// Frees the plaintext buffers and forgets the keys
+void aescbcb64_decrypt_stream_free(aescbcb64_decrypt_stream *s)
+{
+    int k;
+    for (k = 0; k < AESCBCB64_STREAM_KEYS; k++) {
+        if (s->out[k]) {
+            utils_zero(s->out[k], AESCBCB64_DECRYPT_SIZE(s->b64_len));
+            free(s->out[k]);
+        }
+    }
+    utils_zero(s, sizeof(*s));
+}
+
+
+static void aescbcb64_decrypt_stream_fail(aescbcb64_decrypt_stream *s)
+{
+    aescbcb64_decrypt_stream_free(s);
+    s->state = AESCBCB64_STREAM_FAILED;
+}
+
+
+// Expects `b64len` base64 characters. Returns DBB_ERROR if the plaintext buffers
+// cannot be allocated.
+int aescbcb64_decrypt_stream_init(aescbcb64_decrypt_stream *s, int b64len,
+                                  const uint8_t *const keys[AESCBCB64_STREAM_KEYS],
+                                  const AES_KEY_SLOT slots[AESCBCB64_STREAM_KEYS])
+{
+    int k, size = AESCBCB64_DECRYPT_SIZE(b64len);
+
+    memset(s, 0, sizeof(*s));
+    s->b64_len = b64len;
+    if (size < 2 * N_BLOCK) {
+        aescbcb64_decrypt_stream_fail(s);
+        return DBB_ERROR;
+    }
+    for (k = 0; k < AESCBCB64_STREAM_KEYS; k++) {
+        memcpy(s->key[k], keys[k], sizeof(s->key[k]));
+        s->slot[k] = slots[k];
+        s->out[k] = malloc(size);
+        if (!s->out[k]) {
+            aescbcb64_decrypt_stream_fail(s);
+            return DBB_ERROR;
+        }
+    }
+    s->state = AESCBCB64_STREAM_RUNNING;
+    return DBB_OK;
+}
+
+
+// Appends decoded ciphertext and decrypts each completed block under every key
+static void aescbcb64_decrypt_stream_put(aescbcb64_decrypt_stream *s, const uint8_t *data,
+        int len)
+{
+    int k, n;
+    uint8_t iv[N_BLOCK];
+    aes_context scratch[1];
+
+    // Same bound as the output buffer of aescbcb64_decrypt()
+    if (s->cipher_len + len > AESCBCB64_DECRYPT_SIZE(s->b64_len)) {
+        aescbcb64_decrypt_stream_fail(s);
+        return;
+    }
+
+    while (len > 0) {
+        n = MIN(len, N_BLOCK - s->block_len);
+        memcpy(s->block + s->block_len, data, n);
+        s->block_len += n;
+        s->cipher_len += n;
+        data += n;
+        len -= n;
+        if (s->block_len < N_BLOCK) {
+            break;
+        }
+        if (s->cipher_len > N_BLOCK) {
+            for (k = 0; k < AESCBCB64_STREAM_KEYS; k++) {
+                memcpy(iv, s->iv, N_BLOCK);
+                aes_ct_cbc_decrypt(s->block, (uint8_t *)s->out[k] + s->cipher_len - 2 * N_BLOCK, 1,
+                                   iv, aescbcb64_key_schedule_get(s->key[k], s->slot[k], scratch));
+            }
+        }
+        memcpy(s->iv, s->block, N_BLOCK);
+        s->block_len = 0;
+    }
+
+    utils_zero(iv, sizeof(iv));
+    utils_zero(scratch, sizeof(scratch));
+}
+
+
+// `received` characters of `in` are available. Decodes the whole groups that can be
+// neither padded nor the last one, so they decode as they would in unbase64_to().
+void aescbcb64_decrypt_stream_update(aescbcb64_decrypt_stream *s, const char *in,
+                                     int received)
+{
+    uint8_t bin[48];
+    int n, end = MIN(received, s->b64_len - 3) & ~3;
+
+    while (s->state == AESCBCB64_STREAM_RUNNING && s->b64_pos + 4 <= end) {
+        n = MIN(end - s->b64_pos, 64);
+        // A trailing '=' would be taken as padding; it is invalid this far from the end
+        if (in[s->b64_pos + n - 1] == '=' ||
+                unbase64_to(in + s->b64_pos, n, bin, sizeof(bin)) != 3 * n / 4) {
+            aescbcb64_decrypt_stream_fail(s);
+            break;
+        }
+        aescbcb64_decrypt_stream_put(s, bin, 3 * n / 4);
+        s->b64_pos += n;
+    }
+    utils_zero(bin, sizeof(bin));
+}
+
+
+// Decodes the rest of the input and strips the padding like aescbcb64_cbc_decrypt()
+static void aescbcb64_decrypt_stream_finish(aescbcb64_decrypt_stream *s, const char *in)
+{
+    uint8_t bin[48];
+    int k, n, plainlen;
+
+    aescbcb64_decrypt_stream_update(s, in, s->b64_len);
+    if (s->state != AESCBCB64_STREAM_RUNNING) {
+        return;
+    }
+
+    n = unbase64_to(in + s->b64_pos, s->b64_len - s->b64_pos, bin, sizeof(bin));
+    if (n < 0) {
+        aescbcb64_decrypt_stream_fail(s);
+        return;
+    }
+    aescbcb64_decrypt_stream_put(s, bin, n);
+    utils_zero(bin, sizeof(bin));
+    if (s->state != AESCBCB64_STREAM_RUNNING ||
+            (s->cipher_len % N_BLOCK) || s->cipher_len < 2 * N_BLOCK) {
+        aescbcb64_decrypt_stream_fail(s);
+        return;
+    }
+
+    for (k = 0; k < AESCBCB64_STREAM_KEYS; k++) {
+        plainlen = s->cipher_len - N_BLOCK - (uint8_t)s->out[k][s->cipher_len - N_BLOCK - 1];
+        if (plainlen <= 0) {
+            // Bad padding, as with a wrong key
+            utils_zero(s->out[k], AESCBCB64_DECRYPT_SIZE(s->b64_len));
+            free(s->out[k]);
+            s->out[k] = NULL;
+            continue;
+        }
+        utils_zero(s->out[k] + plainlen, AESCBCB64_DECRYPT_SIZE(s->b64_len) - plainlen);
+        s->decrypt_len[k] = plainlen + 1;
+    }
+    s->state = AESCBCB64_STREAM_DONE;
+}
+
+
+// Sets `dec` to what aescbcb64_decrypt() returns for `in` under `key`, finishing the
+// stream first. A key is handed over once. Returns DBB_ERROR if the stream has no
+// answer, for example because `in` is not what was streamed or is not valid base64
+// ciphertext; the caller then falls back to aescbcb64_decrypt().
+//
+// Must free() `dec`
+int aescbcb64_decrypt_stream_take(aescbcb64_decrypt_stream *s, const char *in, int inlen,
+                                  const uint8_t *key, AES_KEY_SLOT slot, char **dec,
+                                  int *decrypt_len)
+{
+    int k;
+
+    *dec = NULL;
+    *decrypt_len = 0;
+    if (s->state == AESCBCB64_STREAM_RUNNING) {
+        if (inlen != s->b64_len) {
+            aescbcb64_decrypt_stream_fail(s);
+            return DBB_ERROR;
+        }
+        aescbcb64_decrypt_stream_finish(s, in);
+    }
+    if (s->state != AESCBCB64_STREAM_DONE || inlen != s->b64_len) {
+        return DBB_ERROR;
+    }
+
+    for (k = 0; k < AESCBCB64_STREAM_KEYS; k++) {
+        if (s->slot[k] == slot && !s->taken[k] && MEMEQ(s->key[k], key, sizeof(s->key[k]))) {
+            *dec = s->out[k];
+            *decrypt_len = s->decrypt_len[k];
+            s->out[k] = NULL;
+            s->taken[k] = 1;
+            return DBB_OK;
+        }
+    }
+    return DBB_ERROR;
+}
+
+
+#ifdef TESTING
+// Host-side counterpart of aescbcb64_hmac_encrypt() using the same cached TFA keys.
+// Returns NULL if the HMAC does not match.
+//
+// Must free() returned value
+char *aescbcb64_hmac_decrypt(const unsigned char *in, int inlen, int *out_msg_len)
+{
+    int i, ub64len;
+    uint8_t diff = 0, hmac[SHA256_DIGEST_LENGTH];
+    HMAC_SHA256_CTX hctx;
+
+    *out_msg_len = 0;
+    if (!in || inlen == 0 || !tfa_keys.valid) {
         return NULL;
     }
 
-    // Unbase64
-    int ub64len;
     unsigned char *ub64 = unbase64((const char *)in, inlen, &ub64len);
     if (!ub64) {
         return NULL;
     }
-    if ((ub64len % N_BLOCK) || ub64len < N_BLOCK) {
+    if ((ub64len % N_BLOCK) || ub64len < N_BLOCK + SHA256_DIGEST_LENGTH) {
         free(ub64);
         return NULL;
     }
 
-    char *ret = aescbcb64_init_and_decrypt(ub64, ub64len, decrypt_len, key);
-    memset(ub64, 0, ub64len);
-    free(ub64);
-    return ret;
+    ub64len -= SHA256_DIGEST_LENGTH;
+    hmac_sha256_Copy(&hctx, &tfa_keys.authentication);
+    hmac_sha256_Update(&hctx, ub64, ub64len);
+    hmac_sha256_Final(&hctx, hmac);
+    for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        diff |= hmac[i] ^ ub64[ub64len + i];
+    }
+    if (diff || aescbcb64_cbc_decrypt(ub64, ub64len, out_msg_len, tfa_keys.encryption_key,
+                                      AES_KEY_TFA) != DBB_OK) {
+        memset(ub64, 0, ub64len + SHA256_DIGEST_LENGTH);
+        free(ub64);
+        return NULL;
+    }
+    return (char *)ub64;
 }
-
-
+#endif
@@ -28,16 +28,97 @@
 #define _AESCBCB64_H_
 
 
-char *aescbcb64_hmac_encrypt(const unsigned char *in, int inlen,
-                             int *out_b64len, const uint8_t *shared_secret);
+#include <stdint.h>
+#include "aes.h"
+#include "sha2.h"
 
-char *aescbcb64_init_and_decrypt(uint8_t *ub64, int ub64len, int *decrypt_len,
+
+// Exact buffer sizes for the allocation-free API, usable for static buffers.
+// A ciphertext is [ iv | PKCS7-padded data ] and always gains at least one pad byte.
+#define AESCBCB64_CIPHER_LEN(inlen)        (N_BLOCK * ((inlen) / N_BLOCK + 2))
+#define AESCBCB64_B64_LEN(binlen)          (4 * (((binlen) + 2) / 3))
+// Size of the raw [ iv | ciphertext | hmac ] from aescbcb64_hmac_encrypt_in_place()
+#define AESCBCB64_HMAC_CIPHER_LEN(inlen)   (AESCBCB64_CIPHER_LEN(inlen) + SHA256_DIGEST_LENGTH)
+// Output size of aescbcb64_encrypt_to() for `inlen` bytes, including the null terminator
+#define AESCBCB64_ENCRYPT_SIZE(inlen)      (AESCBCB64_B64_LEN(AESCBCB64_CIPHER_LEN(inlen)) + 1)
+// Output size of aescbcb64_hmac_encrypt_to() for `inlen` bytes, including the null terminator
+#define AESCBCB64_HMAC_ENCRYPT_SIZE(inlen) (AESCBCB64_B64_LEN(AESCBCB64_HMAC_CIPHER_LEN(inlen)) + 1)
+// Working size of aescbcb64_decrypt_to() for `b64len` base64 characters. The
+// ciphertext is decoded into this span, so it also bounds the plaintext.
+#define AESCBCB64_DECRYPT_SIZE(b64len)     (3 * ((b64len) / 4))
+
+
+// Slots of the expanded AES key-schedule cache. A slot is rescheduled when it is
+// invalidated or used with a different key. AES_KEY_NONE is never cached.
+typedef enum AES_KEY_SLOT {
+    AES_KEY_STAND,
+    AES_KEY_HIDDEN,
+    AES_KEY_TFA,
+    AES_KEY_STORAGE,
+    AES_KEY_NONE  /* keep last */
+} AES_KEY_SLOT;
+
+
+// Decryption of a base64 [ iv | ciphertext ] under several candidate keys while the
+// characters still arrive. Whole base64 groups and whole blocks are processed as they
+// become available, leaving the last block for aescbcb64_decrypt_stream_take().
+#define AESCBCB64_STREAM_KEYS 2
+
+typedef struct {
+    uint8_t key[AESCBCB64_STREAM_KEYS][32];
+    AES_KEY_SLOT slot[AESCBCB64_STREAM_KEYS];
+    char *out[AESCBCB64_STREAM_KEYS];// plaintext so far; null terminated once done
+    int decrypt_len[AESCBCB64_STREAM_KEYS];
+    uint8_t taken[AESCBCB64_STREAM_KEYS];
+    uint8_t iv[N_BLOCK];// previous ciphertext block
+    uint8_t block[N_BLOCK];// ciphertext block being decoded
+    int block_len;
+    int b64_len;// expected base64 characters
+    int b64_pos;// base64 characters decoded
+    int cipher_len;// ciphertext bytes decoded, including the IV
+    uint8_t state;
+} aescbcb64_decrypt_stream;
+
+
+void aescbcb64_key_cache_invalidate(AES_KEY_SLOT slot);
+void aescbcb64_key_cache_clear(void);
+
+void aescbcb64_tfa_keys_set(const uint8_t *shared_secret);
+
+char *aescbcb64_hmac_encrypt(const unsigned char *in, int inlen, int *out_b64len);
+int aescbcb64_hmac_encrypt_to(const unsigned char *in, int inlen, char *out, int out_size,
+                              int *out_b64len);
+int aescbcb64_hmac_encrypt_in_place(uint8_t *buf, int len, int buf_size, int *out_len);
+
+#ifdef TESTING
+char *aescbcb64_hmac_decrypt(const unsigned char *in, int inlen, int *out_msg_len);
+#endif
+
+char *aescbcb64_init_and_decrypt(const uint8_t *ub64, int ub64len, int *decrypt_len,
                                  const uint8_t *key);
 
 char *aescbcb64_encrypt(const unsigned char *in, int inlen,
-                        int *out_b64len, const uint8_t *key);
+                        int *out_b64len, const uint8_t *key, AES_KEY_SLOT slot);
 
 char *aescbcb64_decrypt(const unsigned char *in, int inlen,
-                        int *decrypt_len, const uint8_t *key);
+                        int *decrypt_len, const uint8_t *key, AES_KEY_SLOT slot);
+
+// Allocation-free variants. `out` must hold `out_size` bytes, at least the
+// AESCBCB64_*_SIZE() of the input. Return DBB_OK or DBB_ERROR.
+int aescbcb64_encrypt_to(const unsigned char *in, int inlen, char *out, int out_size,
+                         int *out_b64len, const uint8_t *key, AES_KEY_SLOT slot);
+
+int aescbcb64_decrypt_to(const char *in, int inlen, char *out, int out_size,
+                         int *decrypt_len, const uint8_t *key, AES_KEY_SLOT slot);
+
+int aescbcb64_decrypt_stream_init(aescbcb64_decrypt_stream *s, int b64len,
+                                  const uint8_t *const keys[AESCBCB64_STREAM_KEYS],
+                                  const AES_KEY_SLOT slots[AESCBCB64_STREAM_KEYS]);
+void aescbcb64_decrypt_stream_update(aescbcb64_decrypt_stream *s, const char *in,
+                                     int received);
+int aescbcb64_decrypt_stream_take(aescbcb64_decrypt_stream *s, const char *in, int inlen,
+                                  const uint8_t *key, AES_KEY_SLOT slot, char **dec,
+                                  int *decrypt_len);
+void aescbcb64_decrypt_stream_free(aescbcb64_decrypt_stream *s);
 
 #endif
@@ -28,6 +28,7 @@
 #include <string.h>
 #include "ataes132.h"
 #include "flags.h"
+#include "timer.h"
 #include "drivers/config/mcu.h"
 #ifdef TESTING
 #include <stdlib.h>
@@ -37,6 +38,10 @@
 #endif
 
 
+#define ATAES_POLL_MS           2// between two reads of the status register
+#define ATAES_POLL_TIMEOUT_MS   30
+
+
 static void ataes_calculate_crc(uint8_t length, const uint8_t *data, uint8_t *crc)
 {
     uint8_t counter;
@@ -162,9 +167,9 @@ int ataes_process(uint8_t const *command, uint16_t cmd_len,
 #else
     uint32_t ret = 0;
     uint8_t ataes_status = 0;
-    uint8_t delay = 2; // msec
     uint8_t timeout = 10; // counts
     uint8_t cnt, i, crc[2];
+    uint64_t deadline;
 
     uint8_t command_block[cmd_len + 3];
     command_block[0] = cmd_len + 3;
@@ -181,7 +186,7 @@ int ataes_process(uint8_t const *command, uint16_t cmd_len,
     memset(response_block, 0, response_len);
 
     // Check if awake
-    cnt = 0;
+    deadline = timer_deadline_ms(ATAES_POLL_TIMEOUT_MS);
     while (1) {
         ret = ataes_eeprom_read(BOARD_COM_ATAES_ADDR_STATUS, 1, &ataes_status);
         if (!ataes_status && !ret) {
@@ -190,10 +195,10 @@ int ataes_process(uint8_t const *command, uint16_t cmd_len,
         if ((ataes_status & 0x40) && !ret) {
             break;
         }
-        if (cnt++ > timeout) {
+        if (timer_expired(deadline)) {
             return DBB_ERROR;
         }
-        delay_ms(delay);
+        timer_wait_ms(ATAES_POLL_MS);
     }
 
     // Reset memory pointer
@@ -208,7 +213,7 @@ int ataes_process(uint8_t const *command, uint16_t cmd_len,
     }
 
     // Check if ready
-    cnt = 0;
+    deadline = timer_deadline_ms(ATAES_POLL_TIMEOUT_MS);
     while (1) {
         ret = ataes_eeprom_read(BOARD_COM_ATAES_ADDR_STATUS, 1, &ataes_status);
         if (!ataes_status && !ret) {
@@ -216,10 +221,10 @@ int ataes_process(uint8_t const *command, uint16_t cmd_len,
         }
         if ((ataes_status & 0x40) && !ret) {
             break;
-        } else if (cnt++ > timeout) {
+        } else if (timer_expired(deadline)) {
             return DBB_ERROR;
         }
-        delay_ms(delay);
+        timer_wait_ms(ATAES_POLL_MS);
     }
 
     // Write command block
@@ -234,16 +239,16 @@ int ataes_process(uint8_t const *command, uint16_t cmd_len,
     }
 
     // Check if data is available to read (0x40)
-    cnt = 0;
+    deadline = timer_deadline_ms(ATAES_POLL_TIMEOUT_MS);
     while (1) {
         ret = ataes_eeprom_read(BOARD_COM_ATAES_ADDR_STATUS, 1, &ataes_status);
         if ((ataes_status & 0x40) && !ret) {
             break;
         }
-        if (cnt++ > timeout) {
+        if (timer_expired(deadline)) {
             return DBB_ERROR;
         }
-        delay_ms(delay);
+        timer_wait_ms(ATAES_POLL_MS);
     }
 
     // Reset memory pointer
@@ -286,23 +291,22 @@ int ataes_eeprom(uint16_t LEN, uint32_t ADDR, uint8_t *userdata_read,
 #else
     int ret;
     uint8_t ataes_status = 0;
-    uint8_t delay = 2; // msec
-    uint8_t timeout = 10; // counts
-    uint8_t cnt = 0;
+    uint64_t deadline;
 
     if (userdata_write != NULL) {
         ret = ataes_eeprom_write(ADDR, LEN, userdata_write);
         if (ret) {
             return DBB_ERROR;
         }
+        deadline = timer_deadline_ms(ATAES_POLL_TIMEOUT_MS);
         while (1) {
             ret = ataes_eeprom_read(BOARD_COM_ATAES_ADDR_STATUS, 1, &ataes_status);
             if (!(ataes_status & 0x81) && !ret) { // 0x81 = no error and device ready
                 break;
-            } else if (cnt++ > timeout) {
+            } else if (timer_expired(deadline)) {
                 return DBB_ERROR;
             }
-            delay_ms(delay);
+            timer_wait_ms(ATAES_POLL_MS);
         }
     }
 
@@ -311,14 +315,15 @@ int ataes_eeprom(uint16_t LEN, uint32_t ADDR, uint8_t *userdata_read,
         if (ret) {
             return DBB_ERROR;
         }
+        deadline = timer_deadline_ms(ATAES_POLL_TIMEOUT_MS);
         while (1) {
             ret = ataes_eeprom_read(BOARD_COM_ATAES_ADDR_STATUS, 1, &ataes_status);
             if (!ataes_status && !ret) {
                 break;
-            } else if (cnt++ > timeout) {
+            } else if (timer_expired(deadline)) {
                 return DBB_ERROR;
             }
-            delay_ms(delay);
+            timer_wait_ms(ATAES_POLL_MS);
         }
     }
 #endif
@@ -23,11 +23,20 @@
 
 #include <string.h>
 #include <stdbool.h>
-#include <sys/types.h>
 #include "base58.h"
 #include "utils.h"
 #include "sha2.h"
 
+
+// Largest payload handled, base58_*_check() data plus the 4-byte checksum
+#define B58_MAX_BIN (128 + 4)
+// Base 58^5 limbs, the largest power of 58 that fits in 32 bits
+#define B58_LIMB 656356768u
+#define B58_LIMB_DIGITS 5
+#define B58_MAX_DIGITS (B58_MAX_BIN * 138 / 100 + 1)
+#define B58_MAX_LIMBS ((B58_MAX_DIGITS + B58_LIMB_DIGITS - 1) / B58_LIMB_DIGITS)
+
+
 static const int8_t b58digits_map[] = {
     -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
     -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
@@ -45,37 +54,51 @@ static int b58tobin(void *bin, size_t *binszp, const char *b58)
     const unsigned char *b58u = (const void *)b58;
     unsigned char *binu = bin;
     size_t outisz = (binsz + 3) / 4;
-    uint32_t outi[outisz];
+    uint32_t outi[(B58_MAX_BIN + 3) / 4];
     uint64_t t;
-    uint32_t c;
-    size_t i, j;
+    uint32_t c, mul;
+    size_t i, j, k;
     uint8_t bytesleft = binsz % 4;
     uint32_t zeromask = bytesleft ? (0xffffffff << (bytesleft * 8)) : 0;
     unsigned zerocount = 0;
     size_t b58sz;
 
+    if (binsz > B58_MAX_BIN) {
+        return false;
+    }
+
     b58sz = strlen(b58);
 
     memset(outi, 0, outisz * sizeof(*outi));
 
     // Leading zeros, just count
-    for (i = 0; i < b58sz && !b58digits_map[b58u[i]]; ++i) {
+    for (i = 0; i < b58sz && b58u[i] == '1'; ++i) {
         ++zerocount;
     }
 
-    for ( ; i < b58sz; ++i) {
-        if (b58u[i] & 0x80) {
-            // High-bit set on invalid digit
-            return false;
-        }
-        if (b58digits_map[b58u[i]] == -1) {
-            // Invalid base58 digit
-            return false;
+    // Fold up to B58_LIMB_DIGITS digits into one multiplier below 58^5 per pass
+    k = (b58sz - i) % B58_LIMB_DIGITS;
+    if (!k) {
+        k = B58_LIMB_DIGITS;
+    }
+    while (i < b58sz) {
+        for (c = 0, mul = 1; k--; ++i, mul *= 58) {
+            if (b58u[i] & 0x80) {
+                // High-bit set on invalid digit
+                utils_zero(outi, outisz * sizeof(*outi));
+                return false;
+            }
+            if (b58digits_map[b58u[i]] == -1) {
+                // Invalid base58 digit
+                utils_zero(outi, outisz * sizeof(*outi));
+                return false;
+            }
+            c = c * 58 + (unsigned)b58digits_map[b58u[i]];
         }
-        c = (unsigned)b58digits_map[b58u[i]];
+        k = B58_LIMB_DIGITS;
         for (j = outisz; j--; ) {
-            t = ((uint64_t)outi[j]) * 58 + c;
-            c = (t & 0x3f00000000) >> 32;
+            t = ((uint64_t)outi[j]) * mul + c;
+            c = t >> 32;
             outi[j] = t & 0xffffffff;
         }
         if (c) {
@@ -154,44 +177,67 @@ static const char b58digits_ordered[] =
 static int b58enc(char *b58, size_t *b58sz, const void *data, size_t binsz)
 {
     const uint8_t *bin = data;
-    int carry;
-    ssize_t i, j, high, zcount = 0;
-    size_t size;
+    uint32_t limbs[B58_MAX_LIMBS], w, v;
+    uint64_t t, carry, mul;
+    size_t i, j, k, zcount = 0, used = 0, digits = 0;
+    char *p;
 
-    while (zcount < (ssize_t)binsz && !bin[zcount]) {
-        ++zcount;
+    if (binsz > B58_MAX_BIN) {
+        return false;
     }
 
-    size = (binsz - zcount) * 138 / 100 + 1;
-    uint8_t buf[size];
-    memset(buf, 0, size);
+    while (zcount < binsz && !bin[zcount]) {
+        ++zcount;
+    }
 
-    for (i = zcount, high = size - 1; i < (ssize_t)binsz; ++i, high = j) {
-        for (carry = bin[i], j = size - 1; (j > high) || carry; --j) {
-            carry += 256 * buf[j];
-            buf[j] = carry % 58;
-            carry /= 58;
+    // Little-endian limbs in base 58^5, fed 32 bits (256^4) at a time; the
+    // leading word takes the remainder bytes so that the rest are aligned.
+    k = (binsz - zcount) % 4;
+    if (!k) {
+        k = 4;
+    }
+    for (i = zcount; i < binsz; k = 4) {
+        for (w = 0, mul = 1; k--; ++i, mul <<= 8) {
+            w = (w << 8) | bin[i];
+        }
+        for (carry = w, j = 0; j < used; ++j) {
+            t = (uint64_t)limbs[j] * mul + carry;
+            limbs[j] = t % B58_LIMB;
+            carry = t / B58_LIMB;
+        }
+        while (carry) {
+            limbs[used++] = carry % B58_LIMB;
+            carry /= B58_LIMB;
         }
     }
 
-    for (j = 0; j < (ssize_t)size && !buf[j]; ++j);
+    if (used) {
+        digits = (used - 1) * B58_LIMB_DIGITS;
+        for (v = limbs[used - 1]; v; v /= 58) {
+            ++digits;
+        }
+    }
 
-    if (*b58sz <= zcount + size - j) {
-        *b58sz = zcount + size - j + 1;
-        utils_zero(buf, size);
+    if (*b58sz <= zcount + digits) {
+        *b58sz = zcount + digits + 1;
+        utils_zero(limbs, sizeof(limbs));
         return false;
     }
 
     if (zcount) {
         memset(b58, '1', zcount);
     }
-    for (i = zcount; j < (ssize_t)size; ++i, ++j) {
-        b58[i] = b58digits_ordered[buf[j]];
+    p = b58 + zcount + digits;
+    *p = '\0';
+    for (j = 0; j < used; ++j) {
+        v = limbs[j];
+        for (k = 0; k < B58_LIMB_DIGITS && (v || j + 1 < used); ++k, v /= 58) {
+            *--p = b58digits_ordered[v % 58];
+        }
     }
-    b58[i] = '\0';
-    *b58sz = i + 1;
+    *b58sz = zcount + digits + 1;
 
-    utils_zero(buf, size);
+    utils_zero(limbs, sizeof(limbs));
     return true;
 }
 
@@ -201,7 +247,7 @@ int base58_encode_check(const uint8_t *data, int datalen, char *str, int strsize
     if (datalen > 128) {
         return 0;
     }
-    uint8_t buf[datalen + 32];
+    uint8_t buf[128 + 32];
     uint8_t *hash = buf + datalen;
     memcpy(buf, data, datalen);
     sha256_Raw(data, datalen, hash);
@@ -223,7 +269,7 @@ int base58_decode_check(const char *str, uint8_t *data, int datalen)
     if (datalen > 128) {
         return 0;
     }
-    uint8_t d[datalen + 4];
+    uint8_t d[B58_MAX_BIN];
     size_t res = datalen + 4;
     if (b58tobin(d, &res, str) != true) {
         ret = 0;
@@ -32,6 +32,7 @@
 #define BASE64_H
 
 #include "base64.h"
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -39,145 +40,208 @@
 static const char *b64 =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/" ;
 
-// maps A=>0,B=>1..
-static const unsigned char unb64[] = {
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //10
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //20
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //30
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //40
-    0,   0,   0,  62,   0,   0,   0,  63,  52,  53, //50
-    54,  55,  56,  57,  58,  59,  60,  61,   0,   0, //60
-    0,   0,   0,   0,   0,   0,   1,   2,   3,   4, //70
-    5,   6,   7,   8,   9,  10,  11,  12,  13,  14, //80
-    15,  16,  17,  18,  19,  20,  21,  22,  23,  24, //90
-    25,   0,   0,   0,   0,   0,   0,  26,  27,  28, //100
-    29,  30,  31,  32,  33,  34,  35,  36,  37,  38, //110
-    39,  40,  41,  42,  43,  44,  45,  46,  47,  48, //120
-    49,  50,  51,   0,   0,   0,   0,   0,   0,   0, //130
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //140
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //150
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //160
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //170
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //180
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //190
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //200
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //210
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //220
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //230
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //240
-    0,   0,   0,   0,   0,   0,   0,   0,   0,   0, //250
-    0,   0,   0,   0,   0,   0,
-}; // This array has 255 elements
+// maps A=>0,B=>1.. and every character outside the alphabet, '=' included, to 0xff
+#define X 0xff
+static const unsigned char unb64[256] = {
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0x00
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0x10
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, 62,  X,  X,  X, 63, // 0x20
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61,  X,  X,  X,  X,  X,  X, // 0x30
+    X,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, // 0x40
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,  X,  X,  X,  X,  X, // 0x50
+    X, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, // 0x60
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51,  X,  X,  X,  X,  X, // 0x70
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0x80
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0x90
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0xa0
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0xb0
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0xc0
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0xd0
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0xe0
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0xf0
+};
+#undef X
+
+// Packs four bytes in memory order into a word, so one 32-bit store writes them
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define B64_WORD(b0, b1, b2, b3) \
+    (((uint32_t)(uint8_t)(b0) << 24) | ((uint32_t)(uint8_t)(b1) << 16) | \
+     ((uint32_t)(uint8_t)(b2) << 8) | (uint32_t)(uint8_t)(b3))
+#else
+#define B64_WORD(b0, b1, b2, b3) \
+    ((uint32_t)(uint8_t)(b0) | ((uint32_t)(uint8_t)(b1) << 8) | \
+     ((uint32_t)(uint8_t)(b2) << 16) | ((uint32_t)(uint8_t)(b3) << 24))
+#endif
+
+// Converts binary data of length=len to base64 characters written to out,
+// which must hold outlen >= 4 * ((len + 2) / 3) characters. No null terminator
+// is written. Returns the number of characters written, or -1 if out is too small.
+// Each 3-byte group is read before its 4 characters are stored, so the data may
+// sit at the end of `out` and be encoded over itself.
+int base64_to( const void *binaryData, int len, char *out, int outlen )
+{
+    const unsigned char *bin = (const unsigned char *) binaryData ;
+    int rc = 0 ; // result counter
+    int byteNo ;
+    uint32_t v, w ;
+
+    if ( len < 0 || outlen < BASE64_ENCODE_LEN(len) ) {
+        return -1;
+    }
+
+    for ( byteNo = 0 ; byteNo <= len - 3 ; byteNo += 3 ) {
+        v = ((uint32_t)bin[byteNo] << 16) | ((uint32_t)bin[byteNo + 1] << 8) | bin[byteNo + 2];
+        w = B64_WORD(b64[v >> 18], b64[(v >> 12) & 0x3f], b64[(v >> 6) & 0x3f], b64[v & 0x3f]);
+        memcpy(out + rc, &w, 4);
+        rc += 4;
+    }
+
+    if ( len - byteNo == 1 ) {
+        v = (uint32_t)bin[byteNo] << 16;
+        w = B64_WORD(b64[v >> 18], b64[(v >> 12) & 0x3f], '=', '=');
+        memcpy(out + rc, &w, 4);
+        rc += 4;
+    } else if ( len - byteNo == 2 ) {
+        v = ((uint32_t)bin[byteNo] << 16) | ((uint32_t)bin[byteNo + 1] << 8);
+        w = B64_WORD(b64[v >> 18], b64[(v >> 12) & 0x3f], b64[(v >> 6) & 0x3f], '=');
+        memcpy(out + rc, &w, 4);
+        rc += 4;
+    }
+
+    return rc ;
+}
 
 // Converts binary data of length=len to base64 characters.
 // Length of the resultant string is stored in flen
 // (you must pass pointer flen).
 char *base64( const void *binaryData, int len, int *flen )
 {
-    const unsigned char *bin = (const unsigned char *) binaryData ;
     char *res ;
 
-    int rc = 0 ; // result counter
-    int byteNo ; // I need this after the loop
-
-    int modulusLen = len % 3 ;
-    int pad = ((modulusLen & 1) << 1) + ((modulusLen & 2) >> 1)
-              ; // 2 gives 1 and 1 gives 2, but 0 gives 0.
-
-    *flen = 4 * (len + pad) / 3 ;
+    *flen = BASE64_ENCODE_LEN(len) ;
     res = malloc( *flen + 1 ) ; // and one for the null
     if ( !res ) {
         return 0;
     }
 
-    for ( byteNo = 0 ; byteNo <= len - 3 ; byteNo += 3 ) {
-        unsigned char BYTE0 = bin[byteNo];
-        unsigned char BYTE1 = bin[byteNo + 1];
-        unsigned char BYTE2 = bin[byteNo + 2];
-        res[rc++]  = b64[ BYTE0 >> 2 ] ;
-        res[rc++]  = b64[ ((0x3 & BYTE0) << 4) + (BYTE1 >> 4) ] ;
-        res[rc++]  = b64[ ((0x0f & BYTE1) << 2) + (BYTE2 >> 6) ] ;
-        res[rc++]  = b64[ 0x3f & BYTE2 ] ;
+    base64_to( binaryData, len, res, *flen );
+    res[*flen] = 0; // NULL TERMINATOR! ;)
+    return res ;
+}
+
+// Decodes and validates in a single pass over 4-character groups. A group is
+// converted with four table lookups whatever its characters; an invalid one is
+// only noticed through the OR of all lookups, checked once at the end. On error
+// the contents of `out` are unspecified.
+static int unbase64_decode( const char *ascii, int len, unsigned char *out, int outlen,
+                            int strict )
+{
+    const unsigned char *in = (const unsigned char *)ascii ;
+    unsigned char bad = 0 ;
+    int pad = 0, body, rem, cb = 0, charNo = 0 ;
+    uint32_t v, w ;
+
+    if ( !ascii || len < 2 ) {
+        // catch empty string
+        return -1;
+    }
+
+    pad = (in[len - 1] == '=') + (in[len - 1] == '=' && in[len - 2] == '=') ;
+    body = len - pad ;
+    rem = body % 4 ;
+
+    if ( rem == 1 ) {
+        // a single trailing character carries less than a byte
+        return -1;
+    }
+    if ( (pad || strict) && len % 4 ) {
+        // padded input must be complete quanta; strict input always is
+        return -1;
+    }
+    if ( outlen < 3 * (body / 4) + (rem ? rem - 1 : 0) ) {
+        return -1;
     }
 
-    if ( pad == 2 ) {
-        res[rc++] = b64[ bin[byteNo] >> 2 ] ;
-        res[rc++] = b64[ (0x3 & bin[byteNo]) << 4 ] ;
-        res[rc++] = '=';
-        res[rc++] = '=';
-    } else if ( pad == 1 ) {
-        res[rc++]  = b64[ bin[byteNo] >> 2 ] ;
-        res[rc++]  = b64[ ((0x3 & bin[byteNo]) << 4)   +   (bin[byteNo + 1] >> 4) ] ;
-        res[rc++]  = b64[ (0x0f & bin[byteNo + 1]) << 2 ] ;
-        res[rc++] = '=';
+    // Whole groups with a 32-bit store, whose fourth byte the next group
+    // overwrites. Writes stay behind reads, so decoding in place is safe.
+    for ( ; charNo + 4 < body ; charNo += 4 ) {
+        unsigned char A = unb64[in[charNo]], B = unb64[in[charNo + 1]];
+        unsigned char C = unb64[in[charNo + 2]], D = unb64[in[charNo + 3]];
+        bad |= A | B | C | D;
+        v = ((uint32_t)A << 18) | ((uint32_t)B << 12) | ((uint32_t)C << 6) | D;
+        w = B64_WORD(v >> 16, v >> 8, v, 0);
+        memcpy(out + cb, &w, 4);
+        cb += 3;
     }
 
-    res[rc] = 0; // NULL TERMINATOR! ;)
-    return res ;
+    // Last group, complete or not, with byte stores
+    if ( charNo < body ) {
+        unsigned char A = unb64[in[charNo]], B = unb64[in[charNo + 1]];
+        unsigned char C = rem == 2 ? 0 : unb64[in[charNo + 2]];
+        unsigned char D = rem ? 0 : unb64[in[charNo + 3]];
+        bad |= A | B | C | D;
+        if ( strict && (rem == 2 ? B & 0x0f : rem == 3 ? C & 0x03 : 0) ) {
+            // unused bits of the last character must be zero
+            return -1;
+        }
+        v = ((uint32_t)A << 18) | ((uint32_t)B << 12) | ((uint32_t)C << 6) | D;
+        out[cb++] = v >> 16;
+        if ( rem != 2 ) {
+            out[cb++] = v >> 8;
+        }
+        if ( rem == 0 ) {
+            out[cb++] = v;
+        }
+    }
+
+    if ( bad > 63 ) {
+        return -1;
+    }
+    return cb ;
+}
+
+// Converts base64 characters to binary data written to out, which must hold
+// outlen >= 3 * len / 4 bytes. out may be the same buffer as ascii to decode
+// in place. Padding is optional. Returns the number of bytes written, or -1 on
+// invalid input or if out is too small.
+int unbase64_to( const char *ascii, int len, unsigned char *out, int outlen )
+{
+    return unbase64_decode( ascii, len, out, outlen, 0 );
+}
+
+// As unbase64_to(), but only accepts the canonical encoding that base64_to()
+// produces: complete padded quanta with zero unused bits.
+int unbase64_strict_to( const char *ascii, int len, unsigned char *out, int outlen )
+{
+    return unbase64_decode( ascii, len, out, outlen, 1 );
 }
 
 unsigned char *unbase64( const char *ascii, int len, int *flen )
 {
-    const unsigned char *safeAsciiPtr = (const unsigned char *)ascii ;
     unsigned char *bin ;
-    int cb = 0;
-    int charNo;
-    int pad = 0 ;
+    int pad = 0, size ;
 
+    *flen = 0;
     if ( len < 2 ) { // 2 accesses below would be OOB.
         // catch empty string, return NULL as result.
-        *flen = 0;
         return 0;
     }
-
-    for ( int i = 0; i < len; i++ ) {
-        if (safeAsciiPtr[i] == '=') {
-            ++pad;
-            if (pad > 2) {
-                // invalid padding
-                *flen = 0;
-                return 0;
-            }
-        } else if (strchr(b64, safeAsciiPtr[i]) == NULL) {
-            // invalid character
-            *flen = 0;
-            return 0;
-        } else if (pad) {
-            // contains data beyond pad symbol
-            *flen = 0;
-            return 0;
-        }
+    pad = (ascii[len - 1] == '=') + (ascii[len - 2] == '=');
+    size = 3 * len / 4 - pad ;
+    if ( size <= 0 ) {
+        return 0;
     }
 
-    *flen = 3 * len / 4 - pad ;
-    bin = malloc( *flen ) ;
+    bin = malloc( size ) ;
     if ( !bin ) {
         return 0;
     }
 
-    for ( charNo = 0; charNo <= len - 4 - pad ; charNo += 4 ) {
-        int A = unb64[safeAsciiPtr[charNo]];
-        int B = unb64[safeAsciiPtr[charNo + 1]];
-        int C = unb64[safeAsciiPtr[charNo + 2]];
-        int D = unb64[safeAsciiPtr[charNo + 3]];
-
-        bin[cb++] = (A << 2) | (B >> 4) ;
-        bin[cb++] = (B << 4) | (C >> 2) ;
-        bin[cb++] = (C << 6) | (D) ;
-    }
-
-    if ( pad == 1 ) {
-        int A = unb64[safeAsciiPtr[charNo]];
-        int B = unb64[safeAsciiPtr[charNo + 1]];
-        int C = unb64[safeAsciiPtr[charNo + 2]];
-
-        bin[cb++] = (A << 2) | (B >> 4) ;
-        bin[cb++] = (B << 4) | (C >> 2) ;
-    } else if ( pad == 2 ) {
-        int A = unb64[safeAsciiPtr[charNo]];
-        int B = unb64[safeAsciiPtr[charNo + 1]];
-
-        bin[cb++] = (A << 2) | (B >> 4) ;
+    *flen = unbase64_to( ascii, len, bin, size );
+    if ( *flen < 0 ) {
+        *flen = 0;
+        free( bin );
+        return 0;
     }
 
     return bin ;
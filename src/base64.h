@@ -1,6 +1,7 @@
 /*
 * 2014 Douglas J Bakkum
 * Split into .h and .c files.
+* 2018 Table-driven single-pass decoding, caller buffers and a strict mode.
 */
 
 /*
@@ -43,5 +44,15 @@
 char *base64( const void *binaryData, int len, int *flen );
 unsigned char *unbase64( const char *ascii, int len, int *flen );
 
+#define BASE64_ENCODE_LEN(len) (4 * (((len) + 2) / 3))
+
+// Allocation-free variants writing into a caller buffer of size outlen.
+// Return the output length, or -1 on error. Decoding may be done in place.
+// unbase64_to() accepts unpadded input; unbase64_strict_to() only accepts the
+// canonical padded encoding.
+int base64_to( const void *binaryData, int len, char *out, int outlen );
+int unbase64_to( const char *ascii, int len, unsigned char *out, int outlen );
+int unbase64_strict_to( const char *ascii, int len, unsigned char *out, int outlen );
+
 
 #endif
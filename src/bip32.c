@@ -79,18 +79,22 @@ int hdnode_from_seed(const uint8_t *seed, int seed_len, HDNode *out)
 
 int hdnode_private_ckd(HDNode *inout, uint32_t i)
 {
-    uint8_t data[1 + 32 + 4];
+    uint8_t data[4];
     uint8_t I[32 + 32];
     uint8_t fingerprint[32];
     uint8_t p[32], z[32];
+    HMAC_SHA512_CTX hctx;
 
+    hmac_sha512_Init(&hctx, inout->chain_code, 32);
     if (i & 0x80000000) { // private derivation
         data[0] = 0;
-        memcpy(data + 1, inout->private_key, 32);
+        hmac_sha512_Update(&hctx, data, 1);
+        hmac_sha512_Update(&hctx, inout->private_key, 32);
     } else { // public derivation
-        memcpy(data, inout->public_key, 33);
+        hmac_sha512_Update(&hctx, inout->public_key, 33);
     }
-    write_be(data + 33, i);
+    write_be(data, i);
+    hmac_sha512_Update(&hctx, data, sizeof(data));
 
     sha256_Raw(inout->public_key, 33, fingerprint);
     ripemd160(fingerprint, 32, fingerprint);
@@ -99,7 +103,7 @@ int hdnode_private_ckd(HDNode *inout, uint32_t i)
 
     memcpy(p, inout->private_key, 32);
 
-    hmac_sha512(inout->chain_code, 32, data, sizeof(data), I);
+    hmac_sha512_Final(&hctx, I);
     memcpy(inout->chain_code, I + 32, 32);
     memcpy(inout->private_key, I, 32);
 
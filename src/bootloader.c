@@ -37,22 +37,95 @@
 #include "flash.h"
 #include "utils.h"
 #include "touch.h"
+#include "timer.h"
 #include "version.h"
 #include "bootloader.h"
 
 
 static char report[UDI_HID_REPORT_IN_SIZE];
 static uint8_t bootloader_loading_ready = 0;
-static const char *pubkeys[] = { // order is important
-    "02a1137c6bdd497358537df77d1375a741ed75461b706a612a3717d32748e5acf1",
-    "0256201125b958864de4bb00560a247ad246182866b6fe7ac29d7a12e7718ebb7d",
-    "03d2185d70fb29a36691d8470e65d02adfab2ec00caad91887da23e5ad20a25163",
-    "0263b742d9873405c609814da884324ab0f4c1597a5fd152b388899857f4d041df",
-    "02b95dc22d293376222ef896f74a8436a8b6672e7e416299f3c4e23b49c38ad366",
-    "03ef4c48dc308ace971c025db3edd4bc5d5110e28e14bdd925fffafd4d21002800",
-    "030d8b0b86fca70bfd3a8d842cdb3ff8362c02f455fd092b080f1bb137dfc1d25f",
-    0
+// Uncompressed (x, y) so that boot does not spend a modular square root per key.
+// The compressed form of each key is given above it. Order is important.
+static const uint8_t pubkeys[][64] = {
+    // 02a1137c6bdd497358537df77d1375a741ed75461b706a612a3717d32748e5acf1
+    {
+        0xa1, 0x13, 0x7c, 0x6b, 0xdd, 0x49, 0x73, 0x58,
+        0x53, 0x7d, 0xf7, 0x7d, 0x13, 0x75, 0xa7, 0x41,
+        0xed, 0x75, 0x46, 0x1b, 0x70, 0x6a, 0x61, 0x2a,
+        0x37, 0x17, 0xd3, 0x27, 0x48, 0xe5, 0xac, 0xf1,
+        0xf5, 0x20, 0x29, 0x7a, 0x85, 0xf6, 0x7a, 0xd5,
+        0xe8, 0x85, 0x0e, 0xcc, 0x87, 0x76, 0x18, 0x40,
+        0xaf, 0xcf, 0xe7, 0x3c, 0xef, 0x0a, 0x75, 0x12,
+        0xa1, 0x5b, 0x40, 0xd8, 0xeb, 0xea, 0x8e, 0xe6
+    },
+    // 0256201125b958864de4bb00560a247ad246182866b6fe7ac29d7a12e7718ebb7d
+    {
+        0x56, 0x20, 0x11, 0x25, 0xb9, 0x58, 0x86, 0x4d,
+        0xe4, 0xbb, 0x00, 0x56, 0x0a, 0x24, 0x7a, 0xd2,
+        0x46, 0x18, 0x28, 0x66, 0xb6, 0xfe, 0x7a, 0xc2,
+        0x9d, 0x7a, 0x12, 0xe7, 0x71, 0x8e, 0xbb, 0x7d,
+        0xdc, 0xea, 0x6b, 0x49, 0xa2, 0x46, 0x7d, 0x70,
+        0x8e, 0x71, 0xb2, 0x40, 0x5f, 0xf9, 0xa6, 0x56,
+        0x2d, 0x28, 0x91, 0x42, 0x8f, 0x4a, 0xe7, 0xa7,
+        0xd6, 0x4b, 0xcc, 0xb0, 0x30, 0x77, 0x60, 0x02
+    },
+    // 03d2185d70fb29a36691d8470e65d02adfab2ec00caad91887da23e5ad20a25163
+    {
+        0xd2, 0x18, 0x5d, 0x70, 0xfb, 0x29, 0xa3, 0x66,
+        0x91, 0xd8, 0x47, 0x0e, 0x65, 0xd0, 0x2a, 0xdf,
+        0xab, 0x2e, 0xc0, 0x0c, 0xaa, 0xd9, 0x18, 0x87,
+        0xda, 0x23, 0xe5, 0xad, 0x20, 0xa2, 0x51, 0x63,
+        0x6f, 0xb7, 0xfb, 0xa4, 0x96, 0xba, 0x0e, 0xf2,
+        0x32, 0x95, 0x87, 0xa6, 0xb8, 0xf4, 0x64, 0x18,
+        0x89, 0x63, 0x2a, 0x71, 0x01, 0xdd, 0xd7, 0x85,
+        0xfc, 0x19, 0x49, 0xdc, 0x8d, 0xf8, 0x08, 0xbb
+    },
+    // 0263b742d9873405c609814da884324ab0f4c1597a5fd152b388899857f4d041df
+    {
+        0x63, 0xb7, 0x42, 0xd9, 0x87, 0x34, 0x05, 0xc6,
+        0x09, 0x81, 0x4d, 0xa8, 0x84, 0x32, 0x4a, 0xb0,
+        0xf4, 0xc1, 0x59, 0x7a, 0x5f, 0xd1, 0x52, 0xb3,
+        0x88, 0x89, 0x98, 0x57, 0xf4, 0xd0, 0x41, 0xdf,
+        0xe7, 0xa6, 0x1d, 0x59, 0xd1, 0x3f, 0xdb, 0xc5,
+        0xf4, 0x1d, 0x27, 0x20, 0x7d, 0x9a, 0xbc, 0xa5,
+        0xa0, 0xba, 0xe8, 0xad, 0x8b, 0xea, 0x73, 0x99,
+        0x1f, 0xd3, 0xfa, 0x13, 0x9a, 0x72, 0xe0, 0x38
+    },
+    // 02b95dc22d293376222ef896f74a8436a8b6672e7e416299f3c4e23b49c38ad366
+    {
+        0xb9, 0x5d, 0xc2, 0x2d, 0x29, 0x33, 0x76, 0x22,
+        0x2e, 0xf8, 0x96, 0xf7, 0x4a, 0x84, 0x36, 0xa8,
+        0xb6, 0x67, 0x2e, 0x7e, 0x41, 0x62, 0x99, 0xf3,
+        0xc4, 0xe2, 0x3b, 0x49, 0xc3, 0x8a, 0xd3, 0x66,
+        0xe1, 0xe6, 0x39, 0x8f, 0xd2, 0x4a, 0xf9, 0x4d,
+        0x03, 0xa6, 0x52, 0xb5, 0x51, 0xcc, 0x4d, 0x8f,
+        0xda, 0xa7, 0x9e, 0xaf, 0x93, 0xce, 0x9f, 0xef,
+        0xea, 0xa5, 0xe9, 0x6e, 0xa1, 0xee, 0x7f, 0x96
+    },
+    // 03ef4c48dc308ace971c025db3edd4bc5d5110e28e14bdd925fffafd4d21002800
+    {
+        0xef, 0x4c, 0x48, 0xdc, 0x30, 0x8a, 0xce, 0x97,
+        0x1c, 0x02, 0x5d, 0xb3, 0xed, 0xd4, 0xbc, 0x5d,
+        0x51, 0x10, 0xe2, 0x8e, 0x14, 0xbd, 0xd9, 0x25,
+        0xff, 0xfa, 0xfd, 0x4d, 0x21, 0x00, 0x28, 0x00,
+        0xdb, 0x5f, 0xb8, 0x55, 0xb0, 0xee, 0x53, 0xa6,
+        0x2e, 0xaf, 0xef, 0x9d, 0xfe, 0x53, 0xb8, 0x18,
+        0x5f, 0xc3, 0xe1, 0x6f, 0x1c, 0x62, 0x7f, 0x7b,
+        0x23, 0x4c, 0x5b, 0x48, 0xda, 0x78, 0x5d, 0x65
+    },
+    // 030d8b0b86fca70bfd3a8d842cdb3ff8362c02f455fd092b080f1bb137dfc1d25f
+    {
+        0x0d, 0x8b, 0x0b, 0x86, 0xfc, 0xa7, 0x0b, 0xfd,
+        0x3a, 0x8d, 0x84, 0x2c, 0xdb, 0x3f, 0xf8, 0x36,
+        0x2c, 0x02, 0xf4, 0x55, 0xfd, 0x09, 0x2b, 0x08,
+        0x0f, 0x1b, 0xb1, 0x37, 0xdf, 0xc1, 0xd2, 0x5f,
+        0x4f, 0x22, 0x6d, 0x0e, 0x31, 0xdb, 0xf7, 0x28,
+        0xbf, 0x36, 0x2d, 0x4a, 0xe0, 0x21, 0xa6, 0x89,
+        0x4e, 0xf9, 0xc6, 0xb2, 0xdb, 0x5e, 0x08, 0x68,
+        0x7f, 0x0e, 0xfb, 0x74, 0x4b, 0x96, 0x69, 0x97
+    }
 };
+#define BOOT_PUBKEYS_NUM (sizeof(pubkeys) / sizeof(pubkeys[0]))
 
 
 void _binExec (void *l_code_addr);
@@ -170,18 +243,15 @@ static inline uint32_t bootloader_parse_app_version(uint8_t *start)
 
 static uint8_t bootloader_firmware_verified(void)
 {
-    uint8_t cnt = 0, valid = 0, hash[32], sig[64], pubkey_64[64];
-    const char **pubkey = pubkeys;
+    uint8_t cnt = 0, valid = 0, hash[32], sig[64];
 
     sha256_Raw((uint8_t *)(FLASH_APP_START), FLASH_APP_LEN, hash);
     sha256_Raw(hash, 32, hash);
 
-    while (*pubkey && valid < BOOT_SIG_M) {
+    while (cnt < BOOT_PUBKEYS_NUM && valid < BOOT_SIG_M) {
         memcpy(sig, (uint8_t *)(FLASH_SIG_START + cnt * sizeof(sig)), sizeof(sig));
-        uECC_decompress(utils_hex_to_uint8(*pubkey), pubkey_64, uECC_secp256k1());
-        valid += uECC_verify(pubkey_64, hash, SHA256_DIGEST_LENGTH, sig,
+        valid += uECC_verify(pubkeys[cnt], hash, SHA256_DIGEST_LENGTH, sig,
                              uECC_secp256k1());
-        pubkey++;
         cnt++;
     }
     memcpy(report + 2, utils_uint8_to_hex(hash, 32), 64); // return double hash of app binary
@@ -220,7 +290,7 @@ static uint8_t bootloader_unlocked(void)
 static void bootloader_blink(void)
 {
     led_toggle();
-    delay_ms(300);
+    timer_wait_ms(300);
     led_toggle();
     bootloader_report_status(OP_STATUS_OK);
 }
@@ -286,14 +356,9 @@ void bootloader_command(const char *command)
 
         case OP_VERIFY: {
             uint8_t sig[FLASH_SIG_LEN];
-            uint8_t cnt = 0;
-            const char **pubkey = pubkeys;
-            while (*pubkey) {
-                pubkey++;
-                cnt++;
-            }
             memcpy(sig, (uint8_t *)FLASH_SIG_START, FLASH_SIG_LEN);
-            memcpy(sig, utils_hex_to_uint8(command + FLASH_BOOT_OP_LEN), cnt * 64);
+            memcpy(sig, utils_hex_to_uint8(command + FLASH_BOOT_OP_LEN),
+                   BOOT_PUBKEYS_NUM * 64);
 
             flash_unlock(FLASH_SIG_START, FLASH_SIG_START + FLASH_SIG_LEN, NULL, NULL);
             if (flash_erase_page(FLASH_SIG_START, IFLASH_ERASE_PAGES_8) != FLASH_RC_OK) {
@@ -331,7 +396,7 @@ void bootloader_command(const char *command)
             break;
     }
 
-    usb_reply((uint8_t *)report);
+    usb_reply((uint8_t *)report, sizeof(report));
 }
 
 
@@ -351,9 +416,9 @@ void bootloader_jump(void)
     } else {
         for (int i = 0; i < 9; i++) {
             led_toggle();
-            delay_ms(100);
+            timer_wait_ms(100);
             led_toggle();
-            delay_ms(150);
+            timer_wait_ms(150);
         }
         led_off();
     }
@@ -364,7 +429,7 @@ void bootloader_jump(void)
 
     for (int i = 0; i < 6; i++) {
         led_toggle();
-        delay_ms(100);
+        timer_wait_ms(100);
     }
     led_off();
 }
@@ -0,0 +1,443 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2018 Douglas J. Bakkum
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+
+// ChaCha20-Poly1305 AEAD (RFC 8439) for 32-bit cores. Only additions, rotations,
+// xors and 32x32->64 multiplies are used, none of which depend on secret data for
+// timing on the Cortex-M4. Poly1305 follows the 26-bit limb layout of
+// poly1305-donna-32 by Andrew Moon (public domain).
+
+
+#include <string.h>
+
+#include "chacha20poly1305.h"
+#include "flags.h"
+#include "utils.h"
+
+
+#define U8TO32_LE(p) \
+    (((uint32_t)((p)[0])) | ((uint32_t)((p)[1]) << 8) | \
+     ((uint32_t)((p)[2]) << 16) | ((uint32_t)((p)[3]) << 24))
+
+#define U32TO8_LE(p, v) do { \
+    (p)[0] = (uint8_t)((v)); \
+    (p)[1] = (uint8_t)((v) >> 8); \
+    (p)[2] = (uint8_t)((v) >> 16); \
+    (p)[3] = (uint8_t)((v) >> 24); \
+} while (0)
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) do { \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7); \
+} while (0)
+
+
+static void chacha20_init_state(uint32_t state[16], const uint8_t key[CHACHA20_KEY_LEN],
+                                uint32_t counter, const uint8_t nonce[CHACHA20_NONCE_LEN])
+{
+    int i;
+    // "expand 32-byte k"
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (i = 0; i < 8; i++) {
+        state[4 + i] = U8TO32_LE(key + 4 * i);
+    }
+    state[12] = counter;
+    state[13] = U8TO32_LE(nonce + 0);
+    state[14] = U8TO32_LE(nonce + 4);
+    state[15] = U8TO32_LE(nonce + 8);
+}
+
+
+static void chacha20_core(const uint32_t state[16], uint8_t out[CHACHA20_BLOCK_LEN])
+{
+    int i;
+    uint32_t x[16];
+
+    memcpy(x, state, sizeof(x));
+    for (i = 0; i < 10; i++) {
+        // column rounds
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        // diagonal rounds
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (i = 0; i < 16; i++) {
+        x[i] += state[i];
+        U32TO8_LE(out + 4 * i, x[i]);
+    }
+    utils_zero(x, sizeof(x));
+}
+
+
+void chacha20_block(const uint8_t key[CHACHA20_KEY_LEN], uint32_t counter,
+                    const uint8_t nonce[CHACHA20_NONCE_LEN], uint8_t out[CHACHA20_BLOCK_LEN])
+{
+    uint32_t state[16];
+    chacha20_init_state(state, key, counter, nonce);
+    chacha20_core(state, out);
+    utils_zero(state, sizeof(state));
+}
+
+
+void chacha20_xor(const uint8_t key[CHACHA20_KEY_LEN], uint32_t counter,
+                  const uint8_t nonce[CHACHA20_NONCE_LEN], const uint8_t *in, uint8_t *out,
+                  size_t len)
+{
+    size_t i, n;
+    uint32_t state[16];
+    uint8_t keystream[CHACHA20_BLOCK_LEN];
+
+    chacha20_init_state(state, key, counter, nonce);
+    while (len) {
+        chacha20_core(state, keystream);
+        state[12]++;
+        n = len < CHACHA20_BLOCK_LEN ? len : CHACHA20_BLOCK_LEN;
+        for (i = 0; i < n; i++) {
+            out[i] = in[i] ^ keystream[i];
+        }
+        in += n;
+        out += n;
+        len -= n;
+    }
+    utils_zero(state, sizeof(state));
+    utils_zero(keystream, sizeof(keystream));
+}
+
+
+void poly1305_init(poly1305_context *ctx, const uint8_t key[POLY1305_KEY_LEN])
+{
+    // r &= 0xffffffc0ffffffc0ffffffc0fffffff
+    ctx->r[0] = (U8TO32_LE(key + 0)) & 0x3ffffff;
+    ctx->r[1] = (U8TO32_LE(key + 3) >> 2) & 0x3ffff03;
+    ctx->r[2] = (U8TO32_LE(key + 6) >> 4) & 0x3ffc0ff;
+    ctx->r[3] = (U8TO32_LE(key + 9) >> 6) & 0x3f03fff;
+    ctx->r[4] = (U8TO32_LE(key + 12) >> 8) & 0x00fffff;
+
+    memset(ctx->h, 0, sizeof(ctx->h));
+
+    ctx->pad[0] = U8TO32_LE(key + 16);
+    ctx->pad[1] = U8TO32_LE(key + 20);
+    ctx->pad[2] = U8TO32_LE(key + 24);
+    ctx->pad[3] = U8TO32_LE(key + 28);
+
+    ctx->leftover = 0;
+    ctx->final = 0;
+}
+
+
+static void poly1305_blocks(poly1305_context *ctx, const uint8_t *m, size_t bytes)
+{
+    const uint32_t hibit = ctx->final ? 0 : (1UL << 24);// 2^128
+    uint32_t r0, r1, r2, r3, r4;
+    uint32_t s1, s2, s3, s4;
+    uint32_t h0, h1, h2, h3, h4;
+    uint64_t d0, d1, d2, d3, d4;
+    uint32_t c;
+
+    r0 = ctx->r[0];
+    r1 = ctx->r[1];
+    r2 = ctx->r[2];
+    r3 = ctx->r[3];
+    r4 = ctx->r[4];
+
+    s1 = r1 * 5;
+    s2 = r2 * 5;
+    s3 = r3 * 5;
+    s4 = r4 * 5;
+
+    h0 = ctx->h[0];
+    h1 = ctx->h[1];
+    h2 = ctx->h[2];
+    h3 = ctx->h[3];
+    h4 = ctx->h[4];
+
+    while (bytes >= 16) {
+        // h += m[i]
+        h0 += (U8TO32_LE(m + 0)) & 0x3ffffff;
+        h1 += (U8TO32_LE(m + 3) >> 2) & 0x3ffffff;
+        h2 += (U8TO32_LE(m + 6) >> 4) & 0x3ffffff;
+        h3 += (U8TO32_LE(m + 9) >> 6) & 0x3ffffff;
+        h4 += (U8TO32_LE(m + 12) >> 8) | hibit;
+
+        // h *= r
+        d0 = ((uint64_t)h0 * r0) + ((uint64_t)h1 * s4) + ((uint64_t)h2 * s3) +
+             ((uint64_t)h3 * s2) + ((uint64_t)h4 * s1);
+        d1 = ((uint64_t)h0 * r1) + ((uint64_t)h1 * r0) + ((uint64_t)h2 * s4) +
+             ((uint64_t)h3 * s3) + ((uint64_t)h4 * s2);
+        d2 = ((uint64_t)h0 * r2) + ((uint64_t)h1 * r1) + ((uint64_t)h2 * r0) +
+             ((uint64_t)h3 * s4) + ((uint64_t)h4 * s3);
+        d3 = ((uint64_t)h0 * r3) + ((uint64_t)h1 * r2) + ((uint64_t)h2 * r1) +
+             ((uint64_t)h3 * r0) + ((uint64_t)h4 * s4);
+        d4 = ((uint64_t)h0 * r4) + ((uint64_t)h1 * r3) + ((uint64_t)h2 * r2) +
+             ((uint64_t)h3 * r1) + ((uint64_t)h4 * r0);
+
+        // (partial) h %= p
+        c = (uint32_t)(d0 >> 26);
+        h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c;
+        c = (uint32_t)(d1 >> 26);
+        h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c;
+        c = (uint32_t)(d2 >> 26);
+        h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c;
+        c = (uint32_t)(d3 >> 26);
+        h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c;
+        c = (uint32_t)(d4 >> 26);
+        h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5;
+        c = (h0 >> 26);
+        h0 = h0 & 0x3ffffff;
+        h1 += c;
+
+        m += 16;
+        bytes -= 16;
+    }
+
+    ctx->h[0] = h0;
+    ctx->h[1] = h1;
+    ctx->h[2] = h2;
+    ctx->h[3] = h3;
+    ctx->h[4] = h4;
+}
+
+
+void poly1305_update(poly1305_context *ctx, const uint8_t *m, size_t len)
+{
+    size_t i;
+
+    // handle leftover
+    if (ctx->leftover) {
+        size_t want = (16 - ctx->leftover);
+        if (want > len) {
+            want = len;
+        }
+        for (i = 0; i < want; i++) {
+            ctx->buffer[ctx->leftover + i] = m[i];
+        }
+        len -= want;
+        m += want;
+        ctx->leftover += want;
+        if (ctx->leftover < 16) {
+            return;
+        }
+        poly1305_blocks(ctx, ctx->buffer, 16);
+        ctx->leftover = 0;
+    }
+
+    // process full blocks
+    if (len >= 16) {
+        size_t want = (len & ~(size_t)(16 - 1));
+        poly1305_blocks(ctx, m, want);
+        m += want;
+        len -= want;
+    }
+
+    // store leftover
+    for (i = 0; i < len; i++) {
+        ctx->buffer[ctx->leftover + i] = m[i];
+    }
+    ctx->leftover += len;
+}
+
+
+void poly1305_finish(poly1305_context *ctx, uint8_t mac[POLY1305_TAG_LEN])
+{
+    uint32_t h0, h1, h2, h3, h4, c;
+    uint32_t g0, g1, g2, g3, g4;
+    uint64_t f;
+    uint32_t mask;
+
+    // process the remaining block
+    if (ctx->leftover) {
+        size_t i = ctx->leftover;
+        ctx->buffer[i++] = 1;
+        for (; i < 16; i++) {
+            ctx->buffer[i] = 0;
+        }
+        ctx->final = 1;
+        poly1305_blocks(ctx, ctx->buffer, 16);
+    }
+
+    // fully carry h
+    h0 = ctx->h[0];
+    h1 = ctx->h[1];
+    h2 = ctx->h[2];
+    h3 = ctx->h[3];
+    h4 = ctx->h[4];
+
+    c = h1 >> 26;
+    h1 = h1 & 0x3ffffff;
+    h2 += c;
+    c = h2 >> 26;
+    h2 = h2 & 0x3ffffff;
+    h3 += c;
+    c = h3 >> 26;
+    h3 = h3 & 0x3ffffff;
+    h4 += c;
+    c = h4 >> 26;
+    h4 = h4 & 0x3ffffff;
+    h0 += c * 5;
+    c = h0 >> 26;
+    h0 = h0 & 0x3ffffff;
+    h1 += c;
+
+    // compute h + -p
+    g0 = h0 + 5;
+    c = g0 >> 26;
+    g0 &= 0x3ffffff;
+    g1 = h1 + c;
+    c = g1 >> 26;
+    g1 &= 0x3ffffff;
+    g2 = h2 + c;
+    c = g2 >> 26;
+    g2 &= 0x3ffffff;
+    g3 = h3 + c;
+    c = g3 >> 26;
+    g3 &= 0x3ffffff;
+    g4 = h4 + c - (1UL << 26);
+
+    // select h if h < p, or h + -p if h >= p
+    mask = (g4 >> 31) - 1;
+    g0 &= mask;
+    g1 &= mask;
+    g2 &= mask;
+    g3 &= mask;
+    g4 &= mask;
+    mask = ~mask;
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+    h3 = (h3 & mask) | g3;
+    h4 = (h4 & mask) | g4;
+
+    // h = h % (2^128)
+    h0 = ((h0) | (h1 << 26)) & 0xffffffff;
+    h1 = ((h1 >> 6) | (h2 << 20)) & 0xffffffff;
+    h2 = ((h2 >> 12) | (h3 << 14)) & 0xffffffff;
+    h3 = ((h3 >> 18) | (h4 << 8)) & 0xffffffff;
+
+    // mac = (h + pad) % (2^128)
+    f = (uint64_t)h0 + ctx->pad[0];
+    h0 = (uint32_t)f;
+    f = (uint64_t)h1 + ctx->pad[1] + (f >> 32);
+    h1 = (uint32_t)f;
+    f = (uint64_t)h2 + ctx->pad[2] + (f >> 32);
+    h2 = (uint32_t)f;
+    f = (uint64_t)h3 + ctx->pad[3] + (f >> 32);
+    h3 = (uint32_t)f;
+
+    U32TO8_LE(mac + 0, h0);
+    U32TO8_LE(mac + 4, h1);
+    U32TO8_LE(mac + 8, h2);
+    U32TO8_LE(mac + 12, h3);
+
+    utils_zero(ctx, sizeof(poly1305_context));
+}
+
+
+// Authenticates aad | pad16 | ciphertext | pad16 | le64(aadlen) | le64(ctlen)
+static void chacha20poly1305_tag(const uint8_t key[CHACHA20_KEY_LEN],
+                                 const uint8_t nonce[CHACHA20_NONCE_LEN],
+                                 const uint8_t *aad, size_t aadlen,
+                                 const uint8_t *ct, size_t ctlen,
+                                 uint8_t tag[POLY1305_TAG_LEN])
+{
+    static const uint8_t zeros[16] = {0};
+    uint8_t block[CHACHA20_BLOCK_LEN];
+    uint8_t lengths[16];
+    poly1305_context ctx;
+
+    // One-time Poly1305 key from the first keystream block
+    chacha20_block(key, 0, nonce, block);
+    poly1305_init(&ctx, block);
+
+    poly1305_update(&ctx, aad, aadlen);
+    poly1305_update(&ctx, zeros, (16 - aadlen % 16) % 16);
+    poly1305_update(&ctx, ct, ctlen);
+    poly1305_update(&ctx, zeros, (16 - ctlen % 16) % 16);
+    U32TO8_LE(lengths + 0, (uint32_t)aadlen);
+    U32TO8_LE(lengths + 4, (uint32_t)((uint64_t)aadlen >> 32));
+    U32TO8_LE(lengths + 8, (uint32_t)ctlen);
+    U32TO8_LE(lengths + 12, (uint32_t)((uint64_t)ctlen >> 32));
+    poly1305_update(&ctx, lengths, sizeof(lengths));
+    poly1305_finish(&ctx, tag);
+
+    utils_zero(block, sizeof(block));
+}
+
+
+void chacha20poly1305_seal(const uint8_t key[CHACHA20_KEY_LEN],
+                           const uint8_t nonce[CHACHA20_NONCE_LEN],
+                           const uint8_t *aad, size_t aadlen,
+                           const uint8_t *in, size_t inlen, uint8_t *out)
+{
+    chacha20_xor(key, 1, nonce, in, out, inlen);
+    chacha20poly1305_tag(key, nonce, aad, aadlen, out, inlen, out + inlen);
+}
+
+
+int chacha20poly1305_open(const uint8_t key[CHACHA20_KEY_LEN],
+                          const uint8_t nonce[CHACHA20_NONCE_LEN],
+                          const uint8_t *aad, size_t aadlen,
+                          const uint8_t *in, size_t inlen, uint8_t *out)
+{
+    size_t i, ctlen;
+    uint8_t tag[POLY1305_TAG_LEN], diff = 0;
+
+    if (inlen < POLY1305_TAG_LEN) {
+        return DBB_ERROR;
+    }
+    ctlen = inlen - POLY1305_TAG_LEN;
+
+    // Verify before decrypting, in constant time
+    chacha20poly1305_tag(key, nonce, aad, aadlen, in, ctlen, tag);
+    for (i = 0; i < POLY1305_TAG_LEN; i++) {
+        diff |= tag[i] ^ in[ctlen + i];
+    }
+    utils_zero(tag, sizeof(tag));
+    if (diff) {
+        memset(out, 0, ctlen);
+        return DBB_ERROR;
+    }
+
+    chacha20_xor(key, 1, nonce, in, out, ctlen);
+    return DBB_OK;
+}
@@ -0,0 +1,81 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2018 Douglas J. Bakkum
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+
+#ifndef _CHACHA20POLY1305_H_
+#define _CHACHA20POLY1305_H_
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+#define CHACHA20_KEY_LEN        32
+#define CHACHA20_NONCE_LEN      12
+#define CHACHA20_BLOCK_LEN      64
+#define POLY1305_KEY_LEN        32
+#define POLY1305_TAG_LEN        16
+
+
+// Poly1305 state in 26-bit limbs, so every product fits a 32x32->64 multiply
+// and no step branches on secret data.
+typedef struct {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+    size_t leftover;
+    uint8_t buffer[16];
+    uint8_t final;
+} poly1305_context;
+
+
+// ChaCha20 and Poly1305 as specified in RFC 8439. `in` and `out` may overlap exactly.
+void chacha20_block(const uint8_t key[CHACHA20_KEY_LEN], uint32_t counter,
+                    const uint8_t nonce[CHACHA20_NONCE_LEN], uint8_t out[CHACHA20_BLOCK_LEN]);
+void chacha20_xor(const uint8_t key[CHACHA20_KEY_LEN], uint32_t counter,
+                  const uint8_t nonce[CHACHA20_NONCE_LEN], const uint8_t *in, uint8_t *out,
+                  size_t len);
+
+void poly1305_init(poly1305_context *ctx, const uint8_t key[POLY1305_KEY_LEN]);
+void poly1305_update(poly1305_context *ctx, const uint8_t *m, size_t len);
+void poly1305_finish(poly1305_context *ctx, uint8_t mac[POLY1305_TAG_LEN]);
+
+// AEAD_CHACHA20_POLY1305. `out` receives `inlen` bytes of ciphertext followed by the
+// tag. For opening, `in` is the ciphertext followed by the tag and `out` receives
+// `inlen - POLY1305_TAG_LEN` bytes; on a tag mismatch `out` is zeroed and
+// DBB_ERROR is returned.
+void chacha20poly1305_seal(const uint8_t key[CHACHA20_KEY_LEN],
+                           const uint8_t nonce[CHACHA20_NONCE_LEN],
+                           const uint8_t *aad, size_t aadlen,
+                           const uint8_t *in, size_t inlen, uint8_t *out);
+int chacha20poly1305_open(const uint8_t key[CHACHA20_KEY_LEN],
+                          const uint8_t nonce[CHACHA20_NONCE_LEN],
+                          const uint8_t *aad, size_t aadlen,
+                          const uint8_t *in, size_t inlen, uint8_t *out);
+
+
+#endif
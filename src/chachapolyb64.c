@@ -0,0 +1,227 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2018 Douglas J. Bakkum
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chachapolyb64.h"
+#include "chacha20poly1305.h"
+#include "base64.h"
+#include "hmac.h"
+#include "random.h"
+#include "flags.h"
+#include "utils.h"
+
+
+// Derives the ChaCha20 key from a stored AES key, so that both suites share the
+// secret set by the `password` command without reusing it across ciphers.
+void chachapolyb64_key_derive(const uint8_t *secret, uint8_t key[CHACHA20_KEY_LEN])
+{
+    hmac_sha256(secret, 32, (const uint8_t *)CHACHAPOLYB64_KDF_LABEL,
+                strlen(CHACHAPOLYB64_KDF_LABEL), key);
+}
+
+
+// Derived keys are cached per key slot, like the AES key schedules, as every request
+// is opened under each stored key. An entry is derived again when it is invalidated
+// or used with a different secret. AES_KEY_NONE is never cached.
+typedef struct {
+    uint8_t secret[32];
+    uint8_t key[CHACHA20_KEY_LEN];
+    uint8_t valid;
+} chachapolyb64_key_entry;
+
+static chachapolyb64_key_entry chacha_key_cache[AES_KEY_NONE];
+
+
+void chachapolyb64_key_cache_invalidate(AES_KEY_SLOT slot)
+{
+    if (slot < AES_KEY_NONE) {
+        utils_zero(&chacha_key_cache[slot], sizeof(chacha_key_cache[slot]));
+    }
+}
+
+
+void chachapolyb64_key_cache_clear(void)
+{
+    utils_zero(chacha_key_cache, sizeof(chacha_key_cache));
+}
+
+
+// Returns the derived key of `secret`, either from the slot's cache entry or derived
+// into `scratch` when the slot is AES_KEY_NONE.
+static const uint8_t *chachapolyb64_key_get(const uint8_t *secret, AES_KEY_SLOT slot,
+        uint8_t scratch[CHACHA20_KEY_LEN])
+{
+    chachapolyb64_key_entry *entry;
+
+    if (slot >= AES_KEY_NONE) {
+        chachapolyb64_key_derive(secret, scratch);
+        return scratch;
+    }
+
+    entry = &chacha_key_cache[slot];
+    if (!entry->valid || !MEMEQ(entry->secret, secret, sizeof(entry->secret))) {
+        chachapolyb64_key_derive(secret, entry->key);
+        memcpy(entry->secret, secret, sizeof(entry->secret));
+        entry->valid = 1;
+    }
+    return entry->key;
+}
+
+
+int chachapolyb64_has_prefix(const char *in, int inlen)
+{
+    if (!in || inlen < CHACHAPOLYB64_PREFIX_LEN) {
+        return 0;
+    }
+    return !strncmp(in, CHACHAPOLYB64_PREFIX, CHACHAPOLYB64_PREFIX_LEN);
+}
+
+
+// Seals `in` under a random nonce and writes the prefixed base64 message into `out`,
+// which must hold CHACHAPOLYB64_ENCRYPT_SIZE(inlen) bytes. The binary message is built
+// at the end of the encoded span and encoded forwards over itself, which base64_to()
+// allows because each 3-byte group is read before its 4 characters are written.
+int chachapolyb64_encrypt_to(const unsigned char *in, int inlen, char *out, int out_size,
+                             int *out_b64len, const uint8_t *secret, AES_KEY_SLOT slot)
+{
+    int binlen, b64len;
+    uint8_t scratch[CHACHA20_KEY_LEN], *bin;
+    const uint8_t *key;
+
+    *out_b64len = 0;
+    if (inlen < 0 || out_size < CHACHAPOLYB64_ENCRYPT_SIZE(inlen)) {
+        return DBB_ERROR;
+    }
+
+    binlen = CHACHAPOLYB64_CIPHER_LEN(inlen);
+    b64len = CHACHAPOLYB64_B64_LEN(binlen);
+    bin = (uint8_t *)out + CHACHAPOLYB64_PREFIX_LEN + b64len - binlen;
+
+    if (random_bytes(bin, CHACHA20_NONCE_LEN, 0) == DBB_ERROR) {
+        return DBB_ERROR;
+    }
+    // `in` may not overlap `out`
+    key = chachapolyb64_key_get(secret, slot, scratch);
+    chacha20poly1305_seal(key, bin, NULL, 0, in, inlen, bin + CHACHA20_NONCE_LEN);
+    utils_zero(scratch, sizeof(scratch));
+
+    memcpy(out, CHACHAPOLYB64_PREFIX, CHACHAPOLYB64_PREFIX_LEN);
+    base64_to(bin, binlen, out + CHACHAPOLYB64_PREFIX_LEN, b64len);
+    out[CHACHAPOLYB64_PREFIX_LEN + b64len] = '\0';
+    *out_b64len = CHACHAPOLYB64_PREFIX_LEN + b64len;
+    return DBB_OK;
+}
+
+
+// Decodes the prefixed base64 `in` into `out` and opens it there. `out` must hold
+// CHACHAPOLYB64_DECRYPT_SIZE(inlen) bytes and may be `in` itself. On success `out`
+// holds the null terminated plaintext and `decrypt_len` includes the null terminator.
+// Nothing is decrypted unless the tag verifies.
+int chachapolyb64_decrypt_to(const char *in, int inlen, char *out, int out_size,
+                             int *decrypt_len, const uint8_t *secret, AES_KEY_SLOT slot)
+{
+    int ret, binlen, msglen;
+    uint8_t scratch[CHACHA20_KEY_LEN], nonce[CHACHA20_NONCE_LEN];
+    uint8_t *bin = (uint8_t *)out;
+    const uint8_t *key;
+
+    *decrypt_len = 0;
+    if (!chachapolyb64_has_prefix(in, inlen)) {
+        return DBB_ERROR;
+    }
+
+    // There are no legacy clients of this suite, so only the canonical encoding
+    binlen = unbase64_strict_to(in + CHACHAPOLYB64_PREFIX_LEN,
+                                inlen - CHACHAPOLYB64_PREFIX_LEN, bin, out_size);
+    if (binlen <= CHACHAPOLYB64_CIPHER_LEN(0)) {
+        return DBB_ERROR;
+    }
+    msglen = binlen - CHACHAPOLYB64_CIPHER_LEN(0);
+
+    memcpy(nonce, bin, CHACHA20_NONCE_LEN);
+    key = chachapolyb64_key_get(secret, slot, scratch);
+    ret = chacha20poly1305_open(key, nonce, NULL, 0, bin + CHACHA20_NONCE_LEN,
+                                binlen - CHACHA20_NONCE_LEN, bin + CHACHA20_NONCE_LEN);
+    utils_zero(scratch, sizeof(scratch));
+    if (ret != DBB_OK) {
+        utils_zero(out, out_size);
+        return DBB_ERROR;
+    }
+
+    memmove(out, bin + CHACHA20_NONCE_LEN, msglen);
+    out[msglen] = '\0';
+    *decrypt_len = msglen + 1;
+    return DBB_OK;
+}
+
+
+// Must free() returned value
+char *chachapolyb64_encrypt(const unsigned char *in, int inlen, int *out_b64len,
+                            const uint8_t *secret, AES_KEY_SLOT slot)
+{
+    int size = CHACHAPOLYB64_ENCRYPT_SIZE(inlen);
+    char *b64 = malloc(size);
+    if (!b64) {
+        *out_b64len = 0;
+        return NULL;
+    }
+    if (chachapolyb64_encrypt_to(in, inlen, b64, size, out_b64len, secret,
+                                 slot) != DBB_OK) {
+        free(b64);
+        return NULL;
+    }
+    return b64;
+}
+
+
+// Must free() returned value
+char *chachapolyb64_decrypt(const unsigned char *in, int inlen, int *decrypt_len,
+                            const uint8_t *secret, AES_KEY_SLOT slot)
+{
+    int size = CHACHAPOLYB64_DECRYPT_SIZE(inlen);
+    char *dec;
+
+    *decrypt_len = 0;
+    if (!in || size <= 0) {
+        return NULL;
+    }
+    dec = malloc(size);
+    if (!dec) {
+        return NULL;
+    }
+    if (chachapolyb64_decrypt_to((const char *)in, inlen, dec, size, decrypt_len,
+                                 secret, slot) != DBB_OK) {
+        free(dec);
+        return NULL;
+    }
+    return dec;
+}
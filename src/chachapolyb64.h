@@ -0,0 +1,74 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2018 Douglas J. Bakkum
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+
+
+#ifndef _CHACHAPOLYB64_H_
+#define _CHACHAPOLYB64_H_
+
+
+#include <stdint.h>
+#include "chacha20poly1305.h"
+#include "aescbcb64.h"
+
+
+// Transport format: CHACHAPOLYB64_PREFIX | base64( nonce | ciphertext | tag ).
+// The prefix is outside the base64 alphabet, so a message in this suite cannot be
+// mistaken for an AES-CBC one.
+#define CHACHAPOLYB64_PREFIX             "cp:"
+#define CHACHAPOLYB64_PREFIX_LEN         3
+// HMAC-SHA256 label deriving the ChaCha20 key from a stored AES key
+#define CHACHAPOLYB64_KDF_LABEL          "Digital Bitbox ChaCha20-Poly1305"
+
+#define CHACHAPOLYB64_CIPHER_LEN(inlen)  (CHACHA20_NONCE_LEN + (inlen) + POLY1305_TAG_LEN)
+#define CHACHAPOLYB64_B64_LEN(binlen)    (4 * (((binlen) + 2) / 3))
+// Output size of chachapolyb64_encrypt_to() for `inlen` bytes, including the null terminator
+#define CHACHAPOLYB64_ENCRYPT_SIZE(inlen) \
+    (CHACHAPOLYB64_PREFIX_LEN + CHACHAPOLYB64_B64_LEN(CHACHAPOLYB64_CIPHER_LEN(inlen)) + 1)
+// Working size of chachapolyb64_decrypt_to() for an `inlen` character message
+#define CHACHAPOLYB64_DECRYPT_SIZE(inlen) (3 * ((inlen) / 4))
+
+
+void chachapolyb64_key_derive(const uint8_t *secret, uint8_t key[CHACHA20_KEY_LEN]);
+void chachapolyb64_key_cache_invalidate(AES_KEY_SLOT slot);
+void chachapolyb64_key_cache_clear(void);
+int chachapolyb64_has_prefix(const char *in, int inlen);
+
+// Allocation-free variants. `out` must hold `out_size` bytes, at least the
+// CHACHAPOLYB64_*_SIZE() of the input. Return DBB_OK or DBB_ERROR.
+int chachapolyb64_encrypt_to(const unsigned char *in, int inlen, char *out, int out_size,
+                             int *out_b64len, const uint8_t *secret, AES_KEY_SLOT slot);
+int chachapolyb64_decrypt_to(const char *in, int inlen, char *out, int out_size,
+                             int *decrypt_len, const uint8_t *secret, AES_KEY_SLOT slot);
+
+char *chachapolyb64_encrypt(const unsigned char *in, int inlen, int *out_b64len,
+                            const uint8_t *secret, AES_KEY_SLOT slot);
+char *chachapolyb64_decrypt(const unsigned char *in, int inlen, int *decrypt_len,
+                            const uint8_t *secret, AES_KEY_SLOT slot);
+
+
+#endif
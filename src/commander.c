@@ -42,6 +42,7 @@
 #include "sha2.h"
 #include "aes.h"
 #include "aescbcb64.h"
+#include "chachapolyb64.h"
 #include "hmac.h"
 #include "led.h"
 #include "ecc.h"
@@ -57,11 +58,15 @@ extern const uint8_t MEM_PAGE_ERASE[MEM_PAGE_LEN];
 extern const uint8_t MEM_PAGE_ERASE_FE[MEM_PAGE_LEN];
 
 static int REPORT_BUF_OVERFLOW = 0;
+static int REPORT_RAW_LEN = 0;// raw bytes stored after the report's null terminator
 __extension__ static char json_array[] = {[0 ... COMMANDER_ARRAY_MAX] = 0};
 __extension__ static char json_report[] = {[0 ... COMMANDER_REPORT_SIZE] = 0};
 __extension__ static char sign_command[] = {[0 ... COMMANDER_REPORT_SIZE] = 0};
 static char TFA_PIN[TFA_PIN_LEN * 2 + 1];
 static int TFA_VERIFY = 0;
+static int TRANSPORT_CHACHAPOLY = 0;// reply in the ChaCha20-Poly1305 suite of the request
+static const char *STREAM_COMMAND = NULL;// request being decrypted while it arrives
+static aescbcb64_decrypt_stream STREAM;
 
 
 //
@@ -72,6 +77,14 @@ void commander_clear_report(void)
 {
     memset(json_report, 0, COMMANDER_REPORT_SIZE);
     REPORT_BUF_OVERFLOW = 0;
+    REPORT_RAW_LEN = 0;
+}
+
+
+// Length of the report to encrypt, including raw bytes stored after the JSON
+static int commander_report_len(void)
+{
+    return strlens(json_report) + (REPORT_RAW_LEN ? REPORT_RAW_LEN + 1 : 0);
 }
 
 
@@ -85,6 +98,8 @@ void commander_fill_report(const char *cmd, const char *msg, int flag)
 {
     char *p = json_report;
 
+    REPORT_RAW_LEN = 0;// overwritten by the appended JSON
+
     if (!strlens(json_report)) {
         strncat(json_report, "{", 1);
     } else {
@@ -187,10 +202,10 @@ const char *commander_read_array(void)
 
 int commander_fill_signature_array(const uint8_t sig[64], uint8_t recid)
 {
-    char recid_c[2 + 1] = {0};
-    char sig_c[128 + 1] = {0};
-    snprintf(recid_c, sizeof(recid_c), "%02x", recid);
-    snprintf(sig_c, sizeof(sig_c), "%s", utils_uint8_to_hex(sig, 64));
+    char recid_c[2 + 1];
+    char sig_c[128 + 1];
+    utils_bin_to_hex(&recid, 1, recid_c);
+    utils_bin_to_hex(sig, 64, sig_c);
     const char *key[] = {cmd_str(CMD_sig), cmd_str(CMD_recid), 0};
     const char *value[] = {sig_c, recid_c, 0};
     int type[] = {DBB_JSON_STRING, DBB_JSON_STRING, DBB_JSON_STRING, DBB_JSON_NONE};
@@ -630,8 +645,10 @@ static void commander_process_seed(yajl_val json_node)
 
 static int commander_process_sign(yajl_val json_node)
 {
-    size_t i;
-    int ret;
+    size_t i, batch = 0;
+    int ret = DBB_OK;
+    const char *hashes[WALLET_SIGN_BATCH];
+    const char *keypaths[WALLET_SIGN_BATCH];
     const char *data_path[] = { cmd_str(CMD_sign), cmd_str(CMD_data), NULL };
     yajl_val data = yajl_tree_get(json_node, data_path, yajl_t_array);
 
@@ -654,10 +671,16 @@ static int commander_process_sign(yajl_val json_node)
             return DBB_ERROR;
         }
 
-        ret = wallet_sign(hash, keypath);
-        if (ret != DBB_OK) {
-            return ret;
-        };
+        // Sign in batches, which share the modular inversions of the ECDSA signatures
+        hashes[batch] = hash;
+        keypaths[batch] = keypath;
+        if (++batch == WALLET_SIGN_BATCH || i + 1 == data->u.array.len) {
+            ret = wallet_sign(hashes, keypaths, batch);
+            if (ret != DBB_OK) {
+                return ret;
+            };
+            batch = 0;
+        }
     }
     commander_fill_report(cmd_str(CMD_sign), json_array, DBB_JSON_ARRAY);
     memset(json_array, 0, COMMANDER_ARRAY_MAX);
@@ -669,6 +692,7 @@ static void commander_process_random(yajl_val json_node)
 {
     int update_seed;
     uint8_t number[16];
+    char number_hex[sizeof(number) * 2 + 1];
 
     int encrypt_len;
     char *encoded_report;
@@ -696,15 +720,14 @@ static void commander_process_random(yajl_val json_node)
         return;
     }
 
-    commander_fill_report(cmd_str(CMD_random), utils_uint8_to_hex(number, sizeof(number)),
-                          DBB_OK);
+    utils_bin_to_hex(number, sizeof(number), number_hex);
+    commander_fill_report(cmd_str(CMD_random), number_hex, DBB_OK);
 
-    snprintf(echo_number, sizeof(echo_number), "{\"random\":\"%s\"}",
-             utils_uint8_to_hex(number, sizeof(number)));
+    snprintf(echo_number, sizeof(echo_number), "{\"random\":\"%s\"}", number_hex);
 
     encoded_report = aescbcb64_hmac_encrypt((unsigned char *) echo_number,
                                             strlens(echo_number),
-                                            &encrypt_len, memory_report_aeskey(TFA_SHARED_SECRET));
+                                            &encrypt_len);
 
     if (encoded_report) {
         commander_fill_report(cmd_str(CMD_echo), encoded_report, DBB_OK);
@@ -745,7 +768,7 @@ static void commander_process_xpub(yajl_val json_node)
 
         int encrypt_len;
         char *encoded_report = aescbcb64_hmac_encrypt((unsigned char *) xpub, strlens(xpub),
-                               &encrypt_len, memory_report_aeskey(TFA_SHARED_SECRET));
+                               &encrypt_len);
 
         if (encoded_report) {
             commander_fill_report(cmd_str(CMD_echo), encoded_report, DBB_OK);
@@ -851,8 +874,7 @@ static void commander_process_device(yajl_val json_node)
 
         char *tfa = aescbcb64_hmac_encrypt((const unsigned char *)VERIFYPASS_CRYPT_TEST,
                                            strlens(VERIFYPASS_CRYPT_TEST),
-                                           &tfa_len,
-                                           memory_report_aeskey(TFA_SHARED_SECRET));
+                                           &tfa_len);
         if (!tfa) {
             commander_clear_report();
             commander_fill_report(cmd_str(CMD_device), NULL, DBB_ERR_MEM_ENCRYPT);
@@ -860,7 +882,7 @@ static void commander_process_device(yajl_val json_node)
         }
 
         snprintf(msg, sizeof(msg),
-                 "{\"%s\":\"%s\",\"%s\":\"%s\",\"%s\":\"%s\",\"%s\":\"%s\",\"%s\":%s,\"%s\":%s,\"%s\":%s,\"%s\":%s,\"%s\":\"%s\",\"%s\":%s,\"%s\":%s}",
+                 "{\"%s\":\"%s\",\"%s\":\"%s\",\"%s\":\"%s\",\"%s\":\"%s\",\"%s\":%s,\"%s\":%s,\"%s\":%s,\"%s\":%s,\"%s\":\"%s\",\"%s\":%s,\"%s\":%s,\"%s\":%s}",
                  attr_str(ATTR_serial), utils_uint8_to_hex((uint8_t *)serial, sizeof(serial)),
                  attr_str(ATTR_version), DIGITAL_BITBOX_VERSION,
                  attr_str(ATTR_name), (char *)memory_name(""),
@@ -871,7 +893,8 @@ static void commander_process_device(yajl_val json_node)
                  attr_str(ATTR_sdcard), sdcard,
                  attr_str(ATTR_TFA), tfa,
                  attr_str(ATTR_U2F), u2f_enabled,
-                 attr_str(ATTR_U2F_hijack), u2f_hijack_enabled);
+                 attr_str(ATTR_U2F_hijack), u2f_hijack_enabled,
+                 attr_str(ATTR_suites), COMMANDER_SUITES);
 
         free(tfa);
         commander_fill_report(cmd_str(CMD_device), msg, DBB_JSON_ARRAY);
@@ -1165,8 +1188,7 @@ static int commander_tfa_append_pin(void)
 #ifdef TESTING
         snprintf(TFA_PIN, sizeof(TFA_PIN), "0001");
 #else
-        snprintf(TFA_PIN, sizeof(TFA_PIN), "%s",
-                 utils_uint8_to_hex(pin_b, TFA_PIN_LEN));
+        utils_bin_to_hex(pin_b, TFA_PIN_LEN, TFA_PIN);
 #endif
 
         // Append PIN to echo
@@ -1193,13 +1215,48 @@ static int commander_tfa_check_pin(yajl_val json_node)
     return DBB_OK;
 }
 
+// Replaces the echo in the report by {"echo_format":"2"}, a null terminator and the
+// raw HMAC-encrypted echo. The echo is then base64 encoded only once, together with
+// the rest of the reply, by the outer encryption.
+static int commander_fill_report_echo_raw(void)
+{
+    char format[32];
+    int format_len, raw_len, echo_len = strlens(json_report);
+
+    snprintf(format, sizeof(format), "{\"%s\":\"%i\"}", cmd_str(CMD_echo_format),
+             COMMANDER_ECHO_FORMAT_RAW);
+    format_len = strlens(format) + 1;
+
+    if (format_len + AESCBCB64_HMAC_CIPHER_LEN(echo_len) > COMMANDER_REPORT_SIZE) {
+        commander_clear_report();
+        commander_fill_report(cmd_str(CMD_echo), NULL, DBB_ERR_IO_REPORT_BUF);
+        return DBB_ERROR;
+    }
+
+    if (aescbcb64_hmac_encrypt_in_place((uint8_t *)json_report, echo_len,
+                                        COMMANDER_REPORT_SIZE, &raw_len) != DBB_OK) {
+        commander_clear_report();
+        commander_fill_report(cmd_str(CMD_echo), NULL, DBB_ERR_MEM_ENCRYPT);
+        return DBB_OK;
+    }
+
+    memmove(json_report + format_len, json_report, raw_len);
+    memcpy(json_report, format, format_len);
+    REPORT_RAW_LEN = raw_len;
+    return DBB_OK;
+}
+
+
 static int commander_echo_command(yajl_val json_node)
 {
     const char *meta_path[] = { cmd_str(CMD_sign), cmd_str(CMD_meta), NULL };
     const char *check_path[] = { cmd_str(CMD_sign), cmd_str(CMD_checkpub), NULL };
     const char *data_path[] = { cmd_str(CMD_sign), cmd_str(CMD_data), NULL };
+    const char *format_path[] = { cmd_str(CMD_sign), cmd_str(CMD_echo_format), NULL };
 
     const char *meta = YAJL_GET_STRING(yajl_tree_get(json_node, meta_path, yajl_t_string));
+    const char *format = YAJL_GET_STRING(yajl_tree_get(json_node, format_path,
+                                         yajl_t_string));
     yajl_val check = yajl_tree_get(json_node, check_path, yajl_t_array);
     yajl_val data = yajl_tree_get(json_node, data_path, yajl_t_any);
 
@@ -1279,9 +1336,13 @@ static int commander_echo_command(yajl_val json_node)
         return DBB_ERROR;
     }
 
+    if (strlens(format) && STREQ(format, STRINGIFY(COMMANDER_ECHO_FORMAT_RAW))) {
+        return commander_fill_report_echo_raw();
+    }
+
     int length;
     char *encoded_report = aescbcb64_hmac_encrypt((unsigned char *) json_report,
-                           strlens(json_report), &length, memory_report_aeskey(TFA_SHARED_SECRET));
+                           strlens(json_report), &length);
     commander_clear_report();
     if (encoded_report) {
         commander_fill_report(cmd_str(CMD_echo), encoded_report, DBB_OK);
@@ -1324,6 +1385,80 @@ static void commander_access_err(uint8_t err_msg, uint16_t err_count)
 }
 
 
+// Starts decrypting a request of `len` characters under both stored keys while its
+// frames arrive in the `command` buffer. Only one request is streamed at a time.
+void commander_stream_begin(const char *command, int len)
+{
+    const uint8_t *keys[AESCBCB64_STREAM_KEYS];
+    const AES_KEY_SLOT slots[AESCBCB64_STREAM_KEYS] = { AES_KEY_STAND, AES_KEY_HIDDEN };
+
+    if (STREAM_COMMAND) {
+        return;
+    }
+    memory_read_aeskeys();
+    keys[0] = memory_report_aeskey(PASSWORD_STAND);
+    keys[1] = memory_report_aeskey(PASSWORD_HIDDEN);
+    if (aescbcb64_decrypt_stream_init(&STREAM, len, keys, slots) == DBB_OK) {
+        STREAM_COMMAND = command;
+    }
+}
+
+
+// The first `received` characters of `command` have arrived
+void commander_stream_update(const char *command, int received)
+{
+    if (STREAM_COMMAND && STREAM_COMMAND == command) {
+        aescbcb64_decrypt_stream_update(&STREAM, command, received);
+    }
+}
+
+
+void commander_stream_end(const char *command)
+{
+    if (STREAM_COMMAND && STREAM_COMMAND == command) {
+        aescbcb64_decrypt_stream_free(&STREAM);
+        STREAM_COMMAND = NULL;
+    }
+}
+
+
+// A request is in the ChaCha20-Poly1305 suite if it carries the CHACHAPOLYB64_PREFIX,
+// otherwise in the AES-256-CBC suite. Both are keyed from the stored AES keys.
+// Must free() returned value
+static char *commander_transport_decrypt(const char *encrypted_command, int *decrypt_len,
+        const uint8_t *key, AES_KEY_SLOT slot)
+{
+    if (TRANSPORT_CHACHAPOLY) {
+        return chachapolyb64_decrypt((const unsigned char *)encrypted_command,
+                                     strlens(encrypted_command), decrypt_len, key, slot);
+    }
+    if (STREAM_COMMAND && STREAM_COMMAND == encrypted_command) {
+        char *dec;
+        if (aescbcb64_decrypt_stream_take(&STREAM, encrypted_command,
+                                          strlens(encrypted_command), key, slot, &dec,
+                                          decrypt_len) == DBB_OK) {
+            return dec;
+        }
+    }
+    return aescbcb64_decrypt((const unsigned char *)encrypted_command,
+                             strlens(encrypted_command), decrypt_len, key, slot);
+}
+
+
+// The reply is sealed in the suite of the request
+// Must free() returned value
+static char *commander_transport_encrypt(const char *report, int report_len,
+        int *encrypt_len, const uint8_t *key, AES_KEY_SLOT slot)
+{
+    if (TRANSPORT_CHACHAPOLY) {
+        return chachapolyb64_encrypt((const unsigned char *)report, report_len,
+                                     encrypt_len, key, slot);
+    }
+    return aescbcb64_encrypt((const unsigned char *)report, report_len, encrypt_len, key,
+                             slot);
+}
+
+
 static void commander_parse(char *command)
 {
     char *encoded_report;
@@ -1408,10 +1543,9 @@ static void commander_parse(char *command)
     }
 
 exit:
-    encoded_report = aescbcb64_encrypt((unsigned char *)json_report,
-                                       strlens(json_report),
-                                       &encrypt_len,
-                                       memory_active_key_get());
+    encoded_report = commander_transport_encrypt(json_report, commander_report_len(),
+                     &encrypt_len, memory_active_key_get(),
+                     wallet_is_hidden() ? AES_KEY_HIDDEN : AES_KEY_STAND);
 
     commander_clear_report();
     if (encoded_report) {
@@ -1425,23 +1559,24 @@ exit:
 }
 
 
-static uint8_t commander_find_active_key(const char *encrypted_command)
+// Returns the request decrypted with the active key, or NULL if neither key decrypts
+// it to a JSON object
+//
+// Must free() returned value
+static char *commander_find_active_key(const char *encrypted_command, int *command_len)
 {
-    char *cmd_std, *cmd_hdn;
+    char *cmd_std, *cmd_hdn, *command = NULL;
     int len_std = 0, len_hdn = 0;
-    uint8_t *key_std, *key_hdn, ret = DBB_ERROR;
+    uint8_t *key_std, *key_hdn;
 
     memory_read_aeskeys();
     key_std = memory_report_aeskey(PASSWORD_STAND);
     key_hdn = memory_report_aeskey(PASSWORD_HIDDEN);
 
-    cmd_std = aescbcb64_decrypt((const unsigned char *)encrypted_command,
-                                strlens(encrypted_command),
-                                &len_std, key_std);
-
-    cmd_hdn = aescbcb64_decrypt((const unsigned char *)encrypted_command,
-                                strlens(encrypted_command),
-                                &len_hdn, key_hdn);
+    cmd_std = commander_transport_decrypt(encrypted_command, &len_std, key_std,
+                                          AES_KEY_STAND);
+    cmd_hdn = commander_transport_decrypt(encrypted_command, &len_hdn, key_hdn,
+                                          AES_KEY_HIDDEN);
 
     if (strlens(cmd_std)) {
         if (BRACED(cmd_std)) {
@@ -1450,13 +1585,13 @@ static uint8_t commander_find_active_key(const char *encrypted_command)
                 if (json_node->u.object.len) {
                     wallet_set_hidden(0);
                     memory_active_key_set(key_std);
-                    ret = DBB_OK;
+                    command = cmd_std;
+                    *command_len = len_std;
                 }
             }
             yajl_tree_free(json_node);
         }
     }
-    free(cmd_std);
 
     if (strlens(cmd_hdn)) {
         if (BRACED(cmd_hdn)) {
@@ -1465,15 +1600,21 @@ static uint8_t commander_find_active_key(const char *encrypted_command)
                 if (json_node->u.object.len) {
                     wallet_set_hidden(1);
                     memory_active_key_set(key_hdn);
-                    ret = DBB_OK;
+                    command = cmd_hdn;
+                    *command_len = len_hdn;
                 }
             }
             yajl_tree_free(json_node);
         }
     }
-    free(cmd_hdn);
 
-    return ret;
+    if (cmd_std != command) {
+        free(cmd_std);
+    }
+    if (cmd_hdn != command) {
+        free(cmd_hdn);
+    }
+    return command;
 }
 
 
@@ -1484,12 +1625,7 @@ static char *commander_decrypt(const char *encrypted_command)
     uint16_t err_count = 0, err_iter = 0;
     size_t json_object_len = 0;
 
-    if (commander_find_active_key(encrypted_command) == DBB_OK) {
-        command = aescbcb64_decrypt((const unsigned char *)encrypted_command,
-                                    strlens(encrypted_command),
-                                    &command_len,
-                                    memory_active_key_get());
-    }
+    command = commander_find_active_key(encrypted_command, &command_len);
 
     err_count = memory_report_access_err_count();
     err_iter = memory_report_access_err_count() + 1;
@@ -1620,6 +1756,7 @@ static int commander_check_init(const char *encrypted_command)
 char *commander(const char *command)
 {
     commander_clear_report();
+    TRANSPORT_CHACHAPOLY = chachapolyb64_has_prefix(command, strlens(command));
     if (commander_check_init(command) == DBB_OK) {
         char *command_dec = commander_decrypt(command);
         if (command_dec) {
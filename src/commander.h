@@ -43,6 +43,9 @@ int commander_fill_json_array(const char **key, const char **value, int *type,
 void commander_force_reset(void);
 void commander_create_verifypass(void);
 char *commander(const char *command);
+void commander_stream_begin(const char *command, int len);
+void commander_stream_update(const char *command, int received);
+void commander_stream_end(const char *command);
 
 
 #endif
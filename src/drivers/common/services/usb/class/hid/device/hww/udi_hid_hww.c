@@ -69,7 +69,7 @@ UDC_DESC_STORAGE udi_api_t udi_api_hww = {
 static bool udi_hww_b_report_in_free;
 COMPILER_WORD_ALIGNED static uint8_t udi_hww_rate;
 COMPILER_WORD_ALIGNED static uint8_t udi_hww_protocol;
-COMPILER_WORD_ALIGNED static uint8_t udi_hww_report_in[UDI_HID_REPORT_IN_SIZE];
+COMPILER_WORD_ALIGNED static uint8_t udi_hww_report_in[UDI_HWW_REPORT_IN_SIZE];
 COMPILER_WORD_ALIGNED static uint8_t udi_hww_report_out[UDI_HID_REPORT_OUT_SIZE];
 COMPILER_WORD_ALIGNED static uint8_t udi_hww_report_feature[UDI_HID_REPORT_FEATURE_SIZE];
 
@@ -86,7 +86,11 @@ UDC_DESC_STORAGE udi_hww_report_desc_t udi_hww_report_desc = { {
 	0x15, 0x00,         // LOGICAL_MINIMUM (0)
 	0x26, 0xff, 0x00,   // LOGICAL_MAXIMUM (255)
 	0x75, 0x08,         // REPORT_SIZE (8)
+#if USB_HWW_REPORT_IN_SIZE > USB_REPORT_SIZE
+	0x96, USB_HWW_REPORT_IN_SIZE & 0xff, USB_HWW_REPORT_IN_SIZE >> 8, // REPORT_COUNT
+#else
 	0x95, 0x40,         // REPORT_COUNT (64) 
+#endif
 	0x81, 0x02,         // INPUT (Data,Var,Abs)
 	// Out Report
     0x09, 0x21,         // USAGE (Output Report Data)
@@ -199,21 +203,23 @@ static bool udi_hww_setreport(void)
 //--------------------------------------------
 //------ Interface for application
 
-bool udi_hww_send_report_in(uint8_t *data)
+// Sends the first `size` bytes of a report; shorter reports end with a short packet
+bool udi_hww_send_report_in(uint8_t *data, iram_size_t size)
 {
 	if (!udi_hww_b_report_in_free)
 		return false;
+	if (size > sizeof(udi_hww_report_in))
+		size = sizeof(udi_hww_report_in);
 	irqflags_t flags = cpu_irq_save();
 	// Fill report
 	memset(&udi_hww_report_in, 0,
 			sizeof(udi_hww_report_in));
-	memcpy(&udi_hww_report_in, data,
-	      		sizeof(udi_hww_report_in));
+	memcpy(&udi_hww_report_in, data, size);
 	udi_hww_b_report_in_free =
 			!udd_ep_run(UDI_HWW_EP_IN,
-							false,
+							size < sizeof(udi_hww_report_in),
 							(uint8_t *) & udi_hww_report_in,
-							sizeof(udi_hww_report_in),
+							size,
 							udi_hww_report_in_sent);
 	cpu_irq_restore(flags);
 	return !udi_hww_b_report_in_free;
@@ -240,7 +246,12 @@ static void udi_hww_report_out_received(udd_ep_status_t status,
 		return;	// Abort reception
 
 	if (sizeof(udi_hww_report_out) == nb_received) {
-		UDI_HWW_REPORT_OUT(udi_hww_report_out);
+		// Take the next report while this one is handled, which can wait for a touch
+		uint8_t report[sizeof(udi_hww_report_out)];
+		memcpy(report, udi_hww_report_out, sizeof(report));
+		udi_hww_report_out_enable();
+		UDI_HWW_REPORT_OUT(report);
+		return;
 	}
 	udi_hww_report_out_enable();
 }
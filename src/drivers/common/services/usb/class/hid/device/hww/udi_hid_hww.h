@@ -59,7 +59,11 @@ extern UDC_DESC_STORAGE udi_api_t udi_api_hww;
 
 // Report descriptor for HID generic
 typedef struct {
+#if USB_HWW_REPORT_IN_SIZE > USB_REPORT_SIZE
+	uint8_t array[35];
+#else
 	uint8_t array[34];
+#endif
 } udi_hww_report_desc_t;
 
 
@@ -92,7 +96,7 @@ typedef struct {
    .ep_in.bEndpointAddress    = UDI_HWW_EP_IN,\
    .ep_in.bmAttributes        = USB_EP_TYPE_INTERRUPT,\
    .ep_in.wMaxPacketSize      = LE16(UDI_HID_EP_SIZE),\
-   .ep_in.bInterval           = 4,\
+   .ep_in.bInterval           = UDI_HWW_EP_IN_INTERVAL,\
    .ep_out.bLength            = sizeof(usb_ep_desc_t),\
    .ep_out.bDescriptorType    = USB_DT_ENDPOINT,\
    .ep_out.bEndpointAddress   = UDI_HWW_EP_OUT,\
@@ -102,7 +106,7 @@ typedef struct {
    }
 
 
-bool udi_hww_send_report_in(uint8_t *data);
+bool udi_hww_send_report_in(uint8_t *data, iram_size_t size);
 
 
 #endif
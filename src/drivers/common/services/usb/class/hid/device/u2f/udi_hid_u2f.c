@@ -240,7 +240,12 @@ static void udi_u2f_report_out_received(udd_ep_status_t status,
 		return;	// Abort reception
 
 	if (sizeof(udi_u2f_report_out) == nb_received) {
-		UDI_U2F_REPORT_OUT(udi_u2f_report_out);
+		// Take the next report while this one is handled, which can wait for a touch
+		uint8_t report[sizeof(udi_u2f_report_out)];
+		memcpy(report, udi_u2f_report_out, sizeof(report));
+		udi_u2f_report_out_enable();
+		UDI_U2F_REPORT_OUT(report);
+		return;
 	}
 	udi_u2f_report_out_enable();
 }
@@ -74,6 +74,17 @@ extern char usb_serial_number[];
 #endif
 #define  UDI_HID_REPORT_FEATURE_SIZE 8
 #define  UDI_HID_EP_SIZE             64
+#ifdef BOOTLOADER 
+#define  UDI_HWW_REPORT_IN_SIZE      UDI_HID_REPORT_IN_SIZE
+#else
+#define  UDI_HWW_REPORT_IN_SIZE      USB_HWW_REPORT_IN_SIZE
+#endif
+#if USB_HWW_REPORT_IN_SIZE > USB_REPORT_SIZE
+// Large IN reports span several packets; poll every frame to move them quickly
+#define  UDI_HWW_EP_IN_INTERVAL      1
+#else
+#define  UDI_HWW_EP_IN_INTERVAL      4
+#endif
 
 
 #define  UDI_HWW_IFACE_NUMBER         0
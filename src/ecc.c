@@ -43,6 +43,7 @@ struct ecc_wrapper bitcoin_ecc = {
     ecc_context_init,
     ecc_context_destroy,
     ecc_sign_digest,
+    ecc_sign_digest_batch,
     ecc_sign,
     ecc_sign_double,
     ecc_verify,
@@ -89,12 +90,17 @@ static uECC_Curve ecc_curve_from_id(ecc_curve_id curve)
 int ecc_sign_digest(const uint8_t *private_key, const uint8_t *data, uint8_t *sig,
                     uint8_t *recid, ecc_curve_id curve)
 {
-    (void) recid; // not implemented in uECC
     uint8_t tmp[32 + 32 + 64];
+    uint8_t recid_;
     SHA256_HashContext ctx = {{&init_SHA256, &update_SHA256, &finish_SHA256, 64, 32, tmp}};
     if (uECC_sign_deterministic(private_key, data, SHA256_DIGEST_LENGTH, &ctx.uECC, sig,
-                                ecc_curve_from_id(curve))) {
-        uECC_normalize_signature(sig, ecc_curve_from_id(curve));
+                                &recid_, ecc_curve_from_id(curve))) {
+        if (uECC_normalize_signature(sig, ecc_curve_from_id(curve))) {
+            recid_ ^= 1;
+        }
+        if (recid) {
+            *recid = recid_;
+        }
         return 0;
     } else {
         return 1; // error
@@ -102,6 +108,28 @@ int ecc_sign_digest(const uint8_t *private_key, const uint8_t *data, uint8_t *si
 }
 
 
+// Signs count 32-byte digests, each with its own 32-byte private key. The signatures are
+// identical to those of ecc_sign_digest().
+int ecc_sign_digest_batch(const uint8_t *private_keys, const uint8_t *data, uint8_t *sigs,
+                          uint8_t *recids, uint32_t count, ecc_curve_id curve)
+{
+    uint8_t tmp[32 + 32 + 64];
+    uint32_t i;
+    SHA256_HashContext ctx = {{&init_SHA256, &update_SHA256, &finish_SHA256, 64, 32, tmp}};
+    if (!uECC_sign_deterministic_batch(private_keys, data, SHA256_DIGEST_LENGTH, count,
+                                       &ctx.uECC, sigs, recids,
+                                       ecc_curve_from_id(curve))) {
+        return 1; // error
+    }
+    for (i = 0; i < count; i++) {
+        if (uECC_normalize_signature(sigs + i * 64, ecc_curve_from_id(curve)) && recids) {
+            recids[i] ^= 1;
+        }
+    }
+    return 0;
+}
+
+
 int ecc_sign(const uint8_t *private_key, const uint8_t *msg, uint32_t msg_len,
              uint8_t *sig, uint8_t *recid, ecc_curve_id curve)
 {
@@ -204,17 +232,24 @@ int ecc_ecdh(const uint8_t *pair_pubkey, const uint8_t *rand_privkey,
 }
 
 
+int ecc_recover_public_key_digest(const uint8_t *sig, const uint8_t *hash, uint8_t recid,
+                                  uint8_t *pubkey_65, ecc_curve_id curve)
+{
+    if (!uECC_recover_public_key(sig, hash, SHA256_DIGEST_LENGTH, recid, pubkey_65 + 1,
+                                 ecc_curve_from_id(curve))) {
+        return 1; // error
+    }
+    pubkey_65[0] = 0x04;
+    return 0;
+}
+
+
 int ecc_recover_public_key(const uint8_t *sig, const uint8_t *msg, uint32_t msg_len,
                            uint8_t recid, uint8_t *pubkey_65, ecc_curve_id curve)
 {
-    /* not implemented for uECC */
-    (void) sig;
-    (void) msg;
-    (void) msg_len;
-    (void) pubkey_65;
-    (void) recid;
-    (void) curve;
-    return 1;
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    sha256_Raw(msg, msg_len, hash);
+    return ecc_recover_public_key_digest(sig, hash, recid, pubkey_65, curve);
 }
 
 
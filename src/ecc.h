@@ -44,6 +44,9 @@ struct ecc_wrapper {
     void (*ecc_context_destroy)(void);
     int (*ecc_sign_digest)(const uint8_t *private_key, const uint8_t *data, uint8_t *sig,
                            uint8_t *recid, ecc_curve_id curve);
+    int (*ecc_sign_digest_batch)(const uint8_t *private_keys, const uint8_t *data,
+                                 uint8_t *sigs, uint8_t *recids, uint32_t count,
+                                 ecc_curve_id curve);
     int (*ecc_sign)(const uint8_t *private_key, const uint8_t *msg, uint32_t msg_len,
                     uint8_t *sig, uint8_t *recid, ecc_curve_id curve);
     int (*ecc_sign_double)(const uint8_t *privateKey, const uint8_t *msg, uint32_t msg_len,
@@ -69,6 +72,8 @@ void ecc_context_init(void);
 void ecc_context_destroy(void);
 int ecc_sign_digest(const uint8_t *private_key, const uint8_t *data, uint8_t *sig,
                     uint8_t *recid, ecc_curve_id curve);
+int ecc_sign_digest_batch(const uint8_t *private_keys, const uint8_t *data, uint8_t *sigs,
+                          uint8_t *recids, uint32_t count, ecc_curve_id curve);
 int ecc_sign(const uint8_t *private_key, const uint8_t *msg, uint32_t msg_len,
              uint8_t *sig, uint8_t *recid, ecc_curve_id curve);
 int ecc_sign_double(const uint8_t *privateKey, const uint8_t *msg, uint32_t msg_len,
@@ -88,6 +93,8 @@ int ecc_ecdh(const uint8_t *pair_pubkey, const uint8_t *rand_privkey,
              uint8_t *ecdh_secret, ecc_curve_id curve);
 int ecc_sig_to_der(const uint8_t *sig, uint8_t *der);
 int ecc_der_to_sig(const uint8_t *der, int der_len, uint8_t *sig);
+int ecc_recover_public_key_digest(const uint8_t *sig, const uint8_t *hash, uint8_t recid,
+                                  uint8_t *pubkey_65, ecc_curve_id curve);
 int ecc_recover_public_key(const uint8_t *sig, const uint8_t *msg, uint32_t msg_len,
                            uint8_t recid, uint8_t *pubkey_65, ecc_curve_id curve);
 
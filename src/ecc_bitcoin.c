@@ -46,6 +46,8 @@ void libsecp256k1_ecc_context_init(void);
 void libsecp256k1_ecc_context_destroy(void);
 int libsecp256k1_ecc_sign_digest(const uint8_t *private_key, const uint8_t *data,
                                  uint8_t *sig, uint8_t *recid, ecc_curve_id curve);
+int libsecp256k1_ecc_sign_digest_batch(const uint8_t *private_keys, const uint8_t *data,
+                                       uint8_t *sigs, uint8_t *recids, uint32_t count, ecc_curve_id curve);
 int libsecp256k1_ecc_sign(const uint8_t *private_key, const uint8_t *msg,
                           uint32_t msg_len, uint8_t *sig, uint8_t *recid, ecc_curve_id curve);
 int libsecp256k1_ecc_sign_double(const uint8_t *privateKey, const uint8_t *msg,
@@ -69,6 +71,7 @@ struct ecc_wrapper bitcoin_ecc = {
     libsecp256k1_ecc_context_init,
     libsecp256k1_ecc_context_destroy,
     libsecp256k1_ecc_sign_digest,
+    libsecp256k1_ecc_sign_digest_batch,
     libsecp256k1_ecc_sign,
     libsecp256k1_ecc_sign_double,
     libsecp256k1_ecc_verify,
@@ -131,6 +134,22 @@ int libsecp256k1_ecc_sign_digest(const uint8_t *private_key, const uint8_t *data
 }
 
 
+// libsecp256k1 signs with constant-time inversions internal to each signature and has no
+// batch interface, so the batch is a loop over the single signatures.
+int libsecp256k1_ecc_sign_digest_batch(const uint8_t *private_keys, const uint8_t *data,
+                                       uint8_t *sigs, uint8_t *recids, uint32_t count, ecc_curve_id curve)
+{
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        if (libsecp256k1_ecc_sign_digest(private_keys + i * 32, data + i * 32,
+                                         sigs + i * 64, recids ? recids + i : NULL, curve)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
 int libsecp256k1_ecc_sign(const uint8_t *private_key, const uint8_t *msg,
                           uint32_t msg_len, uint8_t *sig, uint8_t *recid, ecc_curve_id curve)
 {
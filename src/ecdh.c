@@ -98,7 +98,10 @@ static int ecdh_generate_key(TFA_EC_Keypair *keypair)
  */
 static void ecdh_hash_pubkey_command(const char *pair_hash_pubkey)
 {
-    if (strlens(pair_hash_pubkey) != SIZE_SHA256_HEX) {
+    uint8_t pair_hash[SHA256_DIGEST_LENGTH];
+    if (strlens(pair_hash_pubkey) != SIZE_SHA256_HEX ||
+            utils_hex_to_bin(pair_hash_pubkey, SIZE_SHA256_HEX, pair_hash,
+                             sizeof(pair_hash)) != DBB_OK) {
         commander_fill_report(cmd_str(CMD_ecdh), NULL, DBB_ERR_KEY_HASH_ECDH_LEN);
         return;
     }
@@ -120,12 +123,13 @@ static void ecdh_hash_pubkey_command(const char *pair_hash_pubkey)
     }
 
     char msg[256];
+    char hash_pubkey_hex[SIZE_SHA256_HEX + 1];
     uint8_t hash_pubkey[SHA256_DIGEST_LENGTH];
     sha256_Raw(tfa_keypair.public_key, sizeof(tfa_keypair.public_key), hash_pubkey);
-    snprintf(msg, sizeof(msg), "{\"%s\":\"%s\"}",
-             cmd_str(CMD_hash_pubkey), utils_uint8_to_hex(hash_pubkey, sizeof(hash_pubkey)));
+    utils_bin_to_hex(hash_pubkey, sizeof(hash_pubkey), hash_pubkey_hex);
+    snprintf(msg, sizeof(msg), "{\"%s\":\"%s\"}", cmd_str(CMD_hash_pubkey), hash_pubkey_hex);
 
-    memcpy(TFA_IN_HASH_PUB, utils_hex_to_uint8(pair_hash_pubkey), SHA256_DIGEST_LENGTH);
+    memcpy(TFA_IN_HASH_PUB, pair_hash, SHA256_DIGEST_LENGTH);
     commander_clear_report();
     commander_fill_report(cmd_str(CMD_ecdh), msg, DBB_JSON_ARRAY);
 }
@@ -147,7 +151,11 @@ static void ecdh_pubkey_command(const char *pair_pubkey)
     }
 
     uint8_t pair_pubkey_bytes[SIZE_EC_POINT_COMPRESSED];
-    memcpy(pair_pubkey_bytes, utils_hex_to_uint8(pair_pubkey), SIZE_EC_POINT_COMPRESSED);
+    if (utils_hex_to_bin(pair_pubkey, SIZE_EC_POINT_COMPRESSED_HEX, pair_pubkey_bytes,
+                         sizeof(pair_pubkey_bytes)) != DBB_OK) {
+        commander_fill_report(cmd_str(CMD_ecdh), NULL, DBB_ERR_KEY_ECDH_LEN);
+        goto cleanup;
+    }
 
     // Point-at-infinity not allowed
     if (MEMEQ(TFA_ZEROS, pair_pubkey_bytes + 1, SHA256_DIGEST_LENGTH)) {
@@ -184,9 +192,9 @@ static void ecdh_pubkey_command(const char *pair_pubkey)
     }
 
     char msg[256];
-    snprintf(msg, sizeof(msg), "{\"%s\":\"%s\"}",
-             cmd_str(CMD_pubkey), utils_uint8_to_hex(tfa_keypair.public_key,
-                     sizeof(tfa_keypair.public_key)));
+    char pubkey_hex[SIZE_EC_POINT_COMPRESSED_HEX + 1];
+    utils_bin_to_hex(tfa_keypair.public_key, sizeof(tfa_keypair.public_key), pubkey_hex);
+    snprintf(msg, sizeof(msg), "{\"%s\":\"%s\"}", cmd_str(CMD_pubkey), pubkey_hex);
 
     commander_fill_report(cmd_str(CMD_ecdh), msg, DBB_JSON_OBJECT);
 
@@ -37,7 +37,7 @@
 #include "touch.h"
 #include "memory.h"
 #include "random.h"
-#include "systick.h"
+#include "timer.h"
 #include "commander.h"
 #include "board_com.h"
 
@@ -57,7 +57,7 @@ void __attribute__((noreturn)) __stack_chk_fail(void)
 
 void SysTick_Handler(void)
 {
-    systick_update_time();
+    timer_service();
 }
 
 
@@ -111,8 +111,9 @@ int main (void)
     __stack_chk_guard = random_uint32(0);
     pmc_enable_periph_clk(ID_PIOA);
     delay_init(F_CPU);
-    systick_init();
+    timer_init();
     touch_init();
+    touch_wait_callback_set(usb_service);
     ecc_context_init();
 #ifdef ECC_USE_SECP256K1_LIB
     /* only init the context if libsecp256k1 is present */
@@ -133,9 +134,7 @@ int main (void)
     usb_suspend_action();
     udc_start();
 
-    led_on();
-    delay_ms(300);
-    led_off();
+    led_blink();
 
     while (1) {
         sleepmgr_enter_sleep();
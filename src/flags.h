@@ -34,6 +34,9 @@
 #define COMMANDER_SIG_LEN           154// sig + recid + json formatting
 #define COMMANDER_ARRAY_MAX         (COMMANDER_REPORT_SIZE - (COMMANDER_SIG_LEN * 8))// Multiple is emperically found such that NUM_SIG_MIN is maximum
 #define COMMANDER_ARRAY_ELEMENT_MAX 1024
+#define COMMANDER_ECHO_FORMAT_B64   1// TFA echo as base64 text inside the JSON reply (default)
+#define COMMANDER_ECHO_FORMAT_RAW   2// TFA echo as raw bytes after the JSON reply's null terminator
+#define COMMANDER_SUITES            "[\"aes-256-cbc\",\"chacha20-poly1305\"]"// transport ciphers, see chachapolyb64.h
 #define COMMANDER_MAX_ATTEMPTS      15// max PASSWORD or LOCK PIN attempts before device reset
 #define COMMANDER_TOUCH_ATTEMPTS    10// number of attempts until touch button hold required to login
 #define VERIFYPASS_CRYPT_TEST       "Digital Bitbox 2FA"
@@ -97,6 +100,7 @@ X(key)            \
 X(sig)            \
 X(recid)          \
 X(pin)            \
+X(echo_format)    \
 X(U2F)            \
 X(U2F_hijack)     \
 X(U2F_counter)    \
@@ -151,6 +155,7 @@ X(U2F)            \
 X(U2F_load)       \
 X(U2F_create)     \
 X(U2F_hijack)     \
+X(suites)         \
 X(__ERASE__)      \
 X(__FORCE__)      \
 X(NUM)             /* keep last */
@@ -164,6 +169,7 @@ X(ERROR_MEM,             0, 0)\
 X(TOUCHED,               0, 0)\
 X(NOT_TOUCHED,           0, 0)\
 X(TOUCHED_ABORT,         0, 0)\
+X(TOUCH_PENDING,         0, 0)\
 X(TOUCH_SHORT,           0, 0) /* brief touch accept; hold 3s reject       */\
 X(TOUCH_LONG,            0, 0) /* brief touch reject; hold 3s accept (led) */\
 X(TOUCH_LONG_BLINK,      0, 0) /* brief touch reject; hold 3s accept (led) */\
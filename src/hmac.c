@@ -27,13 +27,10 @@
 #include "hmac.h"
 #include "sha2.h"
 
-void hmac_sha256(const uint8_t *key, const uint32_t keylen, const uint8_t *msg,
-                 const uint32_t msglen, uint8_t *hmac)
+void hmac_sha256_Init(HMAC_SHA256_CTX *hctx, const uint8_t *key, const uint32_t keylen)
 {
     int i;
-    uint8_t buf[SHA256_BLOCK_LENGTH], o_key_pad[SHA256_BLOCK_LENGTH],
-            i_key_pad[SHA256_BLOCK_LENGTH];
-    SHA256_CTX ctx;
+    uint8_t buf[SHA256_BLOCK_LENGTH];
 
     memset(buf, 0, SHA256_BLOCK_LENGTH);
     if (keylen > SHA256_BLOCK_LENGTH) {
@@ -43,32 +40,53 @@ void hmac_sha256(const uint8_t *key, const uint32_t keylen, const uint8_t *msg,
     }
 
     for (i = 0; i < SHA256_BLOCK_LENGTH; i++) {
-        o_key_pad[i] = buf[i] ^ 0x5c;
-        i_key_pad[i] = buf[i] ^ 0x36;
+        buf[i] ^= 0x36;
     }
+    sha256_Init(&hctx->inner);
+    sha256_Update(&hctx->inner, buf, SHA256_BLOCK_LENGTH);
 
-    sha256_Init(&ctx);
-    sha256_Update(&ctx, i_key_pad, SHA256_BLOCK_LENGTH);
-    sha256_Update(&ctx, msg, msglen);
-    sha256_Final(buf, &ctx);
+    for (i = 0; i < SHA256_BLOCK_LENGTH; i++) {
+        buf[i] ^= 0x36 ^ 0x5c;
+    }
+    sha256_Init(&hctx->outer);
+    sha256_Update(&hctx->outer, buf, SHA256_BLOCK_LENGTH);
 
-    sha256_Init(&ctx);
-    sha256_Update(&ctx, o_key_pad, SHA256_BLOCK_LENGTH);
-    sha256_Update(&ctx, buf, SHA256_DIGEST_LENGTH);
-    sha256_Final(hmac, &ctx);
+    utils_zero(buf, sizeof(buf));
+}
+
+void hmac_sha256_Copy(HMAC_SHA256_CTX *dst, const HMAC_SHA256_CTX *src)
+{
+    memcpy(dst, src, sizeof(HMAC_SHA256_CTX));
+}
 
+void hmac_sha256_Update(HMAC_SHA256_CTX *hctx, const uint8_t *msg, const uint32_t msglen)
+{
+    sha256_Update(&hctx->inner, msg, msglen);
+}
+
+// Zeroes the context; keep a copy of the precomputed key state for reuse
+void hmac_sha256_Final(HMAC_SHA256_CTX *hctx, uint8_t *hmac)
+{
+    uint8_t buf[SHA256_DIGEST_LENGTH];
+    sha256_Final(buf, &hctx->inner);
+    sha256_Update(&hctx->outer, buf, SHA256_DIGEST_LENGTH);
+    sha256_Final(hmac, &hctx->outer);
     utils_zero(buf, sizeof(buf));
-    utils_zero(o_key_pad, sizeof(o_key_pad));
-    utils_zero(i_key_pad, sizeof(i_key_pad));
 }
 
-void hmac_sha512(const uint8_t *key, const uint32_t keylen, const uint8_t *msg,
+void hmac_sha256(const uint8_t *key, const uint32_t keylen, const uint8_t *msg,
                  const uint32_t msglen, uint8_t *hmac)
+{
+    HMAC_SHA256_CTX hctx;
+    hmac_sha256_Init(&hctx, key, keylen);
+    hmac_sha256_Update(&hctx, msg, msglen);
+    hmac_sha256_Final(&hctx, hmac);
+}
+
+void hmac_sha512_Init(HMAC_SHA512_CTX *hctx, const uint8_t *key, const uint32_t keylen)
 {
     int i;
-    uint8_t buf[SHA512_BLOCK_LENGTH], o_key_pad[SHA512_BLOCK_LENGTH],
-            i_key_pad[SHA512_BLOCK_LENGTH];
-    SHA512_CTX ctx;
+    uint8_t buf[SHA512_BLOCK_LENGTH];
 
     memset(buf, 0, SHA512_BLOCK_LENGTH);
     if (keylen > SHA512_BLOCK_LENGTH) {
@@ -78,21 +96,45 @@ void hmac_sha512(const uint8_t *key, const uint32_t keylen, const uint8_t *msg,
     }
 
     for (i = 0; i < SHA512_BLOCK_LENGTH; i++) {
-        o_key_pad[i] = buf[i] ^ 0x5c;
-        i_key_pad[i] = buf[i] ^ 0x36;
+        buf[i] ^= 0x36;
     }
+    sha512_Init(&hctx->inner);
+    sha512_Update(&hctx->inner, buf, SHA512_BLOCK_LENGTH);
 
-    sha512_Init(&ctx);
-    sha512_Update(&ctx, i_key_pad, SHA512_BLOCK_LENGTH);
-    sha512_Update(&ctx, msg, msglen);
-    sha512_Final(buf, &ctx);
+    for (i = 0; i < SHA512_BLOCK_LENGTH; i++) {
+        buf[i] ^= 0x36 ^ 0x5c;
+    }
+    sha512_Init(&hctx->outer);
+    sha512_Update(&hctx->outer, buf, SHA512_BLOCK_LENGTH);
 
-    sha512_Init(&ctx);
-    sha512_Update(&ctx, o_key_pad, SHA512_BLOCK_LENGTH);
-    sha512_Update(&ctx, buf, SHA512_DIGEST_LENGTH);
-    sha512_Final(hmac, &ctx);
+    utils_zero(buf, sizeof(buf));
+}
 
+void hmac_sha512_Copy(HMAC_SHA512_CTX *dst, const HMAC_SHA512_CTX *src)
+{
+    memcpy(dst, src, sizeof(HMAC_SHA512_CTX));
+}
+
+void hmac_sha512_Update(HMAC_SHA512_CTX *hctx, const uint8_t *msg, const uint32_t msglen)
+{
+    sha512_Update(&hctx->inner, msg, msglen);
+}
+
+// Zeroes the context; keep a copy of the precomputed key state for reuse
+void hmac_sha512_Final(HMAC_SHA512_CTX *hctx, uint8_t *hmac)
+{
+    uint8_t buf[SHA512_DIGEST_LENGTH];
+    sha512_Final(buf, &hctx->inner);
+    sha512_Update(&hctx->outer, buf, SHA512_DIGEST_LENGTH);
+    sha512_Final(hmac, &hctx->outer);
     utils_zero(buf, sizeof(buf));
-    utils_zero(o_key_pad, sizeof(o_key_pad));
-    utils_zero(i_key_pad, sizeof(i_key_pad));
+}
+
+void hmac_sha512(const uint8_t *key, const uint32_t keylen, const uint8_t *msg,
+                 const uint32_t msglen, uint8_t *hmac)
+{
+    HMAC_SHA512_CTX hctx;
+    hmac_sha512_Init(&hctx, key, keylen);
+    hmac_sha512_Update(&hctx, msg, msglen);
+    hmac_sha512_Final(&hctx, hmac);
 }
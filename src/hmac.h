@@ -26,9 +26,33 @@
 #define __HMAC_H__
 
 #include <stdint.h>
+#include "sha2.h"
 
+
+// Inner and outer hash states after absorbing the padded key. Init once per key,
+// then copy the context for each message to skip the two key-block compressions.
+typedef struct _HMAC_SHA256_CTX {
+    SHA256_CTX inner;
+    SHA256_CTX outer;
+} HMAC_SHA256_CTX;
+
+typedef struct _HMAC_SHA512_CTX {
+    SHA512_CTX inner;
+    SHA512_CTX outer;
+} HMAC_SHA512_CTX;
+
+
+void hmac_sha256_Init(HMAC_SHA256_CTX *hctx, const uint8_t *key, const uint32_t keylen);
+void hmac_sha256_Copy(HMAC_SHA256_CTX *dst, const HMAC_SHA256_CTX *src);
+void hmac_sha256_Update(HMAC_SHA256_CTX *hctx, const uint8_t *msg, const uint32_t msglen);
+void hmac_sha256_Final(HMAC_SHA256_CTX *hctx, uint8_t *hmac);
 void hmac_sha256(const uint8_t *key, const uint32_t keylen, const uint8_t *msg,
                  const uint32_t msglen, uint8_t *hmac);
+
+void hmac_sha512_Init(HMAC_SHA512_CTX *hctx, const uint8_t *key, const uint32_t keylen);
+void hmac_sha512_Copy(HMAC_SHA512_CTX *dst, const HMAC_SHA512_CTX *src);
+void hmac_sha512_Update(HMAC_SHA512_CTX *hctx, const uint8_t *msg, const uint32_t msglen);
+void hmac_sha512_Final(HMAC_SHA512_CTX *hctx, uint8_t *hmac);
 void hmac_sha512(const uint8_t *key, const uint32_t keylen, const uint8_t *msg,
                  const uint32_t msglen, uint8_t *hmac);
 
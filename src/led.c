@@ -25,11 +25,12 @@
 */
 
 
+#include <stddef.h>
 #include "led.h"
+#include "timer.h"
 #include "drivers/config/mcu.h"
 #ifndef TESTING
 #include <gpio.h>
-#include <delay.h>
 #include <ioport.h>
 #else
 
@@ -56,21 +57,47 @@ static int ioport_get_pin_level(int led)
 #endif
 
 
+// Blink patterns run from a timer, so that the caller does not wait for them to end.
+// Setting the LED directly stops the pattern.
+static TIMER led_timer;
+static uint8_t led_toggles;
+
+
+static void led_pattern_next(void *arg)
+{
+    (void)arg;
+    ioport_set_pin_level(LED_0_PIN, !ioport_get_pin_level(LED_0_PIN));
+    if (--led_toggles == 0) {
+        timer_stop(&led_timer);
+    }
+}
+
+
+// Toggles the LED toggles times, the first time after wait_ms, then every period_ms
+static void led_pattern(uint16_t wait_ms, uint16_t period_ms, uint8_t toggles)
+{
+    led_toggles = toggles;
+    timer_start(&led_timer, wait_ms * 1000, period_ms * 1000, led_pattern_next, NULL);
+}
+
+
 void led_on(void)
 {
+    timer_stop(&led_timer);
     ioport_set_pin_level(LED_0_PIN, IOPORT_PIN_LEVEL_LOW);
 }
 
 
 void led_off(void)
 {
+    timer_stop(&led_timer);
     ioport_set_pin_level(LED_0_PIN, IOPORT_PIN_LEVEL_HIGH);
-
 }
 
 
 void led_toggle(void)
 {
+    timer_stop(&led_timer);
     ioport_set_pin_level(LED_0_PIN, !ioport_get_pin_level(LED_0_PIN));
 }
 
@@ -81,32 +108,35 @@ void led_toggle(void)
 void led_blink(void)
 {
     led_on();
-    delay_ms(300);
+    led_pattern(300, 0, 1);
+}
+
+
+// Blinks once after wait_ms of darkness
+void led_blink_after(uint16_t wait_ms)
+{
     led_off();
+    led_pattern(wait_ms, 300, 2);
 }
 
 
 void led_abort(void)
 {
     led_off();
-    delay_ms(300);
-    for (int i = 0; i < 6; i++) {
-        led_on();
-        delay_ms(100);
-        led_off();
-        delay_ms(100);
-    }
+    led_pattern(300, 100, 12);
 }
 
+
+// Blocks until the code is shown, as the user answers it with a touch
 void led_code(uint8_t code)
 {
     uint8_t i;
-    delay_ms(500);
+    timer_wait_ms(500);
     for (i = 0; i < code; i++) {
         led_toggle();
-        delay_ms(300);
+        timer_wait_ms(300);
         led_toggle();
-        delay_ms(300);
+        timer_wait_ms(300);
     }
-    delay_ms(500);
+    timer_wait_ms(500);
 }
@@ -40,6 +40,7 @@ void led_on(void);
 void led_off(void);
 void led_toggle(void);
 void led_blink(void);
+void led_blink_after(uint16_t wait_ms);
 void led_abort(void);
 void led_code(uint8_t code);
 
@@ -32,6 +32,8 @@
 #include "commander.h"
 #include "ataes132.h"
 #include "aescbcb64.h"
+#include "chachapolyb64.h"
+#include "u2f_device.h"
 #include "memory.h"
 #include "random.h"
 #include "utils.h"
@@ -115,7 +117,9 @@ static uint8_t memory_eeprom_crypt(const uint8_t *write_b, uint8_t *read_b,
                                    const int32_t addr)
 {
     int enc_len, dec_len;
-    char *enc, *dec, enc_r[MEM_PAGE_LEN * 4 + 1] = {0};
+    char enc_r[MEM_PAGE_LEN * 4 + 1] = {0};
+    char dec[AESCBCB64_DECRYPT_SIZE(MEM_PAGE_LEN * 4)];
+    char hex[MEM_PAGE_LEN * 2 + 1];
     static uint8_t mempass[MEM_PAGE_LEN];
 
     // Encrypt data saved to memory using an AES key obfuscated by the
@@ -130,19 +134,17 @@ static uint8_t memory_eeprom_crypt(const uint8_t *write_b, uint8_t *read_b,
         hmac_sha256(mempass, MEM_PAGE_LEN, rn, FLASH_USERSIG_RN_LEN, mempass);
     }
     sha256_Raw(mempass, MEM_PAGE_LEN, mempass);
-    sha256_Raw((const uint8_t *)(utils_uint8_to_hex(mempass, MEM_PAGE_LEN)), MEM_PAGE_LEN * 2,
-               mempass);
+    utils_bin_to_hex(mempass, MEM_PAGE_LEN, hex);
+    sha256_Raw((const uint8_t *)hex, MEM_PAGE_LEN * 2, mempass);
     sha256_Raw(mempass, MEM_PAGE_LEN, mempass);
 
     if (write_b) {
-        char enc_w[MEM_PAGE_LEN * 4 + 1] = {0};
-        enc = aescbcb64_encrypt((unsigned char *)utils_uint8_to_hex(write_b, MEM_PAGE_LEN),
-                                MEM_PAGE_LEN * 2, &enc_len, mempass);
-        if (!enc) {
+        char enc_w[AESCBCB64_ENCRYPT_SIZE(MEM_PAGE_LEN * 2)] = {0};
+        utils_bin_to_hex(write_b, MEM_PAGE_LEN, hex);
+        if (aescbcb64_encrypt_to((unsigned char *)hex, MEM_PAGE_LEN * 2, enc_w, sizeof(enc_w),
+                                 &enc_len, mempass, AES_KEY_STORAGE) != DBB_OK) {
             goto err;
         }
-        snprintf(enc_w, sizeof(enc_w), "%.*s", enc_len, enc);
-        free(enc);
         if (memory_eeprom((uint8_t *)enc_w, (uint8_t *)enc_r, addr,
                           MEM_PAGE_LEN) == DBB_ERROR) {
             goto err;
@@ -179,27 +181,26 @@ static uint8_t memory_eeprom_crypt(const uint8_t *write_b, uint8_t *read_b,
         }
     }
 
-    dec = aescbcb64_decrypt((unsigned char *)enc_r, MEM_PAGE_LEN * 4, &dec_len,
-                            mempass);
-    if (!dec) {
+    if (aescbcb64_decrypt_to(enc_r, MEM_PAGE_LEN * 4, dec, sizeof(dec), &dec_len,
+                             mempass, AES_KEY_STORAGE) != DBB_OK) {
         goto err;
     }
-    if (read_b) {
-        memcpy(read_b, utils_hex_to_uint8(dec), MEM_PAGE_LEN);
+    if (read_b && utils_hex_to_bin(dec, MEM_PAGE_LEN * 2, read_b, MEM_PAGE_LEN) != DBB_OK) {
+        goto err;
     }
-    utils_zero(dec, dec_len);
-    free(dec);
+    utils_zero(dec, sizeof(dec));
 
+    utils_zero(hex, sizeof(hex));
     utils_zero(mempass, MEM_PAGE_LEN);
-    utils_clear_buffers();
     return DBB_OK;
 err:
     if (read_b) {
         // Randomize return value on error
         hmac_sha256(mempass, MEM_PAGE_LEN, read_b, MEM_PAGE_LEN, read_b);
     }
+    utils_zero(dec, sizeof(dec));
+    utils_zero(hex, sizeof(hex));
     utils_zero(mempass, MEM_PAGE_LEN);
-    utils_clear_buffers();
     return DBB_ERROR;
 }
 
@@ -225,6 +226,9 @@ static void memory_scramble_default_aeskeys(void)
     memcpy(MEM_aeskey_hidden, number, MEM_PAGE_LEN);
     memcpy(MEM_aeskey_verify, number, MEM_PAGE_LEN);
     memcpy(MEM_active_key, number, MEM_PAGE_LEN);
+    aescbcb64_key_cache_clear();
+    chachapolyb64_key_cache_clear();
+    aescbcb64_tfa_keys_set(MEM_aeskey_verify);
 }
 
 
@@ -240,6 +244,7 @@ static void memory_scramble_rn(void)
     }
     flash_erase_user_signature();
     flash_write_user_signature((uint32_t *)usersig, FLASH_USERSIG_SIZE / sizeof(uint32_t));
+    aescbcb64_key_cache_invalidate(AES_KEY_STORAGE);
 }
 
 
@@ -316,10 +321,12 @@ void memory_reset_u2f(void)
 void memory_random_password(PASSWORD_ID id)
 {
     uint8_t number[16] = {0};
+    char hex[sizeof(number) * 2 + 1];
     random_bytes(number, sizeof(number), 0);
-    memory_write_aeskey(utils_uint8_to_hex(number, sizeof(number)), sizeof(number) * 2, id);
+    utils_bin_to_hex(number, sizeof(number), hex);
+    memory_write_aeskey(hex, sizeof(number) * 2, id);
     utils_zero(number, sizeof(number));
-    utils_clear_buffers();
+    utils_zero(hex, sizeof(hex));
 }
 
 
@@ -331,6 +338,9 @@ void memory_clear(void)
     memcpy(MEM_master_hww_chain, MEM_PAGE_ERASE, MEM_PAGE_LEN);
     memcpy(MEM_master_hww, MEM_PAGE_ERASE, MEM_PAGE_LEN);
     memcpy(MEM_master_hww_entropy, MEM_PAGE_ERASE, MEM_PAGE_LEN);
+    aescbcb64_key_cache_clear();
+    chachapolyb64_key_cache_clear();
+    u2f_keyhandle_cache_clear();
 }
 
 
@@ -394,6 +404,9 @@ uint8_t *memory_master_hww_entropy(const uint8_t *master_entropy)
 
 uint8_t *memory_master_u2f(const uint8_t *master_u2f)
 {
+    if (master_u2f) {
+        u2f_keyhandle_cache_clear();
+    }
     memory_eeprom_crypt(master_u2f, MEM_master_u2f, MEM_MASTER_U2F_ADDR);
     return MEM_master_u2f;
 }
@@ -422,6 +435,7 @@ uint8_t memory_write_tfa_shared_secret(const uint8_t *secret)
 {
     int ret = memory_eeprom_crypt(secret, MEM_aeskey_verify,
                                   MEM_AESKEY_SHARED_SECRET_ADDR) - DBB_OK;
+    aescbcb64_tfa_keys_set(MEM_aeskey_verify);
     if (ret) {
         return DBB_ERR_MEM_ATAES;
     } else {
@@ -458,6 +472,10 @@ uint8_t memory_write_aeskey(const char *password, int len, PASSWORD_ID id)
                                MEM_AESKEY_STAND_ADDR) - DBB_OK;
     ret |= memory_eeprom_crypt(MEM_aeskey_hidden, MEM_aeskey_hidden,
                                MEM_AESKEY_HIDDEN_ADDR) - DBB_OK;
+    aescbcb64_key_cache_invalidate(AES_KEY_STAND);
+    aescbcb64_key_cache_invalidate(AES_KEY_HIDDEN);
+    chachapolyb64_key_cache_invalidate(AES_KEY_STAND);
+    chachapolyb64_key_cache_invalidate(AES_KEY_HIDDEN);
 
     utils_zero(password_b, MEM_PAGE_LEN);
 
@@ -476,6 +494,7 @@ void memory_read_aeskeys(void)
         memory_eeprom_crypt(NULL, MEM_aeskey_stand, MEM_AESKEY_STAND_ADDR);
         memory_eeprom_crypt(NULL, MEM_aeskey_hidden, MEM_AESKEY_HIDDEN_ADDR);
         memory_eeprom_crypt(NULL, MEM_aeskey_verify, MEM_AESKEY_SHARED_SECRET_ADDR);
+        aescbcb64_tfa_keys_set(MEM_aeskey_verify);
         sha256_Raw(MEM_aeskey_stand, MEM_PAGE_LEN, MEM_user_entropy);
         read++;
     }
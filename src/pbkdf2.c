@@ -32,32 +32,72 @@
 #include "sha2.h"
 
 
-void pbkdf2_hmac_sha512(const uint8_t *pass, int passlen, const char *salt, uint8_t *key,
-                        int keylen)
+// Inner and outer hashes of every iteration after the first each cover a
+// single block: the 64-byte digest, padding, and the bit length of the
+// 128-byte key block plus the digest.
+#define PBKDF2_BLOCK_BITLEN ((SHA512_BLOCK_LENGTH + SHA512_DIGEST_LENGTH) * 8)
+
+
+static void pbkdf2_write_state(uint8_t *out, const uint64_t *state)
+{
+    int i, j;
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < 8; j++) {
+            out[i * 8 + j] = (state[i] >> (56 - 8 * j)) & 0xFF;
+        }
+    }
+}
+
+
+void pbkdf2_hmac_sha512_progress(const uint8_t *pass, int passlen, const char *salt,
+                                 uint8_t *key, int keylen, pbkdf2_progress_callback progress)
 {
     uint32_t i, j, k;
-    uint8_t f[PBKDF2_HMACLEN], g[PBKDF2_HMACLEN];
+    uint8_t f[PBKDF2_HMACLEN];
+    uint64_t block[SHA512_BLOCK_LENGTH / sizeof(uint64_t)];
+    uint8_t *g = (uint8_t *)block;
     uint32_t blocks = keylen / PBKDF2_HMACLEN;
     int saltlen = strlens(salt);
     uint8_t salt_pbkdf2[saltlen + 4];
-    memset(salt_pbkdf2, 0, sizeof(salt_pbkdf2));
-    memcpy(salt_pbkdf2, salt, saltlen);
+    HMAC_SHA512_CTX pctx, hctx;
+    SHA512_CTX ctx;
 
     if (keylen & (PBKDF2_HMACLEN - 1)) {
         blocks++;
     }
+
+    memset(salt_pbkdf2, 0, sizeof(salt_pbkdf2));
+    memcpy(salt_pbkdf2, salt, saltlen);
+    hmac_sha512_Init(&pctx, pass, passlen);
+
+    memset(block, 0, sizeof(block));
+    g[PBKDF2_HMACLEN] = 0x80;
+    g[SHA512_BLOCK_LENGTH - 2] = (PBKDF2_BLOCK_BITLEN >> 8) & 0xFF;
+    g[SHA512_BLOCK_LENGTH - 1] = PBKDF2_BLOCK_BITLEN & 0xFF;
+
     for (i = 1; i <= blocks; i++) {
         salt_pbkdf2[saltlen    ] = (i >> 24) & 0xFF;
         salt_pbkdf2[saltlen + 1] = (i >> 16) & 0xFF;
         salt_pbkdf2[saltlen + 2] = (i >> 8) & 0xFF;
         salt_pbkdf2[saltlen + 3] = i & 0xFF;
-        hmac_sha512(pass, passlen, salt_pbkdf2, saltlen + 4, g);
+        hmac_sha512_Copy(&hctx, &pctx);
+        hmac_sha512_Update(&hctx, salt_pbkdf2, saltlen + 4);
+        hmac_sha512_Final(&hctx, g);
         memcpy(f, g, PBKDF2_HMACLEN);
         for (j = 1; j < PBKDF2_ROUNDS; j++) {
-            hmac_sha512(pass, passlen, g, PBKDF2_HMACLEN, g);
+            // g holds the previous digest followed by the fixed padding
+            memcpy(ctx.state, pctx.inner.state, sizeof(ctx.state));
+            sha512_Transform(&ctx, block);
+            pbkdf2_write_state(g, ctx.state);
+            memcpy(ctx.state, pctx.outer.state, sizeof(ctx.state));
+            sha512_Transform(&ctx, block);
+            pbkdf2_write_state(g, ctx.state);
             for (k = 0; k < PBKDF2_HMACLEN; k++) {
                 f[k] ^= g[k];
             }
+            if (progress && ((j + 1) % PBKDF2_PROGRESS_STEP) == 0) {
+                progress((i - 1) * PBKDF2_ROUNDS + j + 1, blocks * PBKDF2_ROUNDS);
+            }
         }
         if (i == blocks && (keylen & (PBKDF2_HMACLEN - 1))) {
             memcpy(key + PBKDF2_HMACLEN * (i - 1), f, keylen & (PBKDF2_HMACLEN - 1));
@@ -66,5 +106,14 @@ void pbkdf2_hmac_sha512(const uint8_t *pass, int passlen, const char *salt, uint
         }
     }
     utils_zero(f, sizeof(f));
-    utils_zero(g, sizeof(g));
+    utils_zero(block, sizeof(block));
+    utils_zero(&ctx, sizeof(ctx));
+    utils_zero(&pctx, sizeof(pctx));
+}
+
+
+void pbkdf2_hmac_sha512(const uint8_t *pass, int passlen, const char *salt, uint8_t *key,
+                        int keylen)
+{
+    pbkdf2_hmac_sha512_progress(pass, passlen, salt, key, keylen, NULL);
 }
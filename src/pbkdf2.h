@@ -34,10 +34,18 @@
 
 #define PBKDF2_ROUNDS   2048
 #define PBKDF2_HMACLEN  64
+#define PBKDF2_PROGRESS_STEP    256
+
+
+// Called every PBKDF2_PROGRESS_STEP iterations with the number of iterations
+// done so far and the total number of iterations.
+typedef void (*pbkdf2_progress_callback)(uint32_t done, uint32_t total);
 
 
 void pbkdf2_hmac_sha512(const uint8_t *pass, int passlen, const char *salt, uint8_t *key,
                         int keylen);
+void pbkdf2_hmac_sha512_progress(const uint8_t *pass, int passlen, const char *salt,
+                                 uint8_t *key, int keylen, pbkdf2_progress_callback progress);
 
 
 #endif
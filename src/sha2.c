@@ -175,8 +175,6 @@ typedef uint64_t sha2_word64;   /* Exactly 8 bytes */
  * only.
  */
 void sha512_Last(SHA512_CTX *);
-void sha256_Transform(SHA256_CTX *, const sha2_word32 *);
-void sha512_Transform(SHA512_CTX *, const sha2_word64 *);
 
 
 /*** SHA-XYZ INITIAL HASH VALUES AND CONSTANTS ************************/
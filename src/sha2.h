@@ -62,4 +62,9 @@ void sha512_Update(SHA512_CTX *, const uint8_t *, size_t);
 void sha512_Final(uint8_t[SHA512_DIGEST_LENGTH], SHA512_CTX *);
 void sha512_Raw(const uint8_t *, size_t, uint8_t[SHA512_DIGEST_LENGTH]);
 
+// Single compression of one big-endian block into context->state. The bitcount
+// is not updated and context->buffer is used as scratch space.
+void sha256_Transform(SHA256_CTX *, const uint32_t *);
+void sha512_Transform(SHA512_CTX *, const uint64_t *);
+
 #endif
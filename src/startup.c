@@ -34,7 +34,7 @@
 #include "flags.h"
 #include "flash.h"
 #include "touch.h"
-#include "systick.h"
+#include "timer.h"
 #include "bootloader.h"
 #include "board_com.h"
 #include "sam4s4a.h"
@@ -56,7 +56,7 @@ void __attribute__((noreturn)) __stack_chk_fail(void)
 
 void SysTick_Handler(void)
 {
-    systick_update_time();
+    timer_service();
 }
 
 
@@ -128,7 +128,7 @@ int main(void)
     memcpy((uint8_t *)__stack_chk_guard, rnd, sizeof(__stack_chk_guard));
     pmc_enable_periph_clk(ID_PIOA);
     delay_init(F_CPU);
-    systick_init();
+    timer_init();
     touch_init();
     mpu_init();
     bootloader_jump();
@@ -25,27 +25,90 @@
 */
 
 
-#include <stdio.h>
 #include <stdint.h>
 #include "systick.h"
+#include "utils.h"
 #include "drivers/config/mcu.h"
 
-volatile uint16_t systick_current_time_ms   = 0u;
-volatile uint8_t systick_time_updated       = 0u;
-uint16_t systick_measurement_period_msec    = 25u;
 
+// The time base counts core clock cycles. The SysTick is armed for the next timer
+// deadline, or for 2^24 cycles at the latest, and each arm adds the cycles of the
+// period it ends to systick_cycles. Within a period, the elapsed cycles are read from
+// the SysTick, which keeps counting while the core sleeps in WFI, unlike the DWT cycle
+// counter. An interrupt handler can delay the SysTick interrupt by more than a period,
+// though, and further wraps are not counted; the cycle counter covers that time, as the
+// core is awake while a handler runs. A sleep in the USB suspend (WAIT mode) stops both
+// counters and is not counted.
+static uint32_t systick_cycles_per_us;
+static uint64_t systick_cycles;// cycles before the current period
+static uint32_t systick_period;// reload value of the current period
+static uint32_t systick_cyccnt_start;// DWT cycle counter at the start of the period
+static uint8_t systick_wrapped;// the current period has ended
 
-void systick_update_time(void)
+
+void systick_init(void)
 {
-    systick_time_updated = 1u;
-    systick_current_time_ms += systick_measurement_period_msec;
+    systick_cycles_per_us = sysclk_get_cpu_hz() / 1000000;
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    SysTick->CTRL = 0;
+    SysTick->VAL = 0;// holds an unknown value after reset
+    NVIC_SetPriority(SysTick_IRQn, (1 << __NVIC_PRIO_BITS) - 1);
 }
 
 
-// Configure timer ISR to fire regularly
-void systick_init(void)
+// Cycles since the start of the current period. Call with interrupts masked.
+static uint32_t systick_elapsed(void)
 {
-    SysTick_Config((sysclk_get_cpu_hz() / 1000) * systick_measurement_period_msec);
+    uint32_t awake = DWT->CYCCNT - systick_cyccnt_start;
+    uint32_t val = SysTick->VAL;// read before the wrap flag
+    uint32_t counted;
+
+    // Reading the control register clears the flag
+    if (SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk) {
+        systick_wrapped = 1;
+    }
+    if (systick_wrapped) {
+        counted = systick_period;
+    } else {
+        // The counter is 0 until it first loads the period
+        counted = val ? systick_period - val : 0;
+    }
+    return MAX(counted, awake);
 }
 
 
+uint64_t systick_now_us(void)
+{
+    irqflags_t flags = cpu_irq_save();
+    uint64_t now = (systick_cycles + systick_elapsed()) / systick_cycles_per_us;
+    cpu_irq_restore(flags);
+    return now;
+}
+
+
+// Fires the SysTick interrupt once in us microseconds, or after the longest period of
+// the 24-bit counter
+void systick_arm(uint64_t us)
+{
+    uint32_t max_us = SysTick_LOAD_RELOAD_Msk / systick_cycles_per_us;
+    uint32_t cycles;
+    irqflags_t flags;
+
+    us = us > max_us ? max_us : us;
+    cycles = us ? us * systick_cycles_per_us : 1;
+
+    flags = cpu_irq_save();
+    systick_cycles += systick_elapsed();
+    systick_cyccnt_start = DWT->CYCCNT;
+    systick_period = cycles;
+    systick_wrapped = 0;
+
+    SysTick->CTRL = 0;
+    SysTick->LOAD = cycles;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk |
+                    SysTick_CTRL_ENABLE_Msk;
+    cpu_irq_restore(flags);
+}
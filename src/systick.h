@@ -29,8 +29,12 @@
 #define _SYSTICK_H_
 
 
-void systick_update_time(void);
+#include <stdint.h>
+
+
 void systick_init(void);
+uint64_t systick_now_us(void);
+void systick_arm(uint64_t us);
 
 
 #endif
@@ -0,0 +1,335 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2015-2016 Douglas J. Bakkum
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+#include <string.h>
+#include "timer.h"
+#include "utils.h"
+#ifndef TESTING
+#include "systick.h"
+#include "drivers/config/mcu.h"
+#endif
+
+
+// Timers hash into the wheel by the tick of their deadline. A slot holds the timers of
+// every round, so a service pass checks the deadlines of the slots it walks and leaves
+// the later rounds in place. Expired timers move to a due list, sorted by deadline, and
+// their callbacks run without the lock so that they can start and stop timers.
+#define TIMER_SLOT_DUE      TIMER_WHEEL_SLOTS
+#define TIMER_NEVER         UINT64_MAX
+
+
+static TIMER *timer_wheel[TIMER_WHEEL_SLOTS];
+static TIMER *timer_due;
+static uint64_t timer_tick;// last tick serviced
+
+
+#ifdef TESTING
+static uint64_t timer_sim_us;
+
+
+// Waits jump the simulated clock to the next deadline, so that timing dependent code
+// runs deterministically and without delay in the tests
+void timer_sim_advance(uint64_t us)
+{
+    timer_wait_until(timer_sim_us + us);
+}
+#endif
+
+
+// Timers are started from the USB interrupt and serviced from the SysTick
+static uint32_t timer_lock(void)
+{
+#ifdef TESTING
+    return 0;
+#else
+    return cpu_irq_save();
+#endif
+}
+
+
+static void timer_unlock(uint32_t flags)
+{
+#ifdef TESTING
+    (void)flags;
+#else
+    cpu_irq_restore(flags);
+#endif
+}
+
+
+uint64_t timer_now_us(void)
+{
+#ifdef TESTING
+    return timer_sim_us;
+#else
+    return systick_now_us();
+#endif
+}
+
+
+uint32_t timer_now_ms(void)
+{
+    return timer_now_us() / 1000;
+}
+
+
+uint64_t timer_deadline_ms(uint32_t ms)
+{
+    return timer_now_us() + (uint64_t)ms * 1000;
+}
+
+
+uint8_t timer_expired(uint64_t deadline_us)
+{
+    return timer_now_us() >= deadline_us;
+}
+
+
+static TIMER **timer_list(uint8_t slot)
+{
+    return slot == TIMER_SLOT_DUE ? &timer_due : &timer_wheel[slot];
+}
+
+
+static void timer_insert(TIMER *t)
+{
+    uint64_t tick = t->deadline_us >> TIMER_WHEEL_SHIFT;
+
+    // Slots up to the last tick serviced were already walked
+    if (tick < timer_tick) {
+        tick = timer_tick;
+    }
+    t->slot = tick & (TIMER_WHEEL_SLOTS - 1);
+    t->next = timer_wheel[t->slot];
+    timer_wheel[t->slot] = t;
+    t->active = 1;
+}
+
+
+static void timer_insert_due(TIMER *t)
+{
+    TIMER **p = &timer_due;
+    while (*p && (*p)->deadline_us <= t->deadline_us) {
+        p = &(*p)->next;
+    }
+    t->slot = TIMER_SLOT_DUE;
+    t->next = *p;
+    *p = t;
+}
+
+
+static void timer_unlink(TIMER *t)
+{
+    TIMER **p = timer_list(t->slot);
+    while (*p) {
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+        p = &(*p)->next;
+    }
+    t->next = NULL;
+    t->active = 0;
+}
+
+
+static uint64_t timer_next_us(void)
+{
+    uint64_t next = TIMER_NEVER;
+    uint32_t flags = timer_lock();
+    const TIMER *t;
+    int i;
+
+    for (i = 0; i <= TIMER_SLOT_DUE; i++) {
+        for (t = *timer_list(i); t; t = t->next) {
+            next = MIN(next, t->deadline_us);
+        }
+    }
+    timer_unlock(flags);
+    return next;
+}
+
+
+// Fires the SysTick for the next deadline instead of on a fixed period
+static void timer_arm(uint64_t now_us)
+{
+#ifdef TESTING
+    (void)now_us;
+#else
+    uint64_t next = timer_next_us();
+    systick_arm(next > now_us ? next - now_us : 0);
+#endif
+}
+
+
+void timer_init(void)
+{
+    uint32_t flags;
+#ifndef TESTING
+    systick_init();
+#endif
+    flags = timer_lock();
+    memset(timer_wheel, 0, sizeof(timer_wheel));
+    timer_due = NULL;
+    timer_tick = timer_now_us() >> TIMER_WHEEL_SHIFT;
+    timer_arm(timer_now_us());
+    timer_unlock(flags);
+}
+
+
+// Calls callback(arg) after delay_us, then every period_us unless period_us is 0.
+// Restarts the timer if it is already running.
+void timer_start(TIMER *t, uint32_t delay_us, uint32_t period_us, timer_callback callback,
+                 void *arg)
+{
+    uint32_t flags = timer_lock();
+    uint64_t now = timer_now_us();
+
+    if (t->active) {
+        timer_unlink(t);
+    }
+    t->deadline_us = now + delay_us;
+    t->period_us = period_us;
+    t->callback = callback;
+    t->arg = arg;
+    timer_insert(t);
+    timer_arm(now);
+    timer_unlock(flags);
+}
+
+
+void timer_stop(TIMER *t)
+{
+    uint32_t flags = timer_lock();
+    if (t->active) {
+        timer_unlink(t);
+    }
+    timer_unlock(flags);
+}
+
+
+uint8_t timer_active(const TIMER *t)
+{
+    return t->active;
+}
+
+
+// Runs the callbacks of the expired timers. Called from the SysTick handler and from
+// timer_wait().
+void timer_service(void)
+{
+    uint32_t flags = timer_lock();
+    uint64_t now = timer_now_us();
+    uint64_t tick = now >> TIMER_WHEEL_SHIFT;
+    uint64_t i;
+    TIMER **p, *t;
+
+    for (i = 0; i < TIMER_WHEEL_SLOTS && timer_tick + i <= tick; i++) {
+        p = &timer_wheel[(timer_tick + i) & (TIMER_WHEEL_SLOTS - 1)];
+        while ((t = *p)) {
+            if (t->deadline_us > now) {
+                p = &t->next;
+                continue;
+            }
+            *p = t->next;
+            timer_insert_due(t);
+        }
+    }
+    timer_tick = tick;
+
+    while ((t = timer_due)) {
+        timer_callback callback = t->callback;
+        void *arg = t->arg;
+
+        timer_due = t->next;
+        t->next = NULL;
+        t->active = 0;
+        if (t->period_us) {
+            t->deadline_us += t->period_us;
+            if (t->deadline_us <= now) {
+                // Missed periods are dropped
+                t->deadline_us = now + t->period_us;
+            }
+            timer_insert(t);
+        }
+
+        timer_unlock(flags);
+        callback(arg);
+        flags = timer_lock();
+    }
+
+    timer_arm(now);
+    timer_unlock(flags);
+}
+
+
+// Waits for the next event before deadline_us, running the expired timers. Returns 1
+// once the deadline has passed.
+//
+// In thread mode the core sleeps until the SysTick or another interrupt. An interrupt
+// handler, e.g. a USB command waiting for a touch, is not preempted by the SysTick, so
+// there it returns at once and the caller polls.
+uint8_t timer_wait(uint64_t deadline_us)
+{
+    timer_service();
+    if (timer_expired(deadline_us)) {
+        return 1;
+    }
+
+#ifdef TESTING
+    timer_sim_us = MAX(timer_sim_us, MIN(deadline_us, timer_next_us()));
+    timer_service();
+#else
+    if (!__get_IPSR()) {
+        uint32_t flags = cpu_irq_save();
+        uint64_t now = timer_now_us();
+        uint64_t next = MIN(deadline_us, timer_next_us());
+        if (next > now) {
+            // A pending interrupt ends the sleep even while masked; it runs on restore
+            systick_arm(next - now);
+            __DSB();
+            __WFI();
+        }
+        cpu_irq_restore(flags);
+    }
+#endif
+    return timer_expired(deadline_us);
+}
+
+
+void timer_wait_until(uint64_t deadline_us)
+{
+    while (!timer_wait(deadline_us)) {
+        // pass
+    }
+}
+
+
+void timer_wait_ms(uint32_t ms)
+{
+    timer_wait_until(timer_deadline_ms(ms));
+}
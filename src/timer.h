@@ -0,0 +1,72 @@
+/*
+
+ The MIT License (MIT)
+
+ Copyright (c) 2015-2016 Douglas J. Bakkum
+
+ Permission is hereby granted, free of charge, to any person obtaining
+ a copy of this software and associated documentation files (the "Software"),
+ to deal in the Software without restriction, including without limitation
+ the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ and/or sell copies of the Software, and to permit persons to whom the
+ Software is furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included
+ in all copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES
+ OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+
+#include <stdint.h>
+
+
+#define TIMER_WHEEL_SLOTS   16
+#define TIMER_WHEEL_SHIFT   10// slot width of 1024 usec
+
+
+typedef void (*timer_callback)(void *arg);
+
+
+// Owned by the caller; the service only links it into the wheel while it runs
+typedef struct TIMER {
+    struct TIMER *next;
+    uint64_t deadline_us;
+    uint32_t period_us;// 0 for a one-shot timer
+    timer_callback callback;
+    void *arg;
+    uint8_t slot;
+    uint8_t active;
+} TIMER;
+
+
+void timer_init(void);
+uint64_t timer_now_us(void);
+uint32_t timer_now_ms(void);
+uint64_t timer_deadline_ms(uint32_t ms);
+uint8_t timer_expired(uint64_t deadline_us);
+void timer_start(TIMER *t, uint32_t delay_us, uint32_t period_us, timer_callback callback,
+                 void *arg);
+void timer_stop(TIMER *t);
+uint8_t timer_active(const TIMER *t);
+void timer_service(void);
+uint8_t timer_wait(uint64_t deadline_us);
+void timer_wait_until(uint64_t deadline_us);
+void timer_wait_ms(uint32_t ms);
+#ifdef TESTING
+void timer_sim_advance(uint64_t us);
+#endif
+
+
+#endif
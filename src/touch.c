@@ -30,19 +30,95 @@
 #include "flags.h"
 #include "touch.h"
 #include "hw_version.h"
-#include "systick.h"
+#include "timer.h"
 #include "commander.h"
-#ifndef TESTING
 #include "drivers/config/mcu.h"
+#ifndef TESTING
 #include "touch_api.h"
 #endif
 
 
-extern volatile uint16_t systick_current_time_ms;
+#define TOUCH_SAMPLE_MS 25// Time between two measurements of touch_button_press()
+
+
 volatile uint16_t status_flag = 0u;
 volatile uint16_t burst_flag = 0u;
 
 
+// A touch confirmation is a state machine advanced by touch_poll(), one sensor
+// measurement per call, so that the caller decides what runs between measurements.
+enum {
+    TOUCH_STATE_IDLE,
+    TOUCH_STATE_WAIT,// waiting for the button to be touched
+    TOUCH_STATE_HELD,// touched; waiting for the release or the end of the hold time
+};
+
+
+static struct {
+    uint32_t start_ms;
+    uint32_t touch_ms;
+    uint32_t blink_ms;
+    int16_t thresh;
+    uint8_t type;
+    uint8_t state;
+    uint8_t pushed;
+    uint8_t abort;
+} touch_state;
+
+
+static touch_wait_callback touch_wait = NULL;
+
+
+#ifdef TESTING
+static struct {
+    uint16_t press_ms;
+    uint16_t release_ms;
+    touch_sim_event event;
+    uint8_t armed;
+} touch_sim;
+
+
+// Touch waits run against a simulated button, pressed from press_ms until release_ms
+// after the wait started. event is called between measurements, as the interrupts of the
+// device would run.
+void touch_sim_set(uint16_t press_ms, uint16_t release_ms, touch_sim_event event)
+{
+    touch_sim.press_ms = press_ms;
+    touch_sim.release_ms = release_ms;
+    touch_sim.event = event;
+    touch_sim.armed = 1;
+}
+
+
+void touch_sim_clear(void)
+{
+    touch_sim.armed = 0;
+    touch_sim.event = NULL;
+}
+#endif
+
+
+// Returns how far the sensor signal is below its reference
+static int16_t touch_sense(void)
+{
+#ifdef TESTING
+    uint32_t elapsed = timer_now_ms() - touch_state.start_ms;
+    if (elapsed >= touch_sim.press_ms && elapsed < touch_sim.release_ms) {
+        return 2 * touch_state.thresh;
+    }
+    return 0;
+#else
+    do {
+        status_flag = qt_measure_sensors((uint16_t)timer_now_ms());
+        burst_flag = status_flag & QTLIB_BURST_AGAIN;
+    } while (burst_flag);
+
+    return qt_measure_data.channel_references[QTOUCH_TOUCH_CHANNEL] -
+           qt_measure_data.channel_signals[QTOUCH_TOUCH_CHANNEL];
+#endif
+}
+
+
 void touch_init(void)
 {
 #ifdef TESTING
@@ -65,34 +141,16 @@ void touch_init(void)
 }
 
 
-uint8_t touch_button_press(uint8_t touch_type)
+// Called between measurements while touch_button_press() waits, typically to serve
+// the USB interfaces
+void touch_wait_callback_set(touch_wait_callback callback)
 {
-#ifdef TESTING
-    if (touch_type == DBB_TOUCH_REJECT_TIMEOUT) {
-        // Simulate touch sequence for ecdh led blink coding
-        static uint8_t touch_short_count = 0;
-        if (!touch_short_count) {
-            touch_short_count++;
-            return DBB_ERR_TOUCH_TIMEOUT;
-        } else {
-            touch_short_count = 0;
-            return DBB_ERR_TOUCH_ABORT;
-        }
-    }
-    commander_fill_report(cmd_str(CMD_touchbutton), flag_msg(DBB_WARN_NO_MCU), DBB_OK);
-    return DBB_TOUCHED;
-#else
-    int pushed = DBB_NOT_TOUCHED;
-    int16_t touch_snks;
-    int16_t touch_sns;
-    uint16_t exit_time_ms;
-    uint16_t qt_led_toggle_ms;
-    uint16_t touch_thresh = QTOUCH_TOUCH_THRESH;
-    if (report_hw_version() == HW_VERSION_V1_2) {
-        touch_thresh = QTOUCH_TOUCH_THRESH_HW_V1_2;
-    }
+    touch_wait = callback;
+}
 
 
+int touch_start(uint8_t touch_type)
+{
     if (touch_type != DBB_TOUCH_LONG &&
             touch_type != DBB_TOUCH_SHORT &&
             touch_type != DBB_TOUCH_LONG_BLINK &&
@@ -101,100 +159,176 @@ uint8_t touch_button_press(uint8_t touch_type)
         return DBB_ERROR;
     }
 
+    touch_state.thresh = QTOUCH_TOUCH_THRESH;
+#ifndef TESTING
+    if (report_hw_version() == HW_VERSION_V1_2) {
+        touch_state.thresh = QTOUCH_TOUCH_THRESH_HW_V1_2;
+    }
+#endif
+    touch_state.type = touch_type;
+    touch_state.state = TOUCH_STATE_WAIT;
+    touch_state.pushed = DBB_NOT_TOUCHED;
+    touch_state.abort = 0;
+    touch_state.start_ms = timer_now_ms();
+    touch_state.blink_ms = QTOUCH_TOUCH_BLINK_OFF;
+
     if (touch_type != DBB_TOUCH_REJECT_TIMEOUT) {
         led_on();
     }
+    return DBB_OK;
+}
+
+
+static uint8_t touch_finish(uint8_t pushed)
+{
+    uint8_t touch_type = touch_state.type;
+    touch_state.state = TOUCH_STATE_IDLE;
+
+    if (pushed == DBB_TOUCHED) {
+        if (touch_type == DBB_TOUCH_LONG_BLINK || touch_type == DBB_TOUCH_LONG) {
+            led_blink_after(300);
+        } else {
+            led_off();
+        }
+        return DBB_TOUCHED;
+    } else if (pushed == DBB_TOUCHED_ABORT) {
+        led_abort();
+        return DBB_ERR_TOUCH_ABORT;
+    } else {
+        led_off();
+        return DBB_ERR_TOUCH_TIMEOUT;
+    }
+}
 
-    // Make higher priority so that we can timeout
-    NVIC_SetPriority(SysTick_IRQn, 4);
 
-    qt_led_toggle_ms = QTOUCH_TOUCH_BLINK_OFF;
-    systick_current_time_ms = 0;
-    while (systick_current_time_ms < QTOUCH_TOUCH_TIMEOUT ||
-            touch_type == DBB_TOUCH_SHORT ||
-            touch_type == DBB_TOUCH_LONG_BLINK ||
-            touch_type == DBB_TOUCH_LONG) {
+// Takes one measurement. Returns DBB_TOUCH_PENDING until the confirmation started by
+// touch_start() is answered, then the answer of touch_button_press().
+uint8_t touch_poll(void)
+{
+    uint8_t touch_type = touch_state.type;
+    uint32_t elapsed = timer_now_ms() - touch_state.start_ms;
+    int16_t sense;
+
+    if (touch_state.state == TOUCH_STATE_IDLE) {
+        return DBB_ERROR;
+    }
+
+    if (touch_state.abort) {
+        return touch_finish(DBB_TOUCHED_ABORT);
+    }
+
+    if (touch_state.state == TOUCH_STATE_WAIT) {
+        if (elapsed > QTOUCH_TOUCH_TIMEOUT_HARD) {
+            return touch_finish(DBB_NOT_TOUCHED);
+        }
 
-        if (systick_current_time_ms > QTOUCH_TOUCH_TIMEOUT_HARD) {
-            break;
+        if (elapsed >= QTOUCH_TOUCH_TIMEOUT && (touch_type == DBB_TOUCH_TIMEOUT ||
+                                                touch_type == DBB_TOUCH_REJECT_TIMEOUT)) {
+            return touch_finish(DBB_NOT_TOUCHED);
         }
 
-        if (touch_type == DBB_TOUCH_LONG_BLINK && systick_current_time_ms > qt_led_toggle_ms) {
+        if (touch_type == DBB_TOUCH_LONG_BLINK && elapsed > touch_state.blink_ms) {
             led_off();
-            if (systick_current_time_ms > qt_led_toggle_ms + QTOUCH_TOUCH_BLINK_OFF) {
-                qt_led_toggle_ms += QTOUCH_TOUCH_BLINK_ON + QTOUCH_TOUCH_BLINK_OFF;
+            if (elapsed > touch_state.blink_ms + QTOUCH_TOUCH_BLINK_OFF) {
+                touch_state.blink_ms += QTOUCH_TOUCH_BLINK_ON + QTOUCH_TOUCH_BLINK_OFF;
                 led_on();
             }
         }
 
-        do {
-            status_flag = qt_measure_sensors(systick_current_time_ms);
-            burst_flag = status_flag & QTLIB_BURST_AGAIN;
-        } while (burst_flag);
-
-        touch_snks = qt_measure_data.channel_references[QTOUCH_TOUCH_CHANNEL];
-        touch_sns = qt_measure_data.channel_signals[QTOUCH_TOUCH_CHANNEL];
-
-        if ((touch_snks - touch_sns ) > touch_thresh) {
+        if (touch_sense() > touch_state.thresh) {
             // Touched
             led_off();
-            exit_time_ms = systick_current_time_ms + QTOUCH_TOUCH_TIMEOUT;
-            while (systick_current_time_ms < exit_time_ms) {
-                do {
-                    status_flag = qt_measure_sensors(systick_current_time_ms);
-                    burst_flag = status_flag & QTLIB_BURST_AGAIN;
-                } while (burst_flag);
-
-                touch_snks = qt_measure_data.channel_references[QTOUCH_TOUCH_CHANNEL];
-                touch_sns = qt_measure_data.channel_signals[QTOUCH_TOUCH_CHANNEL];
-
-                if ((touch_snks - touch_sns) < (touch_thresh / 2)) {
-                    // If released before exit_time_ms for:
-                    //     - DBB_TOUCH_LONG_BLINK, answer is 'reject'
-                    //     - DBB_TOUCH_LONG, answer is 'reject'
-                    //     - DBB_TOUCH_SHORT, answer is 'accept'
-                    if (touch_type == DBB_TOUCH_LONG_BLINK || touch_type == DBB_TOUCH_LONG) {
-                        pushed = DBB_TOUCHED_ABORT;
-                        break;
-                    } else if (touch_type == DBB_TOUCH_SHORT) {
-                        pushed = DBB_TOUCHED;
-                        break;
-                    }
-                } else if (touch_type == DBB_TOUCH_LONG_BLINK || touch_type == DBB_TOUCH_LONG) {
-                    pushed = DBB_TOUCHED;
-                } else if (touch_type == DBB_TOUCH_SHORT) {
-                    pushed = DBB_TOUCHED_ABORT;
-                } else if (touch_type == DBB_TOUCH_REJECT_TIMEOUT) {
-                    pushed = DBB_TOUCHED_ABORT;
-                    break;
-                } else if (touch_type == DBB_TOUCH_TIMEOUT) {
-                    // If touched before exit_time_ms for:
-                    //     - DBB_TOUCH_TIMEOUT, answer is 'accept'
-                    pushed = DBB_TOUCHED;
-                    break;
-                }
-            }
-            break;
+            touch_state.touch_ms = timer_now_ms();
+            touch_state.state = TOUCH_STATE_HELD;
         }
+        return DBB_TOUCH_PENDING;
     }
 
-    // Reset lower priority
-    NVIC_SetPriority(SysTick_IRQn, 15);
+    if (timer_now_ms() - touch_state.touch_ms >= QTOUCH_TOUCH_TIMEOUT) {
+        return touch_finish(touch_state.pushed);
+    }
 
-    if (pushed == DBB_TOUCHED) {
+    sense = touch_sense();
+    if (sense < touch_state.thresh / 2) {
+        // If released before the hold time for:
+        //     - DBB_TOUCH_LONG_BLINK, answer is 'reject'
+        //     - DBB_TOUCH_LONG, answer is 'reject'
+        //     - DBB_TOUCH_SHORT, answer is 'accept'
         if (touch_type == DBB_TOUCH_LONG_BLINK || touch_type == DBB_TOUCH_LONG) {
-            led_off();
-            delay_ms(300);
-            led_blink();
+            return touch_finish(DBB_TOUCHED_ABORT);
+        } else if (touch_type == DBB_TOUCH_SHORT) {
+            return touch_finish(DBB_TOUCHED);
         }
-        led_off();
+    } else if (touch_type == DBB_TOUCH_LONG_BLINK || touch_type == DBB_TOUCH_LONG) {
+        touch_state.pushed = DBB_TOUCHED;
+    } else if (touch_type == DBB_TOUCH_SHORT) {
+        touch_state.pushed = DBB_TOUCHED_ABORT;
+    } else if (touch_type == DBB_TOUCH_REJECT_TIMEOUT) {
+        return touch_finish(DBB_TOUCHED_ABORT);
+    } else if (touch_type == DBB_TOUCH_TIMEOUT) {
+        // If touched before the timeout for:
+        //     - DBB_TOUCH_TIMEOUT, answer is 'accept'
+        return touch_finish(DBB_TOUCHED);
+    }
+    return DBB_TOUCH_PENDING;
+}
+
+
+uint8_t touch_pending(void)
+{
+    return touch_state.state != TOUCH_STATE_IDLE;
+}
+
+
+// Answers the pending confirmation with DBB_ERR_TOUCH_ABORT at the next touch_poll()
+void touch_abort(void)
+{
+    if (touch_pending()) {
+        touch_state.abort = 1;
+    }
+}
+
+
+uint8_t touch_button_press(uint8_t touch_type)
+{
+    uint64_t sample_us;
+    uint8_t status;
+
+#ifdef TESTING
+    if (!touch_sim.armed) {
+        if (touch_type == DBB_TOUCH_REJECT_TIMEOUT) {
+            // Simulate touch sequence for ecdh led blink coding
+            static uint8_t touch_short_count = 0;
+            if (!touch_short_count) {
+                touch_short_count++;
+                return DBB_ERR_TOUCH_TIMEOUT;
+            } else {
+                touch_short_count = 0;
+                return DBB_ERR_TOUCH_ABORT;
+            }
+        }
+        commander_fill_report(cmd_str(CMD_touchbutton), flag_msg(DBB_WARN_NO_MCU),
+                              DBB_OK);
         return DBB_TOUCHED;
-    } else if (pushed == DBB_TOUCHED_ABORT) {
-        led_abort();
-        return DBB_ERR_TOUCH_ABORT;
-    } else {
-        led_off();
-        return DBB_ERR_TOUCH_TIMEOUT;
     }
 #endif
+
+    if (touch_start(touch_type) != DBB_OK) {
+        return DBB_ERROR;
+    }
+
+    while ((status = touch_poll()) == DBB_TOUCH_PENDING) {
+        sample_us = timer_deadline_ms(TOUCH_SAMPLE_MS);
+#ifdef TESTING
+        if (touch_sim.event) {
+            touch_sim.event(timer_now_ms() - touch_state.start_ms);
+        }
+#endif
+        do {
+            if (touch_wait) {
+                touch_wait();
+            }
+        } while (!timer_wait(sample_us));
+    }
+    return status;
 }
@@ -51,8 +51,22 @@
 #endif
 
 
+typedef void (*touch_wait_callback)(void);
+
+
 void touch_init(void);
+int touch_start(uint8_t touch_type);
+uint8_t touch_poll(void);
+uint8_t touch_pending(void);
+void touch_abort(void);
+void touch_wait_callback_set(touch_wait_callback callback);
 uint8_t touch_button_press(uint8_t touch_type);
+#ifdef TESTING
+#define TOUCH_SIM_NEVER 0xffff
+typedef void (*touch_sim_event)(uint16_t elapsed_ms);
+void touch_sim_set(uint16_t press_ms, uint16_t release_ms, touch_sim_event event);
+void touch_sim_clear(void);
+#endif
 
 
 #endif
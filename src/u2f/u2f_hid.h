@@ -35,6 +35,7 @@
 #define U2FHID_LOCK         (U2FHID_TYPE_INIT | 0x04)// Send lock channel command
 #define U2FHID_INIT         (U2FHID_TYPE_INIT | 0x06)// Channel initialization
 #define U2FHID_WINK         (U2FHID_TYPE_INIT | 0x08)// Send device identification wink
+#define U2FHID_KEEPALIVE    (U2FHID_TYPE_INIT | 0x3b)// Request still processing
 #define U2FHID_SYNC         (U2FHID_TYPE_INIT | 0x3c)// Send sync command
 #define U2FHID_ERROR        (U2FHID_TYPE_INIT | 0x3f)// Error response
 #define U2FHID_VENDOR_FIRST (U2FHID_TYPE_INIT | 0x40)// First vendor defined command
@@ -42,6 +43,19 @@
 
 // U2FHID vendor defined commands
 #define U2FHID_HWW (U2FHID_VENDOR_FIRST + 0x01)// Hardware wallet command
+#define U2FHID_HWW_REPORT (U2FHID_VENDOR_FIRST + 0x02)// Query/set HWW IN report size
+
+// U2FHID_HWW_REPORT command defines
+// The request is empty (query) or holds the wanted size as 2 big-endian bytes. The
+// response holds the largest size and the size in use, as 2 big-endian bytes each.
+#define U2FHID_HWW_REPORT_REQ_SIZE  2
+#define U2FHID_HWW_REPORT_RESP_SIZE 4
+
+// U2FHID_KEEPALIVE command defines
+// Sent on the channel of a request that waits, as CTAPHID does. Clients skip them.
+#define U2FHID_KEEPALIVE_SIZE       1
+#define U2FHID_KEEPALIVE_PROCESSING 0x01
+#define U2FHID_KEEPALIVE_UPNEEDED   0x02// Waiting for a touch
 
 // U2FHID_INIT command defines
 #define U2FHID_INIT_NONCE_SIZE 8
@@ -40,7 +40,7 @@
 #include "wallet.h"
 #include "random.h"
 #include "version.h"
-#include "systick.h"
+#include "timer.h"
 #include "commander.h"
 
 #include "u2f/u2f.h"
@@ -51,10 +51,14 @@
 
 #define APDU_LEN(A)              (uint32_t)(((A).lc1 << 16) + ((A).lc2 << 8) + ((A).lc3))
 #define U2F_TIMEOUT              500// [msec]
+#define U2F_KEEPALIVE            100// [msec]
 #define U2F_KEYHANDLE_LEN        (U2F_NONCE_LENGTH + SHA256_DIGEST_LENGTH)
+#define U2F_KEYHANDLE_CACHE_LEN  8
 #define U2F_READBUF_MAX_LEN      COMMANDER_REPORT_SIZE// Max allowed by U2F specification = (57 + 128 * 59) = 7609. 
 // In practice, U2F commands do not need this much space.
 // Therefore, reduce to save MCU memory.
+#define U2F_READBUF_SLOT_LEN     ((USB_REPORT_SIZE - 7) + (USB_REPORT_SIZE - 5) * 8)
+#define U2F_READER_SLOTS         4// Channels reassembled at the same time
 
 
 #if (U2F_EC_KEY_SIZE != SHA256_DIGEST_LENGTH) || (U2F_EC_KEY_SIZE != U2F_NONCE_LENGTH)
@@ -63,8 +67,6 @@
 
 
 static uint32_t cid = 0;
-volatile bool u2f_state_continue = false;
-volatile uint16_t u2f_current_time_ms = 0;
 const uint8_t U2F_HIJACK_CODE[U2F_HIJACK_ORIGIN_TOTAL][U2F_NONCE_LENGTH] = {
     {
         /* Corresponds to U2F client challenge filled with `0xdb` */
@@ -105,29 +107,72 @@ typedef struct {
 } U2F_AUTHENTICATE_SIG_STR;
 
 
+// Messages are reassembled per channel, so that a client polling on its own channel is
+// not answered busy while another client sends a message. Slot 0 holds the only buffer
+// large enough for HWW commands; the other slots take U2F requests of up to 8
+// continuation frames.
 typedef struct {
-    uint8_t buf[U2F_READBUF_MAX_LEN];
+    uint8_t *buf;
     uint8_t *buf_ptr;
+    uint32_t size;
     uint32_t len;
+    uint32_t cid;// 0 if the slot is free
+    uint32_t open_ms;
     uint8_t seq;
     uint8_t cmd;
 } U2F_ReadBuffer;
 
 
-static U2F_ReadBuffer reader;
+static uint8_t reader_buf[U2F_READBUF_MAX_LEN];
+static uint8_t reader_slot_buf[U2F_READER_SLOTS - 1][U2F_READBUF_SLOT_LEN];
+static U2F_ReadBuffer readers[U2F_READER_SLOTS];
+
+
+// Request being executed. While it waits for a touch, the USB interrupts keep calling
+// u2f_device_run(): its channel gets keepalives, and other U2F and HWW requests are
+// answered busy. An INIT on its channel aborts the touch and drops its reply.
+typedef struct {
+    uint32_t cid;// 0 if no request runs
+    uint32_t keepalive_ms;// time of the last keepalive
+    uint8_t cancelled;
+} U2F_Running;
+
+
+static U2F_Running running;
+
+
+// Recently derived key handles. Browsers probe every registered key handle of an account
+// with check-only authentications, repeatedly until the user touches the device, so the
+// same (appId, key handle) pairs are checked many times. Handles that failed the MAC
+// check are cached too, without a key.
+typedef struct {
+    uint8_t appId[U2F_APPID_SIZE];
+    uint8_t keyHandle[U2F_KEYHANDLE_LEN];
+    uint8_t privkey[U2F_EC_KEY_SIZE];
+    uint8_t valid;
+    uint32_t used;// 0 if the entry is free
+} U2F_KeyHandleCache;
+
+
+static U2F_KeyHandleCache keyhandle_cache[U2F_KEYHANDLE_CACHE_LEN];
+static uint32_t keyhandle_cache_clock = 0;
 
 
 static uint32_t next_cid(void)
 {
+    uint32_t ncid;
     do {
-        cid = random_uint32(0);
-    } while (cid == 0 || cid == U2FHID_CID_BROADCAST);
-    return cid;
+        ncid = random_uint32(0);
+    } while (ncid == 0 || ncid == U2FHID_CID_BROADCAST);
+    return ncid;
 }
 
 
 void u2f_send_message(const uint8_t *data, const uint32_t len)
 {
+    if (running.cancelled) {
+        return;
+    }
     usb_reply_queue_load_msg(U2FHID_MSG, data, len, cid);
 }
 
@@ -145,6 +190,19 @@ void u2f_send_err_hid(uint32_t fcid, uint8_t err)
 }
 
 
+static void u2f_send_keepalive(uint32_t fcid)
+{
+    USB_FRAME f;
+
+    utils_zero(&f, sizeof(f));
+    f.cid = fcid;
+    f.init.cmd = U2FHID_KEEPALIVE;
+    f.init.bcntl = U2FHID_KEEPALIVE_SIZE;
+    f.init.data[0] = U2FHID_KEEPALIVE_UPNEEDED;
+    usb_reply_queue_add(&f);
+}
+
+
 static void u2f_send_error(const uint16_t err)
 {
     uint8_t data[2];
@@ -170,10 +228,16 @@ static void u2f_keyhandle_gen(const uint8_t *appId, uint8_t *nonce, uint8_t *pri
                               uint8_t *mac)
 {
     uint8_t hash[SHA256_DIGEST_LENGTH];
+    HMAC_SHA256_CTX kctx, hctx;
+    hmac_sha256(appId, U2F_APPID_SIZE, memory_report_master_u2f(), 32, hash);
+    hmac_sha256_Init(&kctx, hash, SHA256_DIGEST_LENGTH);
     for (;;) {
-        hmac_sha256(appId, U2F_APPID_SIZE, memory_report_master_u2f(), 32, hash);
-        hmac_sha256(hash, SHA256_DIGEST_LENGTH, nonce, U2F_NONCE_LENGTH, privkey);
-        hmac_sha256(hash, SHA256_DIGEST_LENGTH, privkey, U2F_EC_KEY_SIZE, mac);
+        hmac_sha256_Copy(&hctx, &kctx);
+        hmac_sha256_Update(&hctx, nonce, U2F_NONCE_LENGTH);
+        hmac_sha256_Final(&hctx, privkey);
+        hmac_sha256_Copy(&hctx, &kctx);
+        hmac_sha256_Update(&hctx, privkey, U2F_EC_KEY_SIZE);
+        hmac_sha256_Final(&hctx, mac);
 
         if (ecc_isValid(privkey, ECC_SECP256r1)) {
             break;
@@ -181,6 +245,60 @@ static void u2f_keyhandle_gen(const uint8_t *appId, uint8_t *nonce, uint8_t *pri
 
         memcpy(nonce, mac, U2F_NONCE_LENGTH);
     }
+    utils_zero(hash, sizeof(hash));
+    utils_zero(&kctx, sizeof(kctx));
+}
+
+
+void u2f_keyhandle_cache_clear(void)
+{
+    utils_zero(keyhandle_cache, sizeof(keyhandle_cache));
+    keyhandle_cache_clock = 0;
+}
+
+
+// Returns the cached entry of the key handle, or NULL
+static const U2F_KeyHandleCache *u2f_keyhandle_cache_get(const uint8_t *appId,
+        const uint8_t *keyHandle)
+{
+    int i;
+    for (i = 0; i < U2F_KEYHANDLE_CACHE_LEN; i++) {
+        U2F_KeyHandleCache *e = &keyhandle_cache[i];
+        if (e->used && MEMEQ(e->keyHandle, keyHandle, U2F_KEYHANDLE_LEN) &&
+                MEMEQ(e->appId, appId, U2F_APPID_SIZE)) {
+            e->used = ++keyhandle_cache_clock;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+
+// Stores a derived key handle in place of the least recently used entry. privkey is NULL
+// if the key handle is not valid for the appId.
+static void u2f_keyhandle_cache_put(const uint8_t *appId, const uint8_t *keyHandle,
+                                    const uint8_t *privkey)
+{
+    int i;
+    U2F_KeyHandleCache *e = &keyhandle_cache[0];
+    for (i = 1; i < U2F_KEYHANDLE_CACHE_LEN; i++) {
+        if (keyhandle_cache[i].used < e->used) {
+            e = &keyhandle_cache[i];
+        }
+    }
+    if (keyhandle_cache_clock == UINT32_MAX) {
+        u2f_keyhandle_cache_clear();
+        e = &keyhandle_cache[0];
+    }
+    memcpy(e->appId, appId, U2F_APPID_SIZE);
+    memcpy(e->keyHandle, keyHandle, U2F_KEYHANDLE_LEN);
+    if (privkey) {
+        memcpy(e->privkey, privkey, U2F_EC_KEY_SIZE);
+    } else {
+        utils_zero(e->privkey, U2F_EC_KEY_SIZE);
+    }
+    e->valid = privkey != NULL;
+    e->used = ++keyhandle_cache_clock;
 }
 
 
@@ -220,6 +338,8 @@ static void u2f_device_register(const USB_APDU *a)
 
         memcpy(resp->keyHandleCertSig, mac, sizeof(mac));
         memcpy(resp->keyHandleCertSig + sizeof(mac), nonce, sizeof(nonce));
+        u2f_keyhandle_cache_put(req->appId, resp->keyHandleCertSig, privkey);
+        utils_zero(privkey, sizeof(privkey));
         memcpy(resp->keyHandleCertSig + resp->keyHandleLen, U2F_ATT_CERT, sizeof(U2F_ATT_CERT));
 
         // Add signature using attestation key
@@ -252,36 +372,73 @@ static void u2f_device_register(const USB_APDU *a)
 }
 
 
+// Commands arrive in chunks of up to U2F_MAX_KH_SIZE - 2 bytes, one per key handle,
+// preceded by the total number of chunks and the chunk index. A client can pack several
+// key handles into one browser sign request by setting U2F_HIJACK_MORE in the index of
+// all but the last one. Those are rejected as unknown key handles, so that the browser
+// goes on with the next key handle instead of returning to the client. The last key
+// handle of a request is acknowledged with an empty report, or answered with the command
+// report once all chunks arrived. The other chunks may arrive in any order, each within
+// U2F_TIMEOUT of the previous one.
 static void u2f_device_hijack(const U2F_AUTHENTICATE_REQ *req)
 {
     static char hijack_cmd[COMMANDER_REPORT_SIZE] = {0};
+    static uint32_t hijack_chunks = 0;// Bitmap of the received chunks
+    static uint32_t hijack_ms = 0;// Time of the last chunk
+    static uint8_t hijack_tot = 0;
 
-    const uint32_t ctr = memory_u2f_count_iter();
     char empty_report[3 + U2F_CTR_SIZE] = {0};// 1-byte flag | 4-byte ctr | 2-byte status
     char *report;
     int report_len;
+    uint32_t ctr;
 
     size_t kh_len = MIN(U2F_MAX_KH_SIZE - 2, strlens((const char *)req->keyHandle + 2));
     uint8_t tot = req->keyHandle[0];
-    uint8_t cnt = req->keyHandle[1];
+    uint8_t cnt = req->keyHandle[1] & ~U2F_HIJACK_MORE;
     size_t idx = cnt * (U2F_MAX_KH_SIZE - 2);
+    uint32_t now_ms = timer_now_ms();
+
+    if (tot != hijack_tot || now_ms - hijack_ms > U2F_TIMEOUT) {
+        // A different command, or one abandoned before its last chunk
+        memset(hijack_cmd, 0, sizeof(hijack_cmd));
+        hijack_chunks = 0;
+        hijack_tot = tot;
+    }
+    hijack_ms = now_ms;
 
     if (idx + kh_len < sizeof(hijack_cmd)) {
         memcpy(hijack_cmd + idx, req->keyHandle + 2, kh_len);
-        hijack_cmd[idx + kh_len] = '\0';
+        if (cnt + 1 >= tot) {
+            hijack_cmd[idx + kh_len] = '\0';
+        }
+        hijack_chunks |= 1UL << cnt;
     }
 
-    if (cnt + 1 < tot) {
+    if (req->keyHandle[1] & U2F_HIJACK_MORE) {
+        u2f_send_error(U2F_SW_WRONG_DATA);
+        return;
+    }
+
+    if (tot > 32 || hijack_chunks != (uint32_t)((1ULL << tot) - 1)) {
+        if (cnt + 1 >= tot) {
+            // Chunks are missing
+            hijack_chunks = 0;
+            u2f_send_error(U2F_SW_WRONG_DATA);
+            return;
+        }
         // Need more data. Acknowledge by returning an empty report.
         report = empty_report;
         report_len = sizeof(empty_report);
+        ctr = memory_u2f_count_read();
     } else {
         led_blink();
+        ctr = memory_u2f_count_iter();
         report = commander(hijack_cmd);
         report_len = MIN(strlens(report) + sizeof(empty_report), COMMANDER_REPORT_SIZE);
         memmove(report + 1 + U2F_CTR_SIZE, report, MIN(strlens(report),
                 COMMANDER_REPORT_SIZE - U2F_CTR_SIZE - 1));
         memset(hijack_cmd, 0, sizeof(hijack_cmd));
+        hijack_chunks = 0;
     }
 
     report[0] = 0;// Flags
@@ -301,8 +458,9 @@ static void u2f_device_hijack(const U2F_AUTHENTICATE_REQ *req)
 static void u2f_device_authenticate(const USB_APDU *a)
 {
     uint8_t privkey[U2F_EC_KEY_SIZE], nonce[U2F_NONCE_LENGTH], mac[SHA256_DIGEST_LENGTH],
-            sig[64], i;
+            sig[64], i, valid;
     const U2F_AUTHENTICATE_REQ *req = (const U2F_AUTHENTICATE_REQ *)a->data;
+    const U2F_KeyHandleCache *cached;
     U2F_AUTHENTICATE_SIG_STR sig_base;
 
     if (APDU_LEN(*a) < U2F_KEYHANDLE_LEN) { // actual size could vary
@@ -329,11 +487,18 @@ static void u2f_device_authenticate(const USB_APDU *a)
         return;
     }
 
-    memcpy(nonce, req->keyHandle + sizeof(mac), sizeof(nonce));
-
-    u2f_keyhandle_gen(req->appId, nonce, privkey, mac);
+    cached = u2f_keyhandle_cache_get(req->appId, req->keyHandle);
+    if (cached) {
+        valid = cached->valid;
+        memcpy(privkey, cached->privkey, sizeof(privkey));
+    } else {
+        memcpy(nonce, req->keyHandle + sizeof(mac), sizeof(nonce));
+        u2f_keyhandle_gen(req->appId, nonce, privkey, mac);
+        valid = MEMEQ(req->keyHandle, mac, SHA256_DIGEST_LENGTH);
+        u2f_keyhandle_cache_put(req->appId, req->keyHandle, valid ? privkey : NULL);
+    }
 
-    if (!MEMEQ(req->keyHandle, mac, SHA256_DIGEST_LENGTH)) {
+    if (!valid) {
         u2f_send_error(U2F_SW_WRONG_DATA);
         return;
     }
@@ -386,10 +551,45 @@ static void u2f_device_authenticate(const USB_APDU *a)
 }
 
 
-static void u2f_device_reset_state(void)
+static U2F_ReadBuffer *u2f_reader_get(uint32_t fcid)
 {
-    memset(&reader, 0, sizeof(reader));
-    u2f_state_continue = false;
+    int i;
+    for (i = 0; i < U2F_READER_SLOTS; i++) {
+        if (fcid && readers[i].cid == fcid) {
+            return &readers[i];
+        }
+    }
+    return NULL;
+}
+
+
+// Takes the smallest free slot that fits a message of len bytes, or returns NULL
+static U2F_ReadBuffer *u2f_reader_open(uint32_t fcid, uint32_t len)
+{
+    int i;
+    for (i = U2F_READER_SLOTS - 1; i >= 0; i--) {
+        U2F_ReadBuffer *r = &readers[i];
+        uint32_t size = i ? U2F_READBUF_SLOT_LEN : U2F_READBUF_MAX_LEN;
+        if (r->cid || len > size) {
+            continue;
+        }
+        memset(r, 0, sizeof(*r));
+        r->buf = i ? reader_slot_buf[i - 1] : reader_buf;
+        r->buf_ptr = r->buf;
+        r->size = size;
+        r->len = len;
+        r->cid = fcid;
+        r->open_ms = timer_now_ms();
+        return r;
+    }
+    return NULL;
+}
+
+
+static void u2f_reader_close(U2F_ReadBuffer *r)
+{
+    commander_stream_end((const char *)r->buf);
+    memset(r, 0, sizeof(*r));
 }
 
 
@@ -435,6 +635,25 @@ static void u2f_device_lock(const uint8_t *buf, uint32_t len)
 }
 
 
+static void u2f_device_hww_report(const uint8_t *buf, uint32_t len)
+{
+    uint8_t resp[U2FHID_HWW_REPORT_RESP_SIZE];
+    uint16_t size;
+
+    if (len != 0 && len != U2FHID_HWW_REPORT_REQ_SIZE) {
+        u2f_send_err_hid(cid, U2FHID_ERR_INVALID_LEN);
+        return;
+    }
+
+    size = len ? usb_hww_report_size_set((buf[0] << 8) + buf[1]) : usb_hww_report_size();
+    resp[0] = USB_HWW_REPORT_IN_SIZE >> 8;
+    resp[1] = USB_HWW_REPORT_IN_SIZE & 0xff;
+    resp[2] = size >> 8;
+    resp[3] = size & 0xff;
+    usb_reply_queue_load_msg(U2FHID_HWW_REPORT, resp, sizeof(resp), cid);
+}
+
+
 static void u2f_device_init(const USB_FRAME *in)
 {
     const U2FHID_INIT_REQ *init_req = (const U2FHID_INIT_REQ *)&in->init.data;
@@ -491,41 +710,88 @@ static void u2f_device_msg(const USB_APDU *a, uint32_t len)
 }
 
 
-static void u2f_device_cmd_cont(const USB_FRAME *f)
+// Saves the state of the request it interrupts in `outer`, for u2f_running_end()
+static void u2f_running_begin(uint32_t fcid, U2F_Running *outer)
+{
+    *outer = running;
+    running.cid = fcid;
+    running.keepalive_ms = timer_now_ms();
+    running.cancelled = 0;
+}
+
+
+static void u2f_running_end(const U2F_Running *outer)
 {
-    (void) f;
+    running = *outer;
+}
+
+
+// True if a request is being executed, i.e. u2f_device_run() is called from the USB
+// interrupts of a touch wait
+bool u2f_device_busy(void)
+{
+    return running.cid != 0;
+}
 
-    if ((reader.buf_ptr - reader.buf) < (signed)reader.len) {
+
+static void u2f_device_cmd_cont(U2F_ReadBuffer *r)
+{
+    U2F_Running outer;
+
+    if (running.cid && (r->cmd == U2FHID_MSG || r->cmd == U2FHID_HWW)) {
+        // Opened before the running request began; it would run nested inside it
+        u2f_send_err_hid(r->cid, U2FHID_ERR_CHANNEL_BUSY);
+        u2f_reader_close(r);
+        return;
+    }
+
+    if (r->cmd == U2FHID_HWW) {
+        // Decrypt what has arrived so far
+        commander_stream_update((const char *)r->buf,
+                                MIN(r->buf_ptr - r->buf, (signed)r->len));
+    }
+
+    if ((r->buf_ptr - r->buf) < (signed)r->len) {
         // Need more data
         return;
     }
 
-    u2f_state_continue = false;
+    cid = r->cid;
 
-    if ( (reader.cmd < U2FHID_VENDOR_FIRST) &&
+    if ( (r->cmd < U2FHID_VENDOR_FIRST) &&
             !(memory_report_ext_flags() & MEM_EXT_MASK_U2F) ) {
         // Abort U2F commands if the U2F bit is not set (==U2F disabled).
         // Vendor specific commands are passed through.
         u2f_send_err_hid(cid, U2FHID_ERR_CHANNEL_BUSY);
     } else {
         // Received all data
-        switch (reader.cmd) {
+        switch (r->cmd) {
             case U2FHID_PING:
-                u2f_device_ping(reader.buf, reader.len);
+                u2f_device_ping(r->buf, r->len);
                 break;
             case U2FHID_MSG:
-                u2f_device_msg((USB_APDU *)reader.buf, reader.len);
+                u2f_running_begin(cid, &outer);
+                u2f_device_msg((USB_APDU *)r->buf, r->len);
+                u2f_running_end(&outer);
                 break;
             case U2FHID_WINK:
-                u2f_device_wink(reader.buf, reader.len);
+                u2f_device_wink(r->buf, r->len);
                 break;
             case U2FHID_HWW: {
                 char *report;
-                reader.buf[MIN(reader.len, sizeof(reader.buf) - 1)] = '\0';// NULL terminate
-                report = commander((const char *)reader.buf);
-                usb_reply_queue_load_msg(U2FHID_HWW, (const uint8_t *)report, strlens(report), cid);
+                r->buf[MIN(r->len, r->size - 1)] = '\0';// NULL terminate
+                u2f_running_begin(cid, &outer);
+                report = commander((const char *)r->buf);
+                if (!running.cancelled) {
+                    usb_reply_queue_load_msg_ref(U2FHID_HWW, (const uint8_t *)report,
+                                                 strlens(report), cid);
+                }
+                u2f_running_end(&outer);
                 break;
             }
+            case U2FHID_HWW_REPORT:
+                u2f_device_hww_report(r->buf, r->len);
+                break;
             default:
                 u2f_send_err_hid(cid, U2FHID_ERR_INVALID_CMD);
                 break;
@@ -533,55 +799,64 @@ static void u2f_device_cmd_cont(const USB_FRAME *f)
     }
 
     // Finished
-    u2f_device_reset_state();
+    u2f_reader_close(r);
     cid = 0;
 }
 
 
 static void u2f_device_cmd_init(const USB_FRAME *f)
 {
+    U2F_ReadBuffer *r;
+
     if (f->cid == U2FHID_CID_BROADCAST || f->cid == 0) {
         u2f_send_err_hid(f->cid, U2FHID_ERR_INVALID_CID);
         return;
     }
 
-    if ((unsigned)U2FHID_MSG_LEN(*f) > sizeof(reader.buf)) {
+    if ((unsigned)U2FHID_MSG_LEN(*f) > U2F_READBUF_MAX_LEN) {
         u2f_send_err_hid(f->cid, U2FHID_ERR_INVALID_LEN);
         return;
     }
 
-    memset(&reader, 0, sizeof(reader));
-    reader.seq = 0;
-    reader.buf_ptr = reader.buf;
-    reader.len = U2FHID_MSG_LEN(*f);
-    reader.cmd = f->type;
-    memcpy(reader.buf_ptr, f->init.data, sizeof(f->init.data));
-    reader.buf_ptr += sizeof(f->init.data);
-    cid = f->cid;
+    r = u2f_reader_open(f->cid, U2FHID_MSG_LEN(*f));
+    if (!r) {
+        u2f_send_err_hid(f->cid, U2FHID_ERR_CHANNEL_BUSY);
+        return;
+    }
 
-    u2f_current_time_ms = 0;
-    u2f_state_continue = true;
-    u2f_device_cmd_cont(f);
+    r->cmd = f->type;
+    if (r->cmd == U2FHID_HWW) {
+        commander_stream_begin((const char *)r->buf, r->len);
+    }
+    memcpy(r->buf_ptr, f->init.data, sizeof(f->init.data));
+    r->buf_ptr += sizeof(f->init.data);
+    u2f_device_cmd_cont(r);
 }
 
 
 void u2f_device_run(const USB_FRAME *f)
 {
+    uint32_t outer_cid = cid;
+    U2F_ReadBuffer *r = u2f_reader_get(f->cid);
+
     if ((f->type & U2FHID_TYPE_MASK) == U2FHID_TYPE_INIT) {
 
         if (f->init.cmd == U2FHID_INIT) {
             u2f_device_init(f);
-            if (f->cid == cid) {
-                u2f_device_reset_state();
-            }
-        } else if (u2f_state_continue) {
-            if (f->cid == cid) {
-                usb_reply_queue_clear();
-                u2f_device_reset_state();
-                u2f_send_err_hid(f->cid, U2FHID_ERR_INVALID_SEQ);
-            } else {
-                u2f_send_err_hid(f->cid, U2FHID_ERR_CHANNEL_BUSY);
+            if (running.cid && f->cid == running.cid) {
+                running.cancelled = 1;
+                touch_abort();
+            } else if (r) {
+                u2f_reader_close(r);
             }
+        } else if (running.cid && (f->cid == running.cid || f->init.cmd == U2FHID_MSG ||
+                                   f->init.cmd == U2FHID_HWW)) {
+            // Only requests that answer at once are served while another one runs
+            u2f_send_err_hid(f->cid, U2FHID_ERR_CHANNEL_BUSY);
+        } else if (r) {
+            usb_reply_queue_clear_cid(f->cid);
+            u2f_reader_close(r);
+            u2f_send_err_hid(f->cid, U2FHID_ERR_INVALID_SEQ);
         } else {
             u2f_device_cmd_init(f);
         }
@@ -590,52 +865,66 @@ void u2f_device_run(const USB_FRAME *f)
 
     if ((f->type & U2FHID_TYPE_MASK) == U2FHID_TYPE_CONT) {
 
-        if (!u2f_state_continue) {
-            goto exit;
-        }
-
-        if (cid != f->cid) {
-            u2f_send_err_hid(f->cid, U2FHID_ERR_CHANNEL_BUSY);
+        if (!r || r->cid == running.cid) {
+            // Not reassembling a message on this channel
             goto exit;
         }
 
-        if (reader.seq != f->cont.seq) {
-            usb_reply_queue_clear();
-            u2f_device_reset_state();
+        if (r->seq != f->cont.seq) {
+            usb_reply_queue_clear_cid(f->cid);
+            u2f_reader_close(r);
             u2f_send_err_hid(f->cid, U2FHID_ERR_INVALID_SEQ);
             goto exit;
         }
 
         // Check bounds
-        if ((reader.buf_ptr - reader.buf) >= (signed) reader.len
-                || (reader.buf_ptr + sizeof(f->cont.data) - reader.buf) > (signed) sizeof(
-                    reader.buf)) {
+        if ((r->buf_ptr - r->buf) >= (signed) r->len
+                || (r->buf_ptr + sizeof(f->cont.data) - r->buf) > (signed) r->size) {
             goto exit;
         }
 
-        reader.seq++;
-        memcpy(reader.buf_ptr, f->cont.data, sizeof(f->cont.data));
-        reader.buf_ptr += sizeof(f->cont.data);
-        u2f_device_cmd_cont(f);
+        r->seq++;
+        memcpy(r->buf_ptr, f->cont.data, sizeof(f->cont.data));
+        r->buf_ptr += sizeof(f->cont.data);
+        u2f_device_cmd_cont(r);
     }
 
 exit:
+    cid = outer_cid;
     usb_reply_queue_send();
 }
 
 
+// Checks the keepalive and reassembly deadlines against the timer clock, so that it can
+// be called at any rate
 void u2f_device_timeout(void)
 {
-    if (!u2f_state_continue) {
-        return;
+    int i;
+    bool queued = false;
+    uint32_t now_ms = timer_now_ms();
+
+    if (running.cid && touch_pending() && !running.cancelled) {
+        if (now_ms - running.keepalive_ms >= U2F_KEEPALIVE) {
+            running.keepalive_ms = now_ms;
+            u2f_send_keepalive(running.cid);
+            queued = true;
+        }
     }
 
-    u2f_current_time_ms += 40;
+    for (i = 0; i < U2F_READER_SLOTS; i++) {
+        U2F_ReadBuffer *r = &readers[i];
+        uint32_t fcid = r->cid;
+        if (!fcid || fcid == running.cid) {
+            continue;
+        }
+        if (now_ms - r->open_ms > U2F_TIMEOUT) {
+            u2f_reader_close(r);
+            u2f_send_err_hid(fcid, U2FHID_ERR_MSG_TIMEOUT);
+            queued = true;
+        }
+    }
 
-    if (u2f_current_time_ms > U2F_TIMEOUT) {
-        u2f_device_reset_state();
-        u2f_send_err_hid(cid, U2FHID_ERR_MSG_TIMEOUT);
+    if (queued) {
         usb_reply_queue_send();
     }
 }
-
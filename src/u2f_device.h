@@ -36,6 +36,7 @@
 
 
 #define U2F_HIJACK_ORIGIN_TOTAL 3
+#define U2F_HIJACK_MORE         0x80// Chunk index flag: more chunks in the same request
 
 
 extern const uint8_t U2F_HIJACK_CODE[U2F_HIJACK_ORIGIN_TOTAL][U2F_NONCE_LENGTH];
@@ -45,6 +46,8 @@ void u2f_send_message(const uint8_t *data, const uint32_t len);
 void u2f_send_err_hid(uint32_t fcid, uint8_t err);
 void u2f_device_run(const USB_FRAME *f);
 void u2f_device_timeout(void);
+bool u2f_device_busy(void);
+void u2f_keyhandle_cache_clear(void);
 
 
 #endif
@@ -157,6 +157,12 @@ struct uECC_Curve_t {
 #if (uECC_OPTIMIZATION_LEVEL > 0)
     void (*mmod_fast)(uECC_word_t *result, uECC_word_t *product);
 #endif
+#if uECC_GENERATOR_COMB
+    const uECC_word_t *G_comb;
+#endif
+#if uECC_VERIFY_G_TABLE
+    const uECC_word_t *G_wnaf;
+#endif
 };
 
 #if uECC_VLI_NATIVE_LITTLE_ENDIAN
@@ -958,20 +964,527 @@ static uECC_word_t regularize_k(const uECC_word_t *const k,
     return carry;
 }
 
-static uECC_word_t EccPoint_compute_public_key(uECC_word_t *result,
-        uECC_word_t *private_key,
+#if uECC_SUPPORTS_secp256k1
+#define EccPoint_a_is_zero(curve) ((curve) == &curve_secp256k1)
+#else
+#define EccPoint_a_is_zero(curve) 0
+#endif
+
+/* Double (X1, Y1, Z1) in place. Unlike curve->double_jacobian() this has no
+   data-dependent branch: M = 3 * x1^2 (a = 0) or 3 * (x1 - z1^2) * (x1 + z1^2) (a = -3),
+   S = 4 * x1 * y1^2, x3 = M^2 - 2S, y3 = M * (S - x3) - 8 * y1^4, z3 = 2 * y1 * z1. */
+static void EccPoint_jacobian_double(uECC_word_t *X1,
+                                     uECC_word_t *Y1,
+                                     uECC_word_t *Z1,
+                                     uECC_Curve curve)
+{
+    uECC_word_t t1[uECC_MAX_WORDS];
+    uECC_word_t t2[uECC_MAX_WORDS];
+    uECC_word_t t3[uECC_MAX_WORDS];
+    wordcount_t num_words = curve->num_words;
+
+    uECC_vli_modSquare_fast(t1, Y1, curve);                  /* t1 = y1^2 */
+    uECC_vli_modMult_fast(t2, X1, t1, curve);                /* t2 = x1*y1^2 */
+    uECC_vli_modAdd(t2, t2, t2, curve->p, num_words);        /* t2 = 2*x1*y1^2 */
+    uECC_vli_modAdd(t2, t2, t2, curve->p, num_words);        /* t2 = 4*x1*y1^2 = S */
+    uECC_vli_modSquare_fast(t1, t1, curve);                  /* t1 = y1^4 */
+    uECC_vli_modAdd(t1, t1, t1, curve->p, num_words);        /* t1 = 2*y1^4 */
+    uECC_vli_modAdd(t1, t1, t1, curve->p, num_words);        /* t1 = 4*y1^4 */
+    uECC_vli_modAdd(t1, t1, t1, curve->p, num_words);        /* t1 = 8*y1^4 */
+
+    if (EccPoint_a_is_zero(curve)) {
+        uECC_vli_modSquare_fast(t3, X1, curve);              /* t3 = x1^2 */
+        uECC_vli_modMult_fast(Z1, Y1, Z1, curve);            /* z3 = y1*z1 */
+    } else {
+        uECC_vli_modSquare_fast(t3, Z1, curve);              /* t3 = z1^2 */
+        uECC_vli_modMult_fast(Z1, Y1, Z1, curve);            /* z3 = y1*z1 */
+        uECC_vli_modAdd(Y1, X1, t3, curve->p, num_words);    /* Y1 = x1 + z1^2 */
+        uECC_vli_modSub(X1, X1, t3, curve->p, num_words);    /* X1 = x1 - z1^2 */
+        uECC_vli_modMult_fast(t3, X1, Y1, curve);            /* t3 = x1^2 - z1^4 */
+    }
+    uECC_vli_modAdd(Z1, Z1, Z1, curve->p, num_words);        /* z3 = 2*y1*z1 */
+    uECC_vli_modAdd(X1, t3, t3, curve->p, num_words);        /* X1 = 2*t3 */
+    uECC_vli_modAdd(t3, X1, t3, curve->p, num_words);        /* t3 = 3*t3 = M */
+
+    uECC_vli_modSquare_fast(X1, t3, curve);                  /* x3 = M^2 */
+    uECC_vli_modSub(X1, X1, t2, curve->p, num_words);
+    uECC_vli_modSub(X1, X1, t2, curve->p, num_words);        /* x3 = M^2 - 2S */
+    uECC_vli_modSub(t2, t2, X1, curve->p, num_words);        /* t2 = S - x3 */
+    uECC_vli_modMult_fast(Y1, t3, t2, curve);                /* y3 = M*(S - x3) */
+    uECC_vli_modSub(Y1, Y1, t1, curve->p, num_words);        /* y3 = M*(S - x3) - 8*y1^4 */
+}
+
+/* Add the affine point (x2, y2) to (X1, Y1, Z1) in place. Returns nonzero if both
+   points have the same x coordinate, which the formulas cannot handle. */
+static uECC_word_t EccPoint_jacobian_add(uECC_word_t *X1,
+        uECC_word_t *Y1,
+        uECC_word_t *Z1,
+        const uECC_word_t *x2,
+        const uECC_word_t *y2,
+        uECC_Curve curve)
+{
+    uECC_word_t t1[uECC_MAX_WORDS];
+    uECC_word_t t2[uECC_MAX_WORDS];
+    uECC_word_t t3[uECC_MAX_WORDS];
+    uECC_word_t degenerate;
+    wordcount_t num_words = curve->num_words;
+
+    uECC_vli_modSquare_fast(t1, Z1, curve);                  /* t1 = z1^2 */
+    uECC_vli_modMult_fast(t2, t1, Z1, curve);                /* t2 = z1^3 */
+    uECC_vli_modMult_fast(t1, t1, x2, curve);                /* t1 = x2*z1^2 */
+    uECC_vli_modMult_fast(t2, t2, y2, curve);                /* t2 = y2*z1^3 */
+    uECC_vli_modSub(t1, t1, X1, curve->p, num_words);        /* t1 = x2*z1^2 - x1 = H */
+    uECC_vli_modSub(t2, t2, Y1, curve->p, num_words);        /* t2 = y2*z1^3 - y1 = R */
+    degenerate = uECC_vli_isZero(t1, num_words);
+
+    uECC_vli_modMult_fast(Z1, Z1, t1, curve);                /* z3 = z1*H */
+    uECC_vli_modSquare_fast(t3, t1, curve);                  /* t3 = H^2 */
+    uECC_vli_modMult_fast(t1, t1, t3, curve);                /* t1 = H^3 */
+    uECC_vli_modMult_fast(t3, X1, t3, curve);                /* t3 = x1*H^2 = V */
+    uECC_vli_modSquare_fast(X1, t2, curve);                  /* x3 = R^2 */
+    uECC_vli_modSub(X1, X1, t1, curve->p, num_words);        /* x3 = R^2 - H^3 */
+    uECC_vli_modSub(X1, X1, t3, curve->p, num_words);
+    uECC_vli_modSub(X1, X1, t3, curve->p, num_words);        /* x3 = R^2 - H^3 - 2V */
+    uECC_vli_modSub(t3, t3, X1, curve->p, num_words);        /* t3 = V - x3 */
+    uECC_vli_modMult_fast(t3, t2, t3, curve);                /* t3 = R*(V - x3) */
+    uECC_vli_modMult_fast(t1, Y1, t1, curve);                /* t1 = y1*H^3 */
+    uECC_vli_modSub(Y1, t3, t1, curve->p, num_words);        /* y3 = R*(V - x3) - y1*H^3 */
+    return degenerate;
+}
+
+#define uECC_MAX_ODD_MULTIPLES 8
+
+/* Fills table with the affine points P, 3P, 5P, ..., (2 * count - 1)P. The running sum
+   stays in Jacobian coordinates and is normalized with a single inversion (Montgomery's
+   trick). Returns 0 if an addition was degenerate, i.e. point is not a valid curve point
+   of prime order. */
+static uECC_word_t EccPoint_odd_multiples(uECC_word_t *table,
+        const uECC_word_t *point,
+        wordcount_t count,
+        uECC_Curve curve)
+{
+    uECC_word_t X[uECC_MAX_WORDS];
+    uECC_word_t Y[uECC_MAX_WORDS];
+    uECC_word_t Z[uECC_MAX_ODD_MULTIPLES][uECC_MAX_WORDS];
+    uECC_word_t prod[uECC_MAX_ODD_MULTIPLES][uECC_MAX_WORDS];
+    uECC_word_t x2[uECC_MAX_WORDS];
+    uECC_word_t y2[uECC_MAX_WORDS];
+    uECC_word_t degenerate = 0;
+    wordcount_t i;
+    wordcount_t num_words = curve->num_words;
+
+    /* (x2, y2) = 2P in affine coordinates */
+    uECC_vli_set(x2, point, num_words);
+    uECC_vli_set(y2, point + num_words, num_words);
+    uECC_vli_clear(X, num_words);
+    X[0] = 1;
+    EccPoint_jacobian_double(x2, y2, X, curve);
+    uECC_vli_modInv(X, X, curve->p, num_words);
+    apply_z(x2, y2, X, curve);
+
+    uECC_vli_set(table, point, num_words * 2);
+    uECC_vli_set(X, point, num_words);
+    uECC_vli_set(Y, point + num_words, num_words);
+    uECC_vli_clear(Z[0], num_words);
+    Z[0][0] = 1;
+    uECC_vli_set(prod[0], Z[0], num_words);
+    for (i = 1; i < count; ++i) {
+        uECC_vli_set(Z[i], Z[i - 1], num_words);
+        degenerate |= EccPoint_jacobian_add(X, Y, Z[i], x2, y2, curve);
+        uECC_vli_set(table + i * num_words * 2, X, num_words);
+        uECC_vli_set(table + i * num_words * 2 + num_words, Y, num_words);
+        uECC_vli_modMult_fast(prod[i], prod[i - 1], Z[i], curve);
+    }
+
+    /* X = 1 / prod[i] while walking back */
+    uECC_vli_modInv(X, prod[count - 1], curve->p, num_words);
+    for (i = count - 1; i > 0; --i) {
+        uECC_word_t *entry = table + i * num_words * 2;
+        uECC_vli_modMult_fast(Y, X, prod[i - 1], curve); /* Y = 1 / Z[i] */
+        uECC_vli_modMult_fast(X, X, Z[i], curve);
+        apply_z(entry, entry + num_words, Y, curve);
+    }
+    return !degenerate;
+}
+
+/* Load table entry index (of count points) into (x, y), negated if negate is 1, reading
+   every entry so that the access pattern does not depend on the index. */
+static void EccPoint_select(uECC_word_t *x,
+                            uECC_word_t *y,
+                            const uECC_word_t *table,
+                            uint32_t count,
+                            uint32_t index,
+                            uECC_word_t negate,
+                            uECC_Curve curve)
+{
+    uECC_word_t neg[uECC_MAX_WORDS];
+    uECC_word_t mask;
+    uint32_t i;
+    wordcount_t j;
+    wordcount_t num_words = curve->num_words;
+
+    uECC_vli_clear(x, num_words);
+    uECC_vli_clear(y, num_words);
+    for (i = 0; i < count; ++i, table += num_words * 2) {
+        mask = (uECC_word_t)0 - (uECC_word_t)(((i ^ index) - 1) >> 31);
+        for (j = 0; j < num_words; ++j) {
+            x[j] |= table[j] & mask;
+            y[j] |= table[num_words + j] & mask;
+        }
+    }
+
+    uECC_vli_sub(neg, curve->p, y, num_words);
+    mask = (uECC_word_t)0 - negate;
+    for (j = 0; j < num_words; ++j) {
+        y[j] = (y[j] & ~mask) | (neg[j] & mask);
+    }
+}
+
+#if uECC_GENERATOR_COMB
+
+/* Computes result = scalar * G for scalar in [1, n - 1] with the signed fixed-base comb
+   of Hedabou, Pinel and Beneteau (also used by mbed TLS): the odd scalar is recoded into
+   uECC_COMB_SPACING + 1 odd signed digits of uECC_COMB_TEETH bits each, so that every
+   step is one doubling and one addition of a table point. Even scalars are handled as
+   n - scalar with the result negated.
+   The result is left in Jacobian coordinates (X, Y, Z).
+   Returns 0 if an addition hit two points with the same x coordinate (negligible for
+   secret scalars); the caller then has to fall back to EccPoint_mult(). */
+static uECC_word_t EccPoint_comb_jacobian(uECC_word_t *X,
+        uECC_word_t *Y,
+        uECC_word_t *Z,
+        const uECC_word_t *scalar,
         uECC_Curve curve)
+{
+    uECC_word_t k[uECC_MAX_WORDS];
+    uECC_word_t x[uECC_MAX_WORDS];
+    uECC_word_t y[uECC_MAX_WORDS];
+    uint8_t digits[uECC_COMB_SPACING + 1];
+    uint8_t c, cc, adjust;
+    uECC_word_t even, degenerate = 0;
+    bitcount_t i, bit;
+    wordcount_t j;
+    wordcount_t num_words = curve->num_words;
+    wordcount_t num_n_words = BITS_TO_WORDS(curve->num_n_bits);
+
+    /* k = scalar if odd, n - scalar if even */
+    uECC_vli_sub(k, curve->n, scalar, num_n_words);
+    even = (uECC_word_t)0 - ((scalar[0] & 1) ^ 1);
+    for (j = 0; j < num_n_words; ++j) {
+        k[j] = (scalar[j] & ~even) | (k[j] & even);
+    }
+
+    /* Column i of the comb holds bits i, i + spacing, i + 2 * spacing, ... */
+    for (i = 0; i < uECC_COMB_SPACING; ++i) {
+        digits[i] = 0;
+        for (j = 0; j < uECC_COMB_TEETH; ++j) {
+            bit = i + j * uECC_COMB_SPACING;
+            if (bit < curve->num_n_bits) {
+                digits[i] |= ((k[bit >> uECC_WORD_BITS_SHIFT] >>
+                               (bit & uECC_WORD_BITS_MASK)) & 1) << j;
+            }
+        }
+    }
+    digits[uECC_COMB_SPACING] = 0;
+
+    /* Make every digit odd: an even digit absorbs the one below it, which is negated
+       (bit 7), and the per-tooth carry moves up a column. digits[0] is odd as k is. */
+    c = 0;
+    for (i = 1; i <= uECC_COMB_SPACING; ++i) {
+        cc = digits[i] & c;
+        digits[i] ^= c;
+        c = cc;
+
+        adjust = 1 - (digits[i] & 0x01);
+        c |= digits[i] & (digits[i - 1] * adjust);
+        digits[i] ^= digits[i - 1] * adjust;
+        digits[i - 1] |= adjust << 7;
+    }
+
+    i = uECC_COMB_SPACING;
+    EccPoint_select(X, Y, curve->G_comb, uECC_COMB_POINTS,
+                    (digits[i] & 0x7f) >> 1, digits[i] >> 7, curve);
+    uECC_vli_clear(Z, num_words);
+    Z[0] = 1;
+    while (i-- > 0) {
+        EccPoint_jacobian_double(X, Y, Z, curve);
+        EccPoint_select(x, y, curve->G_comb, uECC_COMB_POINTS,
+                        (digits[i] & 0x7f) >> 1, digits[i] >> 7, curve);
+        degenerate |= EccPoint_jacobian_add(X, Y, Z, x, y, curve);
+    }
+
+    uECC_vli_sub(y, curve->p, Y, num_words);
+    for (j = 0; j < num_words; ++j) {
+        Y[j] = (Y[j] & ~even) | (y[j] & even);
+    }
+
+    uECC_vli_clear(k, num_n_words);
+    memset(digits, 0, sizeof(digits));
+    return !degenerate;
+}
+
+/* Computes result = scalar * G with the comb; see EccPoint_comb_jacobian(). */
+static uECC_word_t EccPoint_mult_comb(uECC_word_t *result,
+                                      const uECC_word_t *scalar,
+                                      uECC_Curve curve)
+{
+    uECC_word_t X[uECC_MAX_WORDS];
+    uECC_word_t Y[uECC_MAX_WORDS];
+    uECC_word_t Z[uECC_MAX_WORDS];
+    wordcount_t num_words = curve->num_words;
+
+    if (!EccPoint_comb_jacobian(X, Y, Z, scalar, curve)) {
+        return 0;
+    }
+
+    uECC_vli_modInv(Z, Z, curve->p, num_words);
+    apply_z(X, Y, Z, curve);
+
+    uECC_vli_set(result, X, num_words);
+    uECC_vli_set(result + num_words, Y, num_words);
+    return 1;
+}
+
+#endif /* uECC_GENERATOR_COMB */
+
+#if uECC_SECP256K1_GLV
+
+#define uECC_GLV_WINDOW 4
+#define uECC_GLV_POINTS (1 << (uECC_GLV_WINDOW - 1))
+/* |k1| and |k2| are below 2^128, plus one for making them odd */
+#define uECC_GLV_DIGITS ((129 + uECC_GLV_WINDOW - 1) / uECC_GLV_WINDOW)
+
+/* c = round(k * g / 2^384) */
+static void EccPoint_glv_round(uECC_word_t *c,
+                               const uECC_word_t *k,
+                               const uECC_word_t *g,
+                               uECC_Curve curve)
+{
+    uECC_word_t product[2 * uECC_MAX_WORDS];
+    uECC_word_t one[uECC_MAX_WORDS];
+    wordcount_t i;
+    wordcount_t num_words = curve->num_words;
+    wordcount_t shift = 384 / (uECC_WORD_SIZE * 8);
+
+    uECC_vli_mult(product, k, g, num_words);
+    for (i = 0; i < num_words; ++i) {
+        c[i] = (i + shift < 2 * num_words) ? product[i + shift] : 0;
+    }
+    uECC_vli_clear(one, num_words);
+    one[0] = !!uECC_vli_testBit(product, 383);
+    uECC_vli_add(c, c, one, num_words);
+}
+
+/* Replaces k by n - k if it is above n / 2 (so that it is below 2^128 after the split),
+   then adds 1 if it is even. Returns the negation flag in bit 0 and the skew flag in
+   bit 1. */
+static uECC_word_t EccPoint_glv_normalize(uECC_word_t *k, uECC_Curve curve)
+{
+    uECC_word_t half[uECC_MAX_WORDS];
+    uECC_word_t neg[uECC_MAX_WORDS];
+    uECC_word_t negate, even, mask;
+    wordcount_t j;
+    wordcount_t num_words = curve->num_words;
+
+    uECC_vli_set(half, curve->n, num_words);
+    uECC_vli_rshift1(half, num_words);
+    negate = uECC_vli_sub(half, half, k, num_words);
+    uECC_vli_sub(neg, curve->n, k, num_words);
+    mask = (uECC_word_t)0 - negate;
+    for (j = 0; j < num_words; ++j) {
+        k[j] = (k[j] & ~mask) | (neg[j] & mask);
+    }
+
+    even = (k[0] & 1) ^ 1;
+    uECC_vli_clear(half, num_words);
+    half[0] = even;
+    uECC_vli_add(k, k, half, num_words);
+    return negate | (even << 1);
+}
+
+/* Recodes the odd k < 2^(uECC_GLV_WINDOW * uECC_GLV_DIGITS) into odd signed digits with
+   k = sum of digits[i] * 2^(uECC_GLV_WINDOW * i). Digit i is 2 * b + 1 - 2^w for the w
+   bits b of k above bit w * i, and the top digit is positive, so there is no
+   data-dependent branch. */
+static void EccPoint_glv_recode(int8_t *digits, const uECC_word_t *k)
+{
+    bitcount_t i, j, bit;
+    int8_t b;
+
+    for (i = 0; i < uECC_GLV_DIGITS; ++i) {
+        b = 0;
+        for (j = 0; j < uECC_GLV_WINDOW; ++j) {
+            bit = i * uECC_GLV_WINDOW + 1 + j;
+            b |= (!!uECC_vli_testBit(k, bit)) << j;
+        }
+        digits[i] = 2 * b + 1 - (i < uECC_GLV_DIGITS - 1 ? 1 << uECC_GLV_WINDOW : 0);
+    }
+}
+
+/* Load the table point for the odd signed digit into (x, y), negated if negate is 1, and
+   mapped through the endomorphism (beta * x, y) if endo is set. */
+static void EccPoint_glv_select(uECC_word_t *x,
+                                uECC_word_t *y,
+                                const uECC_word_t *table,
+                                int8_t digit,
+                                uECC_word_t negate,
+                                uECC_word_t endo,
+                                uECC_Curve curve)
+{
+    uECC_word_t sign = (uint8_t)digit >> 7;
+    uint32_t index = (uint32_t)(((digit ^ -(int8_t)sign) + sign) >> 1);
+
+    EccPoint_select(x, y, table, uECC_GLV_POINTS, index, sign ^ negate, curve);
+    if (endo) {
+        uECC_vli_modMult_fast(x, x, curve_secp256k1_beta, curve);
+    }
+}
+
+/* Computes result = scalar * point on secp256k1 with the GLV endomorphism: the scalar is
+   split into k1 + k2 * lambda with halves of at most 128 bits, and both are processed
+   together with a fixed signed window, so that every step is uECC_GLV_WINDOW doublings
+   and two additions of masked table lookups. This halves the doublings of the ladder.
+   Returns 0 if an addition hit two points with the same x coordinate (negligible for
+   secret scalars, but also the case for a zero scalar); the caller then has to fall back
+   to EccPoint_mult(). */
+static uECC_word_t EccPoint_mult_glv(uECC_word_t *result,
+                                     const uECC_word_t *point,
+                                     const uECC_word_t *scalar,
+                                     const uECC_word_t *initial_Z,
+                                     uECC_Curve curve)
+{
+    uECC_word_t table[uECC_GLV_POINTS * uECC_MAX_WORDS * 2];
+    uECC_word_t k1[uECC_MAX_WORDS];
+    uECC_word_t k2[uECC_MAX_WORDS];
+    uECC_word_t t[uECC_MAX_WORDS];
+    uECC_word_t X[uECC_MAX_WORDS];
+    uECC_word_t Y[uECC_MAX_WORDS];
+    uECC_word_t Z[uECC_MAX_WORDS];
+    uECC_word_t X2[uECC_MAX_WORDS];
+    uECC_word_t Y2[uECC_MAX_WORDS];
+    uECC_word_t Z2[uECC_MAX_WORDS];
+    uECC_word_t x[uECC_MAX_WORDS];
+    uECC_word_t y[uECC_MAX_WORDS];
+    int8_t digits1[uECC_GLV_DIGITS];
+    int8_t digits2[uECC_GLV_DIGITS];
+    uECC_word_t flags1, flags2, mask, degenerate = 0;
+    bitcount_t i, j;
+    wordcount_t num_words = curve->num_words;
+
+    if (!EccPoint_odd_multiples(table, point, uECC_GLV_POINTS, curve)) {
+        return 0;
+    }
+
+    /* k = scalar mod n; k2 = -(c1 * b1 + c2 * b2), k1 = k - k2 * lambda */
+    mask = (uECC_word_t)0 - !uECC_vli_sub(t, scalar, curve->n, num_words);
+    for (j = 0; j < num_words; ++j) {
+        k1[j] = (scalar[j] & ~mask) | (t[j] & mask);
+    }
+    EccPoint_glv_round(X, k1, curve_secp256k1_g1, curve);
+    EccPoint_glv_round(Y, k1, curve_secp256k1_g2, curve);
+    uECC_vli_modMult(X, X, curve_secp256k1_minus_b1, curve->n, num_words);
+    uECC_vli_modMult(Y, Y, curve_secp256k1_minus_b2, curve->n, num_words);
+    uECC_vli_modAdd(k2, X, Y, curve->n, num_words);
+    uECC_vli_modMult(t, k2, curve_secp256k1_lambda, curve->n, num_words);
+    uECC_vli_modSub(k1, k1, t, curve->n, num_words);
+
+    flags1 = EccPoint_glv_normalize(k1, curve);
+    flags2 = EccPoint_glv_normalize(k2, curve);
+    EccPoint_glv_recode(digits1, k1);
+    EccPoint_glv_recode(digits2, k2);
+
+    i = uECC_GLV_DIGITS - 1;
+    EccPoint_glv_select(X, Y, table, digits1[i], flags1 & 1, 0, curve);
+    uECC_vli_clear(Z, num_words);
+    Z[0] = 1;
+    if (initial_Z) {
+        uECC_vli_set(Z, initial_Z, num_words);
+        apply_z(X, Y, Z, curve);
+    }
+    EccPoint_glv_select(x, y, table, digits2[i], flags2 & 1, 1, curve);
+    degenerate |= EccPoint_jacobian_add(X, Y, Z, x, y, curve);
+    while (i-- > 0) {
+        for (j = 0; j < uECC_GLV_WINDOW; ++j) {
+            EccPoint_jacobian_double(X, Y, Z, curve);
+        }
+        EccPoint_glv_select(x, y, table, digits1[i], flags1 & 1, 0, curve);
+        degenerate |= EccPoint_jacobian_add(X, Y, Z, x, y, curve);
+        EccPoint_glv_select(x, y, table, digits2[i], flags2 & 1, 1, curve);
+        degenerate |= EccPoint_jacobian_add(X, Y, Z, x, y, curve);
+    }
+
+    /* Take off the 1 added to an even half: always compute the addition of -P (or
+       -lambda * P), keep it only for the skewed half */
+    for (i = 0; i < 2; ++i) {
+        uECC_word_t flags = i ? flags2 : flags1;
+        uECC_vli_set(X2, X, num_words);
+        uECC_vli_set(Y2, Y, num_words);
+        uECC_vli_set(Z2, Z, num_words);
+        EccPoint_glv_select(x, y, table, -1, flags & 1, i, curve);
+        mask = (uECC_word_t)0 - (flags >> 1);
+        degenerate |= EccPoint_jacobian_add(X2, Y2, Z2, x, y, curve) & mask;
+        for (j = 0; j < num_words; ++j) {
+            X[j] = (X[j] & ~mask) | (X2[j] & mask);
+            Y[j] = (Y[j] & ~mask) | (Y2[j] & mask);
+            Z[j] = (Z[j] & ~mask) | (Z2[j] & mask);
+        }
+    }
+
+    uECC_vli_modInv(Z, Z, curve->p, num_words);
+    apply_z(X, Y, Z, curve);
+    uECC_vli_set(result, X, num_words);
+    uECC_vli_set(result + num_words, Y, num_words);
+
+    uECC_vli_clear(k1, num_words);
+    uECC_vli_clear(k2, num_words);
+    memset(digits1, 0, sizeof(digits1));
+    memset(digits2, 0, sizeof(digits2));
+    return !degenerate;
+}
+
+#endif /* uECC_SECP256K1_GLV */
+
+/* Computes result = scalar * point in constant time, with the GLV endomorphism on
+   secp256k1 and the Montgomery ladder otherwise. initial_Z, if not 0, randomizes the
+   projective coordinates. */
+static void EccPoint_mult_secret(uECC_word_t *result,
+                                 const uECC_word_t *point,
+                                 const uECC_word_t *scalar,
+                                 const uECC_word_t *initial_Z,
+                                 uECC_Curve curve)
 {
     uECC_word_t tmp1[uECC_MAX_WORDS];
     uECC_word_t tmp2[uECC_MAX_WORDS];
     uECC_word_t *p2[2] = {tmp1, tmp2};
     uECC_word_t carry;
 
+#if uECC_SECP256K1_GLV
+    if (curve == &curve_secp256k1 &&
+            EccPoint_mult_glv(result, point, scalar, initial_Z, curve)) {
+        return;
+    }
+#endif
+
     /* Regularize the bitcount for the private key so that attackers cannot use a side channel
        attack to learn the number of leading zeros. */
-    carry = regularize_k(private_key, tmp1, tmp2, curve);
+    carry = regularize_k(scalar, tmp1, tmp2, curve);
 
-    EccPoint_mult(result, curve->G, p2[!carry], 0, curve->num_n_bits + 1, curve);
+    EccPoint_mult(result, point, p2[!carry], initial_Z, curve->num_n_bits + 1, curve);
+}
+
+/* Computes result = scalar * G for scalar in [1, n - 1]. Returns 0 if the result is the
+   point at infinity. */
+static uECC_word_t EccPoint_mult_G(uECC_word_t *result,
+                                   const uECC_word_t *scalar,
+                                   uECC_Curve curve)
+{
+#if uECC_GENERATOR_COMB
+    if (curve->G_comb && EccPoint_mult_comb(result, scalar, curve)) {
+        return !EccPoint_isZero(result, curve);
+    }
+#endif
+
+    EccPoint_mult_secret(result, curve->G, scalar, 0, curve);
 
     if (EccPoint_isZero(result, curve)) {
         return 0;
@@ -979,6 +1492,40 @@ static uECC_word_t EccPoint_compute_public_key(uECC_word_t *result,
     return 1;
 }
 
+/* Computes scalar * G for scalar in [1, n - 1] in Jacobian coordinates, leaving the
+   inversion of Z to the caller. Returns 0 if the result is the point at infinity. */
+static uECC_word_t EccPoint_mult_G_jacobian(uECC_word_t *X,
+        uECC_word_t *Y,
+        uECC_word_t *Z,
+        const uECC_word_t *scalar,
+        uECC_Curve curve)
+{
+    uECC_word_t point[uECC_MAX_WORDS * 2];
+    wordcount_t num_words = curve->num_words;
+
+#if uECC_GENERATOR_COMB
+    if (curve->G_comb && EccPoint_comb_jacobian(X, Y, Z, scalar, curve)) {
+        return !uECC_vli_isZero(Z, num_words);
+    }
+#endif
+
+    if (!EccPoint_mult_G(point, scalar, curve)) {
+        return 0;
+    }
+    uECC_vli_set(X, point, num_words);
+    uECC_vli_set(Y, point + num_words, num_words);
+    uECC_vli_clear(Z, num_words);
+    Z[0] = 1;
+    return 1;
+}
+
+static uECC_word_t EccPoint_compute_public_key(uECC_word_t *result,
+        uECC_word_t *private_key,
+        uECC_Curve curve)
+{
+    return EccPoint_mult_G(result, private_key, curve);
+}
+
 #if uECC_WORD_SIZE == 1
 
 uECC_VLI_API void uECC_vli_nativeToBytes(uint8_t *bytes,
@@ -1094,9 +1641,7 @@ int uECC_shared_secret(const uint8_t *public_key,
     uECC_word_t _private[uECC_MAX_WORDS];
 
     uECC_word_t tmp[uECC_MAX_WORDS];
-    uECC_word_t *p2[2] = {_private, tmp};
     uECC_word_t *initial_Z = 0;
-    uECC_word_t carry;
     wordcount_t num_words = curve->num_words;
     wordcount_t num_bytes = curve->num_bytes;
 
@@ -1109,20 +1654,17 @@ int uECC_shared_secret(const uint8_t *public_key,
     uECC_vli_bytesToNative(_public + num_words, public_key + num_bytes, num_bytes);
 #endif
 
-    /* Regularize the bitcount for the private key so that attackers cannot use a side channel
-       attack to learn the number of leading zeros. */
-    carry = regularize_k(_private, _private, tmp, curve);
-
     /* If an RNG function was specified, try to get a random initial Z value to improve
        protection against side-channel attacks. */
     if (g_rng_function) {
-        if (!uECC_generate_random_int(p2[carry], curve->p, num_words)) {
+        if (!uECC_generate_random_int(tmp, curve->p, num_words)) {
             return 0;
         }
-        initial_Z = p2[carry];
+        initial_Z = tmp;
     }
 
-    EccPoint_mult(_public, _public, p2[!carry], initial_Z, curve->num_n_bits + 1, curve);
+    EccPoint_mult_secret(_public, _public, _private, initial_Z, curve);
+    uECC_vli_clear(_private, num_words);
 #if uECC_VLI_NATIVE_LITTLE_ENDIAN
     bcopy((uint8_t *) secret, (uint8_t *) _public, num_bytes);
 #else
@@ -1291,37 +1833,49 @@ static void bits2int(uECC_word_t *native,
     }
 }
 
+/* Returns the recovery id of R: the parity of its y coordinate, plus 2 if its x
+   coordinate is not below n. */
+static uint8_t EccPoint_recid(const uECC_word_t *x, const uECC_word_t *y,
+                              uECC_Curve curve)
+{
+    uint8_t recid = y[0] & 0x01;
+    if (curve->num_n_bits <= curve->num_bytes * 8 &&
+            uECC_vli_cmp_unsafe(curve->n, x, curve->num_words) != 1) {
+        recid |= 0x02;
+    }
+    return recid;
+}
+
 static int uECC_sign_with_k(const uint8_t *private_key,
                             const uint8_t *message_hash,
                             unsigned hash_size,
                             uECC_word_t *k,
                             uint8_t *signature,
+                            uint8_t *recid,
                             uECC_Curve curve)
 {
 
     uECC_word_t tmp[uECC_MAX_WORDS];
     uECC_word_t s[uECC_MAX_WORDS];
-    uECC_word_t *k2[2] = {tmp, s};
 #if uECC_VLI_NATIVE_LITTLE_ENDIAN
     uECC_word_t *p = (uECC_word_t *)signature;
 #else
     uECC_word_t p[uECC_MAX_WORDS * 2];
 #endif
-    uECC_word_t carry;
     wordcount_t num_words = curve->num_words;
     wordcount_t num_n_words = BITS_TO_WORDS(curve->num_n_bits);
-    bitcount_t num_n_bits = curve->num_n_bits;
 
     /* Make sure 0 < k < curve_n */
     if (uECC_vli_isZero(k, num_words) || uECC_vli_cmp(curve->n, k, num_n_words) != 1) {
         return 0;
     }
 
-    carry = regularize_k(k, tmp, s, curve);
-    EccPoint_mult(p, curve->G, k2[!carry], 0, num_n_bits + 1, curve);
-    if (uECC_vli_isZero(p, num_words)) {
+    if (!EccPoint_mult_G(p, k, curve)) {
         return 0;
     }
+    if (recid) {
+        *recid = EccPoint_recid(p, p + num_words, curve);
+    }
 
     /* If an RNG function was specified, get a random number
        to prevent side channel analysis of k. */
@@ -1370,6 +1924,7 @@ int uECC_sign(const uint8_t *private_key,
               const uint8_t *message_hash,
               unsigned hash_size,
               uint8_t *signature,
+              uint8_t *recid,
               uECC_Curve curve)
 {
     uECC_word_t k[uECC_MAX_WORDS];
@@ -1380,7 +1935,8 @@ int uECC_sign(const uint8_t *private_key,
             return 0;
         }
 
-        if (uECC_sign_with_k(private_key, message_hash, hash_size, k, signature, curve)) {
+        if (uECC_sign_with_k(private_key, message_hash, hash_size, k, signature, recid,
+                             curve)) {
             return 1;
         }
     }
@@ -1451,6 +2007,7 @@ int uECC_sign_deterministic(const uint8_t *private_key,
                             unsigned hash_size,
                             uECC_HashContext *hash_context,
                             uint8_t *signature,
+                            uint8_t *recid,
                             uECC_Curve curve)
 {
 
@@ -1463,12 +2020,154 @@ int uECC_sign_deterministic(const uint8_t *private_key,
 
     uECC_vli_bytesToNative(_secret, secret, curve->num_bytes);
 
-    if (uECC_sign_with_k(private_key, message_hash, hash_size, _secret, signature, curve)) {
+    if (uECC_sign_with_k(private_key, message_hash, hash_size, _secret, signature, recid,
+                         curve)) {
         return 1;
     }
     return 0;
 }
 
+/* Signs count hashes with one private key each, producing the same signatures as
+   uECC_sign_deterministic(). The signatures are made in groups of up to uECC_SIGN_BATCH
+   that share a single inversion of the Z coordinates of R = k * G mod p and a single
+   (blinded) inversion of the nonces mod n, using Montgomery's trick. */
+int uECC_sign_deterministic_batch(const uint8_t *private_keys,
+                                  const uint8_t *message_hashes,
+                                  unsigned hash_size,
+                                  unsigned count,
+                                  uECC_HashContext *hash_context,
+                                  uint8_t *signatures,
+                                  uint8_t *recids,
+                                  uECC_Curve curve)
+{
+    uECC_word_t k[uECC_SIGN_BATCH][uECC_MAX_WORDS];
+    uECC_word_t X[uECC_SIGN_BATCH][uECC_MAX_WORDS];
+    uECC_word_t Y[uECC_SIGN_BATCH][uECC_MAX_WORDS];
+    uECC_word_t Z[uECC_SIGN_BATCH][uECC_MAX_WORDS];
+    uECC_word_t prod[uECC_SIGN_BATCH][uECC_MAX_WORDS];
+    uECC_word_t inv[uECC_MAX_WORDS];
+    uECC_word_t tmp[uECC_MAX_WORDS];
+    uECC_word_t s[uECC_MAX_WORDS];
+    const uint8_t *private_key;
+    const uint8_t *message_hash;
+    uint8_t *signature;
+    unsigned base, batch, i;
+    int ok = 0;
+    wordcount_t num_words = curve->num_words;
+    wordcount_t num_n_words = BITS_TO_WORDS(curve->num_n_bits);
+    unsigned num_n_bytes = BITS_TO_BYTES(curve->num_n_bits);
+
+    for (base = 0; base < count; base += batch) {
+        batch = count - base;
+        if (batch > uECC_SIGN_BATCH) {
+            batch = uECC_SIGN_BATCH;
+        }
+
+        /* R_i = k_i * G, with the running products of Z_i and k_i */
+        for (i = 0; i < batch; ++i) {
+            private_key = private_keys + (base + i) * num_n_bytes;
+            message_hash = message_hashes + (base + i) * hash_size;
+            uECC_generate_k_rfc6979(hash_context->tmp, private_key,
+                                    message_hash, hash_size,
+                                    hash_context, curve);
+            uECC_vli_bytesToNative(k[i], hash_context->tmp, curve->num_bytes);
+
+            /* Make sure 0 < k < curve_n */
+            if (uECC_vli_isZero(k[i], num_words) ||
+                    uECC_vli_cmp(curve->n, k[i], num_n_words) != 1) {
+                goto out;
+            }
+            if (!EccPoint_mult_G_jacobian(X[i], Y[i], Z[i], k[i], curve)) {
+                goto out;
+            }
+
+            if (i == 0) {
+                uECC_vli_set(prod[0], Z[0], num_words);
+            } else {
+                uECC_vli_modMult_fast(prod[i], prod[i - 1], Z[i], curve);
+            }
+        }
+
+        /* (x_i, y_i) = (X_i / Z_i^2, Y_i / Z_i^3) */
+        uECC_vli_modInv(inv, prod[batch - 1], curve->p, num_words);
+        for (i = batch; i-- > 0;) {
+            if (i > 0) {
+                uECC_vli_modMult_fast(tmp, inv, prod[i - 1], curve);
+                uECC_vli_modMult_fast(inv, inv, Z[i], curve);
+            } else {
+                uECC_vli_set(tmp, inv, num_words);
+            }
+            apply_z(X[i], Y[i], tmp, curve);
+        }
+
+        uECC_vli_set(prod[0], k[0], num_n_words);
+        for (i = 1; i < batch; ++i) {
+            uECC_vli_modMult(prod[i], prod[i - 1], k[i], curve->n, num_n_words);
+        }
+
+        /* If an RNG function was specified, get a random number
+           to prevent side channel analysis of k. */
+        if (!g_rng_function) {
+            uECC_vli_clear(tmp, num_n_words);
+            tmp[0] = 1;
+        } else if (!uECC_generate_random_int(tmp, curve->n, num_n_words)) {
+            goto out;
+        }
+
+        /* 1 / k_i, premultiplying the product by a random number */
+        uECC_vli_modMult(inv, prod[batch - 1], tmp, curve->n, num_n_words);
+        uECC_vli_modInv(inv, inv, curve->n, num_n_words);
+        uECC_vli_modMult(inv, inv, tmp, curve->n, num_n_words);
+        for (i = batch - 1; i > 0; --i) {
+            uECC_vli_modMult(tmp, inv, prod[i - 1], curve->n, num_n_words);
+            uECC_vli_modMult(inv, inv, k[i], curve->n, num_n_words);
+            uECC_vli_set(k[i], tmp, num_n_words);
+        }
+        uECC_vli_set(k[0], inv, num_n_words);
+
+        for (i = 0; i < batch; ++i) {
+            private_key = private_keys + (base + i) * num_n_bytes;
+            message_hash = message_hashes + (base + i) * hash_size;
+            signature = signatures + (base + i) * curve->num_bytes * 2;
+
+#if uECC_VLI_NATIVE_LITTLE_ENDIAN
+            bcopy((uint8_t *) tmp, private_key, num_n_bytes);
+#else
+            uECC_vli_bytesToNative(tmp, private_key, num_n_bytes); /* tmp = d */
+#endif
+
+            s[num_n_words - 1] = 0;
+            uECC_vli_set(s, X[i], num_words);
+            uECC_vli_modMult(s, tmp, s, curve->n, num_n_words); /* s = r*d */
+
+            bits2int(tmp, message_hash, hash_size, curve);
+            uECC_vli_modAdd(s, tmp, s, curve->n, num_n_words); /* s = e + r*d */
+            uECC_vli_modMult(s, s, k[i], curve->n, num_n_words);  /* s = (e + r*d) / k */
+            if (uECC_vli_numBits(s, num_n_words) > (bitcount_t)curve->num_bytes * 8) {
+                goto out;
+            }
+#if uECC_VLI_NATIVE_LITTLE_ENDIAN
+            bcopy(signature, (uint8_t *) X[i], curve->num_bytes);
+            bcopy(signature + curve->num_bytes, (uint8_t *) s, curve->num_bytes);
+#else
+            uECC_vli_nativeToBytes(signature, curve->num_bytes, X[i]); /* store r */
+            uECC_vli_nativeToBytes(signature + curve->num_bytes, curve->num_bytes, s);
+#endif
+            if (recids) {
+                recids[base + i] = EccPoint_recid(X[i], Y[i], curve);
+            }
+        }
+    }
+    ok = 1;
+
+out:
+    memset(k, 0, sizeof(k));
+    memset(prod, 0, sizeof(prod));
+    uECC_vli_clear(inv, num_words);
+    uECC_vli_clear(tmp, num_words);
+    return ok;
+}
+
 int uECC_normalize_signature(uint8_t *signature,
                              uECC_Curve curve)
 {
@@ -1576,6 +2275,148 @@ static bitcount_t smax(bitcount_t a, bitcount_t b)
     return (a > b ? a : b);
 }
 
+#define uECC_WNAF_WINDOW 4
+#define uECC_WNAF_POINTS (1 << (uECC_WNAF_WINDOW - 2))
+#define uECC_WNAF_MAX_DIGITS (uECC_MAX_WORDS * uECC_WORD_SIZE * 8 + 1)
+
+/* Recodes the public scalar into width-w NAF (one signed digit per bit, every nonzero
+   digit odd and below 2^(w - 1) in magnitude, followed by at least w - 1 zeros).
+   Returns the number of digits up to the most significant nonzero one. Variable time. */
+static bitcount_t EccPoint_wnaf(int8_t *naf,
+                                const uECC_word_t *scalar,
+                                uint8_t w,
+                                uECC_Curve curve)
+{
+    bitcount_t num_bits = curve->num_n_bits;
+    bitcount_t bit = 0, len = 0, i;
+    int8_t carry = 0, digit;
+
+    memset(naf, 0, num_bits + 1);
+    while (bit < num_bits) {
+        if ((!!uECC_vli_testBit(scalar, bit)) == carry) {
+            ++bit;
+            continue;
+        }
+        digit = carry;
+        for (i = 0; i < w && bit + i < num_bits; ++i) {
+            digit += (!!uECC_vli_testBit(scalar, bit + i)) << i;
+        }
+        carry = (digit >> (w - 1)) & 1;
+        naf[bit] = digit - (carry << w);
+        len = bit + 1;
+        bit += w;
+    }
+    if (carry) {
+        naf[num_bits] = 1;
+        return num_bits + 1;
+    }
+    return len;
+}
+
+/* Adds the table point for the odd wNAF digit to (X1, Y1, Z1), where z1 = 0 is the point
+   at infinity. Unlike EccPoint_jacobian_add() this handles doubling and P - P, so it is
+   for public data only. */
+static void EccPoint_add_digit(uECC_word_t *X1,
+                               uECC_word_t *Y1,
+                               uECC_word_t *Z1,
+                               const uECC_word_t *table,
+                               int8_t digit,
+                               uECC_Curve curve)
+{
+    uECC_word_t X[uECC_MAX_WORDS];
+    uECC_word_t Y[uECC_MAX_WORDS];
+    uECC_word_t Z[uECC_MAX_WORDS];
+    uECC_word_t y2[uECC_MAX_WORDS];
+    const uECC_word_t *x2;
+    wordcount_t num_words = curve->num_words;
+
+    x2 = table + ((digit < 0 ? -digit : digit) >> 1) * num_words * 2;
+    if (digit < 0) {
+        uECC_vli_sub(y2, curve->p, x2 + num_words, num_words);
+    } else {
+        uECC_vli_set(y2, x2 + num_words, num_words);
+    }
+
+    if (uECC_vli_isZero(Z1, num_words)) {
+        uECC_vli_set(X1, x2, num_words);
+        uECC_vli_set(Y1, y2, num_words);
+        uECC_vli_clear(Z1, num_words);
+        Z1[0] = 1;
+        return;
+    }
+
+    uECC_vli_set(X, X1, num_words);
+    uECC_vli_set(Y, Y1, num_words);
+    uECC_vli_set(Z, Z1, num_words);
+    if (!EccPoint_jacobian_add(X1, Y1, Z1, x2, y2, curve)) {
+        return;
+    }
+
+    /* Same x coordinate: the sum is 2 * (x2, y2) if y1 = y2 * z1^3, else infinity
+       (z1 is already 0 then). */
+    uECC_vli_modSquare_fast(X1, Z, curve);
+    uECC_vli_modMult_fast(X1, X1, Z, curve);
+    uECC_vli_modMult_fast(X1, X1, y2, curve);
+    if (uECC_vli_equal(X1, Y, num_words)) {
+        uECC_vli_set(X1, x2, num_words);
+        uECC_vli_set(Y1, y2, num_words);
+        uECC_vli_clear(Z1, num_words);
+        Z1[0] = 1;
+        EccPoint_jacobian_double(X1, Y1, Z1, curve);
+    }
+}
+
+/* Computes (X, Y, Z) = u1 * G + u2 * Q in Jacobian coordinates, in variable time, with
+   interleaved wNAF. Returns 0 if the odd multiples of Q could not be computed. */
+static uECC_word_t EccPoint_mult_double(uECC_word_t *X,
+                                        uECC_word_t *Y,
+                                        uECC_word_t *Z,
+                                        const uECC_word_t *u1,
+                                        const uECC_word_t *u2,
+                                        const uECC_word_t *Q,
+                                        uECC_Curve curve)
+{
+    uECC_word_t Q_table[uECC_WNAF_POINTS * uECC_MAX_WORDS * 2];
+    uECC_word_t G_table[uECC_WNAF_POINTS * uECC_MAX_WORDS * 2];
+    const uECC_word_t *G_odd = G_table;
+    uint8_t G_window = uECC_WNAF_WINDOW;
+    int8_t naf1[uECC_WNAF_MAX_DIGITS];
+    int8_t naf2[uECC_WNAF_MAX_DIGITS];
+    bitcount_t i;
+    wordcount_t num_words = curve->num_words;
+
+    /* Odd multiples of Q and G for the wNAF digits */
+    if (!EccPoint_odd_multiples(Q_table, Q, uECC_WNAF_POINTS, curve)) {
+        return 0;
+    }
+#if uECC_VERIFY_G_TABLE
+    if (curve->G_wnaf) {
+        G_odd = curve->G_wnaf;
+        G_window = uECC_WNAF_G_WINDOW;
+    }
+#endif
+    if (G_odd == G_table) {
+        EccPoint_odd_multiples(G_table, curve->G, uECC_WNAF_POINTS, curve);
+    }
+
+    /* Starting from the point at infinity */
+    i = smax(EccPoint_wnaf(naf1, u1, G_window, curve),
+             EccPoint_wnaf(naf2, u2, uECC_WNAF_WINDOW, curve));
+    uECC_vli_clear(X, num_words);
+    uECC_vli_clear(Y, num_words);
+    uECC_vli_clear(Z, num_words);
+    while (i-- > 0) {
+        EccPoint_jacobian_double(X, Y, Z, curve);
+        if (naf1[i]) {
+            EccPoint_add_digit(X, Y, Z, G_odd, naf1[i], curve);
+        }
+        if (naf2[i]) {
+            EccPoint_add_digit(X, Y, Z, Q_table, naf2[i], curve);
+        }
+    }
+    return 1;
+}
+
 int uECC_verify(const uint8_t *public_key,
                 const uint8_t *message_hash,
                 unsigned hash_size,
@@ -1584,16 +2425,9 @@ int uECC_verify(const uint8_t *public_key,
 {
     uECC_word_t u1[uECC_MAX_WORDS], u2[uECC_MAX_WORDS];
     uECC_word_t z[uECC_MAX_WORDS];
-    uECC_word_t sum[uECC_MAX_WORDS * 2];
-    uECC_word_t rx[uECC_MAX_WORDS];
-    uECC_word_t ry[uECC_MAX_WORDS];
-    uECC_word_t tx[uECC_MAX_WORDS];
-    uECC_word_t ty[uECC_MAX_WORDS];
-    uECC_word_t tz[uECC_MAX_WORDS];
-    const uECC_word_t *points[4];
-    const uECC_word_t *point;
-    bitcount_t num_bits;
-    bitcount_t i;
+    uECC_word_t X[uECC_MAX_WORDS];
+    uECC_word_t Y[uECC_MAX_WORDS];
+    uECC_word_t Z[uECC_MAX_WORDS];
 #if uECC_VLI_NATIVE_LITTLE_ENDIAN
     uECC_word_t *_public = (uECC_word_t *)public_key;
 #else
@@ -1603,7 +2437,6 @@ int uECC_verify(const uint8_t *public_key,
     wordcount_t num_words = curve->num_words;
     wordcount_t num_n_words = BITS_TO_WORDS(curve->num_n_bits);
 
-    rx[num_n_words - 1] = 0;
     r[num_n_words - 1] = 0;
     s[num_n_words - 1] = 0;
 
@@ -1636,57 +2469,119 @@ int uECC_verify(const uint8_t *public_key,
     uECC_vli_modMult(u1, u1, z, curve->n, num_n_words); /* u1 = e/s */
     uECC_vli_modMult(u2, r, z, curve->n, num_n_words); /* u2 = r/s */
 
-    /* Calculate sum = G + Q. */
-    uECC_vli_set(sum, _public, num_words);
-    uECC_vli_set(sum + num_words, _public + num_words, num_words);
-    uECC_vli_set(tx, curve->G, num_words);
-    uECC_vli_set(ty, curve->G + num_words, num_words);
-    uECC_vli_modSub(z, sum, tx, curve->p, num_words); /* z = x2 - x1 */
-    XYcZ_add(tx, ty, sum, sum + num_words, curve);
-    uECC_vli_modInv(z, z, curve->p, num_words); /* z = 1/z */
-    apply_z(sum, sum + num_words, z, curve);
-
-    /* Use Shamir's trick to calculate u1*G + u2*Q */
-    points[0] = 0;
-    points[1] = curve->G;
-    points[2] = _public;
-    points[3] = sum;
-    num_bits = smax(uECC_vli_numBits(u1, num_n_words),
-                    uECC_vli_numBits(u2, num_n_words));
-
-    point = points[(!!uECC_vli_testBit(u1, num_bits - 1)) | ((!!uECC_vli_testBit(u2,
-                                                          num_bits - 1)) << 1)];
-    uECC_vli_set(rx, point, num_words);
-    uECC_vli_set(ry, point + num_words, num_words);
-    uECC_vli_clear(z, num_words);
-    z[0] = 1;
-
-    for (i = num_bits - 2; i >= 0; --i) {
-        uECC_word_t idx;
-        curve->double_jacobian(rx, ry, z, curve);
-
-        idx = (!!uECC_vli_testBit(u1, i)) | ((!!uECC_vli_testBit(u2, i)) << 1);
-        point = points[idx];
-        if (point) {
-            uECC_vli_set(tx, point, num_words);
-            uECC_vli_set(ty, point + num_words, num_words);
-            apply_z(tx, ty, z, curve);
-            uECC_vli_modSub(tz, rx, tx, curve->p, num_words); /* Z = x2 - x1 */
-            XYcZ_add(tx, ty, rx, ry, curve);
-            uECC_vli_modMult_fast(z, z, tz, curve);
+    /* Calculate u1*G + u2*Q */
+    if (!EccPoint_mult_double(X, Y, Z, u1, u2, _public, curve) ||
+            uECC_vli_isZero(Z, num_words)) {
+        return 0;
+    }
+
+    /* Accept only if x1 = X / Z^2 is r, or r + n when that is below p (x1 mod n == r).
+       Comparing X with r * Z^2 avoids the inversion. */
+    uECC_vli_modSquare_fast(Z, Z, curve);
+    if (uECC_vli_cmp_unsafe(curve->p, r, num_words) == 1) {
+        uECC_vli_modMult_fast(z, r, Z, curve);
+        if (uECC_vli_equal(z, X, num_words)) {
+            return 1;
         }
     }
+    if (curve->num_n_bits <= curve->num_bytes * 8 &&
+            !uECC_vli_add(z, r, curve->n, num_words) &&
+            uECC_vli_cmp_unsafe(curve->p, z, num_words) == 1) {
+        uECC_vli_modMult_fast(z, z, Z, curve);
+        return (int)(uECC_vli_equal(z, X, num_words));
+    }
+    return 0;
+}
 
-    uECC_vli_modInv(z, z, curve->p, num_words); /* Z = 1/Z */
-    apply_z(rx, ry, z, curve);
+int uECC_recover_public_key(const uint8_t *signature,
+                            const uint8_t *message_hash,
+                            unsigned hash_size,
+                            uint8_t recid,
+                            uint8_t *public_key,
+                            uECC_Curve curve)
+{
+    uECC_word_t u1[uECC_MAX_WORDS], u2[uECC_MAX_WORDS];
+    uECC_word_t z[uECC_MAX_WORDS];
+    uECC_word_t R[uECC_MAX_WORDS * 2];
+    uECC_word_t X[uECC_MAX_WORDS];
+    uECC_word_t Y[uECC_MAX_WORDS];
+    uECC_word_t Z[uECC_MAX_WORDS];
+    uECC_word_t r[uECC_MAX_WORDS], s[uECC_MAX_WORDS];
+    wordcount_t num_words = curve->num_words;
+    wordcount_t num_n_words = BITS_TO_WORDS(curve->num_n_bits);
 
-    /* v = x1 (mod n) */
-    if (uECC_vli_cmp_unsafe(curve->n, rx, num_n_words) != 1) {
-        uECC_vli_sub(rx, rx, curve->n, num_n_words);
+    if (recid > 3) {
+        return 0;
     }
 
-    /* Accept only if v == r. */
-    return (int)(uECC_vli_equal(rx, r, num_words));
+    r[num_n_words - 1] = 0;
+    s[num_n_words - 1] = 0;
+
+#if uECC_VLI_NATIVE_LITTLE_ENDIAN
+    bcopy((uint8_t *) r, signature, curve->num_bytes);
+    bcopy((uint8_t *) s, signature + curve->num_bytes, curve->num_bytes);
+#else
+    uECC_vli_bytesToNative(r, signature, curve->num_bytes);
+    uECC_vli_bytesToNative(s, signature + curve->num_bytes, curve->num_bytes);
+#endif
+
+    /* r, s must not be 0. */
+    if (uECC_vli_isZero(r, num_words) || uECC_vli_isZero(s, num_words)) {
+        return 0;
+    }
+
+    /* r, s must be < n. */
+    if (uECC_vli_cmp_unsafe(curve->n, r, num_n_words) != 1 ||
+            uECC_vli_cmp_unsafe(curve->n, s, num_n_words) != 1) {
+        return 0;
+    }
+
+    /* R = (r or r + n, y) with the parity of y given by the recovery id */
+    uECC_vli_set(R, r, num_words);
+    if (recid & 0x02) {
+        if (curve->num_n_bits > curve->num_bytes * 8 ||
+                uECC_vli_add(R, r, curve->n, num_words)) {
+            return 0;
+        }
+    }
+    if (uECC_vli_cmp_unsafe(curve->p, R, num_words) != 1) {
+        return 0;
+    }
+    curve->x_side(R + num_words, R, curve);
+    curve->mod_sqrt(R + num_words, curve);
+    if ((R[num_words] & 0x01) != (recid & 0x01)) {
+        uECC_vli_sub(R + num_words, curve->p, R + num_words, num_words);
+    }
+    /* x has no square root if it is not on the curve */
+    if (!uECC_valid_point(R, curve)) {
+        return 0;
+    }
+
+    /* Q = (s * R - e * G) / r */
+    uECC_vli_modInv(z, r, curve->n, num_n_words); /* z = 1/r */
+    u1[num_n_words - 1] = 0;
+    bits2int(u1, message_hash, hash_size, curve);
+    uECC_vli_modMult(u1, u1, z, curve->n, num_n_words); /* u1 = e/r */
+    if (!uECC_vli_isZero(u1, num_n_words)) {
+        uECC_vli_sub(u1, curve->n, u1, num_n_words); /* u1 = -e/r */
+    }
+    uECC_vli_modMult(u2, s, z, curve->n, num_n_words); /* u2 = s/r */
+
+    if (!EccPoint_mult_double(X, Y, Z, u1, u2, R, curve) ||
+            uECC_vli_isZero(Z, num_words)) {
+        return 0;
+    }
+    uECC_vli_modInv(Z, Z, curve->p, num_words);
+    apply_z(X, Y, Z, curve);
+
+#if uECC_VLI_NATIVE_LITTLE_ENDIAN
+    bcopy(public_key, (uint8_t *) X, curve->num_bytes);
+    bcopy(public_key + curve->num_bytes, (uint8_t *) Y, curve->num_bytes);
+#else
+    uECC_vli_nativeToBytes(public_key, curve->num_bytes, X);
+    uECC_vli_nativeToBytes(public_key + curve->num_bytes, curve->num_bytes, Y);
+#endif
+    return 1;
 }
 
 #if uECC_ENABLE_VLI_API
@@ -1762,12 +2657,7 @@ void uECC_point_mult(uECC_word_t *result,
                      const uECC_word_t *scalar,
                      uECC_Curve curve)
 {
-    uECC_word_t tmp1[uECC_MAX_WORDS];
-    uECC_word_t tmp2[uECC_MAX_WORDS];
-    uECC_word_t *p2[2] = {tmp1, tmp2};
-    uECC_word_t carry = regularize_k(scalar, tmp1, tmp2, curve);
-
-    EccPoint_mult(result, point, p2[!carry], 0, curve->num_n_bits + 1, curve);
+    EccPoint_mult_secret(result, point, scalar, 0, curve);
 }
 
 #endif /* uECC_ENABLE_VLI_API */
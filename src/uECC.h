@@ -75,6 +75,36 @@ If enable another curve, must add `half_n` (half the order n) constant to curve-
 #define uECC_SUPPORT_COMPRESSED_POINT 1
 #endif
 
+/* uECC_GENERATOR_COMB - If enabled (defined as nonzero), multiplications by the generator
+(public key computation and signing) use a constant-time fixed-base comb over a precomputed table
+for secp256r1 and secp256k1. This is several times faster than the Montgomery ladder, but adds
+2 KB of tables per curve. Curves without a table always use the ladder. */
+#ifndef uECC_GENERATOR_COMB
+#define uECC_GENERATOR_COMB 1
+#endif
+
+/* uECC_SECP256K1_GLV - If enabled (defined as nonzero), secp256k1 multiplications of secret
+scalars by arbitrary points (ECDH, and k * G without the comb) split the scalar with the GLV
+endomorphism and run a constant-time interleaved signed window over the two 128-bit halves,
+which needs half the doublings of the Montgomery ladder. */
+#ifndef uECC_SECP256K1_GLV
+#define uECC_SECP256K1_GLV uECC_SUPPORTS_secp256k1
+#endif
+
+/* uECC_VERIFY_G_TABLE - If enabled (defined as nonzero), uECC_verify() takes the odd multiples
+of the generator for its wNAF from a precomputed 1 KB table per curve (secp256r1 and secp256k1)
+with a wider window, instead of computing a small table on every call. */
+#ifndef uECC_VERIFY_G_TABLE
+#define uECC_VERIFY_G_TABLE 1
+#endif
+
+/* uECC_SIGN_BATCH - Number of signatures that uECC_sign_deterministic_batch() computes together,
+sharing one modular inversion mod p and one mod n. Each slot costs 4 words of stack per curve
+word. */
+#ifndef uECC_SIGN_BATCH
+#define uECC_SIGN_BATCH 8
+#endif
+
 struct uECC_Curve_t;
 typedef const struct uECC_Curve_t *uECC_Curve;
 
@@ -253,6 +283,9 @@ Inputs:
 Outputs:
     signature - Will be filled in with the signature value. Must be at least 2 * curve size long.
                 For example, if the curve is secp256r1, signature must be 64 bytes long.
+    recid     - If not NULL, will be filled in with the recovery id (0 to 3) for
+                uECC_recover_public_key(): bit 0 is the parity of the y coordinate of R, bit 1
+                is set if its x coordinate was not below n.
 
 Returns 1 if the signature generated successfully, 0 if an error occurred.
 */
@@ -260,6 +293,7 @@ int uECC_sign(const uint8_t *private_key,
               const uint8_t *message_hash,
               unsigned hash_size,
               uint8_t *signature,
+              uint8_t *recid,
               uECC_Curve curve);
 
 /* uECC_HashContext structure.
@@ -355,6 +389,7 @@ Inputs:
 
 Outputs:
     signature - Will be filled in with the signature value.
+    recid     - If not NULL, will be filled in with the recovery id (see uECC_sign()).
 
 Returns 1 if the signature generated successfully, 0 if an error occurred.
 */
@@ -363,14 +398,43 @@ int uECC_sign_deterministic(const uint8_t *private_key,
                             unsigned hash_size,
                             uECC_HashContext *hash_context,
                             uint8_t *signature,
+                            uint8_t *recid,
                             uECC_Curve curve);
 
+/* uECC_sign_deterministic_batch() function.
+Generate ECDSA signatures for several hash values at once. The signatures are identical to
+those of uECC_sign_deterministic(), but the modular inversions are shared between up to
+uECC_SIGN_BATCH signatures, which makes each of them cheaper.
+
+Inputs:
+    private_keys   - count private keys, concatenated.
+    message_hashes - count hashes to sign, concatenated.
+    hash_size      - The size of each message hash in bytes.
+    count          - The number of signatures to generate.
+    hash_context   - A hash context to use.
+
+Outputs:
+    signatures - Will be filled in with count concatenated signatures.
+    recids     - If not NULL, will be filled in with count recovery ids (see uECC_sign()).
+
+Returns 1 if all signatures generated successfully, 0 if an error occurred.
+*/
+int uECC_sign_deterministic_batch(const uint8_t *private_keys,
+                                  const uint8_t *message_hashes,
+                                  unsigned hash_size,
+                                  unsigned count,
+                                  uECC_HashContext *hash_context,
+                                  uint8_t *signatures,
+                                  uint8_t *recids,
+                                  uECC_Curve curve);
+
 /* uECC_normalize_signature() function.
 Convert a signature to a normalized lower-S form. Refer to
 https://github.com/bitcoin-core/secp256k1/blob/master/include/secp256k1.h for
 the rationale.
 
-Returns 1 if the signature gets normalized, 0 if it already was lower-S form.
+Returns 1 if the signature gets normalized, 0 if it already was lower-S form. Normalizing
+negates R, which flips bit 0 of the recovery id.
 */
 int uECC_normalize_signature(uint8_t *signature,
                              uECC_Curve curve);
@@ -411,6 +475,28 @@ int uECC_verify(const uint8_t *public_key,
                 const uint8_t *signature,
                 uECC_Curve curve);
 
+/* uECC_recover_public_key() function.
+Recover the public key that made an ECDSA signature from the signature, the signed hash and
+the recovery id returned when signing.
+
+Inputs:
+    signature    - The signature value.
+    message_hash - The hash of the signed data.
+    hash_size    - The size of message_hash in bytes.
+    recid        - The recovery id (0 to 3).
+
+Outputs:
+    public_key - Will be filled in with the public key.
+
+Returns 1 if a public key was recovered, 0 if the signature or recovery id is invalid.
+*/
+int uECC_recover_public_key(const uint8_t *signature,
+                            const uint8_t *message_hash,
+                            unsigned hash_size,
+                            uint8_t recid,
+                            uint8_t *public_key,
+                            uECC_Curve curve);
+
 /* uECC_generate_private_key() function
 Get a child private key:
 child = (master + z) % order
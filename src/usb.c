@@ -38,24 +38,65 @@
 #include "u2f/u2f_hid.h"
 
 
-#define USB_QUEUE_NUM_PACKETS 128
+#define USB_QUEUE_NUM_MSGS    32
+#define USB_QUEUE_ARENA_LEN   4096// Holds copies of replies built in temporary buffers
 
 
 static bool usb_hww_enabled = false;
 static bool usb_u2f_enabled = false;
 static uint8_t usb_hww_interface_occupied = 0;
-static uint8_t usb_reply_queue_packets[USB_QUEUE_NUM_PACKETS][USB_REPORT_SIZE];
+static uint32_t usb_hww_cid = 0;// channel of the last frame received on the HWW interface
+static uint16_t usb_hww_report_in_size = USB_REPORT_SIZE;
+
+
+// Queued reply message. Frames are cut from the payload one at a time as the endpoint
+// takes them, instead of being built up front.
+typedef struct {
+    const uint8_t *data;
+    uint32_t len;
+    uint32_t sent;// payload bytes already framed
+    uint32_t cid;
+    uint16_t frame_len;// report size the message is framed in
+    uint8_t cmd;
+    uint8_t seq;// next continuation frame
+    uint8_t copied;// data is in usb_reply_queue_arena
+    uint8_t hww;// reply to the HWW interface
+} USB_REPLY;
+
+
+static USB_REPLY usb_reply_queue_msgs[USB_QUEUE_NUM_MSGS];
+static uint8_t usb_reply_queue_arena[USB_QUEUE_ARENA_LEN];
+static union {
+    USB_FRAME f;
+    uint8_t buf[USB_HWW_REPORT_IN_SIZE];
+} usb_reply_queue_frame;
+static uint32_t usb_reply_queue_frame_size = USB_REPORT_SIZE;
+static uint8_t usb_reply_queue_frame_hww = 0;
+static uint32_t usb_reply_queue_arena_end = 0;
 static uint32_t usb_reply_queue_index_start = 0;
 static uint32_t usb_reply_queue_index_end = 0;
 
 
+#ifdef TESTING
+// Simulated IN endpoints. They are off by default; the tests then read the queue with
+// usb_reply_queue_read() instead.
+static uint8_t usb_sim_on = 0;
+static uint8_t usb_sim_busy[2];
+static uint8_t usb_sim_frame[2][USB_HWW_REPORT_IN_SIZE];
+static uint32_t usb_sim_len[2];
+#endif
+
+
 void usb_hww_report(const unsigned char *command)
 {
     usb_hww_interface_occupied = 1;
 #ifdef BOOTLOADER
     bootloader_command((const char *)command);
 #else
-    usb_reply_queue_clear();// Give HWW priority
+    usb_hww_cid = ((const USB_FRAME *)command)->cid;
+    if (!u2f_device_busy()) {
+        usb_reply_queue_clear();// Give HWW priority
+    }
     u2f_device_run((const USB_FRAME *)command);
 #endif
 }
@@ -64,7 +105,7 @@ void usb_hww_report(const unsigned char *command)
 void usb_u2f_report(const unsigned char *command)
 {
     const USB_FRAME *c = (const USB_FRAME *)command;
-    if (usb_hww_interface_occupied) {
+    if (usb_hww_interface_occupied && !u2f_device_busy()) {
         // Give preference to HWW commands
         // Let U2F client timeout
         return;
@@ -85,33 +126,132 @@ void usb_report_sent(void)
 }
 
 
-void usb_reply(uint8_t *report)
+// Hands a frame to the IN endpoint of one interface. Returns false if the endpoint is
+// still sending the previous frame, in which case the frame is not taken.
+static bool usb_reply_frame(uint8_t hww, uint8_t *report, uint32_t len)
+{
+#if defined(TESTING)
+    if (!usb_sim_on || usb_sim_busy[hww]) {
+        return false;
+    }
+    len = MIN(len, sizeof(usb_sim_frame[hww]));
+    memcpy(usb_sim_frame[hww], report, len);
+    usb_sim_len[hww] = len;
+    usb_sim_busy[hww] = 1;
+    return true;
+#elif defined(BOOTLOADER)
+    (void)hww;
+    return udi_hww_send_report_in(report, len);
+#else
+    return hww ? udi_hww_send_report_in(report, len) : udi_u2f_send_report_in(report);
+#endif
+}
+
+
+void usb_reply(uint8_t *report, uint32_t len)
 {
     if (report) {
-#ifndef TESTING
+#ifdef BOOTLOADER
         if (usb_hww_interface_occupied) {
-            udi_hww_send_report_in(report);
+            usb_reply_frame(1, report, len);
         }
-#ifndef BOOTLOADER
-        else {
-            udi_u2f_send_report_in(report);
-        }
-#endif
+#else
+        usb_reply_frame(usb_reply_queue_frame_hww, report, len);
 #endif
     }
 }
 
 
+// Drops message p, keeping the order of the others
+static void usb_reply_queue_remove(uint32_t p)
+{
+    uint32_t next;
+    if (p == usb_reply_queue_index_start) {
+        usb_reply_queue_index_start = (p + 1) % USB_QUEUE_NUM_MSGS;
+        return;
+    }
+    for (next = (p + 1) % USB_QUEUE_NUM_MSGS; next != usb_reply_queue_index_end;
+            p = next, next = (next + 1) % USB_QUEUE_NUM_MSGS) {
+        usb_reply_queue_msgs[p] = usb_reply_queue_msgs[next];
+    }
+    usb_reply_queue_index_end = p;
+}
+
+
+// Oldest queued message for the IN endpoint of one interface, or the end of the queue
+static uint32_t usb_reply_queue_find(uint8_t hww)
+{
+    uint32_t p;
+    for (p = usb_reply_queue_index_start; p != usb_reply_queue_index_end;
+            p = (p + 1) % USB_QUEUE_NUM_MSGS) {
+        if (usb_reply_queue_msgs[p].hww == hww) {
+            break;
+        }
+    }
+    return p;
+}
+
+
+// Builds the next frame of message p without consuming it. Returns the payload length
+// that usb_reply_queue_frame_commit() consumes once an endpoint took the frame.
+static uint32_t usb_reply_queue_frame_build(uint32_t p)
+{
+    USB_FRAME *f = &usb_reply_queue_frame.f;
+    const USB_REPLY *m = &usb_reply_queue_msgs[p];
+    uint32_t psz, hdr;
+
+    memset(usb_reply_queue_frame.buf, 0, m->frame_len);
+    f->cid = m->cid;
+    if (m->sent == 0 && m->seq == 0) {
+        // Init packet
+        f->init.cmd = m->cmd;
+        f->init.bcnth = m->len >> 8;
+        f->init.bcntl = m->len & 0xff;
+        hdr = USB_FRAME_INIT_HEADER;
+    } else {
+        // Cont packet
+        f->cont.seq = m->seq - 1;
+        hdr = USB_FRAME_CONT_HEADER;
+    }
+    psz = MIN(m->frame_len - hdr, m->len - m->sent);
+    memcpy(usb_reply_queue_frame.buf + hdr, m->data + m->sent, psz);
+    // Large frames are cut short after the payload; hosts pad them to the report size
+    usb_reply_queue_frame_size = MAX(USB_REPORT_SIZE, hdr + psz);
+    usb_reply_queue_frame_hww = m->hww;
+    return psz;
+}
+
+
+static void usb_reply_queue_frame_commit(uint32_t p, uint32_t psz)
+{
+    USB_REPLY *m = &usb_reply_queue_msgs[p];
+    m->sent += psz;
+    m->seq++;
+    if (m->sent >= m->len) {
+        usb_reply_queue_remove(p);
+    }
+}
+
+
+// Builds and consumes the next frame of the oldest queued message
 uint8_t *usb_reply_queue_read(void)
 {
     uint32_t p = usb_reply_queue_index_start;
+
     if (p == usb_reply_queue_index_end) {
         // queue is empty
         usb_hww_interface_occupied = 0;
         return NULL;
     }
-    usb_reply_queue_index_start = (p + 1) % USB_QUEUE_NUM_PACKETS;
-    return usb_reply_queue_packets[p];
+    usb_reply_queue_frame_commit(p, usb_reply_queue_frame_build(p));
+    return usb_reply_queue_frame.buf;
+}
+
+
+// Length of the frame last returned by usb_reply_queue_read()
+uint32_t usb_reply_queue_frame_len(void)
+{
+    return usb_reply_queue_frame_size;
 }
 
 
@@ -121,60 +261,167 @@ void usb_reply_queue_clear(void)
 }
 
 
-void usb_reply_queue_add(const USB_FRAME *frame)
+// Drops the queued messages of one channel, keeping the order of the others
+void usb_reply_queue_clear_cid(const uint32_t cid)
+{
+    uint32_t p, end = usb_reply_queue_index_start;
+    for (p = usb_reply_queue_index_start; p != usb_reply_queue_index_end;
+            p = (p + 1) % USB_QUEUE_NUM_MSGS) {
+        if (usb_reply_queue_msgs[p].cid == cid) {
+            continue;
+        }
+        if (end != p) {
+            usb_reply_queue_msgs[end] = usb_reply_queue_msgs[p];
+        }
+        end = (end + 1) % USB_QUEUE_NUM_MSGS;
+    }
+    usb_reply_queue_index_end = end;
+}
+
+
+// Reserves len contiguous bytes of the arena after the copies still queued, or returns
+// NULL if they do not fit
+static uint8_t *usb_reply_queue_arena_alloc(const uint32_t len)
+{
+    uint32_t p, start = USB_QUEUE_ARENA_LEN, at;
+    for (p = usb_reply_queue_index_start; p != usb_reply_queue_index_end;
+            p = (p + 1) % USB_QUEUE_NUM_MSGS) {
+        if (usb_reply_queue_msgs[p].copied) {
+            start = usb_reply_queue_msgs[p].data - usb_reply_queue_arena;
+            break;
+        }
+    }
+
+    if (start == USB_QUEUE_ARENA_LEN) {
+        at = 0;// no copies queued
+    } else if (usb_reply_queue_arena_end > start) {
+        at = USB_QUEUE_ARENA_LEN - usb_reply_queue_arena_end >= len ?
+             usb_reply_queue_arena_end : 0;
+        if (at == 0 && start < len) {
+            return NULL;
+        }
+    } else {
+        at = usb_reply_queue_arena_end;
+        if (start - at < len) {
+            return NULL;
+        }
+    }
+
+    if (at + len > USB_QUEUE_ARENA_LEN) {
+        return NULL;
+    }
+    usb_reply_queue_arena_end = at + len;
+    return usb_reply_queue_arena + at;
+}
+
+
+static void usb_reply_queue_add_msg(const uint8_t cmd, const uint8_t *data,
+                                    const uint32_t len, const uint32_t cid,
+                                    const uint8_t copy)
 {
-    uint32_t next = (usb_reply_queue_index_end + 1) % USB_QUEUE_NUM_PACKETS;
+    uint32_t next = (usb_reply_queue_index_end + 1) % USB_QUEUE_NUM_MSGS;
+    USB_REPLY *m = &usb_reply_queue_msgs[usb_reply_queue_index_end];
+    uint8_t *buf = NULL;
+
     if (usb_reply_queue_index_start == next) {
         return; // Buffer full
     }
-    memcpy(usb_reply_queue_packets[usb_reply_queue_index_end], frame, USB_REPORT_SIZE);
+    if (copy && len) {
+        buf = usb_reply_queue_arena_alloc(len);
+        if (!buf) {
+            return; // Buffer full
+        }
+        memcpy(buf, data, len);
+        data = buf;
+    }
+
+    m->data = data;
+    m->len = len;
+    m->sent = 0;
+    m->cid = cid;
+    m->frame_len = cmd == U2FHID_HWW ? usb_hww_report_in_size : USB_REPORT_SIZE;
+    m->cmd = cmd;
+    m->seq = 0;
+    m->copied = buf != NULL;
+    m->hww = usb_hww_cid && cid == usb_hww_cid;
     usb_reply_queue_index_end = next;
 }
 
 
+void usb_reply_queue_add(const USB_FRAME *frame)
+{
+    uint32_t len = MIN((uint32_t)U2FHID_MSG_LEN(*frame), sizeof(frame->init.data));
+    usb_reply_queue_add_msg(frame->init.cmd, frame->init.data, len, frame->cid, 1);
+}
+
+
 void usb_reply_queue_load_msg(const uint8_t cmd, const uint8_t *data, const uint32_t len,
                               const uint32_t cid)
 {
-    USB_FRAME f;
-    uint32_t cnt = 0;
-    uint32_t l = len;
-    uint32_t psz;
-    uint8_t seq = 0;
+    usb_reply_queue_add_msg(cmd, data, len, cid, 1);
+}
+
+
+// As usb_reply_queue_load_msg() but without copying the data, which must stay unchanged
+// until the reply is sent
+void usb_reply_queue_load_msg_ref(const uint8_t cmd, const uint8_t *data,
+                                  const uint32_t len,
+                                  const uint32_t cid)
+{
+    usb_reply_queue_add_msg(cmd, data, len, cid, 0);
+}
 
-    memset(&f, 0, sizeof(f));
-    f.cid = cid;
-    f.init.cmd = cmd;
-    f.init.bcnth = len >> 8;
-    f.init.bcntl = len & 0xff;
 
-    // Init packet
-    psz = MIN(sizeof(f.init.data), l);
-    memcpy(f.init.data, data, psz);
-    usb_reply_queue_add(&f);
-    l -= psz;
-    cnt += psz;
+// Gives each idle IN endpoint the next frame of the oldest message for its interface.
+// A frame is consumed only once the endpoint took it, so that the report sent callback
+// of one interface, or a frame received on another channel, cannot drop a frame while
+// the endpoint is still busy.
+void usb_reply_queue_send(void)
+{
+    uint8_t hww;
 
-    // Cont packet(s)
-    for (; l > 0; l -= psz, cnt += psz) {
-        memset(&f.cont.data, 0, sizeof(f.cont.data));
-        f.cont.seq = seq++;
-        psz = MIN(sizeof(f.cont.data), l);
-        memcpy(f.cont.data, data + cnt, psz);
-        usb_reply_queue_add(&f);
+    if (usb_reply_queue_index_start == usb_reply_queue_index_end) {
+        usb_hww_interface_occupied = 0;
+        return;
+    }
+    for (hww = 0; hww < 2; hww++) {
+        uint32_t p = usb_reply_queue_find(hww);
+        uint32_t psz;
+        if (p == usb_reply_queue_index_end) {
+            continue;
+        }
+        psz = usb_reply_queue_frame_build(p);
+        if (usb_reply_frame(hww, usb_reply_queue_frame.buf, usb_reply_queue_frame_size)) {
+            usb_reply_queue_frame_commit(p, psz);
+        }
     }
 }
 
 
-void usb_reply_queue_send(void)
+#ifdef TESTING
+void usb_sim_endpoints(uint8_t on)
 {
-#ifndef TESTING
-    static uint8_t *data;
-    data = usb_reply_queue_read();
-    usb_reply(data);
-#endif
+    usb_sim_on = on;
+    memset(usb_sim_busy, 0, sizeof(usb_sim_busy));
 }
 
 
+// Takes the frame an endpoint holds, as the host would, and runs the report sent
+// callback. Returns the frame length, or 0 if the endpoint is idle.
+uint32_t usb_sim_endpoint_take(uint8_t hww, uint8_t *frame)
+{
+    uint32_t len = usb_sim_len[hww];
+    if (!usb_sim_busy[hww]) {
+        return 0;
+    }
+    memcpy(frame, usb_sim_frame[hww], len);
+    usb_sim_busy[hww] = 0;
+    usb_report_sent();
+    return len;
+}
+#endif
+
+
 void usb_set_feature(uint8_t *report)
 {
     (void) report;
@@ -209,6 +456,7 @@ void usb_u2f_disable(void)
 bool usb_hww_enable(void)
 {
     usb_hww_enabled = true;
+    usb_hww_report_in_size = USB_REPORT_SIZE;// Hosts negotiate again after enumeration
     return true;
 }
 
@@ -219,19 +467,66 @@ void usb_hww_disable(void)
 }
 
 
-// Periodically called every 1(?) msec
-// Can run timed locked processes here
-// Use for u2f timeout function
-void usb_process(uint16_t framenumber)
+uint16_t usb_hww_report_size(void)
 {
-    static uint8_t cpt_sof = 0;
+    return usb_hww_report_in_size;
+}
+
 
-    cpt_sof++;
-    if (cpt_sof < 40) {
+// Sets the IN report size used for HWW replies, limited to what the report descriptor
+// offers. Returns the size in use.
+uint16_t usb_hww_report_size_set(uint16_t size)
+{
+    usb_hww_report_in_size = MAX(USB_REPORT_SIZE, MIN(USB_HWW_REPORT_IN_SIZE, size));
+    return usb_hww_report_in_size;
+}
+
+
+// Runs the USB interrupt handler from code that blocks it, such as a command waiting for
+// a touch inside the handler, so that frames keep being received and sent.
+//
+// The ASF driver is not reentrant, so the nested handler only serves start of frame and
+// data endpoint events. Control requests and bus events (reset, suspend, resume) could
+// reset or re-enumerate the device under the interrupted handler; they stay pending
+// until it returns.
+//
+// Priorities: only the UDP interrupt (UDD_USB_INT_LEVEL) itself or code at a lower
+// priority may call it, never a handler that can preempt the UDP interrupt. The SysTick
+// runs at the lowest priority, so its timer callbacks cannot preempt the UDP interrupt.
+//
+// Stack: the nested handler only runs requests that answer at once, never a second
+// touch wait, so it nests one level deep and takes well under 1 kB of the main stack
+// (__stack_size__ in firmware.ld) on top of the waiting command.
+void usb_service(void)
+{
+#if !defined(TESTING) && !defined(BOOTLOADER)
+    const uint32_t ep_data = ((1u << (USB_DEVICE_MAX_EP + 1)) - 1) & ~UDP_ISR_EP0INT;
+    uint32_t events;
+
+    if (!NVIC_GetPendingIRQ(UDP_IRQn)) {
+        return;
+    }
+    events = UDP->UDP_ISR & (UDP->UDP_IMR | UDP_ISR_ENDBUSRES);
+    if (events & UDP_ISR_ENDBUSRES) {
         return;
     }
-    cpt_sof = 0;
+    // The handler serves one event per call: a start of frame first, then the control
+    // endpoint, then the data endpoints
+    if (!(events & UDP_ISR_SOFINT)) {
+        if ((events & UDP_ISR_EP0INT) || !(events & ep_data)) {
+            return;
+        }
+    }
+    NVIC_ClearPendingIRQ(UDP_IRQn);
+    UDP_Handler();
+#endif
+}
 
+
+// Called on every start of frame (1 msec), from the USB interrupt that also runs
+// u2f_device_run(), so the U2F deadlines are checked without locking
+void usb_process(uint16_t framenumber)
+{
     u2f_device_timeout();
 
     (void)framenumber;
@@ -29,6 +29,7 @@
 #define _USB_H_
 
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #ifndef TESTING
@@ -37,6 +38,16 @@
 
 
 #define  USB_REPORT_SIZE 64
+#define  USB_FRAME_INIT_HEADER 7
+#define  USB_FRAME_CONT_HEADER 5
+
+// Largest IN report the HWW interface can negotiate. Replies to U2FHID_HWW commands are
+// framed in reports of the negotiated size; everything else stays at USB_REPORT_SIZE.
+#if (defined(USB_HWW_LARGE_REPORT) || defined(TESTING)) && !defined(BOOTLOADER)
+#define  USB_HWW_REPORT_IN_SIZE 1024
+#else
+#define  USB_HWW_REPORT_IN_SIZE USB_REPORT_SIZE
+#endif
 
 
 __extension__ typedef struct {
@@ -47,11 +58,11 @@ __extension__ typedef struct {
             uint8_t cmd;        // Command - bit 7 set
             uint8_t bcnth;      // Message byte count - high
             uint8_t bcntl;      // Message byte count - low
-            uint8_t data[USB_REPORT_SIZE - 7]; // Data payload
+            uint8_t data[USB_REPORT_SIZE - USB_FRAME_INIT_HEADER]; // Data payload
         } init;
         struct {
             uint8_t seq;        // Sequence number - bit 7 cleared
-            uint8_t data[USB_REPORT_SIZE - 5]; // Data payload
+            uint8_t data[USB_REPORT_SIZE - USB_FRAME_CONT_HEADER]; // Data payload
         } cont;
     };
 } USB_FRAME;
@@ -65,14 +76,24 @@ typedef struct {
 
 
 void usb_reply_queue_clear(void);
+void usb_reply_queue_clear_cid(const uint32_t cid);
 void usb_reply_queue_add(const USB_FRAME *frame);
 void usb_reply_queue_load_msg(const uint8_t cmd, const uint8_t *data, const uint32_t len,
                               const uint32_t cid);
+void usb_reply_queue_load_msg_ref(const uint8_t cmd, const uint8_t *data,
+                                  const uint32_t len,
+                                  const uint32_t cid);
 void usb_reply_queue_send(void);
 uint8_t *usb_reply_queue_read(void);
-void usb_reply(uint8_t *report);
+uint32_t usb_reply_queue_frame_len(void);
+void usb_reply(uint8_t *report, uint32_t len);
+#ifdef TESTING
+void usb_sim_endpoints(uint8_t on);
+uint32_t usb_sim_endpoint_take(uint8_t hww, uint8_t *frame);
+#endif
 
 void usb_process(uint16_t framenumber);
+void usb_service(void);
 void usb_sof_action(void);
 void usb_suspend_action(void);
 void usb_resume_action(void);
@@ -85,6 +106,8 @@ void usb_report_sent(void);
 bool usb_hww_enable(void);
 void usb_hww_disable(void);
 void usb_hww_report(const unsigned char *command);
+uint16_t usb_hww_report_size(void);
+uint16_t usb_hww_report_size_set(uint16_t size);
 
 bool usb_u2f_enable(void);
 void usb_u2f_disable(void);
@@ -34,7 +34,61 @@
 #include "flags.h"
 
 
-static uint8_t utils_buffer[UTILS_BUFFER_LEN];
+static uint8_t utils_buffer[UTILS_BUFFER_LEN] __attribute__((aligned(4)));
+static size_t utils_buffer_used = UTILS_BUFFER_LEN;// bytes that may hold data
+
+// "000102..ff", two characters per byte value
+static const char utils_hex_pairs[512 + 1] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+// Nibble value of a hex character, or 0xff
+#define X 0xff
+static const uint8_t utils_hex_nibble[256] = {
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0x00
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0x10
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0x20
+    0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  X,  X,  X,  X,  X,  X, // 0x30
+    X, 10, 11, 12, 13, 14, 15,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0x40
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0x50
+    X, 10, 11, 12, 13, 14, 15,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0x60
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0x70
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0x80
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0x90
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0xa0
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0xb0
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0xc0
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0xd0
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0xe0
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X, // 0xf0
+};
+#undef X
+
+// UTILS_CHARS_* classes of each character
+static const uint8_t utils_char_classes[256] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0x00
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0x10
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x48, 0x00, 0x00, 0x00, 0x04, 0x00, 0x10, 0x10, 0x0c, // 0x20
+    0x3d, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x3f, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, // 0x30
+    0x00, 0x17, 0x17, 0x17, 0x17, 0x17, 0x17, 0x16, 0x5e, 0x14, 0x16, 0x16, 0x16, 0x16, 0x16, 0x14, // 0x40
+    0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x00, 0x00, 0x00, 0x00, 0x10, // 0x50
+    0x00, 0x17, 0x17, 0x17, 0x17, 0x17, 0x17, 0x16, 0x5e, 0x16, 0x16, 0x16, 0x14, 0x1e, 0x16, 0x16, // 0x60
+    0x5e, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x16, 0x00, 0x00, 0x00, 0x00, 0x00, // 0x70
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0x80
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0x90
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xa0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xb0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xc0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xd0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xe0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xf0
+};
 
 
 /**
@@ -48,96 +102,146 @@ volatile void *utils_zero(volatile void *dst, size_t len)
 }
 
 
+/**
+ * As utils_zero(), but clears the word-aligned part of dst a word at a time.
+ * The volatile stores are not optimized away either.
+ */
+volatile void *utils_zero_words(volatile void *dst, size_t len)
+{
+    volatile uint8_t *b = (volatile uint8_t *)dst;
+    volatile uint32_t *w;
+
+    for (; len && ((uintptr_t)b & 3); len--) {
+        *b++ = 0;
+    }
+    for (w = (volatile uint32_t *)(volatile void *)b; len >= 4; len -= 4) {
+        *w++ = 0;
+    }
+    for (b = (volatile uint8_t *)w; len; len--) {
+        *b++ = 0;
+    }
+    return dst;
+}
+
+
 void utils_clear_buffers(void)
 {
-    utils_zero(utils_buffer, UTILS_BUFFER_LEN);
+    utils_zero_words(utils_buffer, utils_buffer_used);
+    utils_buffer_used = 0;
 }
 
 
-uint8_t utils_is_hex(const char *str)
+uint8_t utils_char_class(char c)
+{
+    return utils_char_classes[(uint8_t)c];
+}
+
+
+/**
+ * Checks in a single pass that str is non-empty, null terminated within maxlen
+ * bytes and that every character belongs to one of the UTILS_CHARS_* classes in
+ * the mask chars.
+ */
+uint8_t utils_check_chars(const char *str, size_t maxlen, uint8_t chars)
 {
-    static char characters[] = "abcdefABCDEF0123456789";
     size_t i;
 
-    if (!strlens(str)) {
+    if (!str) {
         return DBB_ERROR;
     }
-
-    for (i = 0 ; i < strlens(str); i++) {
-        if (!strchr(characters, str[i])) {
+    for (i = 0; i < maxlen; i++) {
+        uint8_t c = (uint8_t)str[i];
+        if (!c) {
+            return i ? DBB_OK : DBB_ERROR;
+        }
+        if (!(utils_char_classes[c] & chars)) {
             return DBB_ERROR;
         }
     }
-    return DBB_OK;
+    return DBB_ERROR;
+}
+
+
+uint8_t utils_is_hex(const char *str)
+{
+    return utils_check_chars(str, SIZE_MAX, UTILS_CHARS_HEX);
 }
 
 
 uint8_t utils_limit_alphanumeric_hyphen_underscore_period(const char *str)
 {
-    static char characters[] =
-        ".-_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    return utils_check_chars(str, SIZE_MAX, UTILS_CHARS_FILENAME);
+}
+
+
+/**
+ * Decodes hexlen hex characters into hexlen / 2 bytes of bin, which must hold binlen
+ * bytes. Returns DBB_ERROR on an odd length, a non-hex character or a short buffer.
+ */
+int utils_hex_to_bin(const char *hex, size_t hexlen, uint8_t *bin, size_t binlen)
+{
     size_t i;
+    uint8_t hi, lo, bad = 0;
 
-    if (!strlens(str)) {
+    if (!hex || (hexlen & 1) || binlen < hexlen / 2) {
         return DBB_ERROR;
     }
-
-    for (i = 0 ; i < strlens(str); i++) {
-        if (!strchr(characters, str[i])) {
-            return DBB_ERROR;
-        }
+    for (i = 0; i < hexlen / 2; i++) {
+        hi = utils_hex_nibble[(uint8_t)hex[i * 2]];
+        lo = utils_hex_nibble[(uint8_t)hex[i * 2 + 1]];
+        bad |= hi | lo;
+        bin[i] = (hi << 4) | (lo & 0x0f);
+    }
+    if (bad & 0xf0) {
+        utils_zero(bin, hexlen / 2);
+        return DBB_ERROR;
     }
     return DBB_OK;
 }
 
 
+/**
+ * Encodes l bytes as 2 * l lowercase hex characters and a null terminator into hex,
+ * which must hold 2 * l + 1 bytes.
+ */
+void utils_bin_to_hex(const uint8_t *bin, size_t l, char *hex)
+{
+    size_t i;
+    for (i = 0; i < l; i++) {
+        memcpy(hex + i * 2, utils_hex_pairs + bin[i] * 2, 2);
+    }
+    hex[l * 2] = '\0';
+}
+
+
+// Legacy interface returning the shared static buffer. Invalid characters decode
+// as 0. Prefer utils_hex_to_bin().
 uint8_t *utils_hex_to_uint8(const char *str)
 {
-    if (strlens(str) > UTILS_BUFFER_LEN) {
+    size_t i, len = strlens(str);
+    if (len > UTILS_BUFFER_LEN) {
         return NULL;
     }
     utils_clear_buffers();
-    uint8_t c;
-    size_t i;
-    for (i = 0; i < strlens(str) / 2; i++) {
-        c = 0;
-        if (str[i * 2] >= '0' && str[i * 2] <= '9') {
-            c += (str[i * 2] - '0') << 4;
-        }
-        if (str[i * 2] >= 'a' && str[i * 2] <= 'f') {
-            c += (10 + str[i  * 2] - 'a') << 4;
-        }
-        if (str[i * 2] >= 'A' && str[i * 2] <= 'F') {
-            c += (10 + str[i * 2] - 'A') << 4;
-        }
-        if (str[i * 2 + 1] >= '0' && str[i * 2 + 1] <= '9') {
-            c += (str[i * 2 + 1] - '0');
-        }
-        if (str[i * 2 + 1] >= 'a' && str[i * 2 + 1] <= 'f') {
-            c += (10 + str[i * 2 + 1] - 'a');
-        }
-        if (str[i * 2 + 1] >= 'A' && str[i * 2 + 1] <= 'F') {
-            c += (10 + str[i * 2 + 1] - 'A');
-        }
-        utils_buffer[i] = c;
+    for (i = 0; i < len / 2; i++) {
+        uint8_t hi = utils_hex_nibble[(uint8_t)str[i * 2]];
+        uint8_t lo = utils_hex_nibble[(uint8_t)str[i * 2 + 1]];
+        utils_buffer[i] = ((hi & 0xf0) ? 0 : hi << 4) | ((lo & 0xf0) ? 0 : lo);
     }
+    utils_buffer_used = len / 2;
     return utils_buffer;
 }
 
 
+// Legacy interface returning the shared static buffer. Prefer utils_bin_to_hex().
 char *utils_uint8_to_hex(const uint8_t *bin, size_t l)
 {
     if (l > (UTILS_BUFFER_LEN / 2 - 1)) {
         return NULL;
     }
-    static char digits[] = "0123456789abcdef";
     utils_clear_buffers();
-    size_t i;
-    for (i = 0; i < l; i++) {
-        utils_buffer[i * 2] = digits[(bin[i] >> 4) & 0xF];
-        utils_buffer[i * 2 + 1] = digits[bin[i] & 0xF];
-    }
-    utils_buffer[l * 2] = '\0';
+    utils_bin_to_hex(bin, l, (char *)utils_buffer);
+    utils_buffer_used = l * 2 + 1;
     return (char *)utils_buffer;
 }
 
@@ -43,11 +43,25 @@
 #define STREQ(a, b)    (strcmp((a), (b))  == 0)
 #define MEMEQ(a, b, c) (memcmp((a), (b), (c))  == 0)
 
+// Character classes of utils_char_class(), combinable as a mask
+#define UTILS_CHARS_HEX      0x01// 0-9 a-f A-F
+#define UTILS_CHARS_BASE58   0x02// bitcoin base58 alphabet
+#define UTILS_CHARS_BASE64   0x04// A-Z a-z 0-9 + / =
+#define UTILS_CHARS_KEYPATH  0x08// 0-9 m / and the hardened markers
+#define UTILS_CHARS_FILENAME 0x10// A-Z a-z 0-9 . - _
+#define UTILS_CHARS_DIGIT    0x20// 0-9
+#define UTILS_CHARS_PRIME    0x40// hardened keypath markers ' p h H
+
 
 volatile void *utils_zero(volatile void *dst, size_t len);
+volatile void *utils_zero_words(volatile void *dst, size_t len);
 void utils_clear_buffers(void);
+uint8_t utils_char_class(char c);
+uint8_t utils_check_chars(const char *str, size_t maxlen, uint8_t chars);
 uint8_t utils_is_hex(const char *str);
 uint8_t utils_limit_alphanumeric_hyphen_underscore_period(const char *str);
+int utils_hex_to_bin(const char *hex, size_t hexlen, uint8_t *bin, size_t binlen);
+void utils_bin_to_hex(const uint8_t *bin, size_t l, char *hex);
 uint8_t *utils_hex_to_uint8(const char *str);
 char *utils_uint8_to_hex(const uint8_t *bin, size_t l);
 void utils_reverse_hex(char *h, int len);
@@ -37,6 +37,7 @@
 #include "pbkdf2.h"
 #include "utils.h"
 #include "flags.h"
+#include "led.h"
 #include "sha2.h"
 #include "ecc.h"
 
@@ -139,10 +140,13 @@ int wallet_generate_key(HDNode *node, const char *keypath, const uint8_t *privke
                         const uint8_t *chaincode)
 {
     static char delim[] = "/";
-    static char prime[] = "phH\'";
-    static char digits[] = "0123456789";
     uint64_t idx = 0;
 
+    if (utils_check_chars(keypath, COMMANDER_REPORT_SIZE,
+                          UTILS_CHARS_KEYPATH) != DBB_OK) {
+        return DBB_ERROR;
+    }
+
     char *kp = strdup(keypath);
     if (!kp) {
         return DBB_ERROR_MEM;
@@ -173,13 +177,14 @@ int wallet_generate_key(HDNode *node, const char *keypath, const uint8_t *privke
         int prm = 0;
         size_t pch_len = strlens(pch);
         for ( ; i < pch_len; i++) {
-            if (strchr(prime, pch[i])) {
+            uint8_t cls = utils_char_class(pch[i]);
+            if (cls & UTILS_CHARS_PRIME) {
                 if (i != pch_len - 1) {
                     goto err;
                 }
                 prm = 1;
                 has_prm = 1;
-            } else if (!strchr(digits, pch[i])) {
+            } else if (!(cls & UTILS_CHARS_DIGIT)) {
                 goto err;
             }
         }
@@ -214,6 +219,15 @@ err:
 }
 
 
+// Toggles an even number of times per derivation, leaving the LED as it was
+static void wallet_pbkdf2_progress(uint32_t done, uint32_t total)
+{
+    (void)done;
+    (void)total;
+    led_toggle();
+}
+
+
 int wallet_generate_node(const char *passphrase, const char *entropy, HDNode *node)
 {
     int ret;
@@ -225,8 +239,8 @@ int wallet_generate_node(const char *passphrase, const char *entropy, HDNode *no
     }
 
     snprintf(salt, sizeof(salt), "%s%s", "mnemonic", passphrase);
-    pbkdf2_hmac_sha512((const uint8_t *)entropy, strlens(entropy), salt, seed,
-                       sizeof(seed));
+    pbkdf2_hmac_sha512_progress((const uint8_t *)entropy, strlens(entropy), salt, seed,
+                                sizeof(seed), wallet_pbkdf2_progress);
 
     if (hdnode_from_seed(seed, sizeof(seed), node) == DBB_ERROR) {
         ret = DBB_ERROR;
@@ -261,7 +275,7 @@ void wallet_report_id(char *id)
     if (xpub[0]) {
         sha256_Raw((uint8_t *)xpub, 112, h);
         sha256_Raw(h, 32, h);
-        memcpy(id, utils_uint8_to_hex(h, 32), 64);
+        utils_bin_to_hex(h, 32, id);
     }
 }
 
@@ -269,6 +283,7 @@ void wallet_report_id(char *id)
 int wallet_check_pubkey(const char *pubkey, const char *keypath)
 {
     uint8_t pub_key[33];
+    char pub_key_hex[33 * 2 + 1];
     HDNode node;
 
     if (strlens(pubkey) != 66) {
@@ -293,7 +308,8 @@ int wallet_check_pubkey(const char *pubkey, const char *keypath)
     bitcoin_ecc.ecc_get_public_key33(node.private_key, pub_key, ECC_SECP256k1);
 
     utils_zero(&node, sizeof(HDNode));
-    if (!STREQ(pubkey, utils_uint8_to_hex(pub_key, 33))) {
+    utils_bin_to_hex(pub_key, 33, pub_key_hex);
+    if (!STREQ(pubkey, pub_key_hex)) {
         return DBB_KEY_ABSENT;
     } else {
         return DBB_KEY_PRESENT;
@@ -305,45 +321,67 @@ err:
 }
 
 
-int wallet_sign(const char *message, const char *keypath)
+int wallet_sign(const char *const *messages, const char *const *keypaths, size_t count)
 {
-    uint8_t data[32];
-    uint8_t sig[64];
-    uint8_t recid = 0xEE;// Set default value to give an error when trying to recover
+    uint8_t data[WALLET_SIGN_BATCH][32];
+    uint8_t private_keys[WALLET_SIGN_BATCH][32];
+    uint8_t sigs[WALLET_SIGN_BATCH][64];
+    uint8_t recids[WALLET_SIGN_BATCH];
     HDNode node;
+    size_t i;
+    int ret = DBB_OK;
 
-    if (strlens(message) != (32 * 2)) {
-        commander_clear_report();
-        commander_fill_report(cmd_str(CMD_sign), NULL, DBB_ERR_SIGN_HASH_LEN);
-        goto err;
-    }
+    memset(data, 0, sizeof(data));
+    memset(private_keys, 0, sizeof(private_keys));
+    // Set default value to give an error when trying to recover
+    memset(recids, 0xEE, sizeof(recids));
 
-    if (wallet_seeded() != DBB_OK) {
+    if (count > WALLET_SIGN_BATCH) {
         commander_clear_report();
-        commander_fill_report(cmd_str(CMD_sign), NULL, DBB_ERR_KEY_MASTER);
-        goto err;
+        commander_fill_report(cmd_str(CMD_sign), NULL, DBB_ERR_IO_INVALID_CMD);
+        return DBB_ERROR;
     }
 
-    if (wallet_generate_key(&node, keypath, wallet_get_master(),
-                            wallet_get_chaincode()) != DBB_OK) {
-        commander_clear_report();
-        commander_fill_report(cmd_str(CMD_sign), NULL, DBB_ERR_KEY_CHILD);
-        goto err;
-    }
+    for (i = 0; i < count; i++) {
+        if (strlens(messages[i]) != (32 * 2) ||
+                utils_hex_to_bin(messages[i], 32 * 2, data[i], 32) != DBB_OK) {
+            commander_clear_report();
+            commander_fill_report(cmd_str(CMD_sign), NULL, DBB_ERR_SIGN_HASH_LEN);
+            goto err;
+        }
 
-    memcpy(data, utils_hex_to_uint8(message), 32);
+        if (wallet_seeded() != DBB_OK) {
+            commander_clear_report();
+            commander_fill_report(cmd_str(CMD_sign), NULL, DBB_ERR_KEY_MASTER);
+            goto err;
+        }
 
-    if (bitcoin_ecc.ecc_sign_digest(node.private_key, data, sig, &recid, ECC_SECP256k1)) {
+        if (wallet_generate_key(&node, keypaths[i], wallet_get_master(),
+                                wallet_get_chaincode()) != DBB_OK) {
+            commander_clear_report();
+            commander_fill_report(cmd_str(CMD_sign), NULL, DBB_ERR_KEY_CHILD);
+            goto err;
+        }
+        memcpy(private_keys[i], node.private_key, 32);
+        utils_zero(&node, sizeof(HDNode));
+    }
+
+    if (bitcoin_ecc.ecc_sign_digest_batch(private_keys[0], data[0], sigs[0], recids,
+                                          count, ECC_SECP256k1)) {
         commander_clear_report();
         commander_fill_report(cmd_str(CMD_sign), NULL, DBB_ERR_SIGN_ECCLIB);
         goto err;
     }
 
-    utils_zero(&node, sizeof(HDNode));
-    return commander_fill_signature_array(sig, recid);
+    for (i = 0; i < count && ret == DBB_OK; i++) {
+        ret = commander_fill_signature_array(sigs[i], recids[i]);
+    }
+    utils_zero(private_keys, sizeof(private_keys));
+    return ret;
 
 err:
     utils_zero(&node, sizeof(HDNode));
+    utils_zero(private_keys, sizeof(private_keys));
     return DBB_ERROR;
 }
 
@@ -30,9 +30,14 @@
 
 
 #include <stdint.h>
+#include <stddef.h>
 #include "bip32.h"
 
 
+/* Maximum number of hashes passed to one wallet_sign() call */
+#define WALLET_SIGN_BATCH 8
+
+
 /* BIP32 */
 void wallet_set_hidden(int hide);
 int wallet_is_hidden(void);
@@ -44,7 +49,7 @@ int wallet_seeded(void);
 int wallet_erased(void);
 int wallet_create(const char *passphrase, const char *entropy_in);
 int wallet_check_pubkey(const char *pubkey, const char *keypath);
-int wallet_sign(const char *message, const char *keypath);
+int wallet_sign(const char *const *messages, const char *const *keypaths, size_t count);
 void wallet_report_xpub(const char *keypath, char *xpub);
 void wallet_report_id(char *id);
 int wallet_generate_key(HDNode *node, const char *keypath, const uint8_t *privkeymaster,
@@ -37,6 +37,7 @@
 #include "u2f_device.h"
 #include "commander.h"
 #include "aescbcb64.h"
+#include "chachapolyb64.h"
 #include "random.h"
 #include "utest.h"
 #include "usb.h"
@@ -76,9 +77,18 @@ static char command_sent[COMMANDER_REPORT_SIZE] = {0};
 const uint8_t U2F_HIJACK_CODE[U2F_HIJACK_ORIGIN_TOTAL][U2F_NONCE_LENGTH];// extern
 static unsigned char HID_REPORT[HID_REPORT_SIZE] = {0};
 static char decrypted_report[COMMANDER_REPORT_SIZE];
+static uint8_t decrypted_report_raw[COMMANDER_REPORT_SIZE];
+static int decrypted_report_raw_len;
 
 static int TEST_LIVE_DEVICE = 0;
+static int TEST_TRANSPORT_CHACHAPOLY = 0;// send commands in the ChaCha20-Poly1305 suite
 static int TEST_U2FAUTH_HIJACK = 0;
+static int TEST_U2FAUTH_HIJACK_WINDOW = 1;// key handles per browser sign request
+static int TEST_U2FAUTH_HIJACK_REVERSE = 0;// send all but the last chunk in reverse order
+static int TEST_HID_REPORTS_READ = 0;
+static int HWW_REPORT_IN_SIZE = USB_REPORT_SIZE;// negotiated with api_hid_report_size()
+static int TEST_U2FAUTH_HIJACK_ROUND_TRIPS =
+    0;// browser sign requests returned to the client
 
 
 static const char *api_read_decrypted_report(void)
@@ -87,12 +97,22 @@ static const char *api_read_decrypted_report(void)
 }
 
 
+// Raw bytes after the null terminator of the decrypted JSON report, such as a
+// COMMANDER_ECHO_FORMAT_RAW echo.
+static const uint8_t *api_read_decrypted_report_raw(int *len)
+{
+    *len = decrypted_report_raw_len;
+    return decrypted_report_raw;
+}
+
+
 static void api_decrypt_report(const char *report, uint8_t *key)
 {
     int decrypt_len;
     char *dec;
 
     memset(decrypted_report, 0, sizeof(decrypted_report));
+    decrypted_report_raw_len = 0;
 
     yajl_val json_node = yajl_tree_parse(report, NULL, 0);
 
@@ -107,14 +127,25 @@ static void api_decrypt_report(const char *report, uint8_t *key)
         const char *ciphertext = YAJL_GET_STRING(yajl_tree_get(json_node, ciphertext_path,
                                  yajl_t_string));
         if (ciphertext) {
-            dec = aescbcb64_decrypt((const unsigned char *)ciphertext, strlens(ciphertext),
-                                    &decrypt_len, key);
+            if (chachapolyb64_has_prefix(ciphertext, strlens(ciphertext))) {
+                dec = chachapolyb64_decrypt((const unsigned char *)ciphertext,
+                                            strlens(ciphertext), &decrypt_len, key,
+                                            AES_KEY_NONE);
+            } else {
+                dec = aescbcb64_decrypt((const unsigned char *)ciphertext, strlens(ciphertext),
+                                        &decrypt_len, key, AES_KEY_NONE);
+            }
             if (!dec) {
                 strcpy(decrypted_report, "/* error: Failed to decrypt. */");
                 goto exit;
             }
 
             sprintf(decrypted_report, "/* ciphertext */ %.*s", decrypt_len, dec);
+            if (decrypt_len > (int)strlens(dec) + 2) {
+                // `decrypt_len` counts a null terminator after the raw bytes
+                decrypted_report_raw_len = decrypt_len - strlens(dec) - 2;
+                memcpy(decrypted_report_raw, dec + strlens(dec) + 1, decrypted_report_raw_len);
+            }
             free(dec);
             goto exit;
         }
@@ -210,31 +241,40 @@ static int api_hid_send_frames(uint32_t cid, uint8_t cmd, const void *data, size
 }
 
 
-static int api_hid_read_frame(USB_FRAME *r)
+typedef union {
+    USB_FRAME f;
+    uint8_t buf[USB_HWW_REPORT_IN_SIZE];
+} API_HID_REPORT;
+
+
+// Reads one IN report. Reports may be shorter than the negotiated size; the rest of the
+// buffer is padding.
+static int api_hid_read_report(API_HID_REPORT *r)
 {
 
-    memset((int8_t *)r, 0xEE, sizeof(USB_FRAME));
+    memset(r->buf, 0xEE, sizeof(r->buf));
 
     int res = 0;
     if (TEST_LIVE_DEVICE) {
 #ifndef CONTINUOUS_INTEGRATION
-        res = hid_read(HID_HANDLE, (uint8_t *) r, sizeof(USB_FRAME));
+        res = hid_read(HID_HANDLE, r->buf, HWW_REPORT_IN_SIZE);
 #endif
     } else {
         static uint8_t *data;
         data = usb_reply_queue_read();
         if (data) {
-            memcpy(r, data, sizeof(USB_FRAME));
-            res = sizeof(USB_FRAME);
+            res = usb_reply_queue_frame_len();
+            memcpy(r->buf, data, res);
         } else {
             res = 0;
         }
     }
 
 
-    if (res == sizeof(USB_FRAME)) {
+    if (res >= (int)sizeof(USB_FRAME)) {
+        TEST_HID_REPORTS_READ++;
         if (TEST_LIVE_DEVICE) {
-            r->cid = ntohl(r->cid);
+            r->f.cid = ntohl(r->f.cid);
         }
         return 0;
     }
@@ -242,10 +282,19 @@ static int api_hid_read_frame(USB_FRAME *r)
 }
 
 
+static int api_hid_read_frame(USB_FRAME *r)
+{
+    static API_HID_REPORT report;
+    int res = api_hid_read_report(&report);
+    memcpy(r, &report.f, sizeof(USB_FRAME));
+    return res;
+}
+
+
 static int api_hid_read_frames(uint32_t cid, uint8_t cmd, void *data, int max)
 {
-    USB_FRAME frame;
-    int res, result;
+    API_HID_REPORT frame;
+    int res, result, size;
     size_t totalLen, frameLen;
     uint8_t seq = 0;
     uint8_t *pData = (uint8_t *) data;
@@ -253,45 +302,48 @@ static int api_hid_read_frames(uint32_t cid, uint8_t cmd, void *data, int max)
     (void) cmd;
 
     do {
-        res = api_hid_read_frame(&frame);
+        res = api_hid_read_report(&frame);
         if (res != 0) {
             return res;
         }
 
-    } while (frame.cid != cid || U2FHID_FRAME_TYPE(frame) != U2FHID_TYPE_INIT);
+    } while (frame.f.cid != cid || U2FHID_FRAME_TYPE(frame.f) != U2FHID_TYPE_INIT ||
+             frame.f.init.cmd == U2FHID_KEEPALIVE);
 
-    if (frame.init.cmd == U2FHID_ERROR) {
-        return -frame.init.data[0];
+    if (frame.f.init.cmd == U2FHID_ERROR) {
+        return -frame.f.init.data[0];
     }
 
-    totalLen = MIN(max, U2FHID_MSG_LEN(frame));
-    frameLen = MIN(sizeof(frame.init.data), totalLen);
+    // Only hardware wallet replies use the negotiated report size
+    size = frame.f.init.cmd == U2FHID_HWW ? HWW_REPORT_IN_SIZE : USB_REPORT_SIZE;
+    totalLen = MIN(max, U2FHID_MSG_LEN(frame.f));
+    frameLen = MIN((size_t)size - USB_FRAME_INIT_HEADER, totalLen);
 
     result = totalLen;
 
-    memcpy(pData, frame.init.data, frameLen);
+    memcpy(pData, frame.buf + USB_FRAME_INIT_HEADER, frameLen);
     totalLen -= frameLen;
     pData += frameLen;
 
     while (totalLen) {
-        res = api_hid_read_frame(&frame);
+        res = api_hid_read_report(&frame);
         if (res != 0) {
             return res;
         }
 
-        if (frame.cid != cid) {
+        if (frame.f.cid != cid) {
             continue;
         }
-        if (U2FHID_FRAME_TYPE(frame) != U2FHID_TYPE_CONT) {
+        if (U2FHID_FRAME_TYPE(frame.f) != U2FHID_TYPE_CONT) {
             return -U2FHID_ERR_INVALID_SEQ;
         }
-        if (U2FHID_FRAME_SEQ(frame) != seq++) {
+        if (U2FHID_FRAME_SEQ(frame.f) != seq++) {
             return -U2FHID_ERR_INVALID_SEQ;
         }
 
-        frameLen = MIN(sizeof(frame.cont.data), totalLen);
+        frameLen = MIN((size_t)size - USB_FRAME_CONT_HEADER, totalLen);
 
-        memcpy(pData, frame.cont.data, frameLen);
+        memcpy(pData, frame.buf + USB_FRAME_CONT_HEADER, frameLen);
         totalLen -= frameLen;
         pData += frameLen;
     }
@@ -300,6 +352,25 @@ static int api_hid_read_frames(uint32_t cid, uint8_t cmd, void *data, int max)
 }
 
 
+// Asks for HWW IN reports of `size` bytes. Falls back to USB_REPORT_SIZE if the firmware
+// does not know the query. Returns the size in use.
+static int api_hid_report_size(int size)
+{
+    uint8_t req[U2FHID_HWW_REPORT_REQ_SIZE], resp[U2FHID_HWW_REPORT_RESP_SIZE];
+    int res;
+    req[0] = (size >> 8) & 0xff;
+    req[1] = size & 0xff;
+    api_hid_send_frames(HWW_CID, U2FHID_HWW_REPORT, req, sizeof(req));
+    res = api_hid_read_frames(HWW_CID, U2FHID_HWW_REPORT, resp, sizeof(resp));
+    if (res != sizeof(resp)) {
+        HWW_REPORT_IN_SIZE = USB_REPORT_SIZE;
+    } else {
+        HWW_REPORT_IN_SIZE = MIN((resp[2] << 8) + resp[3], USB_HWW_REPORT_IN_SIZE);
+    }
+    return HWW_REPORT_IN_SIZE;
+}
+
+
 #ifndef CONTINUOUS_INTEGRATION
 static int api_hid_init(void)
 {
@@ -351,32 +422,53 @@ static void api_hid_read(uint8_t *key)
 }
 
 
+// Vendor defined U2F commands appear to not be enabled in browsers.
+// As an alternative interface, hijack the U2F AUTH key handle data field.
+// Slower but works in browsers without requiring an extension.
+// Sends chunk idx of total, as one key handle of a browser sign request.
+static void api_hid_send_chunk(const char *cmd, int cmdlen, int idx, int total, int more)
+{
+    uint8_t buf[sizeof(USB_APDU) + sizeof(U2F_AUTHENTICATE_REQ)];
+    USB_APDU *a = (USB_APDU *)buf;
+    U2F_AUTHENTICATE_REQ *auth_req = (U2F_AUTHENTICATE_REQ *)a->data;
+    int kh_max_len = U2F_MAX_KH_SIZE - 2;// Subtract bytes for `idx` and `total`.
+
+    memset(buf, 0, sizeof(buf));
+    a->ins = U2F_AUTHENTICATE;
+    a->lc1 = 0;
+    a->lc2 = (sizeof(U2F_AUTHENTICATE_REQ) >> 8) & 255;
+    a->lc3 = (sizeof(U2F_AUTHENTICATE_REQ) & 255);
+    auth_req->keyHandle[0] = total;
+    auth_req->keyHandle[1] = idx | (more ? U2F_HIJACK_MORE : 0);
+    memcpy(auth_req->keyHandle + 2, cmd + idx * kh_max_len, MIN(kh_max_len, MAX(0,
+            cmdlen - idx * kh_max_len)));
+    memcpy(auth_req->challenge, U2F_HIJACK_CODE, U2F_NONCE_LENGTH);
+    api_hid_send_frames(HWW_CID, U2FHID_MSG, buf, sizeof(buf));
+}
+
+
 static void api_hid_send_len(const char *cmd, int cmdlen)
 {
     if (TEST_U2FAUTH_HIJACK) {
-        // Vendor defined U2F commands appear to not be enabled in browsers.
-        // As an alternative interface, hijack the U2F AUTH key handle data field.
-        // Slower but works in browsers without requiring an extension.
-        uint8_t buf[sizeof(USB_APDU) + sizeof(U2F_AUTHENTICATE_REQ)];
-        USB_APDU *a = (USB_APDU *)buf;
-        U2F_AUTHENTICATE_REQ *auth_req = (U2F_AUTHENTICATE_REQ *)a->data;
-
-        int idx;
-        int kh_max_len = U2F_MAX_KH_SIZE - 2;// Subtract bytes for `idx` and `total`.
+        // Several key handles can be packed into one browser sign request. The browser
+        // only returns to the client once a key handle is not rejected.
+        int i, idx;
+        int kh_max_len = U2F_MAX_KH_SIZE - 2;
         int total = cmdlen ? (1 + ((cmdlen - 1) / kh_max_len)) : 1;
 
-        for (idx = 0; idx < total; idx++) {
-            memset(buf, 0, sizeof(buf));
-            a->ins = U2F_AUTHENTICATE;
-            a->lc1 = 0;
-            a->lc2 = (sizeof(U2F_AUTHENTICATE_REQ) >> 8) & 255;
-            a->lc3 = (sizeof(U2F_AUTHENTICATE_REQ) & 255);
-            auth_req->keyHandle[0] = total;
-            auth_req->keyHandle[1] = idx;
-            memcpy(auth_req->keyHandle + 2, cmd + idx * kh_max_len, MIN(kh_max_len, MAX(0,
-                    cmdlen - idx * kh_max_len)));
-            memcpy(auth_req->challenge, U2F_HIJACK_CODE, U2F_NONCE_LENGTH);
-            api_hid_send_frames(HWW_CID, U2FHID_MSG, buf, sizeof(buf));
+        for (i = 0; i < total; i++) {
+            int more = i + 1 < total && (i + 1) % TEST_U2FAUTH_HIJACK_WINDOW;
+            idx = TEST_U2FAUTH_HIJACK_REVERSE && i + 1 < total ? total - 2 - i : i;
+            api_hid_send_chunk(cmd, cmdlen, idx, total, more);
+            if (i + 1 < total) {
+                uint8_t sw[USB_REPORT_SIZE];
+                int len = api_hid_read_frames(HWW_CID, U2FHID_MSG, sw, sizeof(sw));
+                if (len != 2 || sw[0] != 0x6a || sw[1] != 0x80) {
+                    TEST_U2FAUTH_HIJACK_ROUND_TRIPS++;
+                }
+            } else {
+                TEST_U2FAUTH_HIJACK_ROUND_TRIPS++;
+            }
         }
     } else {
         api_hid_send_frames(HWW_CID, U2FHID_HWW, cmd, cmdlen);
@@ -393,7 +485,14 @@ static void api_hid_send(const char *cmd)
 static void api_hid_send_encrypt(const char *cmd, uint8_t *key)
 {
     int enc_len;
-    char *enc = aescbcb64_encrypt((const unsigned char *)cmd, strlens(cmd), &enc_len, key);
+    char *enc;
+    if (TEST_TRANSPORT_CHACHAPOLY) {
+        enc = chachapolyb64_encrypt((const unsigned char *)cmd, strlens(cmd), &enc_len,
+                                    key, AES_KEY_NONE);
+    } else {
+        enc = aescbcb64_encrypt((const unsigned char *)cmd, strlens(cmd), &enc_len, key,
+                                AES_KEY_NONE);
+    }
     api_hid_send_len(enc, enc_len);
     free(enc);
 }
@@ -482,7 +581,7 @@ static char *api_read_value_decrypt(int cmd, uint8_t *key)
 
     int decrypt_len;
     char *dec = aescbcb64_decrypt((const unsigned char *)val, strlens(val),
-                                  &decrypt_len, key);
+                                  &decrypt_len, key, AES_KEY_NONE);
 
     snprintf(val_dec, HID_REPORT_SIZE, "%.*s", decrypt_len, dec);
     free(dec);
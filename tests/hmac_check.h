@@ -59,10 +59,12 @@ static int check_hmac_sha256(const uint8_t *key, const uint32_t keylen,
 }
 
 
-static char *decrypt_and_check_hmac(const unsigned char *in, int inlen, int *out_msg_len,
-                                    const uint8_t *shared_secret, uint8_t *out_hmac)
+// Checks and decrypts a raw [ iv | ciphertext | hmac ], e.g. a
+// COMMANDER_ECHO_FORMAT_RAW echo.
+static char *decrypt_and_check_hmac_raw(const uint8_t *in, int inlen, int *out_msg_len,
+                                        const uint8_t *shared_secret, uint8_t *out_hmac)
 {
-    if (!in || inlen == 0) {
+    if (!in || (inlen % N_BLOCK) || inlen < N_BLOCK + SHA256_DIGEST_LENGTH) {
         return NULL;
     }
 
@@ -71,34 +73,43 @@ static char *decrypt_and_check_hmac(const unsigned char *in, int inlen, int *out
 
     sharedsecret_derive_keys(shared_secret, encryption_key, authentication_key);
 
+    memcpy(out_hmac, in + (inlen - SHA256_DIGEST_LENGTH), SHA256_DIGEST_LENGTH);
+    int hmac_len = inlen - SHA256_DIGEST_LENGTH;
+
+    char *decrypted = NULL;
+    if (check_hmac_sha256(authentication_key, SHA256_DIGEST_LENGTH, in, hmac_len,
+                          out_hmac)) {
+        decrypted = aescbcb64_init_and_decrypt(in,
+                                               inlen - SHA256_DIGEST_LENGTH,
+                                               out_msg_len,
+                                               encryption_key);
+    }
+
+    utils_zero(encryption_key, sizeof(encryption_key));
+    utils_zero(authentication_key, sizeof(authentication_key));
+    return decrypted;
+}
+
+
+static char *decrypt_and_check_hmac(const unsigned char *in, int inlen, int *out_msg_len,
+                                    const uint8_t *shared_secret, uint8_t *out_hmac)
+{
+    if (!in || inlen == 0) {
+        return NULL;
+    }
+
     // Unbase64
     int ub64len;
     unsigned char *ub64 = unbase64((const char *)in, inlen, &ub64len);
     if (!ub64) {
         return NULL;
     }
-    if ((ub64len % N_BLOCK) || ub64len < N_BLOCK) {
-        memset(ub64, 0, ub64len);
-        free(ub64);
-        return NULL;
-    }
 
-    memcpy(out_hmac, ub64 + (ub64len - SHA256_DIGEST_LENGTH), SHA256_DIGEST_LENGTH);
-    int hmac_len = ub64len - SHA256_DIGEST_LENGTH;
-
-    char *decrypted = NULL;
-    if (check_hmac_sha256(authentication_key, SHA256_DIGEST_LENGTH, ub64, hmac_len,
-                          out_hmac)) {
-        decrypted = aescbcb64_init_and_decrypt(ub64,
-                                               ub64len - SHA256_DIGEST_LENGTH,
-                                               out_msg_len,
-                                               encryption_key);
-    }
+    char *decrypted = decrypt_and_check_hmac_raw(ub64, ub64len, out_msg_len, shared_secret,
+                      out_hmac);
 
     memset(ub64, 0, ub64len);
     free(ub64);
-    utils_zero(encryption_key, sizeof(encryption_key));
-    utils_zero(authentication_key, sizeof(authentication_key));
     return decrypted;
 }
 
@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "sd.h"
 #include "ecdh.h"
@@ -39,6 +40,7 @@
 #include "random.h"
 #include "aescbcb64.h"
 #include "commander.h"
+#include "timer.h"
 #include "yajl/src/api/yajl_tree.h"
 #include "secp256k1/include/secp256k1.h"
 #include "secp256k1/include/secp256k1_recovery.h"
@@ -1590,6 +1592,71 @@ static void tests_input(void)
 }
 
 
+static void tests_transport_suite(void)
+{
+    int enc_len;
+    char *enc, *c;
+    const char *cmd = "{\"name\": \"chacha\"}";
+
+    api_reset_device();
+
+    api_format_send_cmd(cmd_str(CMD_password), tests_pwd, NULL);
+    ASSERT_SUCCESS;
+
+    api_format_send_cmd(cmd_str(CMD_device), attr_str(ATTR_info), KEY_STANDARD);
+    ASSERT_REPORT_HAS_NOT(attr_str(ATTR_error));
+    ASSERT_REPORT_HAS("\"suites\":[\"aes-256-cbc\",\"chacha20-poly1305\"]");
+
+    TEST_TRANSPORT_CHACHAPOLY = 1;
+
+    api_send_cmd(cmd, KEY_STANDARD);
+    ASSERT_REPORT_HAS_NOT(attr_str(ATTR_error));
+    ASSERT_REPORT_HAS("\"name\":\"chacha\"");
+    if (!TEST_U2FAUTH_HIJACK) {
+        // The reply is sealed in the suite of the request
+        u_assert_str_has((char *)HID_REPORT, "\"ciphertext\":\"" CHACHAPOLYB64_PREFIX);
+    }
+
+    api_format_send_cmd(cmd_str(CMD_device), attr_str(ATTR_info), KEY_STANDARD);
+    ASSERT_REPORT_HAS_NOT(attr_str(ATTR_error));
+    ASSERT_REPORT_HAS("\"name\":\"chacha\"");
+
+    // Wrong key
+    api_send_cmd(cmd, KEY_HIDDEN);
+    ASSERT_REPORT_HAS(flag_msg(DBB_ERR_IO_JSON_PARSE));
+
+    // Tampered ciphertext and tag
+    enc = chachapolyb64_encrypt((const unsigned char *)cmd, strlens(cmd), &enc_len,
+                                KEY_STANDARD, AES_KEY_NONE);
+    u_assert(enc);
+    c = enc + CHACHAPOLYB64_PREFIX_LEN + 20;
+    *c = *c == 'A' ? 'B' : 'A';
+    api_hid_send_len(enc, enc_len);
+    api_hid_read(KEY_STANDARD);
+    ASSERT_REPORT_HAS(flag_msg(DBB_ERR_IO_JSON_PARSE));
+    free(enc);
+
+    enc = chachapolyb64_encrypt((const unsigned char *)cmd, strlens(cmd), &enc_len,
+                                KEY_STANDARD, AES_KEY_NONE);
+    u_assert(enc);
+    c = enc + enc_len - 4;
+    *c = *c == 'A' ? 'B' : 'A';
+    api_hid_send_len(enc, enc_len);
+    api_hid_read(KEY_STANDARD);
+    ASSERT_REPORT_HAS(flag_msg(DBB_ERR_IO_JSON_PARSE));
+    free(enc);
+
+    TEST_TRANSPORT_CHACHAPOLY = 0;
+
+    // Both suites remain usable
+    api_send_cmd(cmd, KEY_STANDARD);
+    ASSERT_REPORT_HAS("\"name\":\"chacha\"");
+    if (!TEST_U2FAUTH_HIJACK) {
+        u_assert_str_has_not((char *)HID_REPORT, CHACHAPOLYB64_PREFIX);
+    }
+}
+
+
 static void tests_password(void)
 {
     char cmd[512], xpub_std[112], xpub_hdn[112], xpub_tst[112];
@@ -1910,6 +1977,10 @@ static void tests_echo_tfa(void)
         "{\"meta\":\"hash\", \"data\":[{\"keypath\":\"m/44'/0'/0'/1/7\", \"hash\":\"ffff456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\"}] }";
     char hash_sign3[] =
         "{\"meta\":\"hash\", \"data\":[{\"keypath\":\"m/44'/0'/0'/1/7\", \"hash\":\"456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\"}] }";
+    char hash_sign_raw[] =
+        "{\"meta\":\"hash\", \"echo_format\":\"2\", \"data\":[{\"keypath\":\"m/44'/0'/0'/1/7\", \"hash\":\"0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\"}] }";
+    char hash_sign_unknown[] =
+        "{\"meta\":\"hash\", \"echo_format\":\"99\", \"data\":[{\"keypath\":\"m/44'/0'/0'/1/7\", \"hash\":\"0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\"}] }";
 
     api_reset_device();
 
@@ -1990,6 +2061,35 @@ static void tests_echo_tfa(void)
     ASSERT_REPORT_HAS(cmd_str(CMD_recid));
     ASSERT_REPORT_HAS(cmd_str(CMD_sig));
 
+    // test raw echo format
+    api_format_send_cmd(cmd_str(CMD_sign), hash_sign_raw, KEY_STANDARD);
+    ASSERT_REPORT_HAS(cmd_str(CMD_echo_format));
+    if (!TEST_LIVE_DEVICE) {
+        int len, raw_len;
+        uint8_t hmac[SHA256_DIGEST_LENGTH];
+        const uint8_t *raw = api_read_decrypted_report_raw(&raw_len);
+        char *echo = decrypt_and_check_hmac_raw(raw, raw_len, &len,
+                                                memory_report_aeskey(TFA_SHARED_SECRET), hmac);
+        u_assert(echo);
+        u_assert_str_has(echo,
+                         "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef");
+        u_assert_str_has_not(echo, cmd_str(CMD_echo_format));
+        free(echo);
+    }
+
+    api_format_send_cmd(cmd_str(CMD_sign), "", KEY_STANDARD);
+    ASSERT_REPORT_HAS_NOT(cmd_str(CMD_echo));
+    ASSERT_REPORT_HAS(cmd_str(CMD_recid));
+    ASSERT_REPORT_HAS(cmd_str(CMD_sig));
+
+    // unknown formats fall back to the base64 echo
+    api_format_send_cmd(cmd_str(CMD_sign), hash_sign_unknown, KEY_STANDARD);
+    ASSERT_REPORT_HAS_NOT(cmd_str(CMD_echo_format));
+    ASSERT_REPORT_HAS(cmd_str(CMD_echo));
+
+    api_format_send_cmd(cmd_str(CMD_sign), "", KEY_STANDARD);
+    ASSERT_REPORT_HAS(cmd_str(CMD_sig));
+
     // test hash length
     api_format_send_cmd(cmd_str(CMD_sign), hash_sign3, KEY_STANDARD);
     ASSERT_REPORT_HAS(cmd_str(CMD_echo));
@@ -2096,15 +2196,44 @@ static int recover_public_key_verify_sig(const char *sig, const char *hash,
     }
 
 #else
-    (void) sig;
-    (void) hash;
-    (void) recid;
-    (void) pubkey;
+    uint8_t hash_b[32];
+    uint8_t sig_b[64];
+    uint8_t recid_b;
+    uint8_t pubkey_65[65];
+    uint8_t pubkey_33[33];
+
+    memcpy(hash_b, utils_hex_to_uint8(hash), 32);
+    memcpy(sig_b, utils_hex_to_uint8(sig), 64);
+    memcpy(&recid_b, utils_hex_to_uint8(recid), 1);
+
+    if (ecc_recover_public_key_digest(sig_b, hash_b, recid_b, pubkey_65, ECC_SECP256k1)) {
+        return 1;
+    }
+    pubkey_33[0] = 0x02 | (pubkey_65[64] & 0x01);
+    memcpy(pubkey_33 + 1, pubkey_65 + 1, 32);
+
+    if (ecc_verify_digest(pubkey_65 + 1, hash_b, sig_b, ECC_SECP256k1)) {
+        return 1;
+    }
+
+    if (!MEMEQ(utils_hex_to_uint8(pubkey), pubkey_33, 33)) {
+        return 1;
+    }
 #endif
     return 0; // success
 }
 
 
+// The sign reply pairs each signature with its recovery id
+static void tests_assert_sig_recid(const char *sig, const char *recid)
+{
+    char sig_recid[128 + 32];
+    snprintf(sig_recid, sizeof(sig_recid), "%s\", \"%s\":\"%s\"", sig, cmd_str(CMD_recid),
+             recid);
+    ASSERT_REPORT_HAS(sig_recid);
+}
+
+
 // hash_1_input is normalized (low-S). The non-normalized value is "61e87a12a111987e3bef9dffd4b30a0322f2cc74e65a19aa551a3eaa8f417d0be7cfa5ad06beac67f09192bc7c213396b8277831b939d52e95a97749772f112f"
 const char hash_1_input[] =
     "61e87a12a111987e3bef9dffd4b30a0322f2cc74e65a19aa551a3eaa8f417d0b18305a52f94153980f6e6d4383decc68028764b4f60ecb0d2a28e74359073012";
@@ -2114,6 +2243,40 @@ const char hash_2_input_2[] =
     "529e01807f073dd80a0c9c2b3cc9130a06b88c033577ccc426a383eaadac5b7201923aef70ded7509adfa6282fcb6ff9f0fba16f87c82d5c9810c3da3029cc7d";
 
 
+// Largest number of inputs whose sign echo fits in one reply in the given echo format
+static int tests_sign_echo_capacity(int format)
+{
+    char hashstr[] =
+        "{\"hash\":\"0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\", \"keypath\":\"m/44p/0p/0p/0/9999\"}";
+    char cmd[COMMANDER_REPORT_SIZE];
+    int i, n;
+
+    for (n = 1; ; n++) {
+        snprintf(cmd, sizeof(cmd),
+                 "{\"meta\":\"0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef\", \"echo_format\":\"%i\", \"data\":[",
+                 format);
+        for (i = 0; i < n; i++) {
+            if (strlens(cmd) + strlens(hashstr) + 8 > sizeof(cmd) / 4 * 3 - 64) {
+                return n - 1;// command itself would not fit
+            }
+            strcat(cmd, i ? "," : "");
+            strcat(cmd, hashstr);
+        }
+        strcat(cmd, "]}");
+
+        api_format_send_cmd(cmd_str(CMD_sign), cmd, KEY_STANDARD);
+        int fits = strstr(api_read_decrypted_report(), cmd_str(CMD_echo)) &&
+                   !strstr(api_read_decrypted_report(), attr_str(ATTR_error));
+
+        // leave the signing state without signing
+        api_format_send_cmd(cmd_str(CMD_random), attr_str(ATTR_pseudo), KEY_STANDARD);
+        if (!fits) {
+            return n - 1;
+        }
+    }
+}
+
+
 static void tests_sign(void)
 {
     int i, res;
@@ -2246,6 +2409,14 @@ static void tests_sign(void)
     api_format_send_cmd(cmd_str(CMD_sign), "", KEY_STANDARD);
     ASSERT_REPORT_HAS(flag_msg(DBB_ERR_IO_REPORT_BUF));
 
+    // inputs per echo report in each echo format
+    int echo_b64 = tests_sign_echo_capacity(COMMANDER_ECHO_FORMAT_B64);
+    int echo_raw = tests_sign_echo_capacity(COMMANDER_ECHO_FORMAT_RAW);
+    u_print_info("Max inputs per echo: %i (base64 echo), %i (raw echo)\n", echo_b64,
+                 echo_raw);
+    u_assert_int_eq(echo_b64 >= COMMANDER_NUM_SIG_MIN, 1);
+    u_assert_int_eq(echo_raw > echo_b64, 1);
+
     // sig using no inputs
     api_format_send_cmd(cmd_str(CMD_sign), "{\"meta\":\"_meta_data_\", \"data\":[]}",
                         KEY_STANDARD);
@@ -2275,6 +2446,7 @@ static void tests_sign(void)
     api_format_send_cmd(cmd_str(CMD_sign), "", KEY_STANDARD);
     ASSERT_REPORT_HAS(cmd_str(CMD_recid));
     ASSERT_REPORT_HAS(hash_1_input);
+    tests_assert_sig_recid(hash_1_input, recid_1_input);
     res = recover_public_key_verify_sig(hash_1_input, one_input_msg, recid_1_input,
                                         pubkey_1_input);
     u_assert_int_eq(res, 0);
@@ -2300,6 +2472,8 @@ static void tests_sign(void)
     ASSERT_REPORT_HAS(hash_2_input_1);
     ASSERT_REPORT_HAS(hash_2_input_2);
     ASSERT_REPORT_HAS(cmd_str(CMD_recid));
+    tests_assert_sig_recid(hash_2_input_1, recid_2_input_1);
+    tests_assert_sig_recid(hash_2_input_2, recid_2_input_2);
     res = recover_public_key_verify_sig(hash_2_input_1, two_input_msg_1, recid_2_input_1,
                                         pubkey_2_input_1);
     u_assert_int_eq(res, 0);
@@ -2476,6 +2650,198 @@ static void tests_sign(void)
 }
 
 
+// Browser sign requests needed for a 14-input sign through the hijack interface, with
+// one key handle per request and with several key handles packed into each request.
+// The chunks of a command are also sent out of order.
+static void tests_u2f_hijack_window(void)
+{
+    char cmd[COMMANDER_REPORT_SIZE];
+    char input[128];
+    static char sign_report[4][COMMANDER_REPORT_SIZE];
+    int window[4] = { 1, 8, 1, 8 };
+    int trips_echo[4], trips_sign[4];
+    int i, w, test_u2fauth_hijack = TEST_U2FAUTH_HIJACK;
+
+    strcpy(cmd, "{\"meta\":\"_meta_data_\", \"data\":[");
+    for (i = 0; i < 14; i++) {
+        snprintf(input, sizeof(input),
+                 "%s{\"hash\":\"%064i\", \"keypath\":\"m/44'/0'/0'/0/%i\"}",
+                 i ? "," : "", i + 1, i);
+        strcat(cmd, input);
+    }
+    strcat(cmd, "]}");
+
+    api_reset_device();
+
+    api_format_send_cmd(cmd_str(CMD_password), tests_pwd, NULL);
+    ASSERT_SUCCESS;
+
+    api_format_send_cmd(cmd_str(CMD_backup), attr_str(ATTR_erase), KEY_STANDARD);
+    ASSERT_SUCCESS;
+
+    api_format_send_cmd(cmd_str(CMD_seed),
+                        "{\"key\":\"key\", \"source\":\"create\", \"entropy\":\"entropy_rawH13ucR3\", \"raw\":\"true\", \"filename\":\"w.pdf\"}",
+                        KEY_STANDARD);
+    ASSERT_REPORT_HAS_NOT(attr_str(ATTR_error));
+
+    api_format_send_cmd(cmd_str(CMD_backup), attr_str(ATTR_erase), KEY_STANDARD);
+    ASSERT_SUCCESS;
+
+    TEST_U2FAUTH_HIJACK = 1;
+    for (w = 0; w < 4; w++) {
+        TEST_U2FAUTH_HIJACK_WINDOW = window[w];
+        TEST_U2FAUTH_HIJACK_REVERSE = w >= 2;
+
+        TEST_U2FAUTH_HIJACK_ROUND_TRIPS = 0;
+        api_format_send_cmd(cmd_str(CMD_sign), cmd, KEY_STANDARD);
+        ASSERT_REPORT_HAS(cmd_str(CMD_echo));
+        trips_echo[w] = TEST_U2FAUTH_HIJACK_ROUND_TRIPS;
+
+        TEST_U2FAUTH_HIJACK_ROUND_TRIPS = 0;
+        api_format_send_cmd(cmd_str(CMD_sign), "", KEY_STANDARD);
+        ASSERT_REPORT_HAS_NOT(attr_str(ATTR_error));
+        ASSERT_REPORT_HAS(cmd_str(CMD_recid));
+        trips_sign[w] = TEST_U2FAUTH_HIJACK_ROUND_TRIPS;
+        snprintf(sign_report[w], sizeof(sign_report[w]), "%s",
+                 api_read_decrypted_report());
+    }
+    TEST_U2FAUTH_HIJACK_WINDOW = 1;
+    TEST_U2FAUTH_HIJACK_REVERSE = 0;
+    TEST_U2FAUTH_HIJACK = test_u2fauth_hijack;
+
+    u_print_info("14-input sign round trips: %i (1 key handle per request), %i (%i)\n",
+                 trips_echo[0] + trips_sign[0], trips_echo[1] + trips_sign[1], window[1]);
+    u_assert_int_eq(trips_echo[0] > window[1], 1);
+    u_assert_int_eq(trips_echo[1], (trips_echo[0] + window[1] - 1) / window[1]);
+    u_assert_int_eq(trips_sign[1], (trips_sign[0] + window[1] - 1) / window[1]);
+    u_assert_str_eq(sign_report[0], sign_report[1]);
+    u_assert_str_eq(sign_report[0], sign_report[2]);
+    u_assert_str_eq(sign_report[0], sign_report[3]);
+}
+
+
+// The chunks of a command abandoned before its last chunk expire, so that they are not
+// spliced into a later command whose last chunk arrives first
+static void tests_u2f_hijack_abandoned(void)
+{
+    char cmd[2][3 * (U2F_MAX_KH_SIZE - 2)];
+    uint8_t sw[USB_REPORT_SIZE];
+    int i, len, test_u2fauth_hijack = TEST_U2FAUTH_HIJACK;
+
+    api_reset_device();
+
+    api_format_send_cmd(cmd_str(CMD_password), tests_pwd, NULL);
+    ASSERT_SUCCESS;
+
+    memset(cmd[0], 'a', sizeof(cmd[0]));
+    memset(cmd[1], 'b', sizeof(cmd[1]));
+    for (i = 0; i < 2; i++) {
+        api_hid_send_chunk(cmd[0], sizeof(cmd[0]), i, 3, 1);
+        len = api_hid_read_frames(HWW_CID, U2FHID_MSG, sw, sizeof(sw));
+        u_assert_int_eq(len, 2);
+        u_assert_int_eq((sw[0] << 8) | sw[1], U2F_SW_WRONG_DATA);
+    }
+
+    // Longer than the U2F timeout
+    if (TEST_LIVE_DEVICE) {
+        usleep(600 * 1000);
+    } else {
+        timer_sim_advance(600 * 1000);
+    }
+
+    api_hid_send_chunk(cmd[1], sizeof(cmd[1]), 2, 3, 0);
+    len = api_hid_read_frames(HWW_CID, U2FHID_MSG, sw, sizeof(sw));
+    u_assert_int_eq(len, 2);
+    u_assert_int_eq((sw[0] << 8) | sw[1], U2F_SW_WRONG_DATA);
+
+    // A reordered command still runs
+    TEST_U2FAUTH_HIJACK = 1;
+    TEST_U2FAUTH_HIJACK_REVERSE = 1;
+    api_format_send_cmd(cmd_str(CMD_random), attr_str(ATTR_pseudo), KEY_STANDARD);
+    TEST_U2FAUTH_HIJACK_REVERSE = 0;
+    TEST_U2FAUTH_HIJACK = test_u2fauth_hijack;
+    ASSERT_REPORT_HAS(cmd_str(CMD_random));
+}
+
+
+static void tests_hww_report_size(void)
+{
+    char cmd[COMMANDER_REPORT_SIZE];
+    char input[128];
+    char keypath[] = "m/44'/0'/";
+    static char replies[3][2][COMMANDER_REPORT_SIZE];
+    const char *name[3] = { "xpub", "backup list", "14-input sign" };
+    int size[2] = { USB_REPORT_SIZE, USB_HWW_REPORT_IN_SIZE };
+    int reports[3][2];
+    int i, s, test_u2fauth_hijack = TEST_U2FAUTH_HIJACK;
+
+    strcpy(cmd, "{\"meta\":\"_meta_data_\", \"data\":[");
+    for (i = 0; i < 14; i++) {
+        snprintf(input, sizeof(input),
+                 "%s{\"hash\":\"%064i\", \"keypath\":\"m/44'/0'/0'/0/%i\"}",
+                 i ? "," : "", i + 1, i);
+        strcat(cmd, input);
+    }
+    strcat(cmd, "]}");
+
+    // Report sizes only apply to the HWW interface
+    TEST_U2FAUTH_HIJACK = 0;
+
+    api_reset_device();
+
+    api_format_send_cmd(cmd_str(CMD_password), tests_pwd, NULL);
+    ASSERT_SUCCESS;
+
+    api_format_send_cmd(cmd_str(CMD_backup), attr_str(ATTR_erase), KEY_STANDARD);
+    ASSERT_SUCCESS;
+
+    api_format_send_cmd(cmd_str(CMD_seed),
+                        "{\"key\":\"key\", \"source\":\"create\", \"entropy\":\"entropy_rawH13ucR3\", \"raw\":\"true\", \"filename\":\"report_size.pdf\"}",
+                        KEY_STANDARD);
+    ASSERT_REPORT_HAS_NOT(attr_str(ATTR_error));
+
+    if (api_hid_report_size(USB_HWW_REPORT_IN_SIZE) == USB_REPORT_SIZE) {
+        u_print_info("HWW interface does not offer larger IN reports\n");
+        goto exit;
+    }
+
+    for (s = 0; s < 2; s++) {
+        u_assert_int_eq(api_hid_report_size(size[s]), size[s]);
+
+        TEST_HID_REPORTS_READ = 0;
+        api_format_send_cmd(cmd_str(CMD_xpub), keypath, KEY_STANDARD);
+        ASSERT_REPORT_HAS_NOT(attr_str(ATTR_error));
+        reports[0][s] = TEST_HID_REPORTS_READ;
+        snprintf(replies[0][s], sizeof(replies[0][s]), "%s", api_read_value(CMD_xpub));
+
+        TEST_HID_REPORTS_READ = 0;
+        api_format_send_cmd(cmd_str(CMD_backup), attr_str(ATTR_list), KEY_STANDARD);
+        ASSERT_REPORT_HAS("report_size.pdf");
+        reports[1][s] = TEST_HID_REPORTS_READ;
+        snprintf(replies[1][s], sizeof(replies[1][s]), "%s", api_read_decrypted_report());
+
+        TEST_HID_REPORTS_READ = 0;
+        api_format_send_cmd(cmd_str(CMD_sign), cmd, KEY_STANDARD);
+        ASSERT_REPORT_HAS(cmd_str(CMD_echo));
+        api_format_send_cmd(cmd_str(CMD_sign), "", KEY_STANDARD);
+        ASSERT_REPORT_HAS(cmd_str(CMD_recid));
+        reports[2][s] = TEST_HID_REPORTS_READ;
+        snprintf(replies[2][s], sizeof(replies[2][s]), "%s", api_read_decrypted_report());
+    }
+
+    for (i = 0; i < 3; i++) {
+        u_print_info("%s IN reports: %i (%i-byte), %i (%i-byte)\n", name[i],
+                     reports[i][0], size[0], reports[i][1], size[1]);
+        u_assert_int_eq(reports[i][1] < reports[i][0], 1);
+        u_assert_str_eq(replies[i][0], replies[i][1]);
+    }
+
+exit:
+    api_hid_report_size(USB_REPORT_SIZE);
+    TEST_U2FAUTH_HIJACK = test_u2fauth_hijack;
+}
+
+
 static void tests_memory_setup(void)
 {
     uint8_t key_00[MEM_PAGE_LEN];
@@ -2519,8 +2885,12 @@ static void run_utests(void)
     u_run_test(tests_random);
     u_run_test(tests_device);
     u_run_test(tests_input);
+    u_run_test(tests_transport_suite);
     u_run_test(tests_seed_xpub_backup);
     u_run_test(tests_sign);
+    u_run_test(tests_u2f_hijack_window);
+    u_run_test(tests_u2f_hijack_abandoned);
+    u_run_test(tests_hww_report_size);
 
     if (!U_TESTS_FAIL) {
         printf("\nALL %i TESTS PASSED\n\n", U_TESTS_RUN);
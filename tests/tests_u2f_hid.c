@@ -21,8 +21,11 @@
 #include "memory.h"
 #include "utils.h"
 #include "ecc.h"
+#include "touch.h"
+#include "timer.h"
 
 #include "usb.h"
+#include "u2f_device.h"
 #include "u2f/u2f.h"
 #include "u2f/u2f_hid.h"
 #include "u2f/u2f_util_t.h"
@@ -49,6 +52,34 @@ static void initFrame(USB_FRAME *f, uint32_t cid, uint8_t cmd,
     }
 }
 
+// Initialize a continuation frame with |len| bytes of data.
+static void initCont(USB_FRAME *f, uint32_t cid, uint8_t seq, size_t len,
+                     const void *data)
+{
+    memset(f, 0, sizeof(USB_FRAME));
+    f->cid = cid;
+    f->cont.seq = seq;
+    memcpy(f->cont.data, data, MIN(len, sizeof(f->cont.data)));
+}
+
+// Advance the simulated clock by |ms| and check the device deadlines, as its start of
+// frame interrupt would.
+static void tick_Timeout(uint32_t ms)
+{
+    timer_sim_advance((uint64_t)ms * 1000);
+    u2f_device_timeout();
+}
+
+// Let the device time out on messages waiting for continuation frames.
+static void wait_Timeout(void)
+{
+    if (!U2Fob_liveDeviceTesting()) {
+        for (int i = 0; i < 13; i++) {
+            tick_Timeout(40);
+        }
+    }
+}
+
 // Return true if frame r is error frame for expected error.
 static bool isError(const USB_FRAME r, int error)
 {
@@ -334,34 +365,322 @@ static void test_NotFirst(void)
     CHECK_EQ(-U2FHID_ERR_MSG_TIMEOUT, U2Fob_receiveHidFrame(device, &r, 1.0));
 }
 
-// Check we get a BUSY if device is waiting for CONT on other channel.
+// Check we get a BUSY if the device is waiting for CONT on as many other channels as it
+// can reassemble at the same time.
 static void test_Busy(void)
 {
     USB_FRAME f, r;
+    uint32_t n;
     uint64_t t = 0;
     U2Fob_deltaTime(&t);
 
     initFrame(&f, U2Fob_getCid(device), U2FHID_PING, 99, NULL);
 
-    SEND(f);
-
-    f.cid ^= 1;  // Flip channel.
-
-    SEND(f);
-    RECV(r, 1.0);
+    for (n = 0; n < 16; n++) {
+        f.cid = U2Fob_getCid(device) ^ n;  // Next channel.
+        SEND(f);
+        if (U2Fob_receiveHidFrame(device, &r, .05f) == 0) {
+            break;
+        }
+    }
+    CHECK_GT(n, 1);
+    CHECK_LT(n, 16);
     CHECK_EQ(f.cid, r.cid);
 
-    CHECK_LT(U2Fob_deltaTime(&t), .1);  // Expect busy reply quickly.
+    CHECK_LT(U2Fob_deltaTime(&t), .1 * n);  // Expect busy reply quickly.
     CHECK_EQ(isError(r, U2FHID_ERR_CHANNEL_BUSY), true);
 
-    f.cid ^= 1;  // Flip back.
+    // Expect T/O msg on every waiting channel.
+    wait_Timeout();
+    for (uint32_t i = 0; i < n; i++) {
+        RECV(r, 1.0);
+        CHECK_EQ(isError(r, U2FHID_ERR_MSG_TIMEOUT), true);
+        CHECK_LT((r.cid ^ U2Fob_getCid(device)), n);
+    }
+
+    if (U2Fob_liveDeviceTesting()) {
+        CHECK_GE(U2Fob_deltaTime(&t), .45);  // Expect T/O msg only after timeout.
+    }
+}
 
+// Check that messages sent on different channels at the same time are reassembled
+// independently, and that errors on one channel do not abort the others.
+static void test_Interleave(void)
+{
+    USB_FRAME a, b, c, r;
+    uint8_t data_a[99], data_b[99];
+    const size_t init_len = sizeof(a.init.data);
+
+    for (size_t i = 0; i < sizeof(data_a); ++i) {
+        data_a[i] = rand();
+        data_b[i] = rand();
+    }
+    initFrame(&a, U2Fob_getCid(device), U2FHID_PING, sizeof(data_a), data_a);
+    initFrame(&b, U2Fob_getCid(device) ^ 1, U2FHID_PING, sizeof(data_b), data_b);
+    SEND(a);
+    SEND(b);
+
+    // INIT on a third channel is answered right away.
+    initFrame(&c, U2Fob_getCid(device) ^ 2, U2FHID_INIT, U2FHID_INIT_NONCE_SIZE, NULL);
+    SEND(c);
     RECV(r, 1.0);
-    CHECK_EQ(f.cid, r.cid);
+    CHECK_EQ(c.cid, r.cid);
+    CHECK_EQ(r.init.cmd, U2FHID_INIT);
+
+    // Complete the second message first.
+    initCont(&c, b.cid, 0, sizeof(data_b) - init_len, data_b + init_len);
+    SEND(c);
+    RECV(r, 1.0);
+    CHECK_EQ(b.cid, r.cid);
+    CHECK_EQ(r.init.cmd, U2FHID_PING);
+    CHECK_EQ(U2FHID_MSG_LEN(r), sizeof(data_b));
+    CHECK_EQ(0, memcmp(r.init.data, data_b, init_len));
+    RECV(r, 1.0);
+    CHECK_EQ(b.cid, r.cid);
+    CHECK_EQ(r.cont.seq, 0);
+    CHECK_EQ(0, memcmp(r.cont.data, data_b + init_len, sizeof(data_b) - init_len));
+
+    // Wrong sequence on the second channel.
+    SEND(b);
+    c.cont.seq = 1;
+    SEND(c);
+    RECV(r, 1.0);
+    CHECK_EQ(b.cid, r.cid);
+    CHECK_EQ(isError(r, U2FHID_ERR_INVALID_SEQ), true);
+
+    // The first message is still being reassembled.
+    initCont(&c, a.cid, 0, sizeof(data_a) - init_len, data_a + init_len);
+    SEND(c);
+    RECV(r, 1.0);
+    CHECK_EQ(a.cid, r.cid);
+    CHECK_EQ(r.init.cmd, U2FHID_PING);
+    CHECK_EQ(U2FHID_MSG_LEN(r), sizeof(data_a));
+    CHECK_EQ(0, memcmp(r.init.data, data_a, init_len));
+    RECV(r, 1.0);
+    CHECK_EQ(a.cid, r.cid);
+    CHECK_EQ(0, memcmp(r.cont.data, data_a + init_len, sizeof(data_a) - init_len));
 
+    // Check there are no further messages.
+    CHECK_EQ(-U2FHID_ERR_MSG_TIMEOUT, U2Fob_receiveHidFrame(device, &r, 0.6f));
+}
+
+// Check that each channel times out on its own schedule.
+static void test_InterleaveTimeout(void)
+{
+    USB_FRAME a, b, r;
+
+    initFrame(&a, U2Fob_getCid(device), U2FHID_PING, 99, NULL);
+    initFrame(&b, U2Fob_getCid(device) ^ 1, U2FHID_PING, 99, NULL);
+
+    SEND(a);
+    for (int i = 0; i < 7; i++) {
+        tick_Timeout(40);
+    }
+    SEND(b);
+    for (int i = 0; i < 7; i++) {
+        tick_Timeout(40);
+    }
+
+    // Only the first channel timed out.
+    RECV(r, 1.0);
+    CHECK_EQ(a.cid, r.cid);
     CHECK_EQ(isError(r, U2FHID_ERR_MSG_TIMEOUT), true);
+    CHECK_EQ(-U2FHID_ERR_MSG_TIMEOUT, U2Fob_receiveHidFrame(device, &r, 0.6f));
+
+    initCont(&a, b.cid, 0, 99 - sizeof(b.init.data), b.init.data);
+    SEND(a);
+    RECV(r, 1.0);
+    CHECK_EQ(b.cid, r.cid);
+    CHECK_EQ(r.init.cmd, U2FHID_PING);
+    CHECK_EQ(U2FHID_MSG_LEN(r), 99);
+    RECV(r, 1.0);
+    CHECK_EQ(b.cid, r.cid);
+    CHECK_EQ(-U2FHID_ERR_MSG_TIMEOUT, U2Fob_receiveHidFrame(device, &r, 0.6f));
+}
 
-    CHECK_GE(U2Fob_deltaTime(&t), .45);  // Expect T/O msg only after timeout.
+static struct {
+    int keepalives;
+    uint16_t elapsed_ms;
+} touch_wait;
+
+// Receive all queued frames, counting the keepalives on the channel waiting for a touch.
+// Returns the number of other frames and keeps the first of them in r.
+static int touch_Drain(USB_FRAME *r)
+{
+    USB_FRAME f;
+    int n = 0;
+
+    while (U2Fob_receiveHidFrame(device, &f, 1.0) == 0) {
+        if (f.init.cmd == U2FHID_KEEPALIVE) {
+            CHECK_EQ(f.cid, U2Fob_getCid(device));
+            CHECK_EQ(U2FHID_MSG_LEN(f), U2FHID_KEEPALIVE_SIZE);
+            CHECK_EQ(f.init.data[0], U2FHID_KEEPALIVE_UPNEEDED);
+            touch_wait.keepalives++;
+        } else if (n++ == 0) {
+            *r = f;
+        }
+    }
+    return n;
+}
+
+// Runs between touch measurements as the USB interrupts of the device would
+static void touch_Tick(uint16_t elapsed_ms)
+{
+    USB_FRAME r;
+
+    touch_wait.elapsed_ms = elapsed_ms;
+    u2f_device_timeout();
+    CHECK_EQ(touch_Drain(&r), 0);
+}
+
+// Other channels and the HWW interface are served while a request waits for a touch
+static void touch_Busy(uint16_t elapsed_ms)
+{
+    USB_FRAME f, r;
+    uint32_t other = U2Fob_getCid(device) ^ 1;
+
+    touch_Tick(elapsed_ms);
+
+    switch (elapsed_ms) {
+        case 250:
+            initFrame(&f, other, U2FHID_INIT, U2FHID_INIT_NONCE_SIZE, NULL);
+            SEND(f);
+            CHECK_EQ(touch_Drain(&r), 1);
+            CHECK_EQ(r.cid, other);
+            CHECK_EQ(r.init.cmd, U2FHID_INIT);
+            CHECK_EQ(memcmp(f.init.data, r.init.data, U2FHID_INIT_NONCE_SIZE), 0);
+            break;
+        case 500:
+            initFrame(&f, other, U2FHID_PING, 10, NULL);
+            SEND(f);
+            CHECK_EQ(touch_Drain(&r), 1);
+            CHECK_EQ(r.cid, other);
+            CHECK_EQ(r.init.cmd, U2FHID_PING);
+            CHECK_EQ(memcmp(f.init.data, r.init.data, 10), 0);
+            break;
+        case 750:
+            initFrame(&f, other, U2FHID_MSG, 10, NULL);
+            SEND(f);
+            CHECK_EQ(touch_Drain(&r), 1);
+            CHECK_EQ(r.cid, other);
+            CHECK_EQ(isError(r, U2FHID_ERR_CHANNEL_BUSY), true);
+            break;
+        case 1000:
+            initFrame(&f, U2Fob_getCid(device), U2FHID_PING, 10, NULL);
+            SEND(f);
+            CHECK_EQ(touch_Drain(&r), 1);
+            CHECK_EQ(r.cid, U2Fob_getCid(device));
+            CHECK_EQ(isError(r, U2FHID_ERR_CHANNEL_BUSY), true);
+            break;
+        case 1250:
+            initFrame(&f, 0xff000000, U2FHID_HWW, 10, NULL);
+            usb_hww_report((const unsigned char *)&f);
+            CHECK_EQ(touch_Drain(&r), 1);
+            CHECK_EQ(r.cid, 0xff000000);
+            CHECK_EQ(isError(r, U2FHID_ERR_CHANNEL_BUSY), true);
+            break;
+        default:
+            break;
+    }
+}
+
+// An INIT on the waiting channel aborts the request
+static void touch_Cancel(uint16_t elapsed_ms)
+{
+    USB_FRAME f, r;
+
+    touch_Tick(elapsed_ms);
+
+    if (elapsed_ms == 250) {
+        initFrame(&f, U2Fob_getCid(device), U2FHID_INIT, U2FHID_INIT_NONCE_SIZE, NULL);
+        SEND(f);
+        CHECK_EQ(touch_Drain(&r), 1);
+        CHECK_EQ(r.cid, U2Fob_getCid(device));
+        CHECK_EQ(r.init.cmd, U2FHID_INIT);
+    }
+}
+
+static USB_FRAME touch_nested;
+
+// A request opened before the touch wait began is refused when it completes during it
+static void touch_Nested(uint16_t elapsed_ms)
+{
+    USB_FRAME r;
+
+    touch_Tick(elapsed_ms);
+
+    if (elapsed_ms == 250) {
+        SEND(touch_nested);
+        CHECK_EQ(touch_Drain(&r), 1);
+        CHECK_EQ(r.cid, touch_nested.cid);
+        CHECK_EQ(isError(r, U2FHID_ERR_CHANNEL_BUSY), true);
+    }
+}
+
+// Send a U2F register request, which waits for a touch, and return its status word
+static int touch_Register(uint16_t press_ms, touch_sim_event event)
+{
+    uint8_t apdu[sizeof(USB_APDU) + sizeof(U2F_REGISTER_REQ)];
+    uint8_t resp[1024], cmd;
+    USB_APDU *a = (USB_APDU *)apdu;
+    int len;
+
+    memset(apdu, 0, sizeof(apdu));
+    a->ins = U2F_REGISTER;
+    a->lc3 = sizeof(U2F_REGISTER_REQ);
+    for (size_t i = 0; i < sizeof(U2F_REGISTER_REQ); ++i) {
+        a->data[i] = rand();
+    }
+
+    memset(&touch_wait, 0, sizeof(touch_wait));
+    touch_sim_set(press_ms, TOUCH_SIM_NEVER, event);
+    CHECK_EQ(0, U2Fob_send(device, U2FHID_MSG, apdu, sizeof(apdu)));
+    touch_sim_clear();
+
+    len = U2Fob_recv(device, &cmd, resp, sizeof(resp), 1.0);
+    if (len < 2) {
+        return len;
+    }
+    CHECK_EQ(cmd, U2FHID_MSG);
+    return (resp[len - 2] << 8) + resp[len - 1];
+}
+
+// Check that a request waiting for a touch keeps its channel alive, does not block the
+// other channels and interfaces, and ends on touch, timeout or abort.
+static void test_TouchPending(void)
+{
+    uint8_t apdu[sizeof(USB_APDU) + sizeof(U2F_REGISTER_REQ)];
+    USB_APDU *a = (USB_APDU *)apdu;
+    USB_FRAME f, r;
+
+    // Touched after 1.5 seconds
+    CHECK_EQ(touch_Register(1500, touch_Busy), U2F_SW_NO_ERROR);
+    CHECK_GE(touch_wait.elapsed_ms, 1500);
+    CHECK_LT(touch_wait.elapsed_ms, 1600);
+    CHECK_GE(touch_wait.keepalives, 1500 / 40 / 3);
+
+    // Not touched
+    CHECK_EQ(touch_Register(TOUCH_SIM_NEVER, touch_Tick),
+             U2F_SW_CONDITIONS_NOT_SATISFIED);
+    CHECK_GE(touch_wait.elapsed_ms, 2900);
+    CHECK_GT(touch_wait.keepalives, 0);
+
+    // Aborted; the request is not answered
+    CHECK_EQ(touch_Register(TOUCH_SIM_NEVER, touch_Cancel), -U2FHID_ERR_MSG_TIMEOUT);
+    CHECK_EQ(touch_wait.elapsed_ms, 250);
+    CHECK_EQ(touch_Drain(&r), 0);
+
+    // A 2-frame register on another channel completes during the wait
+    memset(apdu, 0, sizeof(apdu));
+    a->ins = U2F_REGISTER;
+    a->lc3 = sizeof(U2F_REGISTER_REQ);
+    initFrame(&f, U2Fob_getCid(device) ^ 1, U2FHID_MSG, sizeof(apdu), apdu);
+    initCont(&touch_nested, f.cid, 0, sizeof(apdu) - sizeof(f.init.data),
+             apdu + sizeof(f.init.data));
+    SEND(f);
+    CHECK_EQ(touch_Register(1500, touch_Nested), U2F_SW_NO_ERROR);
+    CHECK_GE(touch_wait.elapsed_ms, 1500);
+    CHECK_EQ(touch_Drain(&r), 0);
 }
 
 // Test INIT self aborts wait for CONT frame
@@ -624,11 +943,15 @@ static void run_tests(void)
         PASS(test_NotCont());
         PASS(test_NotFirst());
         PASS(test_Limits());
+        PASS(test_Busy());
+        PASS(test_Interleave());
         if (U2Fob_liveDeviceTesting()) {
             PASS(test_InitOther());
             PASS(test_Timeout());
-            PASS(test_Busy());
             PASS(test_Descriptor());
+        } else {
+            PASS(test_InterleaveTimeout());
+            PASS(test_TouchPending());
         }
         PASS(test_LeadingZero());
         PASS(test_Idle(2.0));
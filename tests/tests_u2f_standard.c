@@ -274,6 +274,108 @@ static uint32_t test_Sign(int expectedSW12, bool checkOnly)
 }
 
 
+// Registers a new key handle for the appId.
+static void probe_Enroll(const uint8_t *appId, uint8_t *keyHandle)
+{
+    char rsp[4096];
+    size_t rsp_len;
+    char regReq_c[U2F_NONCE_LENGTH + U2F_APPID_SIZE + 1];
+    U2F_REGISTER_RESP *resp = (U2F_REGISTER_RESP *)rsp;
+    memset(regReq_c, 0, sizeof(regReq_c));
+    for (size_t i = 0; i < U2F_NONCE_LENGTH; ++i) {
+        regReq_c[i] = rand();
+    }
+    memcpy(regReq_c + U2F_NONCE_LENGTH, appId, U2F_APPID_SIZE);
+    CHECK_EQ(0x9000, U2Fob_apdu(device, 0, U2F_REGISTER, U2F_AUTH_ENFORCE, 0, regReq_c,
+                                U2F_NONCE_LENGTH + U2F_APPID_SIZE, rsp, &rsp_len));
+    CHECK_EQ(resp->keyHandleLen, 64);
+    memcpy(keyHandle, resp->keyHandleCertSig, 64);
+}
+
+
+// Sends an authenticate request for the key handle and returns the status word.
+static int probe_Sign(const uint8_t *appId, const uint8_t *keyHandle, uint8_t p1)
+{
+    char rsp[4096];
+    size_t rsp_len;
+    char authReq_c[U2F_NONCE_LENGTH + U2F_APPID_SIZE + 1 + U2F_MAX_KH_SIZE + 1];
+    const uint8_t keyHandleLen = 64;
+    memset(authReq_c, 0, sizeof(authReq_c));
+    for (size_t i = 0; i < U2F_NONCE_LENGTH; ++i) {
+        authReq_c[i] = rand();
+    }
+    memcpy(authReq_c + U2F_NONCE_LENGTH, appId, U2F_APPID_SIZE);
+    memcpy(authReq_c + U2F_NONCE_LENGTH + U2F_APPID_SIZE, &keyHandleLen, 1);
+    memcpy(authReq_c + U2F_NONCE_LENGTH + U2F_APPID_SIZE + 1, keyHandle, keyHandleLen);
+    return U2Fob_apdu(device, 0, U2F_AUTHENTICATE, p1, 0, authReq_c,
+                      U2F_NONCE_LENGTH + U2F_APPID_SIZE + 1 + keyHandleLen,
+                      rsp, &rsp_len);
+}
+
+
+// Replays the probe sequence of a browser waiting for a touch: every registered key
+// handle of an account is checked, including handles of other accounts on the same
+// device and handles of other authenticators, until one is used to sign.
+static void test_ProbeLatency(void)
+{
+#define PROBE_ACCOUNTS 3
+#define PROBE_HANDLES  3
+#define PROBE_ROUNDS   10
+    uint8_t appId[PROBE_ACCOUNTS][U2F_APPID_SIZE];
+    uint8_t keyHandle[PROBE_ACCOUNTS][PROBE_HANDLES][64];
+    uint8_t foreign[64];
+    double cold = 0, warm = 0;
+
+    for (int a = 0; a < PROBE_ACCOUNTS; a++) {
+        for (size_t i = 0; i < U2F_APPID_SIZE; ++i) {
+            appId[a][i] = rand();
+        }
+        for (int k = 0; k < PROBE_HANDLES; k++) {
+            WaitForUserPresence(device, arg_hasButton);
+            PASS(probe_Enroll(appId[a], keyHandle[a][k]));
+        }
+    }
+    for (size_t i = 0; i < sizeof(foreign); ++i) {
+        foreign[i] = rand();
+    }
+
+    // Each account is probed until the user touches the device; the accounts together
+    // hold more key handles than the device caches.
+    for (int a = 0; a < PROBE_ACCOUNTS; a++) {
+        for (int r = 0; r < PROBE_ROUNDS; r++) {
+            clock_t t = clock();
+            for (int k = 0; k < PROBE_HANDLES; k++) {
+                CHECK_EQ(0x6985, probe_Sign(appId[a], keyHandle[a][k],
+                                            U2F_AUTH_CHECK_ONLY));
+            }
+            CHECK_EQ(0x6a80, probe_Sign(appId[a], foreign, U2F_AUTH_CHECK_ONLY));
+            CHECK_EQ(0x6a80, probe_Sign(appId[a], keyHandle[(a + 1) % PROBE_ACCOUNTS][0],
+                                        U2F_AUTH_CHECK_ONLY));
+            t = clock() - t;
+            if (r) {
+                warm += (double)t / CLOCKS_PER_SEC / (PROBE_ROUNDS - 1) / PROBE_ACCOUNTS;
+            } else {
+                cold += (double)t / CLOCKS_PER_SEC / PROBE_ACCOUNTS;
+            }
+        }
+    }
+    PRINT_INFO("Probe round: %d key handles, first %fs, repeated %fs", PROBE_HANDLES + 2,
+               cold, warm);
+
+    WaitForUserPresence(device, arg_hasButton);
+    CHECK_EQ(0x9000, probe_Sign(appId[0], keyHandle[0][0], U2F_AUTH_ENFORCE));
+
+    if (!U2Fob_liveDeviceTesting()) {
+        // Cached key handles are dropped with the U2F master key.
+        memory_reset_u2f();
+        CHECK_EQ(0x6a80, probe_Sign(appId[0], keyHandle[0][0], U2F_AUTH_CHECK_ONLY));
+    }
+#undef PROBE_ACCOUNTS
+#undef PROBE_HANDLES
+#undef PROBE_ROUNDS
+}
+
+
 static void check_Compilation(void)
 {
     // Couple of sanity checks.
@@ -404,6 +506,9 @@ static void run_tests(void)
         // Ctr should have incremented by 1.
         CHECK_EQ(ctr2, ctr1 + 1);
 
+        // Repeated probes of many key handles
+        PASS(test_ProbeLatency());
+
         // Check if HWW interface updates U2F counter correctly
         PASS(check_CounterUpdate());
 
@@ -45,16 +45,61 @@
 #include "utils.h"
 #include "utest.h"
 #include "sha2.h"
+#include "hmac.h"
 #include "uECC.h"
 #include "ecc.h"
 #include "aes.h"
+#include "aes_ct.h"
+#include "chacha20poly1305.h"
+#include "chachapolyb64.h"
 #include "hmac_check.h"
+#include "bootloader.h"
+#include "usb.h"
+#include "touch.h"
+#include "timer.h"
+#include "u2f/u2f_hid.h"
+#ifdef ECC_USE_SECP256K1_LIB
+#include "secp256k1/include/secp256k1.h"
+#include "secp256k1/include/secp256k1_recovery.h"
+#endif
 
 
 int U_TESTS_RUN = 0;
 int U_TESTS_FAIL = 0;
 
 
+// Heap allocations made through malloc/calloc/realloc. Counted when the linker
+// wraps the allocator (see tests/CMakeLists.txt); otherwise always 0.
+static int tests_malloc_calls = 0;
+
+#ifdef TESTS_WRAP_MALLOC
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    tests_malloc_calls++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    tests_malloc_calls++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    tests_malloc_calls++;
+    return __real_realloc(ptr, size);
+}
+#endif
+
+
 // Most tests taken from:
 // https://github.com/trezor/trezor-crypto/blob/master/tests.c
 
@@ -475,10 +520,107 @@ static void test_rfc6979(void)
 }
 
 
+// RFC 4231 test cases 1, 2 and 6
+static void test_hmac(void)
+{
+    uint8_t key[131], out[SHA512_DIGEST_LENGTH];
+    HMAC_SHA256_CTX pctx256, hctx256;
+    HMAC_SHA512_CTX pctx512, hctx512;
+    const char *msg = "what do ya want for nothing?";
+
+    memset(key, 0x0b, 20);
+    hmac_sha256(key, 20, (const uint8_t *)"Hi There", 8, out);
+    u_assert_mem_eq(out,
+                    utils_hex_to_uint8("b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7"),
+                    SHA256_DIGEST_LENGTH);
+    hmac_sha512(key, 20, (const uint8_t *)"Hi There", 8, out);
+    u_assert_mem_eq(out,
+                    utils_hex_to_uint8("87aa7cdea5ef619d4ff0b4241a1d6cb02379f4e2ce4ec2787ad0b30545e17cdedaa833b7d6b8a702038b274eaea3f4e4be9d914eeb61f1702e696c203a126854"),
+                    SHA512_DIGEST_LENGTH);
+
+    memset(key, 0xaa, sizeof(key));
+    hmac_sha256(key, sizeof(key),
+                (const uint8_t *)"Test Using Larger Than Block-Size Key - Hash Key First", 54, out);
+    u_assert_mem_eq(out,
+                    utils_hex_to_uint8("60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54"),
+                    SHA256_DIGEST_LENGTH);
+    hmac_sha512(key, sizeof(key),
+                (const uint8_t *)"Test Using Larger Than Block-Size Key - Hash Key First", 54, out);
+    u_assert_mem_eq(out,
+                    utils_hex_to_uint8("80b24263c7c1a3ebb71493c1dd7be8b49b46d1f41b4aeec1121b013783f8f3526b56d037e05f2598bd0fd2215d6a1e5295e64f73f63f0aec8b915a985d786598"),
+                    SHA512_DIGEST_LENGTH);
+
+    // Streaming updates from a reused precomputed key state
+    hmac_sha256_Init(&pctx256, (const uint8_t *)"Jefe", 4);
+    hmac_sha512_Init(&pctx512, (const uint8_t *)"Jefe", 4);
+    for (int i = 0; i < 2; i++) {
+        hmac_sha256_Copy(&hctx256, &pctx256);
+        hmac_sha256_Update(&hctx256, (const uint8_t *)msg, 10);
+        hmac_sha256_Update(&hctx256, (const uint8_t *)msg + 10, strlens(msg) - 10);
+        hmac_sha256_Final(&hctx256, out);
+        u_assert_mem_eq(out,
+                        utils_hex_to_uint8("5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843"),
+                        SHA256_DIGEST_LENGTH);
+
+        hmac_sha512_Copy(&hctx512, &pctx512);
+        hmac_sha512_Update(&hctx512, (const uint8_t *)msg, 10);
+        hmac_sha512_Update(&hctx512, (const uint8_t *)msg + 10, strlens(msg) - 10);
+        hmac_sha512_Final(&hctx512, out);
+        u_assert_mem_eq(out,
+                        utils_hex_to_uint8("164b7a7bfcf819e2e395fbe73b56e0a387bd64222e831fd610270cd7ea2505549758bf75c05a994a6d034f65f8f0e6fdcaeab1a34d4a6b4b636e070a38bce737"),
+                        SHA512_DIGEST_LENGTH);
+    }
+}
+
+
+static void test_hmac_speed(void)
+{
+    uint8_t key[32], msg[64], out[SHA512_DIGEST_LENGTH];
+    size_t i, N = 20000;
+    HMAC_SHA512_CTX pctx, hctx;
+
+    for (i = 0; i < sizeof(msg); i++) {
+        msg[i] = i * 1103515245;
+    }
+    memcpy(key, msg, sizeof(key));
+
+    clock_t t = clock();
+    for (i = 0; i < N; i++) {
+        hmac_sha512(key, sizeof(key), msg, sizeof(msg), out);
+    }
+    float one_shot = N / ((float)(clock() - t) / CLOCKS_PER_SEC);
+
+    t = clock();
+    hmac_sha512_Init(&pctx, key, sizeof(key));
+    for (i = 0; i < N; i++) {
+        hmac_sha512_Copy(&hctx, &pctx);
+        hmac_sha512_Update(&hctx, msg, sizeof(msg));
+        hmac_sha512_Final(&hctx, out);
+    }
+    float precomputed = N / ((float)(clock() - t) / CLOCKS_PER_SEC);
+
+    u_print_info("HMAC-SHA512 speed: %0.2f hmac/s (precomputed key: %0.2f hmac/s)\n",
+                 one_shot, precomputed);
+}
+
+
+static uint32_t pbkdf2_progress_calls;
+static uint32_t pbkdf2_progress_done;
+
+
+static void pbkdf2_progress(uint32_t done, uint32_t total)
+{
+    pbkdf2_progress_calls++;
+    pbkdf2_progress_done = done;
+    u_assert_int_eq(total, PBKDF2_ROUNDS * 2);
+}
+
+
 // generated using http://althenia.net/svn/stackoverflow/pbkdf2-test-vectors.py?rev=6
 static void test_pbkdf2(void)
 {
     uint8_t key[PBKDF2_HMACLEN];
+    uint8_t key_long[100];
 
     pbkdf2_hmac_sha512((const uint8_t *)"Digital Bitbox", 14, "Digital Bitbox", key,
                        sizeof(key));
@@ -508,6 +650,15 @@ static void test_pbkdf2(void)
     u_assert_mem_eq(key,
                     utils_hex_to_uint8("03277346174bced652f3f6c6810c5d4750db208bc6f44a9031e6b737c3ce0942b822c90aad129b541e9e884e4cf337c0d15cbdc5967f1603ef21d1f2f39000bf"),
                     32);
+
+    // Two output blocks, the second truncated
+    pbkdf2_hmac_sha512_progress((const uint8_t *)"Digital Bitbox", 14, "Digital Bitbox",
+                                key_long, sizeof(key_long), pbkdf2_progress);
+    u_assert_mem_eq(key_long,
+                    utils_hex_to_uint8("9288a7e3259a0bfb826e5008ffb4109919752bc905b64764e7969a5a8edae970eaa2e4c66535e0df8a251459d83e51af61233a9b87166f4571f17a39c0ddd1e58fca3072fcb0f0b9d0840d13534a1cfe7f419e9293807f2155bdc4f6ccfb1edb6fcc1776"),
+                    sizeof(key_long));
+    u_assert_int_eq(pbkdf2_progress_calls, PBKDF2_ROUNDS * 2 / PBKDF2_PROGRESS_STEP);
+    u_assert_int_eq(pbkdf2_progress_done, PBKDF2_ROUNDS * 2);
 }
 
 
@@ -540,6 +691,96 @@ static void test_sign_speed(void)
 
     u_print_info("Signing speed: %0.2f sig/s\n",
                  N * 2 / ((float)(clock() - t) / CLOCKS_PER_SEC));
+
+    // Key generation, against the variable-base multiplication of uECC_shared_secret()
+    // on G (GLV on secp256k1, the Montgomery ladder on secp256r1)
+    static const char *curve_names[] = { "secp256k1", "secp256r1" };
+    static const char *G[] = {
+        "79be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798"
+        "483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8",
+        "6b17d1f2e12c4247f8bce6e563a440f277037d812deb33a0f4a13945d898c296"
+        "4fe342e2fe1a7f9b8ee7eb4a7c0f9e162bce33576b315ececbb6406837bf51f5",
+    };
+    uECC_Curve curves[] = { uECC_secp256k1(), uECC_secp256r1() };
+    uint8_t g[64], pub_key33[33], x[32];
+    float keygen, ladder;
+    int c;
+    for (c = 0; c < 2; c++) {
+        memcpy(g, utils_hex_to_uint8(G[c]), sizeof(g));
+        t = clock();
+        for (i = 0 ; i < N; i++) {
+            priv_key[31] = i;
+            bitcoin_ecc.ecc_get_public_key33(priv_key, pub_key33, c ? ECC_SECP256r1 : ECC_SECP256k1);
+        }
+        keygen = N / ((float)(clock() - t) / CLOCKS_PER_SEC);
+        t = clock();
+        for (i = 0 ; i < N; i++) {
+            priv_key[31] = i;
+            uECC_shared_secret(g, priv_key, x, curves[c]);
+        }
+        ladder = N / ((float)(clock() - t) / CLOCKS_PER_SEC);
+        u_assert_mem_eq(pub_key33 + 1, x, 32);
+        u_print_info("Keygen speed %s: %0.2f keys/s, variable base %0.2f keys/s\n",
+                     curve_names[c], keygen, ladder);
+    }
+}
+
+
+static void test_sign_batch(void)
+{
+    // 19 signatures cross the boundaries of the uECC_SIGN_BATCH groups
+    uint8_t priv_keys[19][32], hashes[19][32], sigs[19][64], sig[64], recids[19], recid;
+    size_t i, j, N = 20;
+    float single, batch;
+    int res, c;
+    ecc_curve_id curves[] = { ECC_SECP256k1, ECC_SECP256r1 };
+    static const char *curve_names[] = { "secp256k1", "secp256r1" };
+
+    for (i = 0; i < 19; i++) {
+        sha256_Raw((const uint8_t *)&i, sizeof(i), priv_keys[i]);
+        sha256_Raw(priv_keys[i], 32, hashes[i]);
+    }
+
+    res = bitcoin_ecc.ecc_sign_digest_batch(priv_keys[0], hashes[0], sigs[0], recids, 19,
+                                            ECC_SECP256k1);
+    u_assert_int_eq(res, 0);
+    for (i = 0; i < 19; i++) {
+        res = bitcoin_ecc.ecc_sign_digest(priv_keys[i], hashes[i], sig, &recid,
+                                          ECC_SECP256k1);
+        u_assert_int_eq(res, 0);
+        u_assert_mem_eq(sig, sigs[i], 64);
+        u_assert_int_eq(recid, recids[i]);
+    }
+
+    for (c = 0; c < 2; c++) {
+        for (j = 1; j <= 19; j += 6) {
+            memset(sigs, 0, sizeof(sigs));
+            res = ecc_sign_digest_batch(priv_keys[0], hashes[0], sigs[0], recids, j,
+                                        curves[c]);
+            u_assert_int_eq(res, 0);
+            for (i = 0; i < j; i++) {
+                res = ecc_sign_digest(priv_keys[i], hashes[i], sig, &recid, curves[c]);
+                u_assert_int_eq(res, 0);
+                u_assert_mem_eq(sig, sigs[i], 64);
+                u_assert_int_eq(recid, recids[i]);
+            }
+        }
+
+        clock_t t = clock();
+        for (j = 0; j < N; j++) {
+            for (i = 0; i < 16; i++) {
+                ecc_sign_digest(priv_keys[i], hashes[i], sigs[i], NULL, curves[c]);
+            }
+        }
+        single = N * 16 / ((float)(clock() - t) / CLOCKS_PER_SEC);
+        t = clock();
+        for (j = 0; j < N; j++) {
+            ecc_sign_digest_batch(priv_keys[0], hashes[0], sigs[0], NULL, 16, curves[c]);
+        }
+        batch = N * 16 / ((float)(clock() - t) / CLOCKS_PER_SEC);
+        u_print_info("Signing speed %s: %0.2f sig/s, batches of 16 %0.2f sig/s\n",
+                     curve_names[c], single, batch);
+    }
 }
 
 
@@ -589,11 +830,302 @@ static void test_verify_speed(void)
         u_assert_int_eq(res, 0);
     }
 
-    u_print_info("Verifying speed: %0.2f sig/s\n",
-                 100.0f / ((float)(clock() - t) / CLOCKS_PER_SEC));
+    float speed = 100.0f / ((float)(clock() - t) / CLOCKS_PER_SEC);
+
+    // Compressed keys add a modular square root to every verification
+    t = clock();
+    for (i = 0 ; i < 50; i++) {
+        res = bitcoin_ecc.ecc_verify(pub_key33, sig, msg, sizeof(msg), ECC_SECP256k1);
+        u_assert_int_eq(res, 0);
+    }
+    u_print_info("Verifying speed: %0.2f sig/s (compressed keys: %0.2f sig/s)\n", speed,
+                 50.0f / ((float)(clock() - t) / CLOCKS_PER_SEC));
+}
+
+
+// Firmware check of bootloader_firmware_verified(): BOOT_SIG_M signatures over the
+// double SHA256 of the app, with the 7 keys stored uncompressed as in the bootloader
+// against decompressing every key first
+static void test_boot_verify_speed(void)
+{
+    uint8_t priv[7][32], pub33[7][33], pub64[7][64], sig[7][64], hash[32], key[64];
+    int i, j, valid;
+    clock_t t;
+    float stored, decompressed;
+
+    random_bytes(hash, sizeof(hash), 0);
+    sha256_Raw(hash, sizeof(hash), hash);
+    for (i = 0; i < 7; i++) {
+        do {
+            random_bytes(priv[i], 32, 0);
+        } while (!uECC_isValid(priv[i], uECC_secp256k1()));
+        u_assert_int_eq(uECC_compute_public_key(priv[i], pub64[i], uECC_secp256k1()), 1);
+        uECC_compress(pub64[i], pub33[i], uECC_secp256k1());
+        u_assert_int_eq(uECC_sign(priv[i], hash, sizeof(hash), sig[i], NULL,
+                                  uECC_secp256k1()), 1);
+    }
+
+    t = clock();
+    for (j = 0; j < 20; j++) {
+        for (i = 0, valid = 0; i < 7 && valid < BOOT_SIG_M; i++) {
+            valid += uECC_verify(pub64[i], hash, sizeof(hash), sig[i], uECC_secp256k1());
+        }
+        u_assert_int_eq(valid, BOOT_SIG_M);
+    }
+    stored = (float)(clock() - t) * 1000 / CLOCKS_PER_SEC / 20;
+
+    t = clock();
+    for (j = 0; j < 20; j++) {
+        for (i = 0, valid = 0; i < 7 && valid < BOOT_SIG_M; i++) {
+            uECC_decompress(pub33[i], key, uECC_secp256k1());
+            u_assert_mem_eq(key, pub64[i], 64);
+            valid += uECC_verify(key, hash, sizeof(hash), sig[i], uECC_secp256k1());
+        }
+        u_assert_int_eq(valid, BOOT_SIG_M);
+    }
+    decompressed = (float)(clock() - t) * 1000 / CLOCKS_PER_SEC / 20;
+
+    // Any bad signature among the keys is skipped, as long as BOOT_SIG_M remain
+    sig[1][40] ^= 1;
+    for (i = 0, valid = 0; i < 7 && valid < BOOT_SIG_M; i++) {
+        valid += uECC_verify(pub64[i], hash, sizeof(hash), sig[i], uECC_secp256k1());
+    }
+    u_assert_int_eq(valid, BOOT_SIG_M);
+    u_assert_int_eq(i, BOOT_SIG_M + 1);
+
+    u_print_info("Boot verification: %0.2f ms (decompressing keys: %0.2f ms)\n",
+                 stored, decompressed);
 }
 
 
+// r = a - b + carry on 32-byte big-endian numbers, returns the carry out
+static int tests_ecc_sub(const uint8_t *a, const uint8_t *b, int carry, uint8_t *r)
+{
+    int j, d;
+    for (j = 31; j >= 0; j--) {
+        d = a[j] - b[j] + carry;
+        r[j] = d & 0xff;
+        carry = d < 0 ? -1 : d > 0xff;
+    }
+    return carry;
+}
+
+
+// Generator multiplication (fixed-base comb) against the variable-base multiplication of
+// uECC_shared_secret(), and y through signature verification
+static void test_ecc_comb(void)
+{
+    static const char *G[] = {
+        "79be667ef9dcbbac55a06295ce870b07029bfcdb2dce28d959f2815b16f81798"
+        "483ada7726a3c4655da4fbfc0e1108a8fd17b448a68554199c47d08ffb10d4b8",
+        "6b17d1f2e12c4247f8bce6e563a440f277037d812deb33a0f4a13945d898c296"
+        "4fe342e2fe1a7f9b8ee7eb4a7c0f9e162bce33576b315ececbb6406837bf51f5",
+    };
+    static const char *n_minus_1[] = {
+        "fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd0364140",
+        "ffffffff00000000ffffffffffffffffbce6faada7179e84f3b9cac2fc632550",
+    };
+    static const char *edge[] = {
+        "0000000000000000000000000000000000000000000000000000000000000001",
+        "0000000000000000000000000000000000000000000000000000000000000002",
+        "0000000000000000000000000000000000000000000000000000000000000003",
+        "0000000000000000000000000000000000000000000000000000080000000000",
+        "0000000000000000000000000000000000000000000000000000100000000001",
+        "8000000000000000000000000000000000000000000000000000000000000000",
+        "7fffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff",
+        "5555555555555555555555555555555555555555555555555555555555555555",
+        "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+    };
+    uECC_Curve curves[] = { uECC_secp256k1(), uECC_secp256r1() };
+    uint8_t g[64], k[32], nk[32], n1[32], pub[64], neg[64], x[32], sig[64], hash[32];
+    uint8_t rec[64], recid;
+    int c, i, ladder = 0;
+
+    for (c = 0; c < 2; c++) {
+        memcpy(g, utils_hex_to_uint8(G[c]), 64);
+        memcpy(n1, utils_hex_to_uint8(n_minus_1[c]), 32);
+
+        u_assert_int_eq(uECC_compute_public_key(n1, pub, curves[c]), 1);
+        u_assert_mem_eq(pub, g, 32);
+
+        for (i = 0; i < 200 + 2 * (int)(sizeof(edge) / sizeof(edge[0])); i++) {
+            if (i < (int)(sizeof(edge) / sizeof(edge[0]))) {
+                memcpy(k, utils_hex_to_uint8(edge[i]), 32);
+            } else if (i < 2 * (int)(sizeof(edge) / sizeof(edge[0]))) {
+                // n - 1 - edge
+                memcpy(nk, utils_hex_to_uint8(edge[i - sizeof(edge) / sizeof(edge[0])]), 32);
+                if (tests_ecc_sub(n1, nk, 0, k) < 0) {
+                    continue;
+                }
+            } else {
+                random_bytes(k, sizeof(k), 0);
+            }
+            if (!uECC_isValid(k, curves[c])) {
+                continue;
+            }
+
+            // x matches the variable base where it can compute it (the secp256r1 ladder
+            // fails for 1, n - 1 and n - 2, which are covered through G and the negation
+            // check below)
+            u_assert_int_eq(uECC_compute_public_key(k, pub, curves[c]), 1);
+            u_assert_int_eq(uECC_valid_public_key(pub, curves[c]), 1);
+            if (i == 0) {
+                u_assert_mem_eq(pub, g, 64);
+            } else if (uECC_shared_secret(g, k, x, curves[c])) {
+                u_assert_mem_eq(pub, x, 32);
+                ladder++;
+            }
+
+            // (n - k) * G is the negation, through the other parity
+            if (tests_ecc_sub(n1, k, 1, nk) == 0 && uECC_isValid(nk, curves[c])) {
+                u_assert_int_eq(uECC_compute_public_key(nk, neg, curves[c]), 1);
+                u_assert_mem_eq(neg, pub, 32);
+                u_assert_int_eq(uECC_valid_public_key(neg, curves[c]), 1);
+                u_assert_int_eq(memcmp(neg + 32, pub + 32, 32) != 0, 1);
+            }
+
+            // y is right if a signature verifies against it (keys with a small discrete
+            // logarithm such as the edges make the wNAF sum hit doublings, a zero hash
+            // leaves only u2 * Q)
+            random_bytes(hash, sizeof(hash), 0);
+            if (i % 8 == 0) {
+                memset(hash, 0, sizeof(hash));
+            }
+            u_assert_int_eq(uECC_sign(k, hash, sizeof(hash), sig, &recid, curves[c]), 1);
+            u_assert_int_eq(uECC_verify(pub, hash, sizeof(hash), sig, curves[c]), 1);
+            u_assert_int_eq(uECC_recover_public_key(sig, hash, sizeof(hash), recid, rec,
+                                                    curves[c]), 1);
+            u_assert_mem_eq(rec, pub, 64);
+            hash[31] ^= 1;
+            u_assert_int_eq(uECC_verify(pub, hash, sizeof(hash), sig, curves[c]), 0);
+        }
+    }
+    u_assert_int_eq(ladder > 2 * 200, 1);
+}
+
+
+#ifdef ECC_USE_SECP256K1_LIB
+// secp256k1 scalar multiplication of uECC (GLV split for ECDH, comb or GLV for k * G)
+// against libsecp256k1, on random scalars and on scalars around the split boundaries
+static void test_ecc_glv(void)
+{
+    static const char *edge[] = {
+        "0000000000000000000000000000000000000000000000000000000000000001",
+        "0000000000000000000000000000000000000000000000000000000000000002",
+        "0000000000000000000000000000000000000000000000000000000000000003",
+        "00000000000000000000000000000000ffffffffffffffffffffffffffffffff",
+        "0000000000000000000000000000000100000000000000000000000000000000",
+        "0000000000000000000000000000000100000000000000000000000000000001",
+        "5363ad4cc05c30e0a5261c028812645a122e22ea20816678df02967c1b23bd72", // lambda
+        "ac9c52b33fa3cf1f5ad9e3fd77ed9ba4a880b9fc8ec739c2e0cfc810b51283cf", // -lambda
+        "5363ad4cc05c30e0a5261c028812645a122e22ea20816678df02967c1b23bd73", // lambda + 1
+        "7fffffffffffffffffffffffffffffff5d576e7357a4501ddfe92f46681b20a0", // n / 2
+        "7fffffffffffffffffffffffffffffff5d576e7357a4501ddfe92f46681b20a1",
+        "fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd036413f", // n - 2
+        "fffffffffffffffffffffffffffffffebaaedce6af48a03bbfd25e8cd0364140", // n - 1
+    };
+    secp256k1_context *ctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN |
+                             SECP256K1_CONTEXT_VERIFY);
+    uECC_RNG_Function rng = uECC_get_rng();
+    secp256k1_pubkey pubkey;
+    uint8_t q[32], k[32], point[65], expect[65], pub[64], x[32];
+    size_t len;
+    int i, n_edge = sizeof(edge) / sizeof(edge[0]);
+
+    for (i = 0; i < 2 * n_edge + 300; i++) {
+        if (i < 2 * n_edge) {
+            memcpy(k, utils_hex_to_uint8(edge[i % n_edge]), 32);
+        } else {
+            random_bytes(k, sizeof(k), 0);
+            if (!uECC_isValid(k, uECC_secp256k1())) {
+                continue;
+            }
+        }
+        // Without an RNG the projective coordinates are not randomized
+        uECC_set_rng(i % 2 ? rng : NULL);
+
+        do {
+            random_bytes(q, sizeof(q), 0);
+        } while (!secp256k1_ec_pubkey_create(ctx, &pubkey, q));
+        len = sizeof(point);
+        secp256k1_ec_pubkey_serialize(ctx, point, &len, &pubkey,
+                                      SECP256K1_EC_UNCOMPRESSED);
+        u_assert_int_eq(secp256k1_ec_pubkey_tweak_mul(ctx, &pubkey, k), 1);
+        len = sizeof(expect);
+        secp256k1_ec_pubkey_serialize(ctx, expect, &len, &pubkey,
+                                      SECP256K1_EC_UNCOMPRESSED);
+        u_assert_int_eq(uECC_shared_secret(point + 1, k, x, uECC_secp256k1()), 1);
+        u_assert_mem_eq(x, expect + 1, 32);
+
+        u_assert_int_eq(secp256k1_ec_pubkey_create(ctx, &pubkey, k), 1);
+        len = sizeof(expect);
+        secp256k1_ec_pubkey_serialize(ctx, expect, &len, &pubkey,
+                                      SECP256K1_EC_UNCOMPRESSED);
+        u_assert_int_eq(uECC_compute_public_key(k, pub, uECC_secp256k1()), 1);
+        u_assert_mem_eq(pub, expect + 1, 64);
+    }
+
+    // The point at infinity
+    memset(k, 0, sizeof(k));
+    u_assert_int_eq(uECC_shared_secret(point + 1, k, x, uECC_secp256k1()), 0);
+
+    uECC_set_rng(rng);
+    secp256k1_context_destroy(ctx);
+}
+
+
+// uECC signatures, recovery ids and public key recovery against libsecp256k1
+static void test_ecc_recover(void)
+{
+    secp256k1_context *ctx = secp256k1_context_create(SECP256K1_CONTEXT_SIGN |
+                             SECP256K1_CONTEXT_VERIFY);
+    secp256k1_ecdsa_recoverable_signature signature;
+    secp256k1_pubkey pubkey;
+    uint8_t priv_key[32], hash[32], sig[64], expect[64], pub[65], expect_pub[65];
+    uint8_t recid;
+    size_t len;
+    int i, expect_recid, res;
+
+    for (i = 0; i < 400; i++) {
+        random_bytes(hash, sizeof(hash), 0);
+        do {
+            random_bytes(priv_key, sizeof(priv_key), 0);
+        } while (!uECC_isValid(priv_key, uECC_secp256k1()));
+
+        u_assert_int_eq(secp256k1_ecdsa_sign_recoverable(ctx, &signature, hash, priv_key,
+                        NULL, NULL), 1);
+        secp256k1_ecdsa_recoverable_signature_serialize_compact(ctx, expect, &expect_recid,
+                &signature);
+        u_assert_int_eq(ecc_sign_digest(priv_key, hash, sig, &recid, ECC_SECP256k1), 0);
+        u_assert_mem_eq(sig, expect, 64);
+        u_assert_int_eq(recid, expect_recid);
+
+        // Recovery from random signatures and recovery ids, including r below p - n
+        // where the recovery ids 2 and 3 are valid
+        if (i % 2) {
+            random_bytes(sig, sizeof(sig), 0);
+            if (i % 8 == 1) {
+                memset(sig, 0, 16);
+            }
+            recid = i / 2 % 4;
+        }
+        res = secp256k1_ecdsa_recoverable_signature_parse_compact(ctx, &signature, sig,
+                recid) && secp256k1_ecdsa_recover(ctx, &pubkey, &signature, hash);
+        u_assert_int_eq(ecc_recover_public_key_digest(sig, hash, recid, pub,
+                        ECC_SECP256k1), !res);
+        if (res) {
+            len = sizeof(expect_pub);
+            secp256k1_ec_pubkey_serialize(ctx, expect_pub, &len, &pubkey,
+                                          SECP256K1_EC_UNCOMPRESSED);
+            u_assert_mem_eq(pub, expect_pub, 65);
+        }
+    }
+
+    secp256k1_context_destroy(ctx);
+}
+#endif
+
+
 static void test_ecdh(void)
 {
     int i;
@@ -690,14 +1222,652 @@ static void test_aes_cbc(void)
     }
 }
 
+// FIPS-197 appendix C and SP 800-38A F.2 known-answer tests, and a
+// cross-check against the byte-oriented implementation
+static void test_aes_ct(void)
+{
+    aes_context ctx[1], ref[1];
+    uint8_t key[32], iv[16], buf[9 * 16], enc[9 * 16], dec[9 * 16];
+    int i, n;
+
+    static const char *ecb_vector[] = {
+        // key                                                                plain                               cipher
+        "000102030405060708090a0b0c0d0e0f", "00112233445566778899aabbccddeeff", "69c4e0d86a7b0430d8cdb78070b4c55a",
+        "000102030405060708090a0b0c0d0e0f1011121314151617", "00112233445566778899aabbccddeeff", "dda97ca4864cdfe06eaf70a0ec0d7191",
+        "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", "00112233445566778899aabbccddeeff", "8ea2b7ca516745bfeafc49904b496089",
+        0, 0, 0,
+    };
+    static const char *cbc_vector[] = {
+        // key                                                                cipher
+        "2b7e151628aed2a6abf7158809cf4f3c", "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b273bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7",
+        "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4", "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b",
+        0, 0,
+    };
+    const char *cbc_plain =
+        "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e5130c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+
+    for (i = 0; ecb_vector[i]; i += 3) {
+        n = strlens(ecb_vector[i]) / 2;
+        memcpy(key, utils_hex_to_uint8(ecb_vector[i]), n);
+        u_assert_int_eq(aes_ct_set_key(key, n, ctx), 0);
+        memcpy(buf, utils_hex_to_uint8(ecb_vector[i + 1]), 16);
+        aes_ct_encrypt(buf, enc, ctx);
+        u_assert_mem_eq(enc, utils_hex_to_uint8(ecb_vector[i + 2]), 16);
+        aes_ct_decrypt(enc, dec, ctx);
+        u_assert_mem_eq(dec, buf, 16);
+    }
+
+    for (i = 0; cbc_vector[i]; i += 2) {
+        n = strlens(cbc_vector[i]) / 2;
+        memcpy(key, utils_hex_to_uint8(cbc_vector[i]), n);
+        aes_ct_set_key(key, n, ctx);
+        memcpy(buf, utils_hex_to_uint8(cbc_plain), 64);
+        memcpy(iv, utils_hex_to_uint8("000102030405060708090a0b0c0d0e0f"), 16);
+        aes_ct_cbc_encrypt(buf, enc, 4, iv, ctx);
+        u_assert_mem_eq(enc, utils_hex_to_uint8(cbc_vector[i + 1]), 64);
+        // The IV is chained to the last ciphertext block
+        u_assert_mem_eq(iv, enc + 48, 16);
+
+        // In-place decrypt with an odd number of blocks left for the last pass
+        memcpy(dec, enc, 64);
+        memcpy(iv, utils_hex_to_uint8("000102030405060708090a0b0c0d0e0f"), 16);
+        aes_ct_cbc_decrypt(dec, dec, 3, iv, ctx);
+        aes_ct_cbc_decrypt(dec + 48, dec + 48, 1, iv, ctx);
+        u_assert_mem_eq(dec, buf, 64);
+    }
+
+    u_assert_int_eq(aes_ct_set_key(key, 20, ctx), (return_type) - 1);
+    u_assert_int_eq(aes_ct_encrypt(buf, enc, ctx), EXIT_FAILURE);
+
+    for (n = 1; n <= 9; n++) {
+        random_bytes(key, sizeof(key), 0);
+        random_bytes(buf, sizeof(buf), 0);
+        memset(ref, 0, sizeof(ref));
+        aes_set_key(key, 32, ref);
+        aes_ct_set_key(key, 32, ctx);
+
+        memset(iv, n, sizeof(iv));
+        aes_cbc_encrypt(buf, dec, n, iv, ref);
+        memset(iv, n, sizeof(iv));
+        aes_ct_cbc_encrypt(buf, enc, n, iv, ctx);
+        u_assert_mem_eq(enc, dec, n * 16);
+
+        memset(iv, n, sizeof(iv));
+        aes_ct_cbc_decrypt(enc, dec, n, iv, ctx);
+        u_assert_mem_eq(dec, buf, n * 16);
+    }
+}
+
+
+static void test_aes_speed(void)
+{
+    aes_context ctx[1];
+    uint8_t key[32], iv[16], buf[1024];
+    size_t i, N = 1000;
+    clock_t t;
+    float byte_enc, byte_dec, ct_enc, ct_dec;
+
+    random_bytes(key, sizeof(key), 0);
+    random_bytes(buf, sizeof(buf), 0);
+    memset(iv, 0, sizeof(iv));
+
+    memset(ctx, 0, sizeof(ctx));
+    aes_set_key(key, 32, ctx);
+    t = clock();
+    for (i = 0; i < N; i++) {
+        aes_cbc_encrypt(buf, buf, sizeof(buf) / 16, iv, ctx);
+    }
+    byte_enc = N * sizeof(buf) / ((float)(clock() - t) / CLOCKS_PER_SEC) / 1e6;
+    t = clock();
+    for (i = 0; i < N; i++) {
+        aes_cbc_decrypt(buf, buf, sizeof(buf) / 16, iv, ctx);
+    }
+    byte_dec = N * sizeof(buf) / ((float)(clock() - t) / CLOCKS_PER_SEC) / 1e6;
+
+    aes_ct_set_key(key, 32, ctx);
+    t = clock();
+    for (i = 0; i < N; i++) {
+        aes_ct_cbc_encrypt(buf, buf, sizeof(buf) / 16, iv, ctx);
+    }
+    ct_enc = N * sizeof(buf) / ((float)(clock() - t) / CLOCKS_PER_SEC) / 1e6;
+    t = clock();
+    for (i = 0; i < N; i++) {
+        aes_ct_cbc_decrypt(buf, buf, sizeof(buf) / 16, iv, ctx);
+    }
+    ct_dec = N * sizeof(buf) / ((float)(clock() - t) / CLOCKS_PER_SEC) / 1e6;
+
+    u_print_info("AES-256-CBC byte-oriented: encrypt %0.2f MB/s, decrypt %0.2f MB/s\n",
+                 byte_enc, byte_dec);
+    u_print_info("AES-256-CBC constant-time: encrypt %0.2f MB/s, decrypt %0.2f MB/s\n",
+                 ct_enc, ct_dec);
+}
+
+
+static void test_aes_key_cache(void)
+{
+    const char *msg = "{\"random\":\"pseudo\"}";
+    uint8_t key_a[32], key_b[32];
+    char *enc, *dec;
+    int enc_len, dec_len;
+
+    random_bytes(key_a, sizeof(key_a), 0);
+    random_bytes(key_b, sizeof(key_b), 0);
+    aescbcb64_key_cache_clear();
+
+    // Cached and uncached schedules are interchangeable
+    enc = aescbcb64_encrypt((const unsigned char *)msg, strlens(msg), &enc_len, key_a,
+                            AES_KEY_STAND);
+    u_assert(enc);
+    dec = aescbcb64_decrypt((const unsigned char *)enc, enc_len, &dec_len, key_a,
+                            AES_KEY_NONE);
+    u_assert_str_eq(dec, msg);
+    free(enc);
+    free(dec);
+
+    // A slot used with a different key is rescheduled
+    enc = aescbcb64_encrypt((const unsigned char *)msg, strlens(msg), &enc_len, key_b,
+                            AES_KEY_NONE);
+    dec = aescbcb64_decrypt((const unsigned char *)enc, enc_len, &dec_len, key_b,
+                            AES_KEY_STAND);
+    u_assert_str_eq(dec, msg);
+    free(dec);
+
+    // An invalidated slot is rescheduled
+    aescbcb64_key_cache_invalidate(AES_KEY_STAND);
+    dec = aescbcb64_decrypt((const unsigned char *)enc, enc_len, &dec_len, key_b,
+                            AES_KEY_STAND);
+    u_assert_str_eq(dec, msg);
+    free(dec);
+
+    // A cached slot does not leak into another key
+    dec = aescbcb64_decrypt((const unsigned char *)enc, enc_len, &dec_len, key_a,
+                            AES_KEY_STAND);
+    u_assert(dec == NULL || !STREQ(dec, msg));
+    free(dec);
+    free(enc);
+
+    aescbcb64_key_cache_clear();
+}
+
+
+static void test_aescbcb64_no_malloc(void)
+{
+    const char *msg = "{\"sign\":{\"meta\":\"hash\",\"data\":[]}}";
+    char enc[AESCBCB64_ENCRYPT_SIZE(64)];
+    char hmac_enc[AESCBCB64_HMAC_ENCRYPT_SIZE(64)];
+    char dec[AESCBCB64_DECRYPT_SIZE(sizeof(enc) - 1)];
+    uint8_t key[32], shared_secret[32];
+    int i, calls, inlen, enc_len, dec_len;
+
+    random_bytes(key, sizeof(key), 0);
+    random_bytes(shared_secret, sizeof(shared_secret), 0);
+    aescbcb64_tfa_keys_set(shared_secret);
+
+    // Exact sizes at every padding boundary, with and without a cached schedule
+    for (inlen = 0; inlen <= 64; inlen++) {
+        char in[64];
+        memset(in, 'a' + inlen % 26, sizeof(in));
+
+        calls = tests_malloc_calls;
+        u_assert_int_eq(aescbcb64_encrypt_to((const unsigned char *)in, inlen, enc,
+                                             AESCBCB64_ENCRYPT_SIZE(inlen), &enc_len, key,
+                                             inlen % 2 ? AES_KEY_STAND : AES_KEY_NONE), DBB_OK);
+        u_assert_int_eq(enc_len + 1, AESCBCB64_ENCRYPT_SIZE(inlen));
+        u_assert_int_eq(strlens(enc), enc_len);
+
+        // Decrypting the empty plaintext is rejected, as in aescbcb64_decrypt()
+        u_assert_int_eq(aescbcb64_decrypt_to(enc, enc_len, dec,
+                                             AESCBCB64_DECRYPT_SIZE(enc_len), &dec_len, key,
+                                             AES_KEY_STAND), inlen ? DBB_OK : DBB_ERROR);
+        if (inlen) {
+            u_assert_int_eq(dec_len, inlen + 1);
+            u_assert_mem_eq(dec, in, inlen);
+            u_assert_int_eq(dec[inlen], '\0');
+        }
+
+        u_assert_int_eq(aescbcb64_hmac_encrypt_to((const unsigned char *)in, inlen, hmac_enc,
+                        AESCBCB64_HMAC_ENCRYPT_SIZE(inlen), &enc_len), DBB_OK);
+        u_assert_int_eq(enc_len + 1, AESCBCB64_HMAC_ENCRYPT_SIZE(inlen));
+        u_assert_int_eq(tests_malloc_calls, calls);
+
+        // Undersized spans are refused
+        u_assert_int_eq(aescbcb64_encrypt_to((const unsigned char *)in, inlen, enc,
+                                             AESCBCB64_ENCRYPT_SIZE(inlen) - 1, &enc_len, key,
+                                             AES_KEY_NONE), DBB_ERROR);
+        u_assert_int_eq(aescbcb64_hmac_encrypt_to((const unsigned char *)in, inlen, hmac_enc,
+                        AESCBCB64_HMAC_ENCRYPT_SIZE(inlen) - 1, &enc_len), DBB_ERROR);
+    }
+
+    // Matches the allocating API and decrypts in place
+    u_assert_int_eq(aescbcb64_encrypt_to((const unsigned char *)msg, strlens(msg), enc,
+                                         sizeof(enc), &enc_len, key, AES_KEY_STAND), DBB_OK);
+    char *dec_alloc = aescbcb64_decrypt((const unsigned char *)enc, enc_len, &dec_len, key,
+                                        AES_KEY_NONE);
+    u_assert_str_eq(dec_alloc, msg);
+    free(dec_alloc);
+    calls = tests_malloc_calls;
+    u_assert_int_eq(aescbcb64_decrypt_to(enc, enc_len, enc, sizeof(enc), &dec_len, key,
+                                         AES_KEY_STAND), DBB_OK);
+    u_assert_str_eq(enc, msg);
+    u_assert_int_eq(dec_len, (int)strlens(msg) + 1);
+    u_assert_int_eq(tests_malloc_calls, calls);
+
+    // Bounded output, corrupted and truncated input are rejected
+    u_assert_int_eq(aescbcb64_encrypt_to((const unsigned char *)msg, strlens(msg), enc,
+                                         sizeof(enc), &enc_len, key, AES_KEY_STAND), DBB_OK);
+    u_assert_int_eq(aescbcb64_decrypt_to(enc, enc_len, dec,
+                                         AESCBCB64_CIPHER_LEN(strlens(msg)) - 1,
+                                         &dec_len, key, AES_KEY_STAND), DBB_ERROR);
+    u_assert_int_eq(aescbcb64_decrypt_to(enc, enc_len, dec,
+                                         AESCBCB64_CIPHER_LEN(strlens(msg)),
+                                         &dec_len, key, AES_KEY_STAND), DBB_OK);
+    u_assert_int_eq(aescbcb64_decrypt_to(enc, enc_len - 4, dec, sizeof(dec), &dec_len, key,
+                                         AES_KEY_STAND), DBB_ERROR);
+    enc[3] = '*';
+    u_assert_int_eq(aescbcb64_decrypt_to(enc, enc_len, dec, sizeof(dec), &dec_len, key,
+                                         AES_KEY_STAND), DBB_ERROR);
+    u_assert_int_eq(dec_len, 0);
+
+#ifdef TESTS_WRAP_MALLOC
+    // Many round trips without touching the heap
+    calls = tests_malloc_calls;
+    for (i = 0; i < 100; i++) {
+        u_assert_int_eq(aescbcb64_encrypt_to((const unsigned char *)msg, strlens(msg), enc,
+                                             sizeof(enc), &enc_len, key, AES_KEY_HIDDEN), DBB_OK);
+        u_assert_int_eq(aescbcb64_decrypt_to(enc, enc_len, dec, sizeof(dec), &dec_len, key,
+                                             AES_KEY_HIDDEN), DBB_OK);
+    }
+    u_assert_int_eq(tests_malloc_calls, calls);
+
+    // The allocating API costs a single malloc per call
+    char *enc_alloc = aescbcb64_encrypt((const unsigned char *)msg, strlens(msg), &enc_len,
+                                        key, AES_KEY_HIDDEN);
+    u_assert_int_eq(tests_malloc_calls, calls + 1);
+    free(enc_alloc);
+#else
+    (void)i;
+    u_print_info("Heap allocations not counted: allocator not wrapped\n");
+#endif
+
+    aescbcb64_key_cache_clear();
+}
+
+
+// RFC 8439 test vectors
+// Feeds `in` to a stream in chunks of random size and checks that whatever the stream
+// answers for each key matches aescbcb64_decrypt(). Counts the answers in `answers`.
+static void test_aescbcb64_stream_compare(const char *in, int inlen,
+        const uint8_t *const keys[AESCBCB64_STREAM_KEYS],
+        const AES_KEY_SLOT slots[AESCBCB64_STREAM_KEYS], int *answers)
+{
+    aescbcb64_decrypt_stream s;
+    int k, received = 0, dec_len, ref_len;
+    char *dec, *ref;
+
+    *answers = 0;
+    if (aescbcb64_decrypt_stream_init(&s, inlen, keys, slots) != DBB_OK) {
+        return;
+    }
+    while (received < inlen) {
+        received = MIN(inlen, received + 1 + (int)random_uint32(0) % 80);
+        aescbcb64_decrypt_stream_update(&s, in, received);
+    }
+
+    for (k = 0; k < AESCBCB64_STREAM_KEYS; k++) {
+        if (aescbcb64_decrypt_stream_take(&s, in, inlen, keys[k], slots[k], &dec,
+                                          &dec_len) != DBB_OK) {
+            continue;
+        }
+        (*answers)++;
+        ref = aescbcb64_decrypt((const unsigned char *)in, inlen, &ref_len, keys[k],
+                                AES_KEY_NONE);
+        u_assert_int_eq(!dec, !ref);
+        u_assert_int_eq(dec_len, ref_len);
+        if (ref) {
+            u_assert_mem_eq(dec, ref, dec_len);
+        }
+        free(dec);
+        free(ref);
+    }
+    aescbcb64_decrypt_stream_free(&s);
+}
+
+
+static void test_aescbcb64_stream(void)
+{
+    char msg[COMMANDER_REPORT_SIZE / 2], *enc;
+    char in[COMMANDER_REPORT_SIZE];
+    uint8_t key_a[32], key_b[32];
+    const uint8_t *keys[AESCBCB64_STREAM_KEYS] = { key_a, key_b };
+    const AES_KEY_SLOT slots[AESCBCB64_STREAM_KEYS] = { AES_KEY_STAND, AES_KEY_HIDDEN };
+    const char mutations[] = "=\0 A+/*";
+    aescbcb64_decrypt_stream s;
+    int i, j, len, enc_len, dec_len, answers, N = 200;
+    clock_t t, t_stream = 0, t_full = 0;
+    char *dec;
+
+    random_bytes(key_a, sizeof(key_a), 0);
+    random_bytes(key_b, sizeof(key_b), 0);
+
+    for (i = 0; i < N; i++) {
+        len = random_uint32(0) % sizeof(msg);
+        memset(msg, 'a' + i % 26, len);
+        enc = aescbcb64_encrypt((const unsigned char *)msg, len, &enc_len,
+                                i % 2 ? key_a : key_b, AES_KEY_NONE);
+        u_assert(enc);
+        memcpy(in, enc, enc_len);
+        free(enc);
+
+        // Valid requests are answered for both keys
+        test_aescbcb64_stream_compare(in, enc_len, keys, slots, &answers);
+        u_assert_int_eq(answers, 2);
+
+        // Truncated, unpadded and corrupted requests decrypt as before or are left to
+        // aescbcb64_decrypt()
+        test_aescbcb64_stream_compare(in, random_uint32(0) % enc_len, keys, slots, &answers);
+        for (j = enc_len; j > 0 && in[j - 1] == '='; j--);
+        test_aescbcb64_stream_compare(in, j, keys, slots, &answers);
+        in[random_uint32(0) % enc_len] = mutations[random_uint32(0) % (sizeof(mutations) - 1)];
+        test_aescbcb64_stream_compare(in, enc_len, keys, slots, &answers);
+    }
+
+    // Input that differs from what was streamed is not answered
+    enc = aescbcb64_encrypt((const unsigned char *)msg, sizeof(msg), &enc_len, key_a,
+                            AES_KEY_NONE);
+    aescbcb64_decrypt_stream_init(&s, enc_len, keys, slots);
+    aescbcb64_decrypt_stream_update(&s, enc, enc_len);
+    u_assert_int_eq(aescbcb64_decrypt_stream_take(&s, enc, enc_len - 4, key_a, AES_KEY_STAND,
+                    &dec, &dec_len), DBB_ERROR);
+    aescbcb64_decrypt_stream_free(&s);
+
+    // Work left once the last character arrived, against decrypting it all then
+    for (i = 0; i < N; i++) {
+        aescbcb64_decrypt_stream_init(&s, enc_len, keys, slots);
+        aescbcb64_decrypt_stream_update(&s, enc, enc_len);
+        t = clock();
+        aescbcb64_decrypt_stream_take(&s, enc, enc_len, key_a, AES_KEY_STAND, &dec, &dec_len);
+        t_stream += clock() - t;
+        u_assert_int_eq(dec_len, (int)sizeof(msg) + 1);
+        free(dec);
+        aescbcb64_decrypt_stream_free(&s);
+
+        t = clock();
+        dec = aescbcb64_decrypt((const unsigned char *)enc, enc_len, &dec_len, key_a,
+                                AES_KEY_STAND);
+        free(dec);
+        dec = aescbcb64_decrypt((const unsigned char *)enc, enc_len, &dec_len, key_b,
+                                AES_KEY_HIDDEN);
+        free(dec);
+        t_full += clock() - t;
+    }
+    free(enc);
+    u_print_info("Decrypt after the last frame of a %i-byte request: %0.1f us streamed, "
+                 "%0.1f us whole\n", enc_len, 1e6 * t_stream / CLOCKS_PER_SEC / N,
+                 1e6 * t_full / CLOCKS_PER_SEC / N);
+
+    aescbcb64_key_cache_clear();
+}
+
+
+static void test_chacha20poly1305(void)
+{
+    uint8_t key[32], nonce[12], aad[12], block[64], tag[16], buf[256], out[256];
+    poly1305_context ctx;
+    int i, len;
+
+    const char *sunscreen =
+        "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for "
+        "the future, sunscreen would be it.";
+    len = strlens(sunscreen);
+
+    // 2.3.2 Block function
+    for (i = 0; i < 32; i++) {
+        key[i] = i;
+    }
+    memcpy(nonce, utils_hex_to_uint8("000000090000004a00000000"), 12);
+    chacha20_block(key, 1, nonce, block);
+    u_assert_mem_eq(block, utils_hex_to_uint8(
+                        "10f1e7e4d13b5915500fdd1fa32071c4c7d1f4c733c068030422aa9ac3d46c4e"
+                        "d2826446079faa0914c2d705d98b02a2b5129cd1de164eb9cbd083e8a2503c4e"), 64);
+
+    // 2.4.2 Encryption
+    memcpy(nonce, utils_hex_to_uint8("000000000000004a00000000"), 12);
+    chacha20_xor(key, 1, nonce, (const uint8_t *)sunscreen, out, len);
+    u_assert_mem_eq(out, utils_hex_to_uint8(
+                        "6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0b"
+                        "f91b65c5524733ab8f593dabcd62b3571639d624e65152ab8f530c359f0861d8"
+                        "07ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab7793736"
+                        "5af90bbf74a35be6b40b8eedf2785e42874d"), len);
+    chacha20_xor(key, 1, nonce, out, out, len);
+    u_assert_mem_eq(out, sunscreen, len);
+
+    // 2.5.2 Poly1305, absorbed whole and byte by byte
+    const char *cfrg = "Cryptographic Forum Research Group";
+    const char *poly_key = "85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b";
+    const char *poly_tag = "a8061dc1305136c6c22b8baf0c0127a9";
+    poly1305_init(&ctx, utils_hex_to_uint8(poly_key));
+    poly1305_update(&ctx, (const uint8_t *)cfrg, strlens(cfrg));
+    poly1305_finish(&ctx, tag);
+    u_assert_mem_eq(tag, utils_hex_to_uint8(poly_tag), 16);
+    poly1305_init(&ctx, utils_hex_to_uint8(poly_key));
+    for (i = 0; i < (int)strlens(cfrg); i++) {
+        poly1305_update(&ctx, (const uint8_t *)cfrg + i, 1);
+    }
+    poly1305_finish(&ctx, tag);
+    u_assert_mem_eq(tag, utils_hex_to_uint8(poly_tag), 16);
+
+    // 2.6.2 Poly1305 key generation
+    for (i = 0; i < 32; i++) {
+        key[i] = 0x80 + i;
+    }
+    memcpy(nonce, utils_hex_to_uint8("000000000001020304050607"), 12);
+    chacha20_block(key, 0, nonce, block);
+    u_assert_mem_eq(block, utils_hex_to_uint8(
+                        "8ad5a08b905f81cc815040274ab29471a833b637e3fd0da508dbb8e2fdd1a646"), 32);
+
+    // 2.8.2 AEAD
+    memcpy(nonce, utils_hex_to_uint8("070000004041424344454647"), 12);
+    memcpy(aad, utils_hex_to_uint8("50515253c0c1c2c3c4c5c6c7"), 12);
+    chacha20poly1305_seal(key, nonce, aad, sizeof(aad), (const uint8_t *)sunscreen, len,
+                          out);
+    u_assert_mem_eq(out, utils_hex_to_uint8(
+                        "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+                        "3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+                        "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+                        "3ff4def08e4b7a9de576d26586cec64b6116"), len);
+    u_assert_mem_eq(out + len, utils_hex_to_uint8("1ae10b594f09e26a7e902ecbd0600691"), 16);
+
+    // Open in place
+    memcpy(buf, out, len + 16);
+    u_assert_int_eq(chacha20poly1305_open(key, nonce, aad, sizeof(aad), buf, len + 16, buf),
+                    DBB_OK);
+    u_assert_mem_eq(buf, sunscreen, len);
+
+    // Any flipped bit in the aad, ciphertext or tag is rejected and nothing is released
+    for (i = 0; i < len + 16; i += 7) {
+        memcpy(buf, out, len + 16);
+        buf[i] ^= 1 << (i % 8);
+        u_assert_int_eq(chacha20poly1305_open(key, nonce, aad, sizeof(aad), buf, len + 16, buf),
+                        DBB_ERROR);
+        memset(block, 0, sizeof(block));
+        u_assert_mem_eq(buf, block, 64);
+    }
+    aad[0] ^= 1;
+    u_assert_int_eq(chacha20poly1305_open(key, nonce, aad, sizeof(aad), out, len + 16, buf),
+                    DBB_ERROR);
+    u_assert_int_eq(chacha20poly1305_open(key, nonce, aad, sizeof(aad), out, 15, buf),
+                    DBB_ERROR);
+}
+
+
+static void test_chachapolyb64(void)
+{
+    const char *msg = "{\"sign\":{\"meta\":\"hash\",\"data\":[]}}";
+    char enc[CHACHAPOLYB64_ENCRYPT_SIZE(64)];
+    char dec[CHACHAPOLYB64_DECRYPT_SIZE(sizeof(enc) - 1)];
+    uint8_t key[32], key_b[32];
+    int calls, inlen, enc_len, dec_len;
+
+    random_bytes(key, sizeof(key), 0);
+    random_bytes(key_b, sizeof(key_b), 0);
+
+    // Exact sizes for every length, encoded over the binary message in place
+    for (inlen = 0; inlen <= 64; inlen++) {
+        char in[64];
+        memset(in, 'a' + inlen % 26, sizeof(in));
+
+        calls = tests_malloc_calls;
+        u_assert_int_eq(chachapolyb64_encrypt_to((const unsigned char *)in, inlen, enc,
+                        CHACHAPOLYB64_ENCRYPT_SIZE(inlen), &enc_len, key, AES_KEY_NONE),
+                        DBB_OK);
+        u_assert_int_eq(enc_len + 1, CHACHAPOLYB64_ENCRYPT_SIZE(inlen));
+        u_assert_int_eq(strlens(enc), enc_len);
+        u_assert(chachapolyb64_has_prefix(enc, enc_len));
+
+        // The empty plaintext is rejected, as in aescbcb64_decrypt()
+        u_assert_int_eq(chachapolyb64_decrypt_to(enc, enc_len, dec,
+                        CHACHAPOLYB64_DECRYPT_SIZE(enc_len), &dec_len, key,
+                        AES_KEY_NONE),
+                        inlen ? DBB_OK : DBB_ERROR);
+        if (inlen) {
+            u_assert_int_eq(dec_len, inlen + 1);
+            u_assert_mem_eq(dec, in, inlen);
+            u_assert_int_eq(dec[inlen], '\0');
+        }
+        u_assert_int_eq(tests_malloc_calls, calls);
+
+        u_assert_int_eq(chachapolyb64_encrypt_to((const unsigned char *)in, inlen, enc,
+                        CHACHAPOLYB64_ENCRYPT_SIZE(inlen) - 1, &enc_len, key,
+                        AES_KEY_NONE), DBB_ERROR);
+    }
+
+    // Matches the allocating API and decrypts in place
+    char *enc_alloc = chachapolyb64_encrypt((const unsigned char *)msg, strlens(msg),
+                                            &enc_len, key, AES_KEY_NONE);
+    u_assert(enc_alloc);
+    u_assert_int_eq(enc_len, CHACHAPOLYB64_ENCRYPT_SIZE(strlens(msg)) - 1);
+    memcpy(enc, enc_alloc, enc_len + 1);
+    free(enc_alloc);
+    u_assert_int_eq(chachapolyb64_decrypt_to(enc, enc_len, enc, sizeof(enc), &dec_len, key,
+                    AES_KEY_NONE), DBB_OK);
+    u_assert_str_eq(enc, msg);
+    u_assert_int_eq(dec_len, (int)strlens(msg) + 1);
+
+    // Fresh nonces
+    u_assert_int_eq(chachapolyb64_encrypt_to((const unsigned char *)msg, strlens(msg), enc,
+                    sizeof(enc), &enc_len, key, AES_KEY_NONE), DBB_OK);
+    u_assert_int_eq(chachapolyb64_encrypt_to((const unsigned char *)msg, strlens(msg), dec,
+                    sizeof(dec), &enc_len, key, AES_KEY_NONE), DBB_OK);
+    u_assert_str_not_eq(enc, dec);
+
+    // Wrong key, AES-CBC input, bad prefix, truncation and tampering are rejected
+    char *dec_alloc = chachapolyb64_decrypt((const unsigned char *)enc, enc_len, &dec_len,
+                                            key_b, AES_KEY_NONE);
+    u_assert(dec_alloc == NULL);
+    u_assert_int_eq(dec_len, 0);
+    dec_alloc = chachapolyb64_decrypt((const unsigned char *)enc, enc_len, &dec_len, key,
+                                      AES_KEY_NONE);
+    u_assert_str_eq(dec_alloc, msg);
+    free(dec_alloc);
+    u_assert_int_eq(chachapolyb64_decrypt_to(enc + CHACHAPOLYB64_PREFIX_LEN,
+                    enc_len - CHACHAPOLYB64_PREFIX_LEN, dec, sizeof(dec), &dec_len, key,
+                    AES_KEY_NONE), DBB_ERROR);
+    u_assert_int_eq(chachapolyb64_decrypt_to(enc, enc_len - 4, dec, sizeof(dec), &dec_len,
+                    key, AES_KEY_NONE), DBB_ERROR);
+    char *c = enc + CHACHAPOLYB64_PREFIX_LEN + 20;
+    *c = *c == 'A' ? 'B' : 'A';
+    u_assert_int_eq(chachapolyb64_decrypt_to(enc, enc_len, dec, sizeof(dec), &dec_len, key,
+                    AES_KEY_NONE), DBB_ERROR);
+    u_assert_int_eq(dec_len, 0);
+    enc[0] = 'C';
+    u_assert(!chachapolyb64_has_prefix(enc, enc_len));
+    u_assert(!chachapolyb64_has_prefix(enc, 2));
+
+    // Derived keys cached per slot follow the secret of the slot and its invalidation
+    chachapolyb64_key_cache_clear();
+    u_assert_int_eq(chachapolyb64_encrypt_to((const unsigned char *)msg, strlens(msg), enc,
+                    sizeof(enc), &enc_len, key, AES_KEY_STAND), DBB_OK);
+    u_assert_int_eq(chachapolyb64_decrypt_to(enc, enc_len, dec, sizeof(dec), &dec_len, key,
+                    AES_KEY_NONE), DBB_OK);
+    u_assert_str_eq(dec, msg);
+    u_assert_int_eq(chachapolyb64_decrypt_to(enc, enc_len, dec, sizeof(dec), &dec_len,
+                    key_b, AES_KEY_STAND), DBB_ERROR);
+    u_assert_int_eq(chachapolyb64_decrypt_to(enc, enc_len, dec, sizeof(dec), &dec_len, key,
+                    AES_KEY_STAND), DBB_OK);
+    u_assert_str_eq(dec, msg);
+    chachapolyb64_key_cache_invalidate(AES_KEY_STAND);
+    chachapolyb64_key_cache_invalidate(AES_KEY_NONE);
+    u_assert_int_eq(chachapolyb64_decrypt_to(enc, enc_len, dec, sizeof(dec), &dec_len, key,
+                    AES_KEY_STAND), DBB_OK);
+    u_assert_str_eq(dec, msg);
+    chachapolyb64_key_cache_clear();
+}
+
+
+// Crypto cost of one HWW request: decrypt a ~1 kB command, then encrypt a ~1 kB reply
+static void test_transport_speed(void)
+{
+    char cmd[1024], *enc, *dec;
+    uint8_t key[32], buf[1024 + POLY1305_TAG_LEN], nonce[CHACHA20_NONCE_LEN];
+    int i, N = 500, enc_len, dec_len;
+    clock_t t;
+    float aes_req, chacha_req, chacha_mb;
+
+    random_bytes(key, sizeof(key), 0);
+    random_bytes(nonce, sizeof(nonce), 0);
+    memset(cmd, 'a', sizeof(cmd));
+    cmd[0] = '{';
+    cmd[sizeof(cmd) - 2] = '}';
+    cmd[sizeof(cmd) - 1] = '\0';
+
+    aescbcb64_key_cache_clear();
+    t = clock();
+    for (i = 0; i < N; i++) {
+        enc = aescbcb64_encrypt((const unsigned char *)cmd, strlens(cmd), &enc_len, key,
+                                AES_KEY_STAND);
+        dec = aescbcb64_decrypt((const unsigned char *)enc, enc_len, &dec_len, key,
+                                AES_KEY_STAND);
+        u_assert_str_eq(dec, cmd);
+        free(enc);
+        free(dec);
+    }
+    aes_req = N / ((float)(clock() - t) / CLOCKS_PER_SEC);
+    aescbcb64_key_cache_clear();
+
+    t = clock();
+    for (i = 0; i < N; i++) {
+        enc = chachapolyb64_encrypt((const unsigned char *)cmd, strlens(cmd), &enc_len, key,
+                                    AES_KEY_STAND);
+        dec = chachapolyb64_decrypt((const unsigned char *)enc, enc_len, &dec_len, key,
+                                    AES_KEY_STAND);
+        u_assert_str_eq(dec, cmd);
+        free(enc);
+        free(dec);
+    }
+    chacha_req = N / ((float)(clock() - t) / CLOCKS_PER_SEC);
+    chachapolyb64_key_cache_clear();
+
+    t = clock();
+    for (i = 0; i < N * 2; i++) {
+        chacha20poly1305_seal(key, nonce, NULL, 0, buf, 1024, buf);
+    }
+    chacha_mb = N * 2 * 1024 / ((float)(clock() - t) / CLOCKS_PER_SEC) / 1e6;
+
+    u_print_info("Transport AES-256-CBC + base64: %0.2f req/s\n", aes_req);
+    u_print_info("Transport ChaCha20-Poly1305 + base64: %0.2f req/s (AEAD %0.2f MB/s)\n",
+                 chacha_req, chacha_mb);
+}
+
+
 static void test_aes_encrypt_decrypt_hmac(void)
 {
     const char *msg = "A test msg.\n";
     int b64_length = 0;
     const uint8_t *shared_secret =
         utils_hex_to_uint8("603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4");
+    aescbcb64_tfa_keys_set(shared_secret);
     char *encrypted_msg = aescbcb64_hmac_encrypt((const unsigned char *)msg, strlen(msg),
-                          &b64_length, shared_secret);
+                          &b64_length);
     u_assert_int_eq(b64_length, strlen(encrypted_msg));
 
     int out_length = 0;
@@ -709,6 +1879,20 @@ static void test_aes_encrypt_decrypt_hmac(void)
     u_assert_str_eq(decrypted_msg, msg);
     u_assert_int_eq(out_length, strlen(msg) + 1);
 
+    // Raw variant, encrypted in place without base64
+    uint8_t raw[AESCBCB64_HMAC_CIPHER_LEN(12)];
+    int raw_length = 0;
+    memcpy(raw, msg, strlen(msg));
+    u_assert_int_eq(aescbcb64_hmac_encrypt_in_place(raw, strlen(msg), sizeof(raw),
+                    &raw_length), DBB_OK);
+    u_assert_int_eq(raw_length, sizeof(raw));
+    char *raw_msg = decrypt_and_check_hmac_raw(raw, raw_length, &out_length, shared_secret,
+                    hmac);
+    u_assert_str_eq(raw_msg, msg);
+    free(raw_msg);
+    u_assert_int_eq(aescbcb64_hmac_encrypt_in_place(raw, strlen(msg), sizeof(raw) - 1,
+                    &raw_length), DBB_ERROR);
+
     int ub64_length = 0;
     unsigned char *ub64 = unbase64((const char *)encrypted_msg, b64_length, &ub64_length);
     u_assert(ub64);
@@ -724,6 +1908,23 @@ static void test_aes_encrypt_decrypt_hmac(void)
                                     corrupted_encrypted_b64_msg, b64_length, &out_length,
                                     shared_secret, hmac);
     u_assert(corrupted_decrypted_msg == NULL);
+
+    // Same round trip through the cached TFA keys
+    char *cached_msg = aescbcb64_hmac_decrypt((const unsigned char *)encrypted_msg,
+                       strlen(encrypted_msg), &out_length);
+    u_assert(cached_msg);
+    u_assert_str_eq(cached_msg, msg);
+    u_assert_int_eq(out_length, strlen(msg) + 1);
+    u_assert(aescbcb64_hmac_decrypt((const unsigned char *)corrupted_encrypted_b64_msg,
+                                    b64_length, &out_length) == NULL);
+
+    // Keys follow the shared secret
+    aescbcb64_tfa_keys_set(
+        utils_hex_to_uint8("000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"));
+    u_assert(aescbcb64_hmac_decrypt((const unsigned char *)encrypted_msg,
+                                    strlen(encrypted_msg), &out_length) == NULL);
+
+    free(cached_msg);
     free(encrypted_msg);
     free(decrypted_msg);
     free(corrupted_encrypted_b64_msg);
@@ -934,6 +2135,161 @@ static void test_base58(void)
 // test vectors from:
 // https://tools.ietf.org/html/rfc4648
 // https://commons.apache.org/proper/commons-codec/xref-test/org/apache/commons/codec/binary/Base64Test.html
+// Reference Base58Check codec working one byte at a time, as base58.c used to
+static const char tests_base58_alphabet[] =
+    "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+
+static int tests_base58_ref_encode(const uint8_t *data, int datalen, char *str)
+{
+    uint8_t bin[128 + 4], buf[(128 + 4) * 138 / 100 + 1];
+    int i, j, high, carry, zcount = 0, size, binsz = datalen + 4;
+
+    memcpy(bin, data, datalen);
+    sha256_Raw(data, datalen, buf);
+    sha256_Raw(buf, 32, buf);
+    memcpy(bin + datalen, buf, 4);
+
+    while (zcount < binsz && !bin[zcount]) {
+        ++zcount;
+    }
+    size = (binsz - zcount) * 138 / 100 + 1;
+    memset(buf, 0, size);
+    for (i = zcount, high = size - 1; i < binsz; ++i, high = j) {
+        for (carry = bin[i], j = size - 1; (j > high) || carry; --j) {
+            carry += 256 * buf[j];
+            buf[j] = carry % 58;
+            carry /= 58;
+        }
+    }
+    for (j = 0; j < size && !buf[j]; ++j);
+    memset(str, '1', zcount);
+    for (i = zcount; j < size; ++i, ++j) {
+        str[i] = tests_base58_alphabet[buf[j]];
+    }
+    str[i] = '\0';
+    return i + 1;
+}
+
+
+static int tests_base58_ref_decode(const char *str, uint8_t *data, int datalen)
+{
+    uint8_t d[128 + 4], hash[32];
+    int i, j, carry, zeros = 0, n = datalen + 4;
+    const char *p;
+
+    memset(d, 0, n);
+    for (i = 0; str[i] == '1'; i++) {
+        zeros++;
+    }
+    for (; str[i]; i++) {
+        if (!(p = strchr(tests_base58_alphabet, str[i]))) {
+            return 0;
+        }
+        for (carry = p - tests_base58_alphabet, j = n - 1; j >= 0; j--) {
+            carry += 58 * d[j];
+            d[j] = carry & 0xff;
+            carry >>= 8;
+        }
+        if (carry) {
+            return 0;
+        }
+    }
+    for (i = 0; i < n && !d[i]; i++);
+    if (n - i + zeros != n) {
+        return 0;
+    }
+    sha256_Raw(d, datalen, hash);
+    sha256_Raw(hash, 32, hash);
+    if (memcmp(d + datalen, hash, 4)) {
+        return 0;
+    }
+    memcpy(data, d, datalen);
+    return datalen;
+}
+
+
+static void test_base58_fuzz(void)
+{
+    uint8_t bin[128], out[128], ref[128];
+    char str[200], ref_str[200];
+    const char charset[] = "11zZoO0lI+\x80";
+    int i, j, len, ret, ref_len;
+
+    for (i = 0; i < 2000; i++) {
+        len = random_uint32(0) % (sizeof(bin) + 1);
+        random_bytes(bin, len, 0);
+        if (len) {
+            memset(bin, 0, random_uint32(0) % (len + 1) % 5);
+        }
+
+        // Bit-for-bit the same output as the byte-wise codec
+        ret = base58_encode_check(bin, len, str, sizeof(str));
+        ref_len = tests_base58_ref_encode(bin, len, ref_str);
+        u_assert_int_eq(ret, ref_len);
+        u_assert_str_eq(str, ref_str);
+        u_assert_int_eq(base58_encode_check(bin, len, str, ret - 1), 0);
+        u_assert_int_eq(base58_encode_check(bin, len, str, ret), ret);
+
+        // Round trip, and wrong lengths are rejected
+        u_assert_int_eq(base58_decode_check(str, out, len), len);
+        u_assert_mem_eq(out, bin, len);
+        if (len) {
+            u_assert_int_eq(base58_decode_check(str, out, len - 1), 0);
+        }
+        if (len < (int)sizeof(bin)) {
+            u_assert_int_eq(base58_decode_check(str, out, len + 1), 0);
+        }
+
+        // Mutated input decodes exactly as the reference does, or is rejected by both
+        ret = 1 + random_uint32(0) % 2;
+        for (j = 0; j < ret; j++) {
+            char c = random_uint32(0) % 2 ? charset[random_uint32(0) % (sizeof(charset) - 1)] :
+                     tests_base58_alphabet[random_uint32(0) % 58];
+            str[random_uint32(0) % (ref_len - 1)] = c;
+        }
+        ret = base58_decode_check(str, out, len);
+        u_assert_int_eq(ret, tests_base58_ref_decode(str, ref, len));
+        if (ret) {
+            u_assert_mem_eq(out, ref, len);
+        }
+    }
+    u_assert_int_eq(base58_decode_check("", out, 0), 0);
+    u_assert_int_eq(base58_encode_check(bin, 129, str, sizeof(str)), 0);
+}
+
+
+static void test_base58_speed(void)
+{
+    uint8_t xpub[78], out[78];
+    char str[112 + 1];
+    int i, N = 1000;
+    clock_t t;
+    float legacy, limbs;
+
+    random_bytes(xpub, sizeof(xpub), 0);
+    memcpy(xpub, "\x04\x88\xb2\x1e", 4);
+
+    t = clock();
+    for (i = 0; i < N; i++) {
+        tests_base58_ref_encode(xpub, sizeof(xpub), str);
+    }
+    legacy = (float)(clock() - t) / CLOCKS_PER_SEC * 1e3;
+    u_assert_str_has(str, "xpub");
+
+    t = clock();
+    for (i = 0; i < N; i++) {
+        base58_encode_check(xpub, sizeof(xpub), str, sizeof(str));
+    }
+    limbs = (float)(clock() - t) / CLOCKS_PER_SEC * 1e3;
+    u_assert_int_eq(base58_decode_check(str, out, sizeof(out)), sizeof(out));
+    u_assert_mem_eq(out, xpub, sizeof(out));
+
+    u_print_info("%d xpub encodings: %0.2f ms byte-wise, %0.2f ms limbs\n",
+                 N, legacy, limbs);
+}
+
+
 static void test_base64(void)
 {
     const char **plainp, **base64p;
@@ -968,9 +2324,558 @@ static void test_base64(void)
         u_assert_mem_eq(ub64, *plainp, ub64len);
         free(ub64);
 
+        // allocation-free, decoding in place
+        char buf[128];
+        u_assert_int_eq(base64_to(*plainp, strlen(*plainp), buf, sizeof(buf)), b64len);
+        u_assert_mem_eq(buf, *base64p, b64len);
+        if (b64len) {
+            u_assert_int_eq(base64_to(*plainp, strlen(*plainp), buf, b64len - 1), -1);
+            u_assert_int_eq(unbase64_to(buf, b64len, (unsigned char *)buf, sizeof(buf)),
+                            ub64len);
+            u_assert_mem_eq(buf, *plainp, ub64len);
+        }
+
         plainp += 2;
         base64p += 2;
     }
+
+    // Strict and lenient decoding
+    static const struct {
+        const char *in;
+        int lenient, strict;// expected length, or -1
+    } decode_vector[] = {
+        { "Zm9vYg==", 4, 4 },
+        { "Zm9vYg", 4, -1 },   // unpadded
+        { "Zm9vYmE", 5, -1 },  // unpadded
+        { "Zm9vYh==", 4, -1 }, // non-zero unused bits
+        { "Zm9vYmF=", 5, -1 }, // non-zero unused bits
+        { "Zm9vY", -1, -1 },   // a lone trailing character
+        { "Zm9vYg=", -1, -1 }, // incomplete padded quantum
+        { "Zm9v=Yg=", -1, -1 },// data after padding
+        { "Zm9vY===", -1, -1 },
+        { "Zm9 vYg==", -1, -1 },
+        { "Zm9v\nYg==", -1, -1 },
+        { "Zm9-Yg==", -1, -1 },
+        { "Zm9_Yg==", -1, -1 },
+        { "Zm9v\xc3Yg=", -1, -1 },
+        { "==", -1, -1 },
+        { "Z", -1, -1 },
+    };
+    size_t i;
+    for (i = 0; i < sizeof(decode_vector) / sizeof(decode_vector[0]); i++) {
+        unsigned char out[16];
+        const char *in = decode_vector[i].in;
+        u_assert_int_eq(unbase64_to(in, strlens(in), out, sizeof(out)),
+                        decode_vector[i].lenient);
+        if (decode_vector[i].lenient > 0) {
+            u_assert_mem_eq(out, "foobar", decode_vector[i].lenient);
+            u_assert_int_eq(unbase64_to(in, strlens(in), out, decode_vector[i].lenient - 1),
+                            -1);
+        }
+        u_assert_int_eq(unbase64_strict_to(in, strlens(in), out, sizeof(out)),
+                        decode_vector[i].strict);
+    }
+    unsigned char out[16];
+    u_assert_int_eq(unbase64_to("", 0, out, sizeof(out)), -1);
+    u_assert_int_eq(unbase64_to(NULL, 4, out, sizeof(out)), -1);
+}
+
+
+// Reference codec with a bit accumulator, independent of the table-driven one
+static int tests_base64_ref_encode(const uint8_t *in, int len, char *out)
+{
+    const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t acc = 0;
+    int i, bits = 0, n = 0;
+    for (i = 0; i < len; i++) {
+        acc = (acc << 8) | in[i];
+        bits += 8;
+        while (bits >= 6) {
+            bits -= 6;
+            out[n++] = alphabet[(acc >> bits) & 0x3f];
+        }
+    }
+    if (bits) {
+        out[n++] = alphabet[(acc << (6 - bits)) & 0x3f];
+    }
+    while (n % 4) {
+        out[n++] = '=';
+    }
+    return n;
+}
+
+
+static int tests_base64_ref_decode(const char *in, int len, uint8_t *out, int strict)
+{
+    const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t acc = 0;
+    int i, bits = 0, n = 0, pad = 0;
+    while (pad < 2 && len - pad > 0 && in[len - pad - 1] == '=') {
+        pad++;
+    }
+    if (len < 2 || ((pad || strict) && len % 4) || (len - pad) % 4 == 1) {
+        return -1;
+    }
+    for (i = 0; i < len - pad; i++) {
+        const char *p = in[i] ? strchr(alphabet, in[i]) : NULL;
+        if (!p) {
+            return -1;
+        }
+        acc = (acc << 6) | (p - alphabet);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[n++] = acc >> bits;
+        }
+    }
+    if (strict && (acc & ((1 << bits) - 1))) {
+        return -1;
+    }
+    return n;
+}
+
+
+static void test_base64_fuzz(void)
+{
+    uint8_t bin[300], ref[300], out[300];
+    char b64[404], ref_b64[404], mutated[404];
+    const char charset[] = "ABCXYZabcxyz0189+/=- \n\x80";
+    int i, j, len, b64_len, ref_len, ret;
+
+    for (i = 0; i < 2000; i++) {
+        len = random_uint32(0) % sizeof(bin);
+        random_bytes(bin, len, 0);
+
+        // Encoding matches the reference and the allocating API
+        b64_len = base64_to(bin, len, b64, sizeof(b64));
+        u_assert_int_eq(b64_len, tests_base64_ref_encode(bin, len, ref_b64));
+        u_assert_mem_eq(b64, ref_b64, b64_len);
+        int alloc_len;
+        char *b64_alloc = base64(bin, len, &alloc_len);
+        u_assert_int_eq(alloc_len, b64_len);
+        u_assert_mem_eq(b64_alloc, b64, b64_len);
+        free(b64_alloc);
+
+        // Round trips in both modes, in place and through the allocating API
+        if (len) {
+            u_assert_int_eq(unbase64_strict_to(b64, b64_len, out, sizeof(out)), len);
+            u_assert_mem_eq(out, bin, len);
+            int unpadded = b64_len;
+            while (b64[unpadded - 1] == '=') {
+                unpadded--;
+            }
+            u_assert_int_eq(unbase64_to(b64, unpadded, out, sizeof(out)), len);
+            u_assert_mem_eq(out, bin, len);
+            unsigned char *ub64 = unbase64(b64, b64_len, &alloc_len);
+            u_assert_int_eq(alloc_len, len);
+            u_assert_mem_eq(ub64, bin, len);
+            free(ub64);
+            memcpy(mutated, b64, b64_len);
+            u_assert_int_eq(unbase64_to(mutated, b64_len, (unsigned char *)mutated,
+                                        b64_len), len);
+            u_assert_mem_eq(mutated, bin, len);
+        }
+
+        // Mutated input decodes exactly as the reference does, or is rejected by both
+        memcpy(mutated, b64, b64_len);
+        ret = b64_len ? random_uint32(0) % 4 : 0;
+        for (j = 0; j < ret; j++) {
+            char c = charset[random_uint32(0) % (sizeof(charset) - 1)];
+            mutated[random_uint32(0) % b64_len] = c;
+        }
+        int mutated_len = b64_len - (b64_len ? random_uint32(0) % 3 : 0);
+        for (j = 0; j < 2; j++) {
+            ref_len = tests_base64_ref_decode(mutated, mutated_len, ref, j);
+            ret = j ? unbase64_strict_to(mutated, mutated_len, out, sizeof(out)) :
+                  unbase64_to(mutated, mutated_len, out, sizeof(out));
+            u_assert_int_eq(ret, ref_len);
+            if (ret > 0) {
+                u_assert_mem_eq(out, ref, ret);
+            }
+        }
+    }
+}
+
+
+// Frames as built by the former packet queue, which framed each reply up front
+static int test_usb_frames_reference(uint8_t cmd, const uint8_t *data, uint32_t len,
+                                     uint32_t cid, uint8_t frames[][USB_REPORT_SIZE])
+{
+    USB_FRAME f;
+    uint32_t cnt = 0, l = len, psz;
+    uint8_t seq = 0;
+    int n = 0;
+
+    memset(&f, 0, sizeof(f));
+    f.cid = cid;
+    f.init.cmd = cmd;
+    f.init.bcnth = len >> 8;
+    f.init.bcntl = len & 0xff;
+    psz = MIN(sizeof(f.init.data), l);
+    memcpy(f.init.data, data, psz);
+    memcpy(frames[n++], &f, USB_REPORT_SIZE);
+    l -= psz;
+    cnt += psz;
+    for (; l > 0; l -= psz, cnt += psz) {
+        memset(&f.cont.data, 0, sizeof(f.cont.data));
+        f.cont.seq = seq++;
+        psz = MIN(sizeof(f.cont.data), l);
+        memcpy(f.cont.data, data + cnt, psz);
+        memcpy(frames[n++], &f, USB_REPORT_SIZE);
+    }
+    return n;
+}
+
+
+// Reads the queued frames and compares them with the expected stream
+static int test_usb_frames_compare(uint8_t frames[][USB_REPORT_SIZE], int n)
+{
+    uint8_t *frame;
+    int i = 0;
+    while ((frame = usb_reply_queue_read())) {
+        if (i >= n || memcmp(frame, frames[i], USB_REPORT_SIZE)) {
+            return -1;
+        }
+        i++;
+    }
+    return i;
+}
+
+
+static uint16_t test_touch_elapsed_ms;
+static uint16_t test_touch_abort_ms;
+
+
+static void test_touch_event(uint16_t elapsed_ms)
+{
+    test_touch_elapsed_ms = elapsed_ms;
+    if (elapsed_ms == test_touch_abort_ms) {
+        touch_abort();
+    }
+}
+
+
+static void test_touch(void)
+{
+    const struct {
+        uint8_t type;
+        uint16_t press_ms;
+        uint16_t release_ms;
+        uint8_t status;
+        uint16_t min_ms;// earliest answer
+    } v[] = {
+        { DBB_TOUCH_TIMEOUT, TOUCH_SIM_NEVER, TOUCH_SIM_NEVER, DBB_ERR_TOUCH_TIMEOUT, 2975 },
+        { DBB_TOUCH_TIMEOUT, 2000, 2100, DBB_TOUCHED, 2000 },
+        { DBB_TOUCH_TIMEOUT, 3100, TOUCH_SIM_NEVER, DBB_ERR_TOUCH_TIMEOUT, 2975 },
+        { DBB_TOUCH_REJECT_TIMEOUT, TOUCH_SIM_NEVER, TOUCH_SIM_NEVER, DBB_ERR_TOUCH_TIMEOUT, 2975 },
+        { DBB_TOUCH_REJECT_TIMEOUT, 1000, 1100, DBB_ERR_TOUCH_ABORT, 1000 },
+        { DBB_TOUCH_LONG, TOUCH_SIM_NEVER, TOUCH_SIM_NEVER, DBB_ERR_TOUCH_TIMEOUT, 30000 },
+        { DBB_TOUCH_LONG, 10000, 13100, DBB_TOUCHED, 13000 },
+        { DBB_TOUCH_LONG, 10000, 11000, DBB_ERR_TOUCH_ABORT, 11000 },
+        { DBB_TOUCH_LONG_BLINK, 500, 4000, DBB_TOUCHED, 3500 },
+        { DBB_TOUCH_LONG_BLINK, 500, 600, DBB_ERR_TOUCH_ABORT, 600 },
+        { DBB_TOUCH_SHORT, 500, 600, DBB_TOUCHED, 600 },
+        { DBB_TOUCH_SHORT, 500, 4000, DBB_ERR_TOUCH_ABORT, 3500 },
+    };
+    size_t i;
+    int polls = 0;
+
+    test_touch_abort_ms = TOUCH_SIM_NEVER;
+    for (i = 0; i < sizeof(v) / sizeof(v[0]); i++) {
+        test_touch_elapsed_ms = 0;
+        touch_sim_set(v[i].press_ms, v[i].release_ms, test_touch_event);
+        u_assert_int_eq(touch_button_press(v[i].type), v[i].status);
+        u_assert_int_eq(test_touch_elapsed_ms >= v[i].min_ms - 25, 1);
+        u_assert_int_eq(test_touch_elapsed_ms < v[i].min_ms + 100, 1);
+        u_assert_int_eq(touch_pending(), 0);
+    }
+
+    // Aborted while waiting
+    test_touch_abort_ms = 100;
+    touch_sim_set(TOUCH_SIM_NEVER, TOUCH_SIM_NEVER, test_touch_event);
+    u_assert_int_eq(touch_button_press(DBB_TOUCH_LONG), DBB_ERR_TOUCH_ABORT);
+    u_assert_int_eq(test_touch_elapsed_ms, 100);
+    test_touch_abort_ms = TOUCH_SIM_NEVER;
+
+    // Driven by the caller, one measurement per poll
+    touch_sim_set(1000, TOUCH_SIM_NEVER, NULL);
+    u_assert_int_eq(touch_start(DBB_TOUCH_TIMEOUT), DBB_OK);
+    u_assert_int_eq(touch_pending(), 1);
+    while (touch_poll() == DBB_TOUCH_PENDING) {
+        timer_sim_advance(25 * 1000);
+        polls++;
+    }
+    u_assert_int_eq(polls, 1000 / 25 + 1);
+    u_assert_int_eq(touch_pending(), 0);
+    u_assert_int_eq(touch_poll(), DBB_ERROR);
+
+    u_assert_int_eq(touch_start(DBB_TOUCHED), DBB_ERROR);
+    u_assert_int_eq(touch_button_press(DBB_TOUCHED), DBB_ERROR);
+    touch_sim_clear();
+}
+
+
+typedef struct {
+    int calls;
+    uint64_t at[16];
+    TIMER *stop;// stopped by the callback
+    TIMER *self;// restarted by the callback until it ran restarts times
+    int restarts;
+} test_timer_record;
+
+
+static void test_timer_callback(void *arg)
+{
+    test_timer_record *r = arg;
+
+    if (r->calls < (int)(sizeof(r->at) / sizeof(r->at[0]))) {
+        r->at[r->calls] = timer_now_us();
+    }
+    r->calls++;
+    if (r->stop) {
+        timer_stop(r->stop);
+    }
+    if (r->self && r->calls < r->restarts) {
+        timer_start(r->self, 700, 0, test_timer_callback, r);
+    }
+}
+
+
+static void test_timer(void)
+{
+    static TIMER a, b, c, d;
+    test_timer_record ra, rb, rc, rd;
+    uint64_t start = timer_now_us();
+    int i;
+
+    memset(&ra, 0, sizeof(ra));
+    memset(&rb, 0, sizeof(rb));
+
+    // One-shot, at its deadline to the microsecond
+    timer_start(&a, 1500, 0, test_timer_callback, &ra);
+    u_assert_int_eq(timer_active(&a), 1);
+    timer_sim_advance(1499);
+    u_assert_int_eq(ra.calls, 0);
+    timer_sim_advance(1);
+    u_assert_int_eq(ra.calls, 1);
+    u_assert_int_eq(ra.at[0] == start + 1500, 1);
+    u_assert_int_eq(timer_active(&a), 0);
+    timer_sim_advance(10000);
+    u_assert_int_eq(ra.calls, 1);
+
+    // Periodic, and stopped
+    start = timer_now_us();
+    timer_start(&b, 500, 1000, test_timer_callback, &rb);
+    timer_sim_advance(10000);
+    u_assert_int_eq(rb.calls, 10);
+    for (i = 0; i < rb.calls; i++) {
+        u_assert_int_eq(rb.at[i] == start + 500 + 1000 * i, 1);
+    }
+    timer_stop(&b);
+    u_assert_int_eq(timer_active(&b), 0);
+    timer_sim_advance(10000);
+    u_assert_int_eq(rb.calls, 10);
+
+    // Deadlines in the same slot, rounds of the wheel apart, run in order; a callback
+    // stops a timer that is already due
+    memset(&ra, 0, sizeof(ra));
+    memset(&rb, 0, sizeof(rb));
+    memset(&rc, 0, sizeof(rc));
+    start = timer_now_us();
+    timer_start(&a, 100000 + (TIMER_WHEEL_SLOTS << TIMER_WHEEL_SHIFT), 0,
+                test_timer_callback, &ra);
+    timer_start(&c, 100000, 0, test_timer_callback, &rc);
+    timer_start(&b, 100000, 0, test_timer_callback, &rb);
+    rb.stop = &c;
+    timer_sim_advance(100000 + (TIMER_WHEEL_SLOTS << TIMER_WHEEL_SHIFT) - 1);
+    u_assert_int_eq(rb.calls, 1);
+    u_assert_int_eq(rb.at[0] == start + 100000, 1);
+    u_assert_int_eq(rc.calls, 0);
+    u_assert_int_eq(timer_active(&c), 0);
+    u_assert_int_eq(ra.calls, 0);
+    timer_sim_advance(1);
+    u_assert_int_eq(ra.calls, 1);
+
+    // Restarted from its callback
+    memset(&rd, 0, sizeof(rd));
+    rd.self = &d;
+    rd.restarts = 5;
+    start = timer_now_us();
+    timer_start(&d, 700, 0, test_timer_callback, &rd);
+    timer_sim_advance(1000000);
+    u_assert_int_eq(rd.calls, 5);
+    u_assert_int_eq(rd.at[4] == start + 5 * 700, 1);
+
+    // Waits jump the clock to the deadline, running the timers on the way
+    memset(&ra, 0, sizeof(ra));
+    start = timer_now_us();
+    timer_start(&a, 250000, 0, test_timer_callback, &ra);
+    timer_wait_ms(300);
+    u_assert_int_eq(timer_now_us() == start + 300000, 1);
+    u_assert_int_eq(ra.calls, 1);
+    u_assert_int_eq(ra.at[0] == start + 250000, 1);
+    u_assert_int_eq(timer_expired(start + 300000), 1);
+    u_assert_int_eq(timer_expired(start + 300001), 0);
+}
+
+
+static void test_usb_reply_queue(void)
+{
+    static uint8_t data[4][COMMANDER_REPORT_SIZE];
+    static uint8_t frames[256][USB_REPORT_SIZE];
+    const uint32_t lens[] = { 0, 1, 56, 57, 58, 116, 117, 1000, COMMANDER_REPORT_SIZE };
+    uint8_t *d = &data[0][0];
+    uint32_t i;
+    int n;
+    USB_FRAME err;
+
+    for (i = 0; i < sizeof(data); i++) {
+        d[i] = random_uint32(0);
+    }
+
+    // Single messages, copied and referenced
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        usb_reply_queue_clear();
+        n = test_usb_frames_reference(U2FHID_MSG, data[0], lens[i], i + 1, frames);
+        usb_reply_queue_load_msg(U2FHID_MSG, data[0], lens[i], i + 1);
+        u_assert_int_eq(test_usb_frames_compare(frames, n), n);
+
+        n = test_usb_frames_reference(U2FHID_HWW, data[1], lens[i], i + 1, frames);
+        usb_reply_queue_load_msg_ref(U2FHID_HWW, data[1], lens[i], i + 1);
+        u_assert_int_eq(test_usb_frames_compare(frames, n), n);
+    }
+
+    // Several messages and a single frame, with the messages of one channel dropped
+    memset(&err, 0, sizeof(err));
+    err.cid = 7;
+    err.init.cmd = U2FHID_ERROR;
+    err.init.bcntl = 1;
+    err.init.data[0] = U2FHID_ERR_CHANNEL_BUSY;
+    usb_reply_queue_clear();
+    usb_reply_queue_load_msg(U2FHID_PING, data[0], 300, 5);
+    usb_reply_queue_load_msg(U2FHID_MSG, data[1], 70, 6);
+    usb_reply_queue_add(&err);
+    usb_reply_queue_load_msg(U2FHID_MSG, data[2], 200, 6);
+    usb_reply_queue_load_msg_ref(U2FHID_HWW, data[3], 500, 8);
+    usb_reply_queue_clear_cid(6);
+    n = test_usb_frames_reference(U2FHID_PING, data[0], 300, 5, frames);
+    memcpy(frames[n++], &err, USB_REPORT_SIZE);
+    n += test_usb_frames_reference(U2FHID_HWW, data[3], 500, 8, frames + n);
+    u_assert_int_eq(test_usb_frames_compare(frames, n), n);
+
+    // Copies wrap around in the queue's buffer while earlier replies are being sent
+    usb_reply_queue_load_msg(U2FHID_MSG, data[0], 2000, 1);
+    usb_reply_queue_load_msg(U2FHID_MSG, data[1], 1500, 2);
+    n = test_usb_frames_reference(U2FHID_MSG, data[0], 2000, 1, frames);
+    for (i = 0; i < (uint32_t)n; i++) {
+        u_assert_mem_eq(usb_reply_queue_read(), frames[i], USB_REPORT_SIZE);
+    }
+    usb_reply_queue_load_msg(U2FHID_MSG, data[2], 1500, 3);
+    n = test_usb_frames_reference(U2FHID_MSG, data[1], 1500, 2, frames);
+    n += test_usb_frames_reference(U2FHID_MSG, data[2], 1500, 3, frames + n);
+    memset(data[1], 0, sizeof(data[1]));// copied when queued
+    u_assert_int_eq(test_usb_frames_compare(frames, n), n);
+}
+
+
+// Replies on both interfaces. An endpoint is still sending a frame when the report sent
+// callback of the other one runs, and when frames received on other channels or
+// keepalives send the queue.
+static void test_usb_reply_endpoints(void)
+{
+    static uint8_t data[2][300];
+    static uint8_t frames[2][8][USB_REPORT_SIZE];
+    uint8_t frame[USB_HWW_REPORT_IN_SIZE];
+    uint8_t *d = &data[0][0];
+    int n[2], got[2] = { 0, 0 }, i;
+    uint8_t hww;
+    USB_FRAME f;
+
+    for (i = 0; i < (int)sizeof(data); i++) {
+        d[i] = random_uint32(0);
+    }
+
+    // The HWW interface talks on channel 8; the stray continuation frame is ignored
+    usb_reply_queue_clear();
+    usb_hww_report_size_set(USB_REPORT_SIZE);
+    memset(&f, 0, sizeof(f));
+    f.cid = 8;
+    usb_hww_report((const unsigned char *)&f);
+
+    usb_sim_endpoints(1);
+    n[0] = test_usb_frames_reference(U2FHID_PING, data[0], 300, 5, frames[0]);
+    n[1] = test_usb_frames_reference(U2FHID_HWW, data[1], 200, 8, frames[1]);
+    usb_reply_queue_load_msg_ref(U2FHID_HWW, data[1], 200, 8);
+    usb_reply_queue_load_msg(U2FHID_PING, data[0], 300, 5);
+    usb_reply_queue_send();
+
+    // The host reads the HWW endpoint twice as often as the U2F endpoint
+    for (i = 0; got[0] < n[0] || got[1] < n[1]; i++) {
+        u_assert_int_eq(i < 100, 1);
+        usb_reply_queue_send();
+        hww = i % 3 != 2;
+        if (usb_sim_endpoint_take(hww, frame)) {
+            u_assert_int_eq(got[hww] < n[hww], 1);
+            u_assert_mem_eq(frame, frames[hww][got[hww]], USB_REPORT_SIZE);
+            got[hww]++;
+        }
+    }
+    u_assert_int_eq(usb_sim_endpoint_take(0, frame), 0);
+    u_assert_int_eq(usb_sim_endpoint_take(1, frame), 0);
+    usb_sim_endpoints(0);
+}
+
+
+// A frame received on a second channel while the reply of the first one is being sent
+static void test_usb_reply_channels(void)
+{
+    static uint8_t data[300];
+    static uint8_t frames[8][USB_REPORT_SIZE];
+    uint8_t frame[USB_HWW_REPORT_IN_SIZE];
+    uint32_t i, sent;
+    int n, got = 0;
+    USB_FRAME f;
+
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = random_uint32(0);
+    }
+    usb_reply_queue_clear();
+    usb_sim_endpoints(1);
+
+    // Channel 5 pings with 300 bytes
+    memset(&f, 0, sizeof(f));
+    f.cid = 5;
+    f.init.cmd = U2FHID_PING | U2FHID_TYPE_INIT;
+    f.init.bcnth = sizeof(data) >> 8;
+    f.init.bcntl = sizeof(data) & 0xff;
+    memcpy(f.init.data, data, sizeof(f.init.data));
+    usb_u2f_report((const unsigned char *)&f);
+    for (sent = sizeof(f.init.data); sent < sizeof(data); sent += sizeof(f.cont.data)) {
+        memset(&f, 0, sizeof(f));
+        f.cid = 5;
+        f.cont.seq = (sent - sizeof(f.init.data)) / sizeof(f.cont.data);
+        memcpy(f.cont.data, data + sent, MIN(sizeof(f.cont.data), sizeof(data) - sent));
+        usb_u2f_report((const unsigned char *)&f);
+    }
+    n = test_usb_frames_reference(U2FHID_PING, data, sizeof(data), 5, frames);
+    u_assert_int_eq(usb_sim_endpoint_take(0, frame), USB_REPORT_SIZE);
+    u_assert_mem_eq(frame, frames[got++], USB_REPORT_SIZE);
+
+    // Channel 6 pings while the endpoint holds the next frame of channel 5
+    memset(&f, 0, sizeof(f));
+    f.cid = 6;
+    f.init.cmd = U2FHID_PING | U2FHID_TYPE_INIT;
+    f.init.bcntl = 8;
+    memcpy(f.init.data, data, 8);
+    usb_u2f_report((const unsigned char *)&f);
+    n += test_usb_frames_reference(U2FHID_PING, data, 8, 6, frames + n);
+
+    while (usb_sim_endpoint_take(0, frame)) {
+        u_assert_int_eq(got < n, 1);
+        u_assert_mem_eq(frame, frames[got++], USB_REPORT_SIZE);
+    }
+    u_assert_int_eq(got, n);
+    usb_sim_endpoints(0);
 }
 
 
@@ -1082,6 +2987,212 @@ static void test_utils(void)
     utils_reverse_bin(bin_rev, l);
     utils_reverse_hex(hex, l * 2);
     u_assert_str_eq(hex, utils_uint8_to_hex(bin_rev, l));
+
+    // caller-buffer hex conversion
+    uint8_t all[256], dec[256];
+    char all_hex[512 + 1];
+    int i;
+    for (i = 0; i < 256; i++) {
+        all[i] = i;
+    }
+    utils_bin_to_hex(all, sizeof(all), all_hex);
+    u_assert_str_eq(all_hex, utils_uint8_to_hex(all, sizeof(all)));
+    u_assert_int_eq(utils_hex_to_bin(all_hex, 512, dec, sizeof(dec)), DBB_OK);
+    u_assert_mem_eq(dec, all, sizeof(all));
+    u_assert_mem_eq(dec, utils_hex_to_uint8(all_hex), sizeof(all));
+    u_assert_int_eq(utils_hex_to_bin("ABCDEF", 6, dec, 3), DBB_OK);
+    u_assert_mem_eq(dec, utils_hex_to_uint8("abcdef"), 3);
+    u_assert_int_eq(utils_hex_to_bin("abcdef", 6, dec, 2), DBB_ERROR);
+    u_assert_int_eq(utils_hex_to_bin("abcde", 5, dec, 3), DBB_ERROR);
+    u_assert_int_eq(utils_hex_to_bin(NULL, 0, dec, 3), DBB_ERROR);
+    u_assert_int_eq(utils_hex_to_bin("", 0, dec, 0), DBB_OK);
+    for (i = 0; i < 256; i++) {
+        char c[3] = { (char)i, 'a', 0 };
+        int valid = strchr("0123456789abcdefABCDEF", i) && i;
+        u_assert_int_eq(utils_hex_to_bin(c, 2, dec, 1), valid ? DBB_OK : DBB_ERROR);
+        c[0] = 'a';
+        c[1] = (char)i;
+        u_assert_int_eq(utils_hex_to_bin(c, 2, dec, 1), valid ? DBB_OK : DBB_ERROR);
+    }
+    // A rejected decode leaves no partial output
+    memset(dec, 0xaa, sizeof(dec));
+    u_assert_int_eq(utils_hex_to_bin("0102030g", 8, dec, 4), DBB_ERROR);
+    memset(all, 0, sizeof(all));
+    u_assert_mem_eq(dec, all, 4);
+
+    // word-wise zeroing at every alignment
+    uint8_t z[64 + 8];
+    int offset, len;
+    for (offset = 0; offset < 4; offset++) {
+        for (len = 0; len <= 64; len++) {
+            memset(z, 0xff, sizeof(z));
+            utils_zero_words(z + offset, len);
+            for (i = 0; i < (int)sizeof(z); i++) {
+                u_assert_int_eq(z[i], (i >= offset && i < offset + len) ? 0 : 0xff);
+            }
+        }
+    }
+
+    // character classes
+    static const char *class_chars[] = {
+        "0123456789abcdefABCDEF",
+        "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz",
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=",
+        "0123456789m/'phH",
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789.-_",
+        "0123456789",
+        "'phH",
+    };
+    for (i = 0; i < 256; i++) {
+        uint8_t cls = 0;
+        int k;
+        for (k = 0; k < 7; k++) {
+            if (i && strchr(class_chars[k], i)) {
+                cls |= 1 << k;
+            }
+        }
+        u_assert_int_eq(utils_char_class((char)i), cls);
+    }
+    u_assert_int_eq(UTILS_CHARS_HEX, 1 << 0);
+    u_assert_int_eq(UTILS_CHARS_PRIME, 1 << 6);
+
+    u_assert_int_eq(utils_check_chars("m/44'/0'/0'/1/2", 16, UTILS_CHARS_KEYPATH), DBB_OK);
+    u_assert_int_eq(utils_check_chars("m/44'/0'/0'/1/2", 15, UTILS_CHARS_KEYPATH), DBB_ERROR);
+    u_assert_int_eq(utils_check_chars("m/44'/0x", 16, UTILS_CHARS_KEYPATH), DBB_ERROR);
+    u_assert_int_eq(utils_check_chars("abc", 4, UTILS_CHARS_HEX | UTILS_CHARS_BASE58),
+                    DBB_OK);
+    u_assert_int_eq(utils_check_chars("0OIl", 5, UTILS_CHARS_BASE58), DBB_ERROR);
+    u_assert_int_eq(utils_check_chars("0OIl", 5, UTILS_CHARS_BASE64), DBB_OK);
+    u_assert_int_eq(utils_check_chars("a b", 4, UTILS_CHARS_FILENAME), DBB_ERROR);
+    u_assert_int_eq(utils_check_chars("", 1, UTILS_CHARS_HEX), DBB_ERROR);
+    u_assert_int_eq(utils_check_chars("ab", 0, UTILS_CHARS_HEX), DBB_ERROR);
+    u_assert_int_eq(utils_check_chars(NULL, 4, UTILS_CHARS_HEX), DBB_ERROR);
+    u_assert_int_eq(utils_is_hex("0123456789abcdefABCDEF"), DBB_OK);
+    u_assert_int_eq(utils_is_hex("0123g"), DBB_ERROR);
+    u_assert_int_eq(utils_is_hex(""), DBB_ERROR);
+    u_assert_int_eq(utils_limit_alphanumeric_hyphen_underscore_period("my-backup_1.pdf"),
+                    DBB_OK);
+    u_assert_int_eq(utils_limit_alphanumeric_hyphen_underscore_period("../backup"),
+                    DBB_ERROR);
+}
+
+
+// The strlens/strchr validation loop replaced by utils_check_chars()
+static uint8_t tests_check_chars_legacy(const char *str, const char *characters)
+{
+    size_t i;
+
+    if (!strlens(str)) {
+        return DBB_ERROR;
+    }
+    for (i = 0 ; i < strlens(str); i++) {
+        if (!strchr(characters, str[i])) {
+            return DBB_ERROR;
+        }
+    }
+    return DBB_OK;
+}
+
+
+static void test_validate_speed(void)
+{
+    static const char *names[] = { "hex", "base58", "base64", "keypath", "filename" };
+    static const char *alphabets[] = {
+        "0123456789abcdefABCDEF",
+        "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz",
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/=",
+        "0123456789m/'phH",
+        ".-_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789",
+    };
+    static const uint8_t classes[] = {
+        UTILS_CHARS_HEX, UTILS_CHARS_BASE58, UTILS_CHARS_BASE64,
+        UTILS_CHARS_KEYPATH, UTILS_CHARS_FILENAME
+    };
+    static char str[4096 + 1];
+    int i, k, N = 10, M = 10000;
+    clock_t t;
+    float legacy, table;
+
+    for (k = 0; k < 5; k++) {
+        size_t n = strlen(alphabets[k]);
+        for (i = 0; i < 4096; i++) {
+            str[i] = alphabets[k][i % n];
+        }
+        str[4096] = 0;
+
+        t = clock();
+        for (i = 0; i < N; i++) {
+            u_assert_int_eq(tests_check_chars_legacy(str, alphabets[k]), DBB_OK);
+        }
+        legacy = (float)(clock() - t) / CLOCKS_PER_SEC / N * 1e6;
+
+        t = clock();
+        for (i = 0; i < M; i++) {
+            u_assert_int_eq(utils_check_chars(str, sizeof(str), classes[k]), DBB_OK);
+        }
+        table = (float)(clock() - t) / CLOCKS_PER_SEC / M * 1e6;
+
+        u_print_info("Validate 4KB %s: %0.2f us legacy, %0.2f us class table\n",
+                     names[k], legacy, table);
+    }
+}
+
+
+// Hex and buffer-clearing work of a `sign` request with COMMANDER_NUM_SIG_MIN
+// hashes: decode each hash, encode each signature and recid, check one pubkey.
+static void test_hex_speed(void)
+{
+    uint8_t data[32], sig[64], recid = 1, pubkey[33];
+    char hash[64 + 1], sig_c[128 + 1], recid_c[2 + 1], pubkey_c[66 + 1];
+    __extension__ static uint8_t report[] = {[0 ... COMMANDER_REPORT_SIZE - 1] = 0};
+    int i, j, N = 2000;
+    clock_t t;
+    float legacy, reentrant, zero_bytes, zero_words;
+
+    random_bytes(sig, sizeof(sig), 0);
+    random_bytes(pubkey, sizeof(pubkey), 0);
+    utils_bin_to_hex(sig, 32, hash);
+
+    t = clock();
+    for (i = 0; i < N; i++) {
+        for (j = 0; j < COMMANDER_NUM_SIG_MIN; j++) {
+            memcpy(data, utils_hex_to_uint8(hash), 32);
+            snprintf(sig_c, sizeof(sig_c), "%s", utils_uint8_to_hex(sig, 64));
+            snprintf(recid_c, sizeof(recid_c), "%02x", recid);
+        }
+        snprintf(pubkey_c, sizeof(pubkey_c), "%s", utils_uint8_to_hex(pubkey, 33));
+    }
+    legacy = (float)(clock() - t) / CLOCKS_PER_SEC / N * 1e6;
+    u_assert_mem_eq(data, sig, 32);
+
+    t = clock();
+    for (i = 0; i < N; i++) {
+        for (j = 0; j < COMMANDER_NUM_SIG_MIN; j++) {
+            utils_hex_to_bin(hash, 64, data, sizeof(data));
+            utils_bin_to_hex(sig, 64, sig_c);
+            utils_bin_to_hex(&recid, 1, recid_c);
+        }
+        utils_bin_to_hex(pubkey, 33, pubkey_c);
+    }
+    reentrant = (float)(clock() - t) / CLOCKS_PER_SEC / N * 1e6;
+    u_assert_mem_eq(data, sig, 32);
+    u_assert_str_eq(recid_c, "01");
+
+    t = clock();
+    for (i = 0; i < N; i++) {
+        utils_zero(report, sizeof(report));
+    }
+    zero_bytes = N * sizeof(report) / ((float)(clock() - t) / CLOCKS_PER_SEC) / 1e6;
+    t = clock();
+    for (i = 0; i < N; i++) {
+        utils_zero_words(report, sizeof(report));
+    }
+    zero_words = N * sizeof(report) / ((float)(clock() - t) / CLOCKS_PER_SEC) / 1e6;
+
+    u_print_info("Hex per sign request: %0.2f us legacy, %0.2f us caller buffers\n",
+                 legacy, reentrant);
+    u_print_info("Zeroing: %0.2f MB/s byte-wise, %0.2f MB/s word-wise\n",
+                 zero_bytes, zero_words);
 }
 
 
@@ -1090,7 +3201,27 @@ static void test_recoverable_signature(void)
     size_t i, N = 256;
     uint8_t res, recid, sig[64], pubkey_recover[65], pubkey_derive[65], privkey[32], msg[256],
             msg_len = 0;
+    clock_t t;
 
+    for (i = 0; i < 64; i++) {
+        ecc_curve_id curve = i % 2 ? ECC_SECP256r1 : ECC_SECP256k1;
+        random_bytes(msg, sizeof(msg), 0);
+        random_bytes(privkey, sizeof(privkey), 0);
+        res = ecc_sign(privkey, msg, sizeof(msg), sig, &recid, curve);
+        u_assert_int_eq(res, 0);
+        ecc_get_public_key65(privkey, pubkey_derive, curve);
+        res = ecc_recover_public_key(sig, msg, sizeof(msg), recid, pubkey_recover, curve);
+        u_assert_int_eq(res, 0);
+        u_assert_mem_eq(pubkey_derive, pubkey_recover, 65);
+        // the other recovery ids give another key or none
+        res = ecc_recover_public_key(sig, msg, sizeof(msg), recid ^ 1, pubkey_recover,
+                                     curve);
+        u_assert_int_eq(res == 0 && MEMEQ(pubkey_derive, pubkey_recover, 65), 0);
+        res = ecc_recover_public_key(sig, msg, sizeof(msg), 4, pubkey_recover, curve);
+        u_assert_int_eq(res, 1);
+    }
+
+    t = clock();
     for (i = 0; i < N; i++) {
         // random message len between 1 and 256
         random_bytes(msg, 1, 0);
@@ -1113,6 +3244,8 @@ static void test_recoverable_signature(void)
         u_assert_int_eq(res, 0);
         u_assert_mem_eq(pubkey_derive, pubkey_recover, 65);
     }
+    u_print_info("Sign, derive, verify and recover: %0.2f ms\n",
+                 1000.0f * ((float)(clock() - t) / CLOCKS_PER_SEC) / N);
 }
 
 
@@ -1122,28 +3255,52 @@ int main(void)
     bitcoin_ecc.ecc_context_init();
 
     u_run_test(test_sign_speed);
+    u_run_test(test_sign_batch);
     u_run_test(test_verify_speed);
+    u_run_test(test_boot_verify_speed);
+    u_run_test(test_ecc_comb);
+#ifdef ECC_USE_SECP256K1_LIB
+    u_run_test(test_ecc_glv);
+    u_run_test(test_ecc_recover);
+#endif
     u_run_test(test_ecdh);
     u_run_test(test_ecc_sig_to_der);
     u_run_test(test_bip32_vector_1);
     u_run_test(test_bip32_vector_2);
+    u_run_test(test_hmac);
+    u_run_test(test_hmac_speed);
     u_run_test(test_pbkdf2);
     u_run_test(test_base58);
+    u_run_test(test_base58_fuzz);
+    u_run_test(test_base58_speed);
     u_run_test(test_base64);
+    u_run_test(test_base64_fuzz);
     u_run_test(test_address);
     u_run_test(test_wif);
     u_run_test(test_aes_cbc);
+    u_run_test(test_aes_ct);
+    u_run_test(test_aes_speed);
     u_run_test(test_buffer_overflow);
+    u_run_test(test_usb_reply_queue);
+    u_run_test(test_usb_reply_endpoints);
+    u_run_test(test_usb_reply_channels);
+    u_run_test(test_touch);
+    u_run_test(test_timer);
     u_run_test(test_utils);
+    u_run_test(test_hex_speed);
+    u_run_test(test_validate_speed);
     u_run_test(test_aes_encrypt_decrypt_hmac);
+    u_run_test(test_aes_key_cache);
+    u_run_test(test_aescbcb64_no_malloc);
+    u_run_test(test_aescbcb64_stream);
+    u_run_test(test_chacha20poly1305);
+    u_run_test(test_chachapolyb64);
+    u_run_test(test_transport_speed);
 
     // unit tests for secp256k1 rfc6979 are in tests_secp256k1.c
     u_run_test(test_rfc6979);
 
-#ifdef ECC_USE_SECP256K1_LIB
-    // recoverable signature not implemented for uECC
     u_run_test(test_recoverable_signature);
-#endif
 
     if (!U_TESTS_FAIL) {
         printf("\nALL %i TESTS PASSED\n\n", U_TESTS_RUN);
@@ -402,7 +402,8 @@ int U2Fob_recv(struct U2Fob *device, uint8_t *cmd,
         }
 
         timeout -= U2Fob_deltaTime(&timeTracker);
-    } while (frame.cid != device->cid || U2FHID_FRAME_TYPE(frame) != U2FHID_TYPE_INIT);
+    } while (frame.cid != device->cid || U2FHID_FRAME_TYPE(frame) != U2FHID_TYPE_INIT ||
+             frame.init.cmd == U2FHID_KEEPALIVE);
 
     if (frame.init.cmd == U2FHID_ERROR) {
         return -frame.init.data[0];